@@ -24,40 +24,58 @@ uint32_t D1, D2;
 static uint8_t data[3] = {0};
 uint32_t initTime = 0;
 
+// The conversion commands and the ADC reads run in the background
+static twi_xfer_t baro_cmd_xfer = { .addr = MS5611_ADDR, .write = true };
+static twi_xfer_t baro_read_xfer = { .addr = MS5611_ADDR, .reg = READ, .length = 3, .data = data };
+
+static void baro_command(uint8_t cmd)
+{
+	baro_cmd_xfer.reg = cmd;
+	twi_submit(&baro_cmd_xfer);
+}
+
+// Called every TIMER_PERIOD: starts the pressure conversion, reads it
+// and starts the temperature conversion after 10 ms, reads that after
+// another 3 ms and calculates the results. Never waits for the bus.
 void read_baro(void)
 {
+	if (baro_cmd_xfer.status == TWI_PENDING || baro_read_xfer.status == TWI_PENDING)
+		return;
 
 	if(loop_count==0)
 	{
-		NRF_TWI0->ADDRESS = MS5611_ADDR;
-		NRF_TWI0->SHORTS = TWI_SHORTS_BB_STOP_Msk;
-		NRF_TWI0->TXD = CONVERT_D1_4096;
-		NRF_TWI0->TASKS_STARTTX = 1;
+		baro_command(CONVERT_D1_4096);
 
 		loop_count = 1;
 		initTime = get_time_us();
 	}
     
-	if(loop_count == 1 && ((get_time_us() - initTime) >= 10000))
+	else if(loop_count == 1 && ((get_time_us() - initTime) >= 10000))
+	{
+		twi_submit(&baro_read_xfer);
+		baro_command(CONVERT_D2_1024);
+
+		loop_count = 2;
+		initTime = get_time_us();
+	}
+	
+	else if(loop_count == 2 && ((get_time_us() - initTime) >= 3000))
 	{
-		if (i2c_read(MS5611_ADDR, READ, 3, data)) {
+		if (baro_read_xfer.status != TWI_DONE) {
 			//printf("> I2C rd err @ baro 1\n");
+			loop_count = 0;
 			return;
 		}
 		D1 = (uint32_t) ((data[0] << 16)|(data[1] << 8)|data[2]);
+		twi_submit(&baro_read_xfer);
 
-		NRF_TWI0->ADDRESS = MS5611_ADDR;
-		NRF_TWI0->SHORTS = TWI_SHORTS_BB_STOP_Msk;
-		NRF_TWI0->TXD = CONVERT_D2_1024;
-		NRF_TWI0->TASKS_STARTTX = 1;
-
-		loop_count = 2;
-		initTime = get_time_us();
+		loop_count = 3;
 	}
-	
-	if(loop_count == 2 && ((get_time_us() - initTime) >= 3000))
+
+	else if(loop_count == 3)
 	{
-		if (i2c_read(MS5611_ADDR, READ, 3, data)) {
+		loop_count = 0;
+		if (baro_read_xfer.status != TWI_DONE) {
 			//printf("> I2C rd err @ baro 2\n");
 			return;
 		}
@@ -73,8 +91,6 @@ void read_baro(void)
 
 		temperature = 2000 + ((dT*prom[6])>>23);           // First-order Temperature in degrees Centigrade
 		pressure = (((D1*SENS)>>21) - OFFSET)>>15;  // Pressure in mbar or kPa
-	
-		loop_count = 0;
 	}
 }
 
@@ -102,10 +102,7 @@ static void gap_params_init(void)
 /**@snippet [Handling the data received over BLE] */
 static void nus_data_handler(ble_nus_t * p_nus, uint8_t * p_data, uint16_t length)
 {
-    for (uint32_t i = 0; i < length; i++)
-    {
-	enqueue(&ble_rx_queue, p_data[i]);
-    }
+    enqueue_n(&ble_rx_queue, p_data, length);
 //nrf_gpio_pin_toggle(RED);
 }
 /**@snippet [Handling the data received over BLE] */
@@ -263,25 +260,9 @@ void ble_send(void)
 	uint8_t data[20];
 	uint8_t length;
 
-	while(ble_tx_queue.count)
+	while((length = dequeue_n(&ble_tx_queue, data, 20)))
 	{
-		if (ble_tx_queue.count > 20)
-		{
-			for (uint8_t p=0;p<20;p++)
-			{
-				data[p] = dequeue(&ble_tx_queue);
-			}
-			ble_nus_string_send(&m_nus, data, 20);
-		}
-		else
-		{ 
-			length = ble_tx_queue.count;
-			for (uint8_t p=0;p<length;p++)
-			{
-				data[p] = dequeue(&ble_tx_queue);
-			}
-			ble_nus_string_send(&m_nus, data, length);
-		}	
+		ble_nus_string_send(&m_nus, data, length);
 	}	
 }
 
@@ -11,7 +11,8 @@
 #include "in4073.h"
 #include "interrupt_prio.h"
 
-static bool sensor_int_flag = false;
+// Time of the last IMU interrupt, for the wakeup latency
+static volatile uint32_t sensor_int_time = 0;
 
 void gpio_init(void)
 {
@@ -46,17 +47,25 @@ void GPIOTE_IRQHandler(void)
 	if(NRF_GPIOTE->EVENTS_IN[0] != 0)
 	{
 		NRF_GPIOTE->EVENTS_IN[0] = 0;
-		sensor_int_flag = true;
+		sensor_int_time = get_time_us();
+		// The control task is posted once the FIFO is read
+		imu_fetch_start();
+		TRACE(TRACE_INSTANT | TRACE_SENSOR_IRQ);
         }
 }
 
 
 bool check_sensor_int_flag(void)
 {
-	return sensor_int_flag;
+	return pending_tasks & TASK_SENSOR;
 }
 
 void clear_sensor_int_flag(void)
 {
-	sensor_int_flag = false;
+	task_clear(TASK_SENSOR);
+}
+
+uint32_t get_sensor_int_time(void)
+{
+	return sensor_int_time;
 }
@@ -1,40 +1,81 @@
 /*------------------------------------------------------------------
- *  queue.c -- some queue implementation stolen from the interwebs
+ *  queue.c -- single-producer/single-consumer ring buffer
  *
  *  I. Protonotarios
  *  Embedded Software Lab
  *
  *  July 2016
+ *
+ *  Rewritten as a lock-free SPSC ring by Boldizsar Palotas: "last"
+ *  is only written by the producer and "first" only by the consumer,
+ *  so an ISR and the main loop can share a queue without masking
+ *  interrupts. Both indices run freely and are masked on access, so
+ *  last - first is the number of bytes in the queue.
  *------------------------------------------------------------------
  */
 
 #include "in4073.h"
 
 void init_queue(queue *q){
-	
+
 	q->first = 0;
-	q->last = QUEUE_SIZE - 1;
-	q->count = 0;
+	q->last = 0;
 }
 
 void enqueue(queue *q,char x){
 
-	if (q->count == QUEUE_SIZE)
+	uint32_t last = q->last;
+	if (last - q->first == QUEUE_SIZE)
 		return;
 
-	CRITICALSECTION_FastEnter();
-	q->last = (q->last + 1) & (QUEUE_SIZE - 1);
-	q->Data[ q->last ] = x;
-	q->count += 1;
-	CRITICALSECTION_FastExit();
+	q->Data[ last & (QUEUE_SIZE - 1) ] = x;
+	__DMB(); // Data must be written before it is published
+	q->last = last + 1;
 }
 
 char dequeue(queue *q){
 
-	char x = q->Data[ q->first ];
-	CRITICALSECTION_FastEnter();
-	q->first = (q->first + 1) & (QUEUE_SIZE - 1);
-	q->count -= 1;
-	CRITICALSECTION_FastExit();
+	uint32_t first = q->first;
+	char x = q->Data[ first & (QUEUE_SIZE - 1) ];
+	__DMB(); // Data must be read before the slot is released
+	q->first = first + 1;
 	return x;
 }
+
+// Enqueue up to n bytes at once
+// ---
+// Parameters: q: the queue, data: the bytes to add, n: number of bytes
+// Returns: the number of bytes actually added (less if q is full)
+// Author: Boldizsar Palotas
+uint32_t enqueue_n(queue *q, const uint8_t *data, uint32_t n){
+
+	uint32_t last = q->last;
+	uint32_t space = QUEUE_SIZE - (last - q->first);
+	if (space < n)
+		n = space;
+
+	for (uint32_t i = 0; i < n; i++)
+		q->Data[ (last + i) & (QUEUE_SIZE - 1) ] = data[i];
+	__DMB();
+	q->last = last + n;
+	return n;
+}
+
+// Dequeue up to n bytes at once
+// ---
+// Parameters: q: the queue, data: buffer for the bytes, n: buffer size
+// Returns: the number of bytes actually removed (less if q is empty)
+// Author: Boldizsar Palotas
+uint32_t dequeue_n(queue *q, uint8_t *data, uint32_t n){
+
+	uint32_t first = q->first;
+	uint32_t count = q->last - first;
+	if (count < n)
+		n = count;
+
+	for (uint32_t i = 0; i < n; i++)
+		data[i] = q->Data[ (first + i) & (QUEUE_SIZE - 1) ];
+	__DMB();
+	q->first = first + n;
+	return n;
+}
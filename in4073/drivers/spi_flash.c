@@ -28,6 +28,7 @@
 #define WREN            0x06
 #define EWSR            0x50
 #define CHIP_ERASE      0x60
+#define SECTOR_ERASE    0x20
 #define AAI             0xAF 
 
 #define SPI_FREQ_4MBPS        0x40
@@ -340,7 +341,7 @@ bool spi_master_tx_rx_fast_write(uint8_t spi_num, uint16_t transfer_size, const
         nrf_gpio_pin_set(spi_config_table[spi_num].pin_CSN);
 		if(address + bytesWritten >= 0x1FFFF)
 		{
-			if(transfer_size)
+			if(transfer_size > 1)
 			{
 				return false;
 			}
@@ -433,6 +434,44 @@ bool flash_read_status(uint8_t *data)
 	return result; 
 }
 
+/**
+ * Starts erasing the 4 KiB sector containing the specified address (sets its bytes to 0xFF).
+ *
+ * @note Returns without waiting for the erase to finish (up to 25 ms). Use flash_busy() to check
+ *       if it is done before writing to the flash again.
+ *
+ * @param address any address in the sector between 0x000000 to 0x01FFFF.
+ * @return
+ * @retval true if operation is successful.
+ * @retval false if operation is failed.
+ */
+bool flash_sector_erase(uint32_t address)
+{
+	uint8_t tx_data[4] = {SECTOR_ERASE,(address & 0xFFFFFF) >> 16,(address & 0xFFFF)>> 8,address & 0xFF};
+	if(!flash_write_enable())
+	{
+		return false;
+	}
+	return spi_master_tx(SPI_MODULE, 4, tx_data);
+}
+
+/**
+ * Checks the BUSY bit of the status register.
+ *
+ * @return
+ * @retval true if an erase or write is in progress or the status could not be read.
+ * @retval false if the flash is ready.
+ */
+bool flash_busy(void)
+{
+	uint8_t data;
+	if(!flash_read_status(&data))
+	{
+		return true;
+	}
+	return data & 0x01;
+}
+
 /**
  * Enable-Write-Status-Register (EWSR). This function must be followed by flash_enable_WSR().
  *
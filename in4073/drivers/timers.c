@@ -12,14 +12,12 @@
 #include "in4073.h"
 #include "interrupt_prio.h"
  
-static bool TIMER2_flag;
 static uint32_t global_time;
 static void (*timer_handler)(void);
 
 void timers_init(void)
 {
 	global_time = 0;
-	TIMER2_flag = false;
 	timer_handler = NULL;
 
 	NRF_TIMER2->PRESCALER 	= 0x4UL; // 1us 
@@ -66,7 +64,8 @@ void TIMER2_IRQHandler(void)
 	if (NRF_TIMER2->EVENTS_COMPARE[1])
     	{
 		NRF_TIMER2->CC[1] += TIMER_PERIOD;
-		TIMER2_flag = true;
+		task_post(TASK_TIMER);
+		TRACE(TRACE_INSTANT | TRACE_TIMER_IRQ);
 		NVIC_SetPendingIRQ(SWI0_IRQn);	//issue software interrupt
 		NRF_TIMER2->EVENTS_COMPARE[1] = 0;
     	}
@@ -127,10 +126,10 @@ uint32_t get_time_us(void)
 
 bool check_timer_flag(void)
 {
-	return TIMER2_flag;
+	return pending_tasks & TASK_TIMER;
 }
 
 void clear_timer_flag(void)
 {
-	TIMER2_flag = false;
+	task_clear(TASK_TIMER);
 }
@@ -3,6 +3,10 @@
  *			sdk could be used. ~650us to read the fifo
  *			-=sucks=- how much faster can you make it??
  *
+ *			Transactions are now queued and run by the interrupt
+ *			handler (twi_submit), the blocking i2c_read/i2c_write
+ *			of the sdk wait for theirs in the same queue.
+ *
  *  I. Protonotarios
  *  Embedded Software Lab
  *
@@ -13,130 +17,228 @@
 #include "in4073.h"
 #include "interrupt_prio.h"
 
-static volatile bool sent = false;
-static volatile bool read = false;
-
-bool i2c_read(uint8_t slave_addr, uint8_t reg_addr, uint8_t data_length, uint8_t *data)
+// A blocking call gives up if the bus shows no progress for this long
+#define TWI_TIMEOUT_US	2000
+
+// The queue of transactions, the head is the one on the bus
+static twi_xfer_t *volatile twi_head = 0;
+static twi_xfer_t *volatile twi_tail = 0;
+// Time of the last event of the transaction on the bus
+static volatile uint32_t twi_last_event = 0;
+
+static void twi_configure(void);
+static void twi_start(twi_xfer_t *xfer);
+static void twi_finish(twi_status_t status);
+
+// Starts a transaction on the bus by sending the register address
+// ---
+// Parameters: xfer: the transaction at the head of the queue
+// Returns: nothing
+// Author: Boldizsar Palotas
+static void twi_start(twi_xfer_t *xfer)
 {
-	volatile uint32_t to;
-	if (!data_length) return -1;
-
-	sent = false;
-	read = false;
-	NRF_TWI0->ADDRESS = slave_addr;
-	NRF_TWI0->TXD = reg_addr;
+	twi_last_event = get_time_us();
+	NRF_TWI0->EVENTS_STOPPED = 0;
+	NRF_TWI0->ADDRESS = xfer->addr;
 	NRF_TWI0->SHORTS = 0;
+	NRF_TWI0->TXD = xfer->reg;
 	NRF_TWI0->TASKS_STARTTX = 1;
+}
 
-	to = 10000;
-	while (!sent && --to);
-	if (!to) return -2;
-	sent = false;
-	
-	if (data_length-1 == 0) NRF_TWI0->SHORTS = TWI_SHORTS_BB_STOP_Msk;
-	else NRF_TWI0->SHORTS = TWI_SHORTS_BB_SUSPEND_Msk;
-
-	NRF_TWI0->TASKS_STARTRX = 1;
+// Completes the transaction at the head of the queue, calls its
+// callback and starts the next one. Called from the interrupt
+// handler or with the interrupts masked.
+// ---
+// Parameters: status: the result of the transaction
+// Returns: nothing
+// Author: Boldizsar Palotas
+static void twi_finish(twi_status_t status)
+{
+	twi_xfer_t *xfer = twi_head;
+	if (!xfer)
+		return;
+	twi_head = xfer->next;
+	if (twi_head)
+		twi_start(twi_head);
+	else
+		twi_tail = 0;
+	xfer->status = status;
+	// The callback may queue the next transaction of a chain
+	if (xfer->done_fn)
+		xfer->done_fn(xfer);
+}
 
-	while (true)
-	{
-		to = 10000;
-		while (!read && --to);
-		if (!to) return -3;
-		read = false;
-	
-		*data++ = NRF_TWI0->RXD;
-		if (--data_length == 1) NRF_TWI0->SHORTS = TWI_SHORTS_BB_STOP_Msk;
-		NRF_TWI0->TASKS_RESUME = 1;
-		if (data_length == 0) break;	
+// Queues a transaction, it is started right away if the bus is idle.
+// Can be called from interrupt handlers and completion callbacks.
+// ---
+// Parameters: xfer: the transaction, owned by the caller and not
+//     touched until its status is no longer TWI_PENDING
+// Returns: false if the transaction is invalid or already queued
+// Author: Boldizsar Palotas
+bool twi_submit(twi_xfer_t *xfer)
+{
+	if (!xfer->write && !xfer->length)
+		return false;
+	CRITICALSECTION_FastEnter();
+	if (xfer->status == TWI_PENDING) {
+		CRITICALSECTION_FastExit();
+		return false;
+	}
+	xfer->status = TWI_PENDING;
+	xfer->error = false;
+	xfer->pos = 0;
+	xfer->next = 0;
+	if (twi_tail) {
+		twi_tail->next = xfer;
+		twi_tail = xfer;
+	} else {
+		twi_head = twi_tail = xfer;
+		twi_start(xfer);
 	}
-	return 0;			
+	CRITICALSECTION_FastExit();
+	return true;
 }
 
-bool i2c_write(uint8_t slave_addr, uint8_t reg_addr, uint8_t data_length, uint8_t const *data)
+// Checks whether there are transactions queued or on the bus
+// ---
+// Parameters: none
+// Returns: true if the bus is busy
+// Author: Boldizsar Palotas
+bool twi_busy(void)
 {
-	if (!data_length) return -1;
-
-	sent = false;
-	NRF_TWI0->ADDRESS = slave_addr;
-	NRF_TWI0->SHORTS = 0;
-	NRF_TWI0->TXD = reg_addr;
-	NRF_TWI0->TASKS_STARTTX = 1;
+	return twi_head != 0;
+}
 
-	while(!sent);
-	sent = false;  // address sent
+// Gives up the transaction on the bus if it made no progress for
+// TWI_TIMEOUT_US: it completes with TWI_TIMEOUT and the peripheral
+// is reset.
+// ---
+// Parameters: none
+// Returns: true if the transaction was given up
+// Author: Boldizsar Palotas
+bool twi_check_timeout(void)
+{
+	bool timeout = false;
+	CRITICALSECTION_FastEnter();
+	if (twi_head && TWI_TIMEOUT_US < get_time_us() - twi_last_event) {
+		NRF_TWI0->ENABLE = TWI_ENABLE_ENABLE_Disabled;
+		twi_configure();
+		twi_finish(TWI_TIMEOUT);
+		timeout = true;
+	}
+	CRITICALSECTION_FastExit();
+	return timeout;
+}
 
-	while (data_length-- != 0)
-	{
-		NRF_TWI0->TXD = *data++;
+// Runs a transaction and waits until it completes
+// ---
+// Parameters: xfer: the transaction
+// Returns: the status of the transaction
+// Author: Boldizsar Palotas
+static twi_status_t twi_transfer(twi_xfer_t *xfer)
+{
+	if (!twi_submit(xfer))
+		return TWI_ERROR;
+	while (xfer->status == TWI_PENDING)
+		twi_check_timeout();
+	return xfer->status;
+}
 
-		while(!sent);
-		sent = false;  
-	}
-	
-	NRF_TWI0->TASKS_STOP = 1;
+bool i2c_read(uint8_t slave_addr, uint8_t reg_addr, uint8_t data_length, uint8_t *data)
+{
+	twi_xfer_t xfer = {
+		.addr = slave_addr, .reg = reg_addr, .length = data_length, .data = data, .write = false
+	};
+	return twi_transfer(&xfer) != TWI_DONE;
+}
 
-	return 0;
+bool i2c_write(uint8_t slave_addr, uint8_t reg_addr, uint8_t data_length, uint8_t const *data)
+{
+	twi_xfer_t xfer = {
+		.addr = slave_addr, .reg = reg_addr, .length = data_length, .data = (uint8_t *) data, .write = true
+	};
+	return twi_transfer(&xfer) != TWI_DONE;
 }
-	
-void SPI0_TWI0_IRQHandler(void) 
+
+// The state machine of the transaction at the head of the queue:
+// - write: each TXDSENT sends the next byte, STOP after the last
+// - read: the TXDSENT of the register address starts the reception,
+//   each byte suspends the bus until it is read from RXD, the last
+//   one stops it
+// The transaction completes on STOPPED.
+void SPI0_TWI0_IRQHandler(void)
 {
+	twi_xfer_t *xfer = twi_head;
+	twi_last_event = get_time_us();
+
 	if(NRF_TWI0->EVENTS_RXDREADY != 0)
 	{
 		NRF_TWI0->EVENTS_RXDREADY = 0;
-//		printf("\revent rxready\n");
-		read = true;
+		if (xfer && xfer->pos < xfer->length) {
+			xfer->data[xfer->pos++] = NRF_TWI0->RXD;
+			if (xfer->length - xfer->pos == 1)
+				NRF_TWI0->SHORTS = TWI_SHORTS_BB_STOP_Msk;
+			NRF_TWI0->TASKS_RESUME = 1;
+		}
 	}
 
-        if(NRF_TWI0->EVENTS_TXDSENT != 0)
+	if(NRF_TWI0->EVENTS_TXDSENT != 0)
 	{
 		NRF_TWI0->EVENTS_TXDSENT = 0;
-//		printf("\revent txdsent\n");
-		sent = true;
-  	}
-        
+		if (xfer && !xfer->write) {
+			NRF_TWI0->SHORTS = xfer->length == 1 ?
+				TWI_SHORTS_BB_STOP_Msk : TWI_SHORTS_BB_SUSPEND_Msk;
+			NRF_TWI0->TASKS_STARTRX = 1;
+		} else if (xfer && xfer->pos < xfer->length) {
+			NRF_TWI0->TXD = xfer->data[xfer->pos++];
+		} else if (xfer) {
+			NRF_TWI0->TASKS_STOP = 1;
+		}
+	}
+
 	if(NRF_TWI0->EVENTS_ERROR != 0)
-    	{
-		printf("\revent error, code: %lx | at %lu usecs\n", NRF_TWI0->ERRORSRC, get_time_us());
+	{
 		NRF_TWI0->ERRORSRC = 3;
-        	NRF_TWI0->EVENTS_ERROR = 0;
-    	}        
-
-/*	if(NRF_TWI0->EVENTS_STOPPED != 0)
-    	{
-//		printf("\revent stopped\n");
-        	NRF_TWI0->EVENTS_STOPPED = 0;
-    	}        
-
-	if(NRF_TWI0->EVENTS_SUSPENDED != 0)
-    	{
-//		printf("\revent suspended\n");
-        	NRF_TWI0->EVENTS_SUSPENDED = 0;
-    	}        
-
-	if(NRF_TWI0->EVENTS_BB != 0)
-    	{
-//		printf("\revent bb\n");
-        	NRF_TWI0->EVENTS_BB = 0;
-    	}	
-*/
-}
+		NRF_TWI0->EVENTS_ERROR = 0;
+		if (xfer)
+			xfer->error = true;
+		NRF_TWI0->TASKS_STOP = 1;
+	}
 
+	if(NRF_TWI0->EVENTS_STOPPED != 0)
+	{
+		NRF_TWI0->EVENTS_STOPPED = 0;
+		if (xfer)
+			twi_finish(xfer->error ? TWI_ERROR : TWI_DONE);
+	}
+}
 
-void twi_init(void)
+// Sets up the peripheral, also after a bus lockup
+// ---
+// Parameters: none
+// Returns: nothing
+// Author: Mostly the original code, modified by Boldizsar Palotas
+static void twi_configure(void)
 {
-	nrf_gpio_cfg(TWI_SCL, NRF_GPIO_PIN_DIR_INPUT, NRF_GPIO_PIN_INPUT_CONNECT, NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_S0D1, NRF_GPIO_PIN_NOSENSE); 
-	nrf_gpio_cfg(TWI_SDA, NRF_GPIO_PIN_DIR_INPUT, NRF_GPIO_PIN_INPUT_CONNECT, NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_S0D1, NRF_GPIO_PIN_NOSENSE); 
-
   	NRF_TWI0->PSELSCL	  = TWI_SCL;
 	NRF_TWI0->PSELSDA 	  = TWI_SDA;
  	NRF_TWI0->EVENTS_RXDREADY = 0;
 	NRF_TWI0->EVENTS_TXDSENT  = 0;
+	NRF_TWI0->EVENTS_ERROR    = 0;
+	NRF_TWI0->EVENTS_STOPPED  = 0;
     	NRF_TWI0->FREQUENCY       = TWI_FREQUENCY_FREQUENCY_K400;
-	NRF_TWI0->INTENSET	  = TWI_INTENSET_TXDSENT_Msk | TWI_INTENSET_RXDREADY_Msk | TWI_INTENSET_ERROR_Msk;// | TWI_INTENSET_SUSPENDED_Msk | TWI_INTENSET_BB_Msk | TWI_INTENSET_STOPPED_Msk;
+	NRF_TWI0->INTENSET	  = TWI_INTENSET_TXDSENT_Msk | TWI_INTENSET_RXDREADY_Msk | TWI_INTENSET_ERROR_Msk | TWI_INTENSET_STOPPED_Msk;
 
 	NRF_TWI0->SHORTS	  = 0;
 	NRF_TWI0->ENABLE          = TWI_ENABLE_ENABLE_Enabled;
+}
+
+void twi_init(void)
+{
+	nrf_gpio_cfg(TWI_SCL, NRF_GPIO_PIN_DIR_INPUT, NRF_GPIO_PIN_INPUT_CONNECT, NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_S0D1, NRF_GPIO_PIN_NOSENSE);
+	nrf_gpio_cfg(TWI_SDA, NRF_GPIO_PIN_DIR_INPUT, NRF_GPIO_PIN_INPUT_CONNECT, NRF_GPIO_PIN_PULLUP, NRF_GPIO_PIN_S0D1, NRF_GPIO_PIN_NOSENSE);
+
+	twi_configure();
 
 	NVIC_ClearPendingIRQ(SPI0_TWI0_IRQn);
 	NVIC_SetPriority(SPI0_TWI0_IRQn, SPI0_TWI0_INT_PRIO);
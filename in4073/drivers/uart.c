@@ -11,28 +11,30 @@
 #include "in4073.h"
 #include "interrupt_prio.h"
 
-bool txd_available = true;
+// Only written by UART0_IRQHandler (after init)
+static volatile bool txd_available = true;
 
+// The byte is always queued first. If the transmitter is idle the
+// IRQ is pended to start it, so tx_queue keeps a single producer and
+// a single consumer and the UART IRQ never has to be disabled. Either
+// the IRQ ran before the enqueue and left txd_available set, or it
+// runs after and finds the byte in the queue.
 void uart_put(uint8_t byte)
 {
-	NVIC_DisableIRQ(UART0_IRQn);
-
-	if (txd_available) {txd_available = false; NRF_UART0->TXD = byte;}
-	else enqueue(&tx_queue, byte);
-
-	NVIC_EnableIRQ(UART0_IRQn);
+	enqueue(&tx_queue, byte);
+	if (txd_available) NVIC_SetPendingIRQ(UART0_IRQn);
 }
 
 // Reroute printf
 int _write(int file, const char * p_char, int len)
 {
 #ifndef ENABLE_PRINTF
-	int i;
-
-	for (i = 0; i < len; i++)
-	{
- 		enqueue(&text_queue, *p_char++);
-	}
+	// printf is also called from ISRs, so producers of text_queue
+	// are serialised here (once per call, not per byte).
+	CRITICALSECTION_FastEnter();
+	enqueue_n(&text_queue, (const uint8_t*) p_char, len);
+	CRITICALSECTION_FastExit();
+	task_post(TASK_TEXT);
 
 	return len;
 #else
@@ -47,13 +49,22 @@ void UART0_IRQHandler(void)
     	{
 		NRF_UART0->EVENTS_RXDRDY  = 0;
 		enqueue( &rx_queue, NRF_UART0->RXD);
+		task_post(TASK_RX);
 	}
     
     	if (NRF_UART0->EVENTS_TXDRDY != 0)
     	{
     		NRF_UART0->EVENTS_TXDRDY = 0;
-		if (tx_queue.count) NRF_UART0->TXD = dequeue(&tx_queue);
+		if (queue_count(&tx_queue)) NRF_UART0->TXD = dequeue(&tx_queue);
 		else txd_available = true;
+		task_post(TASK_TX);
+	}
+
+	// Start transmission if uart_put found the transmitter idle
+	if (txd_available && queue_count(&tx_queue))
+	{
+		txd_available = false;
+		NRF_UART0->TXD = dequeue(&tx_queue);
 	}
     
 	if (NRF_UART0->EVENTS_ERROR != 0)
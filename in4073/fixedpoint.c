@@ -43,30 +43,402 @@ uint32_t fp_sqrt(uint32_t n) {
     return res;
 }
 
-// pi in q16.16 format
+// sqrt(i * 2^15) for i = 8..32 in 10.6 format
+static const uint32_t sqrt_table[25] = {
+    32768, 34756, 36636, 38424, 40132, 41771, 43348, 44869,
+    46341, 47767, 49152, 50499, 51811, 53090, 54340, 55561,
+    56756, 57926, 59073, 60199, 61303, 62388, 63455, 64504,
+    65536
+};
+
+/** =======================================================
+ *  fp_sqrt20 -- Integer square root of numbers below 2^20.
+ *  =======================================================
+ *  Gives the same result as fp_sqrt, rounded to nearest,
+ *  without loops or division. n is scaled by a power of 4
+ *  into [2^18, 2^20) in fixed steps, where the interpolated
+ *  sqrt_table is within 0.25 of the root. Scaled back and
+ *  rounded it is at most 1 off, which a comparison of the
+ *  squares corrects.
+ *  Parameters:
+ *  - n: The input, n < 2^20, e.g. a squared motor speed.
+ *  Returns: sqrt(n) rounded to nearest.
+ *  Author: Boldizsar Palotas
+**/
+uint32_t fp_sqrt20(uint32_t n) {
+    if (!n)
+        return 0;
+    // m = n * 4^k
+    uint32_t m = n;
+    int k = 0;
+    if (m < (1ul << 4))  { m <<= 16; k += 8; }
+    if (m < (1ul << 12)) { m <<= 8;  k += 4; }
+    if (m < (1ul << 16)) { m <<= 4;  k += 2; }
+    if (m < (1ul << 18)) { m <<= 2;  k += 1; }
+    int i = (m >> 15) - 8;
+    uint32_t s = sqrt_table[i] + ((sqrt_table[i + 1] - sqrt_table[i]) * (m & 0x7FFF) >> 15);
+    uint32_t r = (s + (1ul << (5 + k))) >> (6 + k);
+    // r is the nearest if r^2 - r < n <= r^2 + r
+    r += n > r * r + r;
+    r -= n <= r * r - r;
+    return r;
+}
+
+// pi and pi / 2 in q16.16 format
 #define PI_Q16 205887
+#define PI_2_Q16 102944
+// Turns per radian in q0.32 format, 2^32 / (2 pi)
+#define TURN_Q32 683565276
+
+// Angle in 16.16 format radians as the fraction of a full turn in
+// 0.32 format, which wraps around like the angle
+#define FP_PHASE(angle) ((uint32_t) (((int64_t) (angle) * TURN_Q32 + (1ll << 15)) >> 16))
+
+// sin(i * pi / 512) in 16.16 format, a quarter wave and a guard
+static const int32_t sin_table[258] = {
+    0, 402, 804, 1206, 1608, 2010, 2412, 2814,
+    3216, 3617, 4019, 4420, 4821, 5222, 5623, 6023,
+    6424, 6824, 7224, 7623, 8022, 8421, 8820, 9218,
+    9616, 10014, 10411, 10808, 11204, 11600, 11996, 12391,
+    12785, 13180, 13573, 13966, 14359, 14751, 15143, 15534,
+    15924, 16314, 16703, 17091, 17479, 17867, 18253, 18639,
+    19024, 19409, 19792, 20175, 20557, 20939, 21320, 21699,
+    22078, 22457, 22834, 23210, 23586, 23961, 24335, 24708,
+    25080, 25451, 25821, 26190, 26558, 26925, 27291, 27656,
+    28020, 28383, 28745, 29106, 29466, 29824, 30182, 30538,
+    30893, 31248, 31600, 31952, 32303, 32652, 33000, 33347,
+    33692, 34037, 34380, 34721, 35062, 35401, 35738, 36075,
+    36410, 36744, 37076, 37407, 37736, 38064, 38391, 38716,
+    39040, 39362, 39683, 40002, 40320, 40636, 40951, 41264,
+    41576, 41886, 42194, 42501, 42806, 43110, 43412, 43713,
+    44011, 44308, 44604, 44898, 45190, 45480, 45769, 46056,
+    46341, 46624, 46906, 47186, 47464, 47741, 48015, 48288,
+    48559, 48828, 49095, 49361, 49624, 49886, 50146, 50404,
+    50660, 50914, 51166, 51417, 51665, 51911, 52156, 52398,
+    52639, 52878, 53114, 53349, 53581, 53812, 54040, 54267,
+    54491, 54714, 54934, 55152, 55368, 55582, 55794, 56004,
+    56212, 56418, 56621, 56823, 57022, 57219, 57414, 57607,
+    57798, 57986, 58172, 58356, 58538, 58718, 58896, 59071,
+    59244, 59415, 59583, 59750, 59914, 60075, 60235, 60392,
+    60547, 60700, 60851, 60999, 61145, 61288, 61429, 61568,
+    61705, 61839, 61971, 62101, 62228, 62353, 62476, 62596,
+    62714, 62830, 62943, 63054, 63162, 63268, 63372, 63473,
+    63572, 63668, 63763, 63854, 63944, 64031, 64115, 64197,
+    64277, 64354, 64429, 64501, 64571, 64639, 64704, 64766,
+    64827, 64884, 64940, 64993, 65043, 65091, 65137, 65180,
+    65220, 65259, 65294, 65328, 65358, 65387, 65413, 65436,
+    65457, 65476, 65492, 65505, 65516, 65525, 65531, 65535,
+    65536, 65536
+};
+
+// atan(i / 128) in 16.16 format and a guard
+static const uint16_t atan_table[130] = {
+    0, 512, 1024, 1536, 2047, 2559, 3070, 3580,
+    4091, 4600, 5110, 5618, 6126, 6633, 7140, 7645,
+    8150, 8653, 9156, 9657, 10158, 10657, 11155, 11652,
+    12147, 12641, 13133, 13624, 14114, 14601, 15088, 15572,
+    16055, 16536, 17015, 17492, 17968, 18441, 18913, 19382,
+    19850, 20315, 20779, 21240, 21699, 22156, 22610, 23062,
+    23512, 23960, 24406, 24849, 25289, 25727, 26163, 26597,
+    27028, 27456, 27882, 28306, 28727, 29145, 29561, 29975,
+    30386, 30794, 31200, 31603, 32003, 32401, 32797, 33190,
+    33580, 33968, 34353, 34735, 35115, 35492, 35867, 36239,
+    36608, 36975, 37340, 37701, 38060, 38417, 38771, 39123,
+    39472, 39818, 40162, 40503, 40842, 41178, 41512, 41844,
+    42172, 42499, 42823, 43145, 43464, 43780, 44095, 44407,
+    44716, 45024, 45328, 45631, 45931, 46229, 46525, 46818,
+    47109, 47398, 47685, 47969, 48251, 48531, 48809, 49085,
+    49359, 49630, 49899, 50167, 50432, 50695, 50956, 51215,
+    51472, 51472
+};
+
+// g(i / 64) in 16.16 format and a guard, where
+// asin(x) = pi / 2 - sqrt(1 - x) * g(x) for 0 <= x <= 1. Unlike
+// asin, g is smooth up to 1, g(0) = pi / 2 and g(1) = sqrt(2).
+static const int32_t asin_table[66] = {
+    102944, 102725, 102510, 102297, 102087, 101879, 101674, 101471,
+    101271, 101073, 100877, 100684, 100492, 100303, 100116, 99931,
+    99748, 99567, 99387, 99210, 99034, 98860, 98688, 98518,
+    98349, 98182, 98017, 97853, 97691, 97530, 97370, 97213,
+    97056, 96901, 96748, 96595, 96445, 96295, 96147, 96000,
+    95854, 95709, 95566, 95424, 95283, 95143, 95004, 94867,
+    94730, 94595, 94460, 94327, 94195, 94064, 93933, 93804,
+    93676, 93548, 93422, 93296, 93172, 93048, 92925, 92803,
+    92682, 92682
+};
+
+/** =======================================================
+ *  fp_angle_wrap -- Wrap an angle between -pi and +pi.
+ *  =======================================================
+ *  Subtracts the nearest whole number of turns, without
+ *  loops or branches.
+ *  Parameters:
+ *  - angle: The angle in 16.16 format radians.
+ *  Returns: The angle in the same format, between -pi and
+ *      +pi, the turns subtracted are exact to 1 LSB.
+ *  Author: Boldizsar Palotas
+**/
+f16p16_t fp_angle_wrap(f16p16_t angle) {
+    int32_t turns = ((int64_t) angle * TURN_Q32 + (1ll << 47)) >> 48;
+    // 2 pi in 16.16 format is 2 * PI_Q16 + 205 / 256
+    return angle - turns * (2 * PI_Q16) - ((turns * 205 + 128) >> 8);
+}
+
+// Sine of a phase in 0.32 format (see FP_PHASE): the quarter
+// wave is mirrored and negated with masks, without branches
+static f16p16_t fp_sin_phase(uint32_t phase) {
+    uint32_t p = phase & 0x3FFFFFFF;
+    // 2nd and 4th quarter: p = 2^30 - p
+    uint32_t mirror = -((phase >> 30) & 1);
+    p += mirror & (((uint32_t) 1 << 30) - 2 * p);
+    int i = p >> 22;
+    int32_t frac = (p >> 6) & 0xFFFF;
+    int32_t v = sin_table[i] + (((sin_table[i + 1] - sin_table[i]) * frac + (1 << 15)) >> 16);
+    // 3rd and 4th quarter: v = -v
+    int32_t negate = -(int32_t) (phase >> 31);
+    return (v ^ negate) - negate;
+}
+
+/** =======================================================
+ *  fp_sin -- Sine by linear interpolation of a table.
+ *  =======================================================
+ *  Runs in constant time for any angle.
+ *  Parameters:
+ *  - angle: The angle in 16.16 format radians.
+ *  Returns: The sine in 16.16 format, at most 1.5 LSB off.
+ *  Author: Boldizsar Palotas
+**/
+f16p16_t fp_sin(f16p16_t angle) {
+    return fp_sin_phase(FP_PHASE(angle));
+}
+
+/** =======================================================
+ *  fp_cos -- Cosine by linear interpolation of a table.
+ *  =======================================================
+ *  Runs in constant time for any angle.
+ *  Parameters:
+ *  - angle: The angle in 16.16 format radians.
+ *  Returns: The cosine in 16.16 format, at most 1.5 LSB off.
+ *  Author: Boldizsar Palotas
+**/
+f16p16_t fp_cos(f16p16_t angle) {
+    return fp_sin_phase(FP_PHASE(angle) + ((uint32_t) 1 << 30));
+}
+
+// Square root of n in the 16 fixed steps of the digit by digit
+// method: fp_sqrt without the loop skipping the leading zeros,
+// and with masks instead of the branch, so it takes the same
+// time for any n. Rounded to nearest like fp_sqrt.
+static uint32_t fp_sqrt_steps(uint32_t n) {
+    uint32_t op = n;
+    uint32_t res = 0;
+    for (uint32_t one = 1ul << 30; one; one >>= 2) {
+        // All ones if res + one <= op
+        uint32_t take = -(uint32_t) (res + one <= op);
+        op -= take & (res + one);
+        res = (res >> 1) + (take & one);
+    }
+    return res + (res < op);
+}
+
+/** =======================================================
+ *  fp_asin -- Arcsine by linear interpolation of a table.
+ *  =======================================================
+ *  Interpolates the smooth g(x) of asin_table instead of
+ *  asin itself, whose slope is infinite at +-1. Runs in
+ *  constant time for any x, the square root it takes has
+ *  a fixed number of steps.
+ *  Parameters:
+ *  - x: The sine in 16.16 format, saturated to [-1, 1].
+ *  Returns: The angle in 16.16 format radians, at most
+ *      2 LSB off.
+ *  Author: Boldizsar Palotas
+**/
+f16p16_t fp_asin(f16p16_t x) {
+    uint32_t ax = x < 0 ? -(uint32_t) x : (uint32_t) x;
+    ax = ax < FP_INT(1, 16) ? ax : FP_INT(1, 16);
+    uint32_t u = FP_INT(1, 16) - ax;
+    // sqrt(1 - |x|) in 16.16 format. u << 16 is 2^32 for x = 0,
+    // that is read as 2^32 - 1, which still rounds to 1.
+    uint32_t s = fp_sqrt_steps((u << 16) - (u >> 16));
+    int i = ax >> 10;
+    int32_t frac = ax & 0x3FF;
+    uint32_t g = asin_table[i] + (((asin_table[i + 1] - asin_table[i]) * frac + (1 << 9)) >> 10);
+    // s * g in 16.16 format, g is split as it has 17 bits
+    int32_t a = PI_2_Q16 - (int32_t) ((s * (g >> 8) + (s * (g & 0xFF) >> 8) + (1 << 7)) >> 8);
+    return x < 0 ? -a : a;
+}
+
+/** =======================================================
+ *  fp_atan2 -- Arctangent of y / x by interpolation.
+ *  =======================================================
+ *  Reduces the vector to the first octant, where the
+ *  ratio of its coordinates is between 0 and 1, and
+ *  interpolates the atan table. Runs in constant time: the
+ *  ratio is divided out bit by bit in 17 fixed steps.
+ *  Parameters:
+ *  - y, x: The vector, in any but the same scale.
+ *  Returns: The angle in 16.16 format radians between -pi
+ *      and +pi, at most 3.5 LSB off: the ratio has only 16
+ *      significant bits.
+ *  Author: Boldizsar Palotas
+**/
+f16p16_t fp_atan2(q32_t y, q32_t x) {
+    uint32_t ax = x < 0 ? -(uint32_t) x : (uint32_t) x;
+    uint32_t ay = y < 0 ? -(uint32_t) y : (uint32_t) y;
+    uint32_t hi = ax < ay ? ay : ax;
+    uint32_t lo = ax < ay ? ax : ay;
+    // Make hi < 2^16 for the division
+    int shift = 0;
+    shift += hi >> (shift + 24) ? 8 : 0;
+    shift += hi >> (shift + 20) ? 4 : 0;
+    shift += hi >> (shift + 18) ? 2 : 0;
+    shift += hi >> (shift + 17) ? 1 : 0;
+    shift += hi >> (shift + 16) ? 1 : 0;
+    // Rounded, 2^16 is taken as 2^16 - 1 so that lo << 16 fits
+    uint32_t half = ((uint32_t) 1 << shift) >> 1;
+    hi = (hi + half) >> shift;
+    lo = (lo + half) >> shift;
+    hi -= hi >> 16;
+    lo -= lo >> 16;
+    // t = (lo << 16) / hi rounded, by restoring division: it is
+    // below 2^17, as lo <= hi
+    uint32_t r = (lo << 16) + (hi >> 1);
+    uint32_t t = 0;
+    for (int i = 16; 0 <= i; i--) {
+        uint32_t take = -(uint32_t) ((hi << i) <= r);
+        r -= take & (hi << i);
+        t |= take & ((uint32_t) 1 << i);
+    }
+    // The vector (0, 0)
+    t &= -(uint32_t) (hi != 0);
+
+    int i = t >> 9;
+    int32_t frac = t & 0x1FF;
+    int32_t a = atan_table[i] + (((atan_table[i + 1] - atan_table[i]) * frac + (1 << 8)) >> 9);
+    a = ax < ay ? PI_2_Q16 - a : a;
+    a = x < 0 ? PI_Q16 - a : a;
+    return y < 0 ? -a : a;
+}
+
+// Number of CORDIC iterations, enough for 1 binary angle unit
+#define CORDIC_STEPS 16
+// atan(2^-i) in binary angle units << 16, pi is 2^31
+static const uint32_t cordic_atan[CORDIC_STEPS] = {
+    536870912, 316933406, 167458907, 85004756,
+    42667331, 21354465, 10679838, 5340245,
+    2670163, 1335087, 667544, 333772,
+    166886, 83443, 41722, 20861
+};
+// 1 / CORDIC gain in q1.15 format
+#define CORDIC_GAIN_INV_Q15 19898
+
+/** =======================================================
+ *  fp_polar -- CORDIC angle and magnitude of a vector.
+ *  =======================================================
+ *  Rotates (x, y) onto the x axis with shifts and adds only,
+ *  summing the angles of the rotations. The vector is scaled
+ *  to 28-29 bits first, so x and y can have any scale, as
+ *  long as it is the same.
+ *  The angle is a binary angle: a full turn is 2^16 and pi
+ *  is -2^15, so it wraps around like the angle itself.
+ *  Parameters:
+ *  - y, x: The vector.
+ *  - r: If not NULL, the magnitude of the vector in the scale
+ *      of x and y is returned here. It is only correct if it
+ *      fits, e.g. |x|, |y| < 2^30.
+ *  Returns: atan2(y, x) in binary angle units, accurate to 1.
+ *  Author: Boldizsar Palotas
+**/
+q16_t fp_polar(q32_t y, q32_t x, q32_t* r) {
+    uint32_t ax = x < 0 ? -(uint32_t) x : (uint32_t) x;
+    uint32_t ay = y < 0 ? -(uint32_t) y : (uint32_t) y;
+    uint32_t max = ax < ay ? ay : ax;
+    int shift = 0;
+    if (!max) {
+        if (r)
+            *r = 0;
+        return 0;
+    }
+    // Leave room for the gain (1.65) and the rotation (sqrt 2)
+    while (max >= (1ul << 29)) {
+        max >>= 1;
+        shift--;
+    }
+    while (max < (1ul << 28)) {
+        max <<= 1;
+        shift++;
+    }
+    x = shift < 0 ? x >> -shift : (int32_t) ((uint32_t) x << shift);
+    y = shift < 0 ? y >> -shift : (int32_t) ((uint32_t) y << shift);
 
-// Clip an angle in 16.16 format radians between -pi and +pi
-// Param in: angle: the angle
-// Returns the clipped angle in the same format
-// Author: Boldizsar Palotas
-f16p16_t fp_angle_clip(f16p16_t angle) {
-    while (PI_Q16 < angle) {
-        angle -= 2 * PI_Q16;
+    // Rotate into the right half plane where the iteration
+    // converges. The angle is unsigned to wrap around at pi.
+    uint32_t z = 0;
+    int32_t t;
+    if (x < 0) {
+        t = x;
+        if (0 < y) {
+            x = y;
+            y = -t;
+            z = (uint32_t) 1 << 30;
+        } else {
+            x = -y;
+            y = t;
+            z = -((uint32_t) 1 << 30);
+        }
     }
-    while (angle < - PI_Q16) {
-        angle += 2 * PI_Q16;
+    for (int i = 0; i < CORDIC_STEPS; i++) {
+        t = x;
+        if (0 < y) {
+            x += y >> i;
+            y -= t >> i;
+            z += cordic_atan[i];
+        } else {
+            x -= y >> i;
+            y += t >> i;
+            z -= cordic_atan[i];
+        }
     }
-    return angle;
+
+    if (r) {
+        x = (x >> 14) * CORDIC_GAIN_INV_Q15 >> 1;
+        *r = shift < 0 ? (int32_t) ((uint32_t) x << -shift) : x >> shift;
+    }
+    // Round to binary angle units
+    return (q16_t) ((z + ((uint32_t) 1 << 15)) >> 16);
 }
 
-// Second-order approximation of arcsin(angle) where angle is in 16.16 format
-// Param in: angle: the NON-angle result actually of sin(something)
-// Returns: The approximation of asin(angle) = something
-// The approximation is good between -1 and 1.
-// asin(x) ~= x - x^3 / 3! + x^5/5! - ...
-f16p16_t fp_asin_t1(f16p16_t angle) {
-    int32_t a2 = FP_MUL3(angle, angle, 4, 4, 8);
-    int32_t a3 = FP_MUL3(angle, a2, 4, 4, 8);
-    return (angle) - FP_MUL1((int32_t)FP_FLOAT(1.f/6.f, 8), a3, 8);
+// Product of two q2.30 quaternion elements in q4.60
+#define QUAT_MUL(a, b)  ((int64_t) (a) * (b))
+
+/** =======================================================
+ *  fp_quat_euler -- Euler angles of a unit quaternion.
+ *  =======================================================
+ *  The rotation matrix elements are formed from 64-bit
+ *  products and atan2'd by fp_polar. The pitch is the angle
+ *  of its sine and cosine instead of an arcsine, the cosine
+ *  being the magnitude of the roll vector, so it stays
+ *  accurate near +-90 degrees and for quaternions not
+ *  exactly of unit length.
+ *  Parameters:
+ *  - quat: The quaternion w, x, y, z in q2.30 format.
+ *  - phi, theta, psi: Where to put roll, pitch and yaw in
+ *      binary angle units (FP_BRAD_PI is pi).
+ *  Author: Boldizsar Palotas
+**/
+void fp_quat_euler(const q32_t* quat, q16_t* phi, q16_t* theta, q16_t* psi) {
+    int64_t q00 = QUAT_MUL(quat[0], quat[0]);
+    int64_t q11 = QUAT_MUL(quat[1], quat[1]);
+    int64_t q22 = QUAT_MUL(quat[2], quat[2]);
+    int64_t q33 = QUAT_MUL(quat[3], quat[3]);
+    q32_t cos_theta;
+
+    // The elements of the rotation matrix in q2.30
+    *phi = fp_polar((QUAT_MUL(quat[2], quat[3]) + QUAT_MUL(quat[0], quat[1])) >> 29,
+        (q00 - q11 - q22 + q33) >> 30, &cos_theta);
+    *theta = fp_polar((QUAT_MUL(quat[1], quat[3]) - QUAT_MUL(quat[0], quat[2])) >> 29,
+        cos_theta, 0);
+    *psi = fp_polar((QUAT_MUL(quat[1], quat[2]) + QUAT_MUL(quat[0], quat[3])) >> 29,
+        (q00 + q11 - q22 - q33) >> 30, 0);
 }
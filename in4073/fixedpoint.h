@@ -97,9 +97,21 @@ typedef int8_t          q8_t;
 #ifdef QUADCOPTER
     // Function to to integer square root
     uint32_t fp_sqrt(uint32_t n);
+    // Faster integer square root of n < 2^20, same results
+    uint32_t fp_sqrt20(uint32_t n);
 #endif // QUADCOPTER
 
-f16p16_t fp_angle_clip(f16p16_t);
-f16p16_t fp_asin_t1(f16p16_t);
+// Trigonometry on 16.16 format radians, by interpolated lookup tables
+f16p16_t fp_angle_wrap(f16p16_t angle);
+f16p16_t fp_sin(f16p16_t angle);
+f16p16_t fp_cos(f16p16_t angle);
+f16p16_t fp_asin(f16p16_t x);
+f16p16_t fp_atan2(q32_t y, q32_t x);
+
+// Binary angle units: pi is 2^15, the q16_t wraps around with the angle
+#define FP_BRAD_PI  32768
+q16_t fp_polar(q32_t y, q32_t x, q32_t* r);
+// Roll, pitch and yaw of a q2.30 quaternion in binary angle units
+void fp_quat_euler(const q32_t* quat, q16_t* phi, q16_t* theta, q16_t* psi);
 
 #endif // FIXEDPOINT_H
@@ -39,12 +39,38 @@ static void init_modes(void);
 static void led_display(void);
 static void init_all(void);
 static void transmit_text(void);
-static bool process_and_control(void);
+static void process_and_control(void);
 static void receive_commands(void);
 static void process_dmp_data(void);
-static bool process_raw_data(void);
+static void process_raw_data(void);
 static void idle_task(bool);
-
+static bool control_ready(uint32_t*);
+static bool control_task(void);
+static bool receive_ready(uint32_t*);
+static bool receive_task(void);
+static bool tx_flush_ready(uint32_t*);
+static bool tx_flush_task(void);
+static bool timer_ready(uint32_t*);
+static bool timer_task(void);
+static bool text_ready(uint32_t*);
+static bool text_task(void);
+
+// Time of one frame at 115200 baud, 10 bits per byte
+#define FRAME_TIME_US   (FRAME_SIZE * 10 * 1000000 / 115200)
+
+// Main loop tasks (see sched.h), in the order of their deadlines.
+// The index of a task is its index in the telemetry (MESSAGE_SCHED_ID).
+sched_t sched;
+static sched_task_t tasks[QC_STATE_TASK_CNT] = {
+    // trigger          task            period                  deadline        budget  priority    trace
+    { control_ready,    control_task,   1000000 / IMU_RAW_FREQ, 2500,           2000,   5,          TRACE_CONTROL },
+    { receive_ready,    receive_task,   FRAME_TIME_US,          5000,           500,    4,          TRACE_RECEIVE },
+    { tx_flush_ready,   tx_flush_task,  FRAME_TIME_US,          5000,           200,    3,          TRACE_TX_FLUSH },
+    { timer_ready,      timer_task,     TIMER_PERIOD,           TIMER_PERIOD,   3000,   2,          TRACE_TIMER_TASK },
+    { text_ready,       text_task,      FRAME_TIME_US,          50000,          200,    1,          TRACE_TEXT },
+};
+
+volatile uint32_t pending_tasks = 0;
 uint32_t iteration = 0;
 uint32_t control_iteration = 0;
 bool is_test_device = false;
@@ -59,49 +85,152 @@ int main(void) {
 
     while (1) {
 
-        // This is priority round robin scheduling.
-        // The higher priority task is the first in the chain of
-        // if (...) else if (...) sequences. This guarantees that then
-        // latency for the highest priority task is the time needed to
-        // complete a single other task.
-        bool finished = true;
-        if (check_sensor_int_flag() || !finished) {
-            idle_task(false);
-            clear_sensor_int_flag();
-            // Processing the data might happen before all data is read.
-            // In this case we want to enter this branch again, that is
-            // what the "finished" flag is for.
-            finished = process_and_control();
-        }
-        else if (rx_queue.count) {
-            idle_task(false);
-            receive_commands();
-        }
-        else if (check_timer_flag()) {
-            clear_timer_flag();
-            idle_task(false);
-            qc_hal.get_inputs_fn(&qc_state);
-            led_display();
-            qc_system_log_data(&qc_system);
-        }
-        else if (text_queue.count) {
+        // The IMU FIFO chain and the barometer run on the TWI in the
+        // background, nothing waits for them. If the bus hangs, they
+        // complete with TWI_TIMEOUT here: every pass, at least once a
+        // timer tick, as the timer interrupt wakes the loop.
+        twi_check_timeout();
+
+        // This is fixed priority scheduling, see sched.h and the task
+        // table above. The released task with the highest priority
+        // runs to completion, so the latency of the control task is
+        // the time needed to complete a single other task, which is
+        // bounded by the budgets. If no task is ready the processor
+        // sleeps until an interrupt posts one.
+        sched_task_t* task = sched_next(&sched);
+        if (task) {
             idle_task(false);
-            transmit_text();
+            TRACE(TRACE_BEGIN | task->trace_id);
+            sched_run(&sched, task);
+            TRACE(TRACE_END | task->trace_id);
         }
         else {
             idle_task(true);
+            task_wait();
         }
 
         iteration++;
     }
 }
 
+// Trigger of the control task: new sensor data, released at the
+// time of its interrupt.
+// ---
+// Parameters: release: set to the time of the sensor interrupt
+// Returns: true if the sensor interrupt fired
+// Author: Boldizsar Palotas
+bool control_ready(uint32_t* release) {
+    if (!check_sensor_int_flag())
+        return false;
+    *release = get_sensor_int_time();
+    return true;
+}
+
+// TASK: Process sensor inputs and apply outputs.
+// ---
+// Parameters: none
+// Returns: true
+// Author: Boldizsar Palotas
+bool control_task(void) {
+    if (check_sensor_int_flag()) {
+        // Measure pr5: Time from the sensor interrupt until it is handled (wakeup latency).
+        profile_start_tag(&qc_state.prof.pr[5], get_sensor_int_time(), control_iteration);
+        profile_end(&qc_state.prof.pr[5], get_time_us());
+    }
+    clear_sensor_int_flag();
+    // The data was read in the background. If raw samples are left
+    // in the FIFO, the next read is started and posts the task again.
+    process_and_control();
+    return true;
+}
+
+// Trigger of the receive task: bytes in rx_queue
+// ---
+// Parameters: release: unused
+// Returns: true if there are bytes to process
+// Author: Boldizsar Palotas
+bool receive_ready(uint32_t* release) {
+    return queue_count(&rx_queue);
+}
+
+// TASK: Process the received commands
+// ---
+// Parameters: none
+// Returns: true
+// Author: Boldizsar Palotas
+bool receive_task(void) {
+    receive_commands();
+    return true;
+}
+
+// Trigger of the transmit flush task: a deferred frame fits
+// ---
+// Parameters: release: unused
+// Returns: true if a deferred frame can be sent
+// Author: Boldizsar Palotas
+bool tx_flush_ready(uint32_t* release) {
+    return qc_hal_tx_ready();
+}
+
+// TASK: Move deferred frames into the UART transmit queue
+// ---
+// Parameters: none
+// Returns: true
+// Author: Boldizsar Palotas
+bool tx_flush_task(void) {
+    qc_hal.tx_flush_fn(false);
+    return true;
+}
+
+// Trigger of the timer task: TIMER_PERIOD elapsed
+// ---
+// Parameters: release: unused
+// Returns: true if the timer fired
+// Author: Boldizsar Palotas
+bool timer_ready(uint32_t* release) {
+    return check_timer_flag();
+}
+
+// TASK: Read the inputs, update the LEDs, log and send telemetry
+// ---
+// Parameters: none
+// Returns: true
+// Author: Boldizsar Palotas
+bool timer_task(void) {
+    clear_timer_flag();
+    qc_hal.get_inputs_fn(&qc_state);
+    led_display();
+    TRACE(TRACE_BEGIN | TRACE_LOG_DATA);
+    qc_system_log_data(&qc_system);
+    TRACE(TRACE_END | TRACE_LOG_DATA);
+    return true;
+}
+
+// Trigger of the text task: text queued and room to send it
+// ---
+// Parameters: release: unused
+// Returns: true if a text frame can be sent
+// Author: Boldizsar Palotas
+bool text_ready(uint32_t* release) {
+    return queue_count(&text_queue) && FRAME_SIZE + 2 <= qc_hal_tx_space();
+}
+
+// TASK: Send the next part of the queued text
+// ---
+// Parameters: none
+// Returns: true
+// Author: Boldizsar Palotas
+bool text_task(void) {
+    transmit_text();
+    return true;
+}
+
 // TASK: Process sensor inputs and apply outputs. Also measure timing.
 // ---
 // Parameters: none
 // Returns: nothing
 // Author: Boldizsar Palotas
-bool process_and_control(void) {
+void process_and_control(void) {
     // Start measuring pr0: Time from sensor interrupt until outputs are applied to the motor.
     profile_start_tag(&qc_state.prof.pr[0], get_time_us(), control_iteration);
     // End measuring pr2: Time from applying outputs to new data from sensor.
@@ -109,12 +238,10 @@ bool process_and_control(void) {
 
     // Calculate outputs for the control system according to current mode.
     // ========================
-    bool finished;
     if (qc_state.option.raw_control) {
-        finished = process_raw_data();
+        process_raw_data();
     } else {
         process_dmp_data();
-        finished = true;
     }
     qc_system_step(&qc_system);
     // ========================
@@ -124,36 +251,32 @@ bool process_and_control(void) {
     profile_end(&qc_state.prof.pr[0], get_time_us());
 
     control_iteration++;
-    return finished;
 }
 
 // Process sensor inputs when in raw mode.
 // ---
+// The samples queued in the FIFO were read in the background in one
+// burst (see imu_fetch_start), at most IMU_RAW_BATCH of them, and are
+// filtered back-to-back.
 // Parameters: none
 // Returns: nothing
 // Author: Boldizsar Palotas
-bool process_raw_data(void) {
-    static int iter_count = 0;
-    do {
-        sensor_fifo_count = 0;
-        // Start measuring pr3: Time of one data read
-        profile_start_tag(&qc_state.prof.pr[3], get_time_us(), control_iteration);
-        get_raw_sensor_data();
-        qc_state.sensor.sax =  sax * ACC_G_SCALE_INV - qc_state.offset.sax;
-        qc_state.sensor.say = -say * ACC_G_SCALE_INV - qc_state.offset.say;
-        qc_state.sensor.saz = -saz * ACC_G_SCALE_INV - qc_state.offset.saz;
-        qc_state.sensor.sp  = GYRO_CONV_FROM_NATIVE( sp) - qc_state.offset.sp;
-        qc_state.sensor.sq  = GYRO_CONV_FROM_NATIVE(-sq) - qc_state.offset.sq;
-        qc_state.sensor.sr  = GYRO_CONV_FROM_NATIVE(-sr) - qc_state.offset.sr;
+void process_raw_data(void) {
+    imu_sample_t sample[IMU_RAW_BATCH];
+    // Start measuring pr3: Time of parsing and filtering one batch
+    profile_start_tag(&qc_state.prof.pr[3], get_time_us(), control_iteration);
+    uint8_t count = get_raw_sensor_data(sample);
+    for (uint8_t i = 0; i < count; i++) {
+        qc_state.sensor.sax =  sample[i].sax * ACC_G_SCALE_INV - qc_state.offset.sax;
+        qc_state.sensor.say = -sample[i].say * ACC_G_SCALE_INV - qc_state.offset.say;
+        qc_state.sensor.saz = -sample[i].saz * ACC_G_SCALE_INV - qc_state.offset.saz;
+        qc_state.sensor.sp  = GYRO_CONV_FROM_NATIVE( sample[i].sp) - qc_state.offset.sp;
+        qc_state.sensor.sq  = GYRO_CONV_FROM_NATIVE(-sample[i].sq) - qc_state.offset.sq;
+        qc_state.sensor.sr  = GYRO_CONV_FROM_NATIVE(-sample[i].sr) - qc_state.offset.sr;
         acc_filter(&qc_state);
         qc_kalman_filter(&qc_state);
-        iter_count = iter_count + 1;
-        if (iter_count == 4) iter_count = 0;
-        profile_end(&qc_state.prof.pr[3], get_time_us());
-    } while (sensor_fifo_count && (iter_count != 3));
-    //if ((control_iteration & (0x1F << 3)) == 0)
-    //    printf("iter:%d fifo:%d\n", iter_count, sensor_fifo_count);
-    return (sensor_fifo_count == 0);
+    }
+    profile_end(&qc_state.prof.pr[3], get_time_us());
 }
 
 // Process sensor inputs when using the DMP of the IMU
@@ -162,17 +285,12 @@ bool process_raw_data(void) {
 // Returns: nothing
 // Author: Boldizsar Palotas
 void process_dmp_data(void) {
-    int iter_count = 0;
-    do {
-        sensor_fifo_count = 0;
-        // Start measuring pr3: Time of one data read
-        profile_start_tag(&qc_state.prof.pr[3], get_time_us(), control_iteration);
-        get_dmp_data();
-        profile_end(&qc_state.prof.pr[3], get_time_us());
-        iter_count++;
-    } while (sensor_fifo_count);
-    //if ((control_iteration & (0x1F << 3)) == 0)
-    //    printf("iter:%d fifo:%d\n", iter_count, sensor_fifo_count);
+    // The FIFO was read in the background (see imu_fetch_start),
+    // only the newest packet is left to parse.
+    // Start measuring pr3: Time of one data read
+    profile_start_tag(&qc_state.prof.pr[3], get_time_us(), control_iteration);
+    get_dmp_data();
+    profile_end(&qc_state.prof.pr[3], get_time_us());
 
     qc_state.sensor.sax =  sax * ACC_G_SCALE_INV - qc_state.offset.sax;
     qc_state.sensor.say = -say * ACC_G_SCALE_INV - qc_state.offset.say;
@@ -192,8 +310,30 @@ void process_dmp_data(void) {
 // Returns: nothing
 // Author: Boldizsar Palotas
 void receive_commands(void) {
-    while (rx_queue.count)
-        serialcomm_receive_char(&serialcomm, dequeue(&rx_queue));
+    uint8_t buf[FRAME_SIZE];
+    uint32_t n;
+    while ((n = dequeue_n(&rx_queue, buf, FRAME_SIZE))) {
+        for (uint32_t i = 0; i < n; i++)
+            serialcomm_receive_char(&serialcomm, buf[i]);
+    }
+}
+
+// Sleep until an interrupt handler posts a task (see pending_tasks)
+// ---
+// Interrupts are masked while checking, so a task posted after the
+// check still wakes the processor: WFI also returns on a masked
+// pending interrupt, whose handler runs once they are unmasked. The
+// bits that only wake the main loop are cleared, the loop checks
+// their queues anyway.
+// Parameters: none
+// Returns: nothing
+// Author: Boldizsar Palotas
+void task_wait(void) {
+    __disable_irq();
+    if (!pending_tasks)
+        __WFI();
+    pending_tasks &= ~(TASK_RX | TASK_TX | TASK_TEXT);
+    __enable_irq();
 }
 
 // TASK to measure the free time we have (and diagnose clogging)
@@ -208,7 +348,9 @@ void idle_task(bool is_idle) {
     static bool was_idle = true;
     if (was_idle && !is_idle) {
         profile_end(&qc_state.prof.pr[4], get_time_us()); // End measuring idle time
+        TRACE(TRACE_END | TRACE_IDLE);
     } else if (!was_idle && is_idle) {
+        TRACE(TRACE_BEGIN | TRACE_IDLE);
         profile_start(&qc_state.prof.pr[4], get_time_us()); // Start measuring idle time
     }
     was_idle = is_idle;
@@ -247,6 +389,7 @@ void init_all(void) {
     profile_start_tag(&qc_state.prof.pr[2], get_time_us(), control_iteration);
     profile_start_tag(&qc_state.prof.pr[4], get_time_us(), control_iteration);
     qc_command.timer = qc_hal.get_time_us_fn();
+    sched_init(&sched, tasks, QC_STATE_TASK_CNT, &qc_state.sched, get_time_us);
 }
 
 // Initialize the mode tables for all modes
@@ -272,9 +415,7 @@ void transmit_text(void) {
     message_value_t msgv;
     msgv.v32[0] = 0;
     msgv.v32[1] = 0;
-    for (int i = 0; i < MESSAGE_VALUE_SIZE && text_queue.count; i++) {
-        msgv.v8[i] = dequeue(&text_queue);
-    }
+    dequeue_n(&text_queue, msgv.v8, MESSAGE_VALUE_SIZE);
     serialcomm_quick_send(&serialcomm, MESSAGE_TEXT_ID, msgv.v32[0], msgv.v32[1]);
 }
 
@@ -27,6 +27,8 @@
 #include "mode_3_calibrate.h"
 #include "mode_5_full.h"
 #include "profile.h"
+#include "trace.h"
+#include "sched.h"
 
 // Start critical section code
 // Original code by Boldizsar Palotas for previous university project.
@@ -53,6 +55,42 @@ inline static void CRITICALSECTION_FastExit(void)
 }
 // End critical section code
 
+// Record an event in the trace (see trace.h), also from interrupt
+// handlers: the recording is short enough to simply mask them.
+#define TRACE(code) do {                        \
+        CRITICALSECTION_FastEnter();            \
+        trace_event((code), get_time_us());     \
+        CRITICALSECTION_FastExit();             \
+    } while (0)
+
+// Pending tasks
+// Bits of pending_tasks, posted by the interrupt handlers when there
+// may be work for the main loop. The main loop sleeps in task_wait()
+// while none of them is set. SENSOR and TIMER are the flags of their
+// tasks and are cleared when the task runs, the others only wake the
+// main loop which then checks its queues.
+#define TASK_SENSOR     0x01    // IMU data ready
+#define TASK_TIMER      0x02    // TIMER_PERIOD elapsed
+#define TASK_RX         0x04    // byte received into rx_queue
+#define TASK_TX         0x08    // byte sent from tx_queue
+#define TASK_TEXT       0x10    // text queued in text_queue
+extern volatile uint32_t pending_tasks;
+void task_wait(void);
+
+static inline void task_post(uint32_t tasks)
+{
+    CRITICALSECTION_FastEnter();
+    pending_tasks |= tasks;
+    CRITICALSECTION_FastExit();
+}
+
+static inline void task_clear(uint32_t tasks)
+{
+    CRITICALSECTION_FastEnter();
+    pending_tasks &= ~tasks;
+    CRITICALSECTION_FastExit();
+}
+
 #define RED				22
 #define YELLOW				24
 #define GREEN				28
@@ -91,18 +129,23 @@ void set_timer_handler(void (*handler)(void));
 void gpio_init(void);
 bool check_sensor_int_flag(void);
 void clear_sensor_int_flag(void);
+uint32_t get_sensor_int_time(void);
 
 // Queue
-// Must be power of 2
+// Single producer, single consumer: lock-free between one ISR and the
+// main loop. Must be power of 2
 #define QUEUE_SIZE 256
 typedef struct {
 	uint8_t Data[QUEUE_SIZE];
-	uint32_t first,last;
-  	uint32_t count; 
+	volatile uint32_t first; // Written by the consumer only
+	volatile uint32_t last;  // Written by the producer only
 } queue;
 void init_queue(queue *q);
 void enqueue(queue *q, char x);
 char dequeue(queue *q);
+uint32_t enqueue_n(queue *q, const uint8_t *data, uint32_t n);
+uint32_t dequeue_n(queue *q, uint8_t *data, uint32_t n);
+static inline uint32_t queue_count(queue *q) { return q->last - q->first; }
 
 // UART
 #define RX_PIN_NUMBER  16
@@ -113,10 +156,39 @@ queue text_queue;
 void uart_init(void);
 void uart_put(uint8_t);
 
+// Transmit scheduler (qc_hal.c)
+bool qc_hal_tx_ready(void);
+uint32_t qc_hal_tx_space(void);
+
 // TWI
+// Transactions are queued and run by the TWI interrupt handler, which
+// also calls done_fn when one completes (see drivers/twi.c). A write
+// of length 0 only sends reg, e.g. a command byte.
 #define TWI_SCL	4
 #define TWI_SDA	2
+typedef enum twi_status {
+	TWI_DONE,
+	TWI_PENDING,
+	TWI_ERROR,
+	TWI_TIMEOUT
+} twi_status_t;
+typedef struct twi_xfer {
+	uint8_t addr;
+	uint8_t reg;
+	uint8_t length;
+	bool write;
+	uint8_t *data;
+	void (*done_fn)(struct twi_xfer *xfer);
+	volatile twi_status_t status;
+	// Used by the driver
+	uint8_t pos;
+	bool error;
+	struct twi_xfer *next;
+} twi_xfer_t;
 void twi_init(void);
+bool twi_submit(twi_xfer_t *xfer);
+bool twi_busy(void);
+bool twi_check_timeout(void);
 bool i2c_write(uint8_t slave_addr, uint8_t reg_addr, uint8_t length, uint8_t const *data);
 bool i2c_read(uint8_t slave_addr, uint8_t reg_addr, uint8_t length, uint8_t *data);
 
@@ -126,9 +198,16 @@ int16_t phi, theta, psi;
 int16_t sp, sq, sr;
 int16_t sax, say, saz;
 uint8_t sensor_fifo_count;
+// Raw samples read from the FIFO in one burst, oldest first
+#define IMU_RAW_BATCH 4
+typedef struct imu_sample {
+	int16_t sax, say, saz;
+	int16_t sp, sq, sr;
+} imu_sample_t;
 void imu_init(bool dmp, uint16_t interrupt_frequency); // if dmp is true, the interrupt frequency is 100Hz - otherwise 32Hz-8kHz
 void get_dmp_data(void);
-void get_raw_sensor_data(void);
+void imu_fetch_start(void);
+uint8_t get_raw_sensor_data(imu_sample_t *sample);
 
 // Barometer
 int32_t pressure;
@@ -144,6 +223,8 @@ void adc_request_sample(void);
 // Flash
 bool spi_flash_init(void);
 bool flash_chip_erase(void);
+bool flash_sector_erase(uint32_t address);
+bool flash_busy(void);
 bool flash_write_byte(uint32_t address, uint8_t data);
 bool flash_write_bytes(uint32_t address, uint8_t *data, uint32_t count);
 bool flash_read_byte(uint32_t address, uint8_t *buffer);
@@ -1232,17 +1232,47 @@ int dmp_read_fifo(short *gyro, short *accel, long *quat,
     unsigned long *timestamp, short *sensors, unsigned char *more)
 {
     unsigned char fifo_data[MAX_PACKET_LENGTH];
-    unsigned char ii = 0;
 
-    /* TODO: sensors[0] only changes when dmp_enable_feature is called. We can
-     * cache this value and save some cycles.
-     */
     sensors[0] = 0;
 
     /* Get a packet. */
     if (mpu_read_fifo_stream(dmp.packet_length, fifo_data, more))
         return -1;
 
+//    get_ms(timestamp);
+    return dmp_parse_fifo(fifo_data, gyro, accel, quat, sensors);
+}
+
+/**
+ *  @brief      Get the length of one DMP packet in the FIFO.
+ *  @return     Packet length in bytes, at most MAX_PACKET_LENGTH.
+ */
+unsigned char dmp_get_packet_length(void)
+{
+    return dmp.packet_length;
+}
+
+/**
+ *  @brief      Parse one packet read from the FIFO.
+ *  Same as dmp_read_fifo for a packet of dmp_get_packet_length() bytes
+ *  read by the caller.
+ *  @param[in]  fifo_data   The packet.
+ *  @param[out] gyro        Gyro data in hardware units.
+ *  @param[out] accel       Accel data in hardware units.
+ *  @param[out] quat        3-axis quaternion data in hardware units.
+ *  @param[out] sensors     Mask of sensors read from FIFO.
+ *  @return     0 if successful.
+ */
+int dmp_parse_fifo(unsigned char *fifo_data, short *gyro, short *accel,
+    long *quat, short *sensors)
+{
+    unsigned char ii = 0;
+
+    /* TODO: sensors[0] only changes when dmp_enable_feature is called. We can
+     * cache this value and save some cycles.
+     */
+    sensors[0] = 0;
+
     /* Parse DMP packet. */
     if (dmp.feature_mask & (DMP_FEATURE_LP_QUAT | DMP_FEATURE_6X_LP_QUAT)) {
 #ifdef FIFO_CORRUPTION_CHECK
@@ -1305,7 +1335,6 @@ int dmp_read_fifo(short *gyro, short *accel, long *quat,
     if (dmp.feature_mask & (DMP_FEATURE_TAP | DMP_FEATURE_ANDROID_ORIENT))
         decode_gesture(fifo_data + ii);
 
-//    get_ms(timestamp);
     return 0;
 }
 
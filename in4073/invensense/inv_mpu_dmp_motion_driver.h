@@ -92,6 +92,10 @@ int dmp_enable_gyro_cal(unsigned char enable);
  */
 int dmp_read_fifo(short *gyro, short *accel, long *quat,
     unsigned long *timestamp, short *sensors, unsigned char *more);
+/* For packets read from the FIFO by the caller, e.g. in the background. */
+unsigned char dmp_get_packet_length(void);
+int dmp_parse_fifo(unsigned char *fifo_data, short *gyro, short *accel,
+    long *quat, short *sensors);
 
 #endif  /* #ifndef _INV_MPU_DMP_MOTION_DRIVER_H_ */
 
@@ -7,37 +7,201 @@
  *  July 2016
  *------------------------------------------------------------------
  */
-#include <math.h>
 #include "in4073.h"
+#include "fixedpoint.h"
 
-#define QUAT_SENS       0x040000000 //1073741824.f //2^30
-#define EPSILON         0.0001f
-#define PI_2            1.57079632679489661923f
+// Euler angles of the DMP quaternion in binary angle units
+// (FP_BRAD_PI is pi), without floating point (see fp_quat_euler)
+// ---
+// Parameters: quat: the quaternion w, x, y, z in q2.30
+// Returns: nothing, sets phi, theta and psi
+// Author: Boldizsar Palotas
+void update_euler_from_quaternions(int32_t *quat)
+{
+	fp_quat_euler(quat, &phi, &theta, &psi);
+}
+
+// Background read of the FIFO
+// The sensor interrupt starts a chain of TWI transactions: the FIFO
+// count, the overflow flag if the FIFO is half full, then the queued
+// DMP packets one by one, of which the newest one is kept, or up to
+// IMU_RAW_BATCH raw samples in one burst. The control task is posted
+// when the chain ends, it only parses the data.
+#define MPU_ADDR		0x68
+#define MPU_INT_STATUS		0x3A
+#define MPU_FIFO_COUNT_H	0x72
+#define MPU_FIFO_R_W		0x74
+#define MPU_FIFO_SIZE		1024
+#define MPU_FIFO_OVERFLOW	0x10
+#define DMP_PACKET_MAX		32
+// Accel and gyro, as imu_init configures the FIFO in raw mode
+#define RAW_PACKET_SIZE		12
+
+static bool dmp_on = false;
+static volatile bool fifo_busy = false;
+// The result of the read has not been parsed yet
+static volatile bool fifo_ready = false;
+static twi_xfer_t fifo_xfer;
+static uint8_t fifo_count_buf[2];
+static uint8_t fifo_packet[DMP_PACKET_MAX];
+static uint8_t raw_packets[RAW_PACKET_SIZE * IMU_RAW_BATCH];
+static uint8_t raw_count;
+static uint16_t fifo_count;
+static uint8_t fifo_retry;
+// 0 if fifo_packet is the newest packet, the error of the read otherwise
+static int8_t fifo_status = -1;
 
-void update_euler_from_quaternions(int32_t *quat) 
+static void fifo_read(uint8_t reg, uint8_t length, uint8_t *data, void (*done_fn)(twi_xfer_t *));
+static void fifo_count_done(twi_xfer_t *xfer);
+static void fifo_overflow_done(twi_xfer_t *xfer);
+static void fifo_packet_done(twi_xfer_t *xfer);
+static void fifo_finish(int8_t status);
+static void raw_count_done(twi_xfer_t *xfer);
+static void raw_overflow_done(twi_xfer_t *xfer);
+static void raw_burst_read(void);
+static void raw_burst_done(twi_xfer_t *xfer);
+
+// Starts reading the FIFO in the background, called by the sensor
+// interrupt
+// ---
+// Parameters: none
+// Returns: nothing
+// Author: Boldizsar Palotas
+void imu_fetch_start(void)
 {
-	float q[4];
+	// The data is kept until it is parsed, the FIFO is drained
+	// by the next read
+	if (fifo_busy || fifo_ready)
+		return;
+	fifo_busy = true;
+	fifo_retry = 0;
+	raw_count = 0;
+	fifo_read(MPU_FIFO_COUNT_H, 2, fifo_count_buf, dmp_on ? fifo_count_done : raw_count_done);
+}
 
-	q[0] = (float)quat[0]/QUAT_SENS;
-	q[1] = (float)quat[1]/QUAT_SENS;
-	q[2] = (float)quat[2]/QUAT_SENS;
-	q[3] = (float)quat[3]/QUAT_SENS;
+static void fifo_read(uint8_t reg, uint8_t length, uint8_t *data, void (*done_fn)(twi_xfer_t *))
+{
+	fifo_xfer.addr = MPU_ADDR;
+	fifo_xfer.reg = reg;
+	fifo_xfer.length = length;
+	fifo_xfer.write = false;
+	fifo_xfer.data = data;
+	fifo_xfer.done_fn = done_fn;
+	if (!twi_submit(&fifo_xfer))
+		fifo_finish(-1);
+}
 
-        phi = (int16_t) (atan2(2.0*(q[2]*q[3] + q[0]*q[1]), q[0]*q[0] - q[1]*q[1] - q[2]*q[2] + q[3]*q[3]) *10430.0);
-        theta = (int16_t) (-1.0 * asin(-2.0*(q[1]*q[3] - q[0]*q[2]))*10430.0);
-        psi = (int16_t) (atan2(2.0*(q[1]*q[2] + q[0]*q[3]), q[0]*q[0] + q[1]*q[1] - q[2]*q[2] - q[3]*q[3])*10430.0);
+static void fifo_finish(int8_t status)
+{
+	fifo_status = status;
+	fifo_ready = true;
+	fifo_busy = false;
+	task_post(TASK_SENSOR);
 }
 
-// reading & conversion takes 3.2 ms!!! hurray (still lots of time till 10)
+static void fifo_count_done(twi_xfer_t *xfer)
+{
+	uint8_t length = dmp_get_packet_length();
+	if (xfer->status != TWI_DONE || !length || DMP_PACKET_MAX < length) {
+		fifo_finish(-1);
+		return;
+	}
+	fifo_count = (fifo_count_buf[0] << 8) | fifo_count_buf[1];
+	if (fifo_count < length) {
+		// The count sometimes reads zero when a reread proves
+		// that it is not (see mpu_read_fifo_stream)
+		if (fifo_retry++)
+			fifo_finish(-1);
+		else
+			fifo_read(MPU_FIFO_COUNT_H, 2, fifo_count_buf, fifo_count_done);
+	} else if (fifo_count > MPU_FIFO_SIZE / 2) {
+		// FIFO is 50% full, better check overflow bit.
+		fifo_read(MPU_INT_STATUS, 1, fifo_count_buf, fifo_overflow_done);
+	} else {
+		fifo_read(MPU_FIFO_R_W, length, fifo_packet, fifo_packet_done);
+	}
+}
+
+static void fifo_overflow_done(twi_xfer_t *xfer)
+{
+	if (xfer->status != TWI_DONE)
+		fifo_finish(-1);
+	else if (fifo_count_buf[0] & MPU_FIFO_OVERFLOW)
+		fifo_finish(-2);
+	else
+		fifo_read(MPU_FIFO_R_W, dmp_get_packet_length(), fifo_packet, fifo_packet_done);
+}
+
+static void fifo_packet_done(twi_xfer_t *xfer)
+{
+	uint8_t length = dmp_get_packet_length();
+	if (xfer->status != TWI_DONE) {
+		fifo_finish(-1);
+		return;
+	}
+	fifo_count -= length;
+	if (fifo_count < length)
+		fifo_finish(0);
+	else
+		fifo_read(MPU_FIFO_R_W, length, fifo_packet, fifo_packet_done);
+}
+
+static void raw_count_done(twi_xfer_t *xfer)
+{
+	if (xfer->status != TWI_DONE) {
+		fifo_finish(-1);
+		return;
+	}
+	fifo_count = (fifo_count_buf[0] << 8) | fifo_count_buf[1];
+	if (fifo_count < RAW_PACKET_SIZE)
+		fifo_finish(0);
+	else if (fifo_count > MPU_FIFO_SIZE / 2)
+		// FIFO is 50% full, better check overflow bit.
+		fifo_read(MPU_INT_STATUS, 1, fifo_count_buf, raw_overflow_done);
+	else
+		raw_burst_read();
+}
+
+static void raw_overflow_done(twi_xfer_t *xfer)
+{
+	if (xfer->status != TWI_DONE)
+		fifo_finish(-1);
+	else if (fifo_count_buf[0] & MPU_FIFO_OVERFLOW)
+		fifo_finish(-2);
+	else
+		raw_burst_read();
+}
+
+static void raw_burst_read(void)
+{
+	raw_count = fifo_count / RAW_PACKET_SIZE;
+	if (raw_count > IMU_RAW_BATCH)
+		raw_count = IMU_RAW_BATCH;
+	TRACE(TRACE_BEGIN | TRACE_IMU_READ);
+	fifo_read(MPU_FIFO_R_W, raw_count * RAW_PACKET_SIZE, raw_packets, raw_burst_done);
+}
+
+static void raw_burst_done(twi_xfer_t *xfer)
+{
+	TRACE(TRACE_END | TRACE_IMU_READ);
+	fifo_finish(xfer->status == TWI_DONE ? 0 : -1);
+}
+
+// Parses the packet of the background read, the reading (which took
+// 3.2 ms when it was done here) is over by the time this runs
 void get_dmp_data(void)
 {
-	int8_t read_stat;
+	int8_t read_stat = fifo_ready ? fifo_status : -1;
 	int16_t gyro[3], accel[3], sensors;
 	int32_t quat[4];
 
-	if (!(read_stat = dmp_read_fifo(gyro, accel, quat, NULL, &sensors, &sensor_fifo_count)))
+	sensor_fifo_count = 0;
+	if (!read_stat)
+		read_stat = dmp_parse_fifo(fifo_packet, gyro, accel, quat, &sensors);
+	fifo_ready = false;
+	if (!read_stat)
 	{
-		if (!sensor_fifo_count && (sensors & (INV_XYZ_ACCEL | INV_XYZ_GYRO | INV_WXYZ_QUAT)) == (INV_XYZ_ACCEL | INV_XYZ_GYRO | INV_WXYZ_QUAT)) {
+		if ((sensors & (INV_XYZ_ACCEL | INV_XYZ_GYRO | INV_WXYZ_QUAT)) == (INV_XYZ_ACCEL | INV_XYZ_GYRO | INV_WXYZ_QUAT)) {
 			update_euler_from_quaternions(quat);
 			sax = accel[0];
 			say = accel[1];
@@ -48,35 +212,62 @@ void get_dmp_data(void)
 		}
 	}
 	else {
-		sensor_fifo_count = 0;
+		if (read_stat == -2)
+			mpu_reset_fifo();
 		printf("> DMP err %d\n", read_stat);
 	}
 }
 
 
-void get_raw_sensor_data(void){
-		
-	int8_t read_stat;
-	uint8_t sensors;
-	int16_t gyro[3], accel[3];
+// Parses the raw samples of the background read, up to IMU_RAW_BATCH
+// of them read in one burst. If more are queued in the FIFO, the next
+// read starts right away instead of at the next sensor interrupt.
+// ---
+// Parameters: sample: the samples read, oldest first, room for
+//     IMU_RAW_BATCH of them
+// Returns: the number of samples read, sensor_fifo_count is set to
+//     the number of samples left in the FIFO
+// Author: Boldizsar Palotas
+uint8_t get_raw_sensor_data(imu_sample_t *sample)
+{
+	int8_t read_stat = fifo_ready ? fifo_status : -1;
+	uint8_t count = raw_count;
 
-	if (!(read_stat = mpu_read_fifo(gyro, accel, NULL, &sensors, &sensor_fifo_count)))
+	sensor_fifo_count = 0;
+	fifo_ready = false;
+	if (read_stat)
 	{
-		if ((sensors & (INV_XYZ_ACCEL | INV_XYZ_GYRO)) == (INV_XYZ_ACCEL | INV_XYZ_GYRO)) {
-			sax = accel[0];
-			say = accel[1];
-			saz = accel[2];
-			sp = gyro[0];
-			sq = gyro[1];
-			sr = gyro[2];
-		} else {
-			printf("raw: no acc/gyro\n");
-		}
-	}
-	else {
-		sensor_fifo_count = 0;
+		if (read_stat == -2)
+			mpu_reset_fifo();
 		printf("> MPU err %d\n", read_stat);
+		return 0;
+	}
+	for (uint8_t i = 0; i < count; i++) {
+		uint8_t *p = &raw_packets[RAW_PACKET_SIZE * i];
+		sample[i].sax = (p[0] << 8) | p[1];
+		sample[i].say = (p[2] << 8) | p[3];
+		sample[i].saz = (p[4] << 8) | p[5];
+		sample[i].sp = (p[6] << 8) | p[7];
+		sample[i].sq = (p[8] << 8) | p[9];
+		sample[i].sr = (p[10] << 8) | p[11];
 	}
+	// The newest sample is also kept where qc_hal reads it
+	if (count) {
+		sax = sample[count - 1].sax;
+		say = sample[count - 1].say;
+		saz = sample[count - 1].saz;
+		sp = sample[count - 1].sp;
+		sq = sample[count - 1].sq;
+		sr = sample[count - 1].sr;
+	}
+	sensor_fifo_count = fifo_count / RAW_PACKET_SIZE - count;
+	if (sensor_fifo_count) {
+		// Not raced by the sensor interrupt starting it as well
+		CRITICALSECTION_FastEnter();
+		imu_fetch_start();
+		CRITICALSECTION_FastExit();
+	}
+	return count;
 }
 
 void imu_init(bool dmp, uint16_t freq)
@@ -90,6 +281,13 @@ void imu_init(bool dmp, uint16_t freq)
 	if (dmp)
 		dmp_features |= DMP_FEATURE_6X_LP_QUAT;
 
+	// Let a background read finish, it is not restarted until the end
+	NVIC_DisableIRQ(GPIOTE_IRQn);
+	while (fifo_busy)
+		twi_check_timeout();
+	dmp_on = false;
+	fifo_ready = false;
+
 	//mpu	
 	printf("mpu i:%d\n", mpu_init(NULL));
 	printf("mpu s:%d\n", mpu_set_sensors(INV_XYZ_GYRO | INV_XYZ_ACCEL));
@@ -115,5 +313,6 @@ void imu_init(bool dmp, uint16_t freq)
 	}
 	
 	// Enable sensor interrupt
+	dmp_on = dmp;
 	NVIC_EnableIRQ(GPIOTE_IRQn);
 }
@@ -3,82 +3,112 @@
 #include "log.h"
 
 // Flash is 1024 * 1024 bits.
-// One item is 9 * 8 bits
-// 1024 * 1024 / (8 * 9) = 14 563,56
-#define LOG_MAX_ITEMS	14563
+#define LOG_FLASH_SIZE	(1024 * 1024 / 8)
+
+// The flash is erased in 4 KiB sectors
+#define LOG_SECTOR_SIZE	4096
+
+// Longest possible delta record, four fields with 3 byte varints.
+// Such records are replaced by keyframes.
+#define LOG_DELTA_MAX_SIZE	(1 + 4 * 3)
+
+// Size of one RAM staging buffer, one flash page
+#define LOG_PAGE_SIZE	256
+
+// Number of staging buffers, a power of two. log_task() programs
+// less than the full log mask stages in the tick at a sector
+// boundary, where each ID starts with a keyframe, and nothing while
+// an erase runs. Items are collected in the other pages meanwhile.
+#define LOG_PAGE_CNT	4
+
+// Most bytes log_task() programs per call. The flash takes about
+// 21 us per byte in AAI mode, this keeps a tick under 700 us and
+// still outpaces the ~21 bytes per tick of the full log mask.
+#define LOG_PROGRAM_BUDGET	32
+
+// Start erasing the next sector when less than this is erased ahead
+// of the write position. A sector erase takes up to 25 ms and the
+// space left must last until it is done.
+#define LOG_ERASE_AHEAD	(2 * LOG_SECTOR_SIZE)
 
 /** LOG FORMAT
  *
- *  | ...                                       |  Address
+ *  | ...                                       |  Offset
  *  +----------+----------+----------+----------+
- *  | ID_(n+0) | ID_(n+1) | ID_(n+2) | ID_(n+3) |  36 n
+ *  | REC_(n)             | REC_(n+1)| REC_(n+2)|
  *  +----------+----------+----------+----------+
- *  | ITEM_(n+0).v32[0]             ITEM_(n+0)  |  36 n + 4
- *  +----------------------------- - - - - - - -+
- *  | ITEM_(n+0).v32[1]                         | 
- *  +-------------------------------------------+
- *  | ITEM_(n+1).v32[0]             ITEM_(n+1)  |  36 n + 8
- *  +----------------------------- - - - - - - -+
- *  | ITEM_(n+1).v32[1]                         |
- *  +-------------------------------------------+
- *  | ITEM_(n+2).v32[0]             ITEM_(n+2)  |  36 n + 12
- *  +----------------------------- - - - - - - -+
- *  | ITEM_(n+2).v32[1]                         |
- *  +-------------------------------------------+
- *  | ITEM_(n+3).v32[0]             ITEM_(n+3)  |  36 n + 16
- *  +----------------------------- - - - - - - -+
- *  | ITEM_(n+3).v32[1]                         |
+ *  | REC_(n+2) ...                  | PAD      |
+ *  +----------+----------+----------+----------+  Sector boundary
+ *  | REC_(n+3)                      | ...      |
  *  +----------+----------+----------+----------+
- *  | ...      | ...      | ...      | ...      |
  *
- *  IDs contain the information needed to
- *  decode the values in the ITEMs.
- *  
- *  Address for ID of item #k is:
- *  addr(k) = floor(k, 4) * 36 + rem(k, 4)
- *  	floor(k, 4) is (k & ~0x03), round down modulo 4
- *		rem(k, 4)   is (k &  0x03), or (k % 4)
+ *  The log is a stream of variable length records, see LOG
+ *  RECORD FORMAT in log.h.
  *
- *  ITEMs have type message_value_t and can be accessed at byte,
- *  halword and word offsets via the .v8[], .v16[] or .v32[] union
- *  members.
-
- *  Address for ITEM #k is:
- *  addr(k) = floor(k, 4) * 36 + rem(k, 4) * 8 + 4
- *  	floor(k, 4) is (k & ~0x03)
- *		rem(k, 4)   is (k & 0x03)
+ *  The stream wraps around the end of the flash, the flash
+ *  address of an offset is offs % LOG_FLASH_SIZE. Sectors are
+ *  erased one by one ahead of the write position instead of
+ *  erasing the whole chip. In LOG_MODE_RING this destroys the
+ *  oldest records, so the flash always holds the most recent
+ *  ~128 KiB of the log. In LOG_MODE_LINEAR logging stops
+ *  instead.
+ *
+ *  Records are not written to the flash one by one. They are
+ *  collected in RAM buffers that mirror 256 byte pages of the
+ *  flash. log_task() programs the full pages in every timer
+ *  tick, LOG_PROGRAM_BUDGET bytes at a time, and resumes the
+ *  page in the next tick. log_request_flush() makes it program
+ *  the last, partial page as well. Only log_flush() waits for
+ *  the flash and programs everything at once.
  *
  *  The fill rate and status of the log is
  *	kept separately in static variables.
  *
 **/
 
-static uint32_t log_id(uint32_t index);
-static uint32_t log_item(uint32_t index);
+static uint32_t log_encode(message_t* item, uint8_t* rec);
+static bool log_program(bool partial, uint32_t budget);
+static bool log_may_erase(void);
+static void log_erase_ahead(void);
+
+// Stream offsets of the oldest valid record and of the next record
+// to write. The log holds the bytes log_tail .. log_head - 1.
+static uint32_t log_tail;
+static uint32_t log_head;
+
+// Encoder state: the last logged value of each ID and a bit mask
+// of the IDs that have one since the last sync point.
+static message_value_t log_prev[LOG_RECORD_DELTA_IDS];
+static uint32_t log_prev_valid;
+
+// Number of items dropped because the flash was not ready
+static uint32_t log_dropped;
+
+// Stream offsets. Bytes before flash_end are in the flash, the ones
+// between flash_end and log_head only in page_buf. The flash is
+// erased up to erased_end.
+static uint32_t flash_end;
+static uint32_t erased_end;
+
+// Set by log_request_flush(): the staged bytes up to flush_end are
+// to be programmed by log_task() although their page is not full
+static bool     flush_pending;
+static uint32_t flush_end;
 
-// Number of items in the log
-uint32_t logsize;
+// Staging buffers, stream offset o is in page_buf[o / 256 % 4][o % 256]
+static uint8_t  page_buf[LOG_PAGE_CNT][LOG_PAGE_SIZE];
 
 // Serial communication ling
 static serialcomm_t* sc = 0;
 static qc_hal_t*     hal = 0;
 
-// Return address of ID of item No. i
+// Return the staging buffer byte of a stream offset
 // ---
-// Parameters: i: index of item in the log.
-// Returns: The address
+// Parameters: offs: the stream offset
+// Returns: Pointer to the byte
 // Author: Boldizsar Palotas
-uint32_t log_id(uint32_t i) {
-	return (i & ~0x03ul) * 36 + (i & 0x03ul);
-}
-
-// Return address of value of item No. i
-// ---
-// Parameters: i: index of item in the log.
-// Returns: The address
-// Author: Boldizsar Palotas
-uint32_t log_item(uint32_t i) {
-	return (i & ~0x03ul) * 36 + (i & 0x03ul) * 8 + 4;
+static uint8_t* log_page_byte(uint32_t offs) {
+	return &page_buf[(offs / LOG_PAGE_SIZE) % LOG_PAGE_CNT][offs % LOG_PAGE_SIZE];
 }
 
 // Initialize the log structure
@@ -87,8 +117,13 @@ uint32_t log_item(uint32_t i) {
 //	serialcomm: the comm object to use for log readback
 // Returns: true if there was an error
 // Author: Boldizsar Palotas
-bool log_init(qc_hal_t* h, serialcomm_t* serialcomm) {	
-	logsize = 0;
+bool log_init(qc_hal_t* h, serialcomm_t* serialcomm) {
+	log_tail = 0;
+	log_head = 0;
+	log_prev_valid = 0;
+	log_dropped = 0;
+	flash_end = 0;
+	flush_pending = false;
 	hal = h;
 	volatile uint32_t to = 10000;
 	while (--to) {}
@@ -96,82 +131,361 @@ bool log_init(qc_hal_t* h, serialcomm_t* serialcomm) {
 	if (result) {
 		sc = serialcomm;
 	}
+	// The whole chip is erased by flash_init_fn
+	erased_end = LOG_FLASH_SIZE;
 	return result;
 }
 
+// Encode an item as a delta or keyframe record
+// ---
+// Does not change the encoder state.
+// Parameters: item: The item to encode
+// (out) rec: buffer for the record, LOG_DELTA_MAX_SIZE bytes
+// Returns: The length of the record
+// Author: Boldizsar Palotas
+uint32_t log_encode(message_t* item, uint8_t* rec) {
+	uint32_t size = serialcomm_value_size(item->ID);
+	uint32_t len = 1;
+
+	if (item->ID < LOG_RECORD_DELTA_IDS && (log_prev_valid & (1ul << item->ID))) {
+		int fields = (size + 1) / 2;
+		uint16_t zz[4];
+		uint8_t mask = 0;
+		bool nibbles = fields <= 3;
+		for (int i = 0; i < fields; i++) {
+			int16_t delta = item->value.v16[i] - log_prev[item->ID].v16[i];
+			zz[i] = (uint16_t) ((uint16_t) delta << 1) ^ (uint16_t) -(delta < 0);
+			if (zz[i] == 0)
+				continue;
+			mask |= 1 << i;
+			if (0x10 <= zz[i])
+				nibbles = false;
+		}
+
+		if (nibbles) {
+			// Two changed fields per byte, low nibble first
+			int n = 0;
+			for (int i = 0; i < fields; i++) {
+				if (!(mask & (1 << i)))
+					continue;
+				if (n++ & 1)
+					rec[len++] |= zz[i] << 4;
+				else
+					rec[len] = zz[i];
+			}
+			len += n & 1;
+			rec[0] = LOG_RECORD_NIBBLES | (mask << 4) | item->ID;
+			return len;
+		}
+
+		for (int i = 0; i < fields; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			while (0x80 <= zz[i]) {
+				rec[len++] = (zz[i] & 0x7F) | 0x80;
+				zz[i] >>= 7;
+			}
+			rec[len++] = zz[i];
+		}
+		rec[0] = (mask << 4) | item->ID;
+		if (len <= 2 + size)
+			return len;
+	}
+
+	rec[0] = LOG_RECORD_KEYFRAME;
+	rec[1] = item->ID;
+	for (uint32_t i = 0; i < size; i++)
+		rec[2 + i] = item->value.v8[i];
+	return 2 + size;
+}
+
 // Write a few values (one item) to the log
 // ---
+// The item is encoded and only staged in RAM, log_task() programs it
+// once its page is full. Never programs the flash, if the staging
+// buffers are full the item is dropped.
 // Parameters: item: The items to write
-// Returns: True if there was an error
+// Returns: True if there was no error
 // Author: Boldizsar Palotas
 bool log_write(message_t* item) {
-	if (LOG_MAX_ITEMS < logsize) {
-		printf("> Log full!\n");
+	uint8_t rec[LOG_DELTA_MAX_SIZE];
+	uint32_t offs = log_head;
+	uint32_t pad = 0;
+
+	// Each sector starts with a fresh encoder state
+	if (offs % LOG_SECTOR_SIZE == 0)
+		log_prev_valid = 0;
+	uint32_t len = log_encode(item, rec);
+	if (LOG_SECTOR_SIZE - offs % LOG_SECTOR_SIZE < len) {
+		pad = LOG_SECTOR_SIZE - offs % LOG_SECTOR_SIZE;
+		log_prev_valid = 0;
+		len = log_encode(item, rec);
+	}
+	uint32_t end = offs + pad + len;
+
+	if (erased_end - offs < pad + len) {
+		if (!log_may_erase()) {
+			printf("> Log full!\n");
+			return false;
+		}
+		log_dropped++;
+		log_erase_ahead();
+		return false;
+	}
+	if (flash_end - flash_end % LOG_PAGE_SIZE + LOG_PAGE_CNT * LOG_PAGE_SIZE - offs < pad + len) {
+		log_dropped++;
 		return false;
 	}
 
-	bool result1 = hal->flash_write_fn(log_id(logsize), &item->ID, 1);
-	bool result2 = hal->flash_write_fn(log_item(logsize), item->value.v8, 8);
-	if (result1 && result2) {
-		logsize++;
-		return true;
-	} else {
+	for (uint32_t i = 0; i < pad; i++)
+		*log_page_byte(offs++) = LOG_RECORD_PAD;
+	for (uint32_t i = 0; i < len; i++)
+		*log_page_byte(offs++) = rec[i];
+	log_head = end;
+	if (item->ID < LOG_RECORD_DELTA_IDS) {
+		log_prev[item->ID] = item->value;
+		log_prev_valid |= 1ul << item->ID;
+	}
+
+	log_erase_ahead();
+	return true;
+}
+
+// Program the staged bytes to the flash
+// ---
+// Only writes while the flash is not busy with an erase. A page may
+// be programmed in several parts, each one continues at flash_end.
+// Parameters: partial: also program the last, not yet full page,
+//	budget: the most bytes to program
+// Returns: True if there was no error
+// Author: Boldizsar Palotas
+bool log_program(bool partial, uint32_t budget) {
+	uint32_t offs = log_head;
+	while (flash_end != offs && budget) {
+		uint32_t end = flash_end - flash_end % LOG_PAGE_SIZE + LOG_PAGE_SIZE;
+		if (offs < end) {
+			if (!partial)
+				return true;
+			end = offs;
+		}
+		if (budget < end - flash_end)
+			end = flash_end + budget;
+		if (hal->flash_busy_fn())
+			return true;
+		// The written part of a failed write is lost, skip it
+		bool result = hal->flash_write_fn(flash_end % LOG_FLASH_SIZE,
+			log_page_byte(flash_end), end - flash_end);
+		budget -= end - flash_end;
+		flash_end = end;
+		if (!result)
+			return false;
+	}
+	return true;
+}
+
+// Check if the next sector may be erased
+// ---
+// Parameters: none
+// Returns: False in LOG_MODE_LINEAR if the sector still holds records
+// Author: Boldizsar Palotas
+bool log_may_erase(void) {
+#if LOG_MODE == LOG_MODE_LINEAR
+	return erased_end + LOG_SECTOR_SIZE - LOG_FLASH_SIZE <= log_tail;
+#else
+	return true;
+#endif
+}
+
+// Start erasing the next sector if the erased space runs low
+// ---
+// The erase runs in the background, the flash reports busy until it
+// is done. In LOG_MODE_RING the records in the sector are dropped
+// from the log, in LOG_MODE_LINEAR sectors with records are not erased.
+// Parameters: none
+// Returns: nothing
+// Author: Boldizsar Palotas
+void log_erase_ahead(void) {
+	if (LOG_ERASE_AHEAD <= erased_end - log_head)
+		return;
+	if (!log_may_erase())
+		return;
+	if (hal->flash_busy_fn())
+		return;
+	if (!hal->flash_erase_sector_fn(erased_end % LOG_FLASH_SIZE)) {
+		printf("> Sector erase failed!\n");
+		return;
+	}
+	erased_end += LOG_SECTOR_SIZE;
+	// The previous lap's data in the sector is lost, the log now
+	// starts at the next sector boundary, which is a sync point.
+	uint32_t lost_end = erased_end - LOG_FLASH_SIZE;
+	if (log_tail < lost_end)
+		log_tail = lost_end;
+}
+
+// Write all staged bytes to the flash
+// ---
+// Waits for a running erase to finish, so this is not meant to be
+// called in every control cycle.
+// Parameters: none
+// Returns: True if there was no error
+// Author: Boldizsar Palotas
+bool log_flush(void) {
+	while (hal->flash_busy_fn()) {}
+	return log_program(true, UINT32_MAX);
+}
+
+// Request that the staged bytes be written to the flash
+// ---
+// Does not wait for the flash: the bytes staged so far are programmed
+// by log_task() once it is not busy, so this can be called in a
+// control cycle, unlike log_flush().
+// Parameters: none
+// Returns: nothing
+// Author: Boldizsar Palotas
+void log_request_flush(void) {
+	flush_pending = true;
+	flush_end = log_head;
+}
+
+// Program the staged bytes while the flash is not busy
+// ---
+// Called in every timer tick. Programs at most LOG_PROGRAM_BUDGET
+// bytes of the full pages, and of the partial page as well while
+// a flush is requested.
+// Parameters: none
+// Returns: nothing
+// Author: Boldizsar Palotas
+void log_task(void) {
+	if (hal->flash_busy_fn())
+		return;
+	if (!log_program(flush_pending, LOG_PROGRAM_BUDGET))
 		printf("> Log wr err!\n");
-		return false;
+	if (flush_end <= flash_end)
+		flush_pending = false;
+}
+
+// Read bytes of the log from the flash or from the staging buffers
+// ---
+// Parameters: offs: stream offset, buf: buffer for the bytes, size: count
+// Returns: True if there was no error
+// Author: Boldizsar Palotas
+static bool log_read_bytes(uint32_t offs, uint8_t* buf, uint32_t size) {
+	while (size && offs < flash_end) {
+		uint32_t n = size;
+		if (flash_end - offs < n)
+			n = flash_end - offs;
+		if (LOG_FLASH_SIZE - offs % LOG_FLASH_SIZE < n)
+			n = LOG_FLASH_SIZE - offs % LOG_FLASH_SIZE;
+		if (!hal->flash_read_fn(offs % LOG_FLASH_SIZE, buf, n))
+			return false;
+		offs += n;
+		buf += n;
+		size -= n;
+	}
+	while (size--) {
+		*buf++ = *log_page_byte(offs++);
 	}
+	return true;
 }
 
-// Read a few values (one item) from the log
+// Size of the log
 // ---
-// Parameters: item: The items to write
-// (out) item: The message object containing the values if no error
-// Returns: True if there was an error
+// Parameters: none
+// Returns: The number of bytes that can be read back
 // Author: Boldizsar Palotas
-bool log_read(uint32_t index, message_t* item) {
-	if (LOG_MAX_ITEMS < index)
-		return false;
+uint32_t log_getsize(void) {
+	return log_head - log_tail;
+}
 
-	bool result1 = hal->flash_read_fn(log_id(index), &item->ID, 1);
-	bool result2 = hal->flash_read_fn(log_item(index), item->value.v8, 8);
-	if (result1 && result2) {
+// Transmit a range of the log in bulk frames
+// ---
+// The log is read one flash page at a time with a single (fast read)
+// SPI transaction and each page is sent as a few bulk frames tagged
+// with their offset relative to the start of the log.
+// Parameters: offs: offset of the first byte relative to log_tail,
+//	size: number of bytes
+// Returns: True if there was no read error
+// Author: Boldizsar Palotas
+static bool log_send_range(uint32_t offs, uint32_t size) {
+	uint8_t buf[LOG_PAGE_SIZE];
+	uint32_t logsize = log_getsize();
+	if (logsize < offs)
 		return true;
-	} else {
-		return false;
+	if (logsize - offs < size)
+		size = logsize - offs;
+	while (size) {
+		uint32_t n = size < LOG_PAGE_SIZE ? size : LOG_PAGE_SIZE;
+		if (!log_read_bytes(log_tail + offs, buf, n)) {
+			printf("> Log rd err at %"PRIu32"\n", offs);
+			return false;
+		}
+		for (uint32_t i = 0; i < n; i += BULK_DATA_SIZE) {
+			uint32_t m = n - i < BULK_DATA_SIZE ? n - i : BULK_DATA_SIZE;
+			serialcomm_send_bulk(sc, offs + i, &buf[i], m);
+			// Readback is not time critical: wait for the UART instead
+			// of letting the transmit scheduler drop log data.
+			hal->tx_flush_fn(true);
+		}
+		offs += n;
+		size -= n;
 	}
+	return true;
 }
 
-// Read all values (all items) from the log and transmit to PC
+// Read the whole log and transmit it to PC
 // ---
+// The raw record stream is sent from the oldest record still in the
+// flash and decoded by the PC. The log is kept until the PC resets it,
+// so that it can ask for lost parts again with log_resend().
 // Parameters: none
 // Returns: nothing
 // Author: Boldizsar Palotas
 void log_readback(void) {
-	message_t msg;
-	printf("> Log read (sum %"PRIu32")\n", logsize);
-	if (!sc)
+	uint32_t logsize = log_getsize();
+	printf("> Log read (%"PRIu32" bytes, dropped %"PRIu32")\n", logsize, log_dropped);
+	if (!sc) {
 		printf("> Log serial error\n");
-	serialcomm_quick_send(sc, MESSAGE_LOG_START_ID, 0, 0);
-	int i;
-	for (i = 0; i < logsize; i++) {
-		if (!log_read(i, &msg)) {
-			break;
-		}
-		serialcomm_quick_send(sc, msg.ID, msg.value.v32[0], msg.value.v32[1]);
+		return;
+	}
+	if (!log_flush())
+		printf("> Log flush error\n");
+	serialcomm_quick_send(sc, MESSAGE_LOG_START_ID, logsize, 0);
+	log_send_range(0, logsize);
+	serialcomm_quick_send(sc, MESSAGE_LOG_END_ID, logsize, 0);
+}
+
+// Transmit parts of the log again
+// ---
+// Parameters: offs: offset relative to the start of the log (as sent
+//	by log_readback), mask: bit i selects the bulk frame at
+//	offs + i * BULK_DATA_SIZE
+// Returns: nothing
+// Author: Boldizsar Palotas
+void log_resend(uint32_t offs, uint32_t mask) {
+	if (!sc)
+		return;
+	for (uint32_t i = 0; mask; i++, mask >>= 1) {
+		if (mask & 1)
+			log_send_range(offs + i * BULK_DATA_SIZE, BULK_DATA_SIZE);
 	}
-	serialcomm_quick_send(sc, MESSAGE_LOG_END_ID, 0, 0);
-	if (i != logsize)
-		printf("> Log rd err at %d\n", i);
-	log_reset();
+	serialcomm_quick_send(sc, MESSAGE_LOG_END_ID, log_getsize(), 0);
 }
 
 // Reset the log
 // ---
+// Drops all records but keeps writing at the same position, the
+// sectors are erased ahead of the writes as usual. The encoder state
+// is cleared so that the log can be decoded from the new start. Does
+// not wait for the flash: the staged bytes are programmed by
+// log_task() as usual.
 // Parameters: none
 // Returns: nothing
 // Author: Koos Eerden
 void log_reset(void) {
 	printf("> Log reset\n");
-	logsize = 0;
-	if (!hal->flash_erase_fn())
-		printf("> Chip erase failed!\n");;
+	log_tail = log_head;
+	log_prev_valid = 0;
+	flush_pending = false;
+	log_dropped = 0;
 }
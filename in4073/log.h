@@ -5,11 +5,65 @@
 #include "qc_hal.h"
 #include <inttypes.h>
 
+// Log modes, selected at build time with LOG_MODE:
+//  - LINEAR: logging stops when the flash is full
+//  - RING: the oldest items are overwritten when the flash is full,
+//    the log always holds the most recent items
+#define LOG_MODE_LINEAR     0
+#define LOG_MODE_RING       1
+
+#ifndef LOG_MODE
+    #define LOG_MODE        LOG_MODE_RING
+#endif
+
+/** LOG RECORD FORMAT
+ *
+ *  The log is a stream of variable length records, the values
+ *  of a message are split into 16 bit fields:
+ *
+ *  - Delta record: one header byte with the message ID in the
+ *    low nibble (below LOG_RECORD_DELTA_IDS) and a mask of the
+ *    changed fields in the high nibble, followed by the zigzag
+ *    encoded difference to the previous value of each changed
+ *    field as a varint (7 bits per byte, least significant
+ *    first, bit 7 set if more bytes follow).
+ *  - Nibble delta record: for messages with at most 3 fields,
+ *    if every difference fits in 4 bits (zigzag encoded) the
+ *    header has LOG_RECORD_NIBBLES set, the mask is in bits
+ *    4..6, and the differences are packed two per byte, low
+ *    nibble first.
+ *  - Keyframe record: LOG_RECORD_KEYFRAME, the message ID and
+ *    the raw value bytes (serialcomm_value_size() of them).
+ *  - Padding: LOG_RECORD_PAD, a single byte without data, same
+ *    as erased flash.
+ *
+ *  A message is delta encoded against the previous record of
+ *  the same ID. Each 4 KiB flash sector starts with a fresh
+ *  encoder state, so the first record of each ID in a sector is
+ *  a keyframe and decoding can start at any sector boundary.
+ *  Records never cross sector boundaries, the rest of the
+ *  sector is padded instead.
+**/
+#define LOG_RECORD_KEYFRAME 0x0F
+#define LOG_RECORD_PAD      0xFF
+#define LOG_RECORD_NIBBLES  0x80
+#define LOG_RECORD_MAX_SIZE 10
+
+// Number of message IDs that can be delta encoded
+#define LOG_RECORD_DELTA_IDS    15
+
+#define LOG_RECORD_ID(header)   ((header) & 0x0F)
+#define LOG_RECORD_MASK(header) ((header) >> 4)
+#define LOG_RECORD_NIBBLE_MASK(header) (((header) >> 4) & 0x07)
+
 bool log_init(qc_hal_t* hal, serialcomm_t* sc);
 uint32_t log_getsize(void);
-bool log_read(uint32_t index, message_t* item);
 bool log_write(message_t* item);
+bool log_flush(void);
+void log_request_flush(void);
+void log_task(void);
 void log_reset(void);
 void log_readback(void);
+void log_resend(uint32_t offs, uint32_t mask);
 
 #endif
@@ -86,6 +86,7 @@ static void enter_mode_4_yaw_fn(qc_state_t* state, qc_mode_t old_mode);
 static void enter_mode_5_full_fn(qc_state_t* state, qc_mode_t old_mode);
 static bool motor_on_fn(qc_state_t* state);
 static void height_control(qc_state_t* state);
+static void mix(qc_state_t* state);
 
 static qc_mode_t active_mode = MODE_0_SAFE;
 static bool prev_height_control = false;
@@ -200,24 +201,52 @@ void control_fn(qc_state_t* state) {
                               FP_MUL3(T_INV_I_N , state->spin.r, 4, 4, 0),
                               0, 0, YAWP_FRAC_BITS);
 
-    // See project_dir/control_ae.m MATLAB file for calculations.
-    // ae_1^2 = -1/(4b') Z +        0 L +  1/(2b') M + -1/(4d') N
-    // ae_2^2 = -1/(4b') Z + -1/(2b') L +        0 M +  1/(4d') N
-    // ae_3^2 = -1/(4b') Z +        0 L + -1/(2b') M + -1/(4d') N
-    // ae_4^2 = -1/(4b') Z +  1/(2b') L +        0 M +  1/(4d') N
-    // b' and d' are system-specific constants
+    mix(state);
+}
+
+/** =======================================================
+ *  mix -- Set the motor speeds from the force and torques.
+ *  =======================================================
+ *  The squared speeds are the product of the allocation
+ *  matrix (MIXER_MATRIX) and [Z L M N]. The matrix is
+ *  constant, so the compiler unrolls the rows and drops the
+ *  zero terms.
+ *  If the fastest motor would go over MAX_MOTOR_SPEED, all of
+ *  them are lowered by the excess instead of clipping that
+ *  one: the differences between the motors, which make the
+ *  torques, are kept and only the lift gives way. What is
+ *  still below zero after that is clipped.
+ *
+ *  Parameters:
+ *  - state: The state with the force and torques, the motor
+ *      speeds are written to it.
+ *  Author: Boldizsar Palotas
+**/
+// The motor speeds only have room for QC_STATE_MOTOR_CNT motors
+#if QC_STATE_MOTOR_CNT < MIXER_MOTORS
+#error "MIXER_MOTORS is more than QC_STATE_MOTOR_CNT"
+#endif
+static void mix(qc_state_t* state) {
+    static const int32_t matrix[MIXER_MOTORS][4] = MIXER_MATRIX;
+    int32_t ae_sq[MIXER_MOTORS];
+    int32_t excess = - MAX_MOTOR_SPEED * MAX_MOTOR_SPEED;
 
     // f24.8 * f16.16 == f8.24, we have to shift >> 8 to get f16.16 again.
-    // Note that aex_sq can be interpreted as regular integers too.
-    int32_t ae1_sq = (M1_4B * state->force.Z + _1_2B * state->torque.M - _1_4D * state->torque.N) >> 8;
-    int32_t ae2_sq = (M1_4B * state->force.Z - _1_2B * state->torque.L + _1_4D * state->torque.N) >> 8;
-    int32_t ae3_sq = (M1_4B * state->force.Z - _1_2B * state->torque.M - _1_4D * state->torque.N) >> 8;
-    int32_t ae4_sq = (M1_4B * state->force.Z + _1_2B * state->torque.L + _1_4D * state->torque.N) >> 8;
-
-    state->motor.ae1 = MAX_MOTOR_SPEED * MAX_MOTOR_SPEED < ae1_sq ? MAX_MOTOR_SPEED : ae1_sq < 0 ? 0 : fp_sqrt(ae1_sq);
-    state->motor.ae2 = MAX_MOTOR_SPEED * MAX_MOTOR_SPEED < ae2_sq ? MAX_MOTOR_SPEED : ae2_sq < 0 ? 0 : fp_sqrt(ae2_sq);
-    state->motor.ae3 = MAX_MOTOR_SPEED * MAX_MOTOR_SPEED < ae3_sq ? MAX_MOTOR_SPEED : ae3_sq < 0 ? 0 : fp_sqrt(ae3_sq);
-    state->motor.ae4 = MAX_MOTOR_SPEED * MAX_MOTOR_SPEED < ae4_sq ? MAX_MOTOR_SPEED : ae4_sq < 0 ? 0 : fp_sqrt(ae4_sq);
+    // Note that ae_sq can be interpreted as regular integers too.
+    for (int i = 0; i < MIXER_MOTORS; i++) {
+        ae_sq[i] = (matrix[i][0] * state->force.Z  + matrix[i][1] * state->torque.L +
+                    matrix[i][2] * state->torque.M + matrix[i][3] * state->torque.N) >> 8;
+        if (excess < ae_sq[i] - MAX_MOTOR_SPEED * MAX_MOTOR_SPEED)
+            excess = ae_sq[i] - MAX_MOTOR_SPEED * MAX_MOTOR_SPEED;
+    }
+    if (excess < 0)
+        excess = 0;
+
+    // MAX_MOTOR_SPEED^2 < 2^20, as fp_sqrt20 needs
+    for (int i = 0; i < MIXER_MOTORS; i++) {
+        int32_t sq = ae_sq[i] - excess;
+        state->motor.ae[i] = sq < 0 ? 0 : fp_sqrt20(sq);
+    }
 }
 
 /** =======================================================
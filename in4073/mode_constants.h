@@ -212,6 +212,34 @@
 #define _1_2B       (_1_B / 2)
 // 1/(4d')
 #define _1_4D       (_1_D / 4)
+// 1/(2b') * cos(45 deg), rounded
+#define _1_2B_X     ((_1_2B * 181 + 128) >> 8)
+
+// Motor mixer: the allocation matrix from the force and torques
+// [Z L M N] to the squared motor speeds ae^2, one row per motor.
+// See project_dir/control_ae.m for how it is derived. The frame
+// is chosen at build time, the default is the + frame.
+// + frame: 1 front, 2 right, 3 back, 4 left
+// X frame (MIXER_FRAME_X): 1 front right, 2 back right,
+//     3 back left, 4 front left
+// 1 and 3 spin the opposite way than 2 and 4 in both.
+// Another airframe only needs its rows and MIXER_MOTORS, at
+// most QC_STATE_MOTOR_CNT motors.
+#ifdef MIXER_FRAME_X
+#define MIXER_MOTORS    4
+#define MIXER_MATRIX    {                                   \
+    { M1_4B, - _1_2B_X,   _1_2B_X, - _1_4D },               \
+    { M1_4B, - _1_2B_X, - _1_2B_X,   _1_4D },               \
+    { M1_4B,   _1_2B_X, - _1_2B_X, - _1_4D },               \
+    { M1_4B,   _1_2B_X,   _1_2B_X,   _1_4D } }
+#else
+#define MIXER_MOTORS    4
+#define MIXER_MATRIX    {                                   \
+    { M1_4B,       0,   _1_2B, - _1_4D },                   \
+    { M1_4B, - _1_2B,       0,   _1_4D },                   \
+    { M1_4B,       0, - _1_2B, - _1_4D },                   \
+    { M1_4B,   _1_2B,       0,   _1_4D } }
+#endif
 
 // Value of pi in a Qx.29 format (highest precision, if 3 <= x).
 #define PI_Q29      1686629713
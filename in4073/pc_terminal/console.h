@@ -10,5 +10,6 @@ int	term_getchar();
 void    term_puts(char *s) ;
 
 unsigned long long time_get_ms(void);
+unsigned long long time_get_us(void);
 
 #endif
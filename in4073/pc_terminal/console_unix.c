@@ -70,6 +70,12 @@ int term_getchar_nb()
         clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
         return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000ull;
     }
+
+    unsigned long long time_get_us(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000ull;
+    }
 #else
 
     unsigned long long time_get_ms(void) {
@@ -78,4 +84,11 @@ int term_getchar_nb()
         if (rv) return 0;
         return now.tv_sec * 1000ull + now.tv_usec / 1000000ull;
     }
+
+    unsigned long long time_get_us(void) {
+        struct timeval now;
+        int rv = gettimeofday(&now, NULL);
+        if (rv) return 0;
+        return now.tv_sec * 1000000ull + now.tv_usec;
+    }
 #endif
@@ -55,3 +55,11 @@ unsigned long long time_get_ms(void) {
     }
     return c;
 }
+
+unsigned long long time_get_us(void) {
+    LARGE_INTEGER freq, cnt;
+    if (QueryPerformanceFrequency(&freq) && QueryPerformanceCounter(&cnt))
+        return cnt.QuadPart / freq.QuadPart * 1000000ull
+            + cnt.QuadPart % freq.QuadPart * 1000000ull / freq.QuadPart;
+    return 0;
+}
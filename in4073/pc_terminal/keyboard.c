@@ -259,6 +259,24 @@ static void handle_keypress(pc_command_t* command) {
 				command->option_clear = false;
 				command->option_toggle = true;
 				break;
+			case '9':		// Option 9 profiling reset
+				command->option_number = 9;
+				command->option_set = true;
+				command->option_clear = false;
+				command->option_toggle = false;
+				break;
+			case 't':		// Option 10 trace dump over serial
+				command->option_number = 10;
+				command->option_set = true;
+				command->option_clear = false;
+				command->option_toggle = false;
+				break;
+			case 'T':		// Option 11 trace dump into the log
+				command->option_number = 11;
+				command->option_set = true;
+				command->option_clear = false;
+				command->option_toggle = false;
+				break;
 
 			// ----------------------------------
 			// Logging
@@ -0,0 +1,222 @@
+#include "pc_capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void pc_capture_flush(pc_capture_t* capture);
+
+/******************************
+pc_capture_open()
+*******************************
+Description:
+	Creates a capture file and writes its header
+
+parameters:
+	-	pc_capture_t* capture:
+			Pointer to the capture structure that is initialised
+	-	const char* path:
+			Path of the capture file, overwritten if it exists
+	-	uint64_t now_us:
+			The current time, the start of the capture
+
+Returns:
+	false if the file cannot be written
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+bool pc_capture_open(pc_capture_t* capture, const char* path, uint64_t now_us) {
+    memset(capture, 0, sizeof(*capture));
+    if (!(capture->file = fopen(path, "wb")))
+        return false;
+    uint8_t header[PC_CAPTURE_HEADER_SIZE] = PC_CAPTURE_MAGIC;
+    header[4] = PC_CAPTURE_VERSION;
+    uint64_t start = (uint64_t) time(NULL) * 1000000;
+    for (int i = 0; i < 8; i++)
+        header[8 + i] = start >> (8 * i);
+    fwrite(header, 1, sizeof(header), capture->file);
+    capture->last_us = now_us;
+    return true;
+}
+
+/******************************
+pc_capture_byte()
+*******************************
+Description:
+	Captures a byte. It is added to the current record if that
+	is in the same direction, started less than
+	PC_CAPTURE_MERGE_US ago and is not full, otherwise the
+	current record is written and the byte starts a new one.
+
+parameters:
+	-	pc_capture_t* capture:
+			Pointer to the capture structure
+	-	int dir:
+			PC_CAPTURE_RX or PC_CAPTURE_TX
+	-	uint8_t byte:
+			The byte read or written
+	-	uint64_t now_us:
+			The current time
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_capture_byte(pc_capture_t* capture, int dir, uint8_t byte, uint64_t now_us) {
+    if (!capture->file)
+        return;
+    if (capture->run_len && (capture->run_dir != dir || capture->run_len == PC_CAPTURE_RUN_MAX
+            || PC_CAPTURE_MERGE_US <= now_us - capture->run_us))
+        pc_capture_flush(capture);
+    if (!capture->run_len) {
+        capture->run_us = now_us;
+        capture->run_dir = dir;
+    }
+    capture->run[capture->run_len++] = byte;
+    capture->bytes[dir]++;
+}
+
+/******************************
+pc_capture_close()
+*******************************
+Description:
+	Writes the current record and closes the capture file
+
+parameters:
+	-	pc_capture_t* capture:
+			Pointer to the capture structure
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_capture_close(pc_capture_t* capture) {
+    if (!capture->file)
+        return;
+    pc_capture_flush(capture);
+    fclose(capture->file);
+    capture->file = 0;
+    fprintf(stderr, "Capture: %"PRIu32" bytes received, %"PRIu32" bytes sent.\n",
+        capture->bytes[PC_CAPTURE_RX], capture->bytes[PC_CAPTURE_TX]);
+}
+
+/******************************
+pc_capture_load()
+*******************************
+Description:
+	Reads a capture file into memory and checks its header
+
+parameters:
+	-	const char* path:
+			Path of the capture file
+	-	size_t* size:
+			Where to put the size of the capture
+	-	uint64_t* start_us:
+			Where to put the wall clock time of the start
+
+Returns:
+	The capture, to be freed, NULL on errors
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+uint8_t* pc_capture_load(const char* path, size_t* size, uint64_t* start_us) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    uint8_t* buf = NULL;
+    long length;
+    if (!fseek(file, 0, SEEK_END) && 0 <= (length = ftell(file)) && !fseek(file, 0, SEEK_SET)
+            && PC_CAPTURE_HEADER_SIZE <= length && (buf = malloc(length))
+            && fread(buf, 1, length, file) == (size_t) length
+            && !memcmp(buf, PC_CAPTURE_MAGIC, 4) && buf[4] == PC_CAPTURE_VERSION) {
+        *size = length;
+        *start_us = 0;
+        for (int i = 0; i < 8; i++)
+            *start_us |= (uint64_t) buf[8 + i] << (8 * i);
+    } else {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(file);
+    return buf;
+}
+
+/******************************
+pc_capture_next()
+*******************************
+Description:
+	Reads the next record of a capture in memory
+
+parameters:
+	-	const uint8_t* buf, size_t size:
+			The capture, as pc_capture_load() gives it
+	-	size_t* pos:
+			Position of the record, PC_CAPTURE_HEADER_SIZE for
+			the first one, moved to the next one
+	-	pc_capture_record_t* record:
+			Where to put the record, its time is added to the
+			time of the previous one
+
+Returns:
+	1 if a record was read, 0 at the end, -1 if the capture is
+	truncated or corrupt
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+int pc_capture_next(const uint8_t* buf, size_t size, size_t* pos, pc_capture_record_t* record) {
+    size_t p = *pos;
+    if (size <= p)
+        return 0;
+    uint64_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (size <= p || 63 < shift)
+            return -1;
+        v |= (uint64_t) (buf[p] & 0x7F) << shift;
+        if (!(buf[p++] & 0x80))
+            break;
+    }
+    if (size <= p || !buf[p] || size - p - 1 < buf[p])
+        return -1;
+    record->time_us += v >> 1;
+    record->dir = v & 1;
+    record->size = buf[p];
+    record->data = &buf[p + 1];
+    *pos = p + 1 + record->size;
+    return 1;
+}
+
+/******************************
+pc_capture_flush()
+*******************************
+Description:
+	Writes the current record, if any
+
+parameters:
+	-	pc_capture_t* capture:
+			Pointer to the capture structure
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_capture_flush(pc_capture_t* capture) {
+    if (!capture->run_len)
+        return;
+    uint8_t head[11];
+    int len = 0;
+    uint64_t v = (capture->run_us - capture->last_us) << 1 | capture->run_dir;
+    do {
+        head[len++] = (v & 0x7F) | (0x7F < v ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    head[len++] = capture->run_len;
+    fwrite(head, 1, len, capture->file);
+    fwrite(capture->run, 1, capture->run_len, capture->file);
+    capture->last_us = capture->run_us;
+    capture->run_len = 0;
+}
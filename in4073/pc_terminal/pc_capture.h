@@ -0,0 +1,88 @@
+#ifndef PC_CAPTURE_H
+#define PC_CAPTURE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+/** Serial capture file
+ *  ===================
+ *
+ *  The raw bytes of a session in both directions, with the time
+ *  they were read or written, so that it can be replayed offline
+ *  (see pc_replay.c).
+ *
+ *  Header, 16 bytes:
+ *      "QCAP", version (1), 3 reserved zero bytes, and the wall
+ *      clock time of the start in us since the epoch (uint64_t,
+ *      little endian).
+ *  Records, until the end of the file:
+ *      - varint: time since the previous record in us, shifted
+ *        left by 1, ORed with the direction (PC_CAPTURE_RX/TX)
+ *      - uint8_t: number of bytes, 1 to PC_CAPTURE_RUN_MAX
+ *      - the bytes
+ *  The varint is LEB128: 7 bits per byte, least significant first,
+ *  the top bit set on all but the last byte. A record holds the
+ *  bytes in the same direction within PC_CAPTURE_MERGE_US of its
+ *  first one, which is its time. So a burst of a frame costs 3
+ *  bytes or so, instead of the 9 or more of a timestamp per byte.
+**/
+
+#define PC_CAPTURE_MAGIC        "QCAP"
+#define PC_CAPTURE_VERSION      1
+#define PC_CAPTURE_HEADER_SIZE  16
+#define PC_CAPTURE_RUN_MAX      255
+#define PC_CAPTURE_MERGE_US     1000
+
+// Direction of a byte
+#define PC_CAPTURE_RX           0   // Quadcopter -> PC
+#define PC_CAPTURE_TX           1   // PC -> Quadcopter
+
+/** pc_capture_t
+ *  Writes a capture file
+ *  -------------------
+ *  Fields:
+ *  - file: The capture file, NULL if not capturing.
+ *  - last_us: Time of the previous record written.
+ *  - run_us, run_dir, run, run_len: The record being collected.
+ *  - bytes: Number of bytes captured per direction.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct pc_capture {
+    FILE*       file;
+    uint64_t    last_us;
+    uint64_t    run_us;
+    int         run_dir;
+    uint8_t     run[PC_CAPTURE_RUN_MAX];
+    int         run_len;
+    uint32_t    bytes[2];
+} pc_capture_t;
+
+/** pc_capture_record_t
+ *  A record read from a capture in memory
+ *  -------------------
+ *  Fields:
+ *  - time_us: Time since the start of the capture.
+ *  - dir: PC_CAPTURE_RX or PC_CAPTURE_TX.
+ *  - data, size: The bytes, within the capture.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct pc_capture_record {
+    uint64_t        time_us;
+    int             dir;
+    const uint8_t*  data;
+    int             size;
+} pc_capture_record_t;
+
+bool pc_capture_open(pc_capture_t* capture, const char* path, uint64_t now_us);
+
+void pc_capture_byte(pc_capture_t* capture, int dir, uint8_t byte, uint64_t now_us);
+
+void pc_capture_close(pc_capture_t* capture);
+
+uint8_t* pc_capture_load(const char* path, size_t* size, uint64_t* start_us);
+
+int pc_capture_next(const uint8_t* buf, size_t size, size_t* pos, pc_capture_record_t* record);
+
+#endif // PC_CAPTURE_H
@@ -48,6 +48,9 @@ void pc_command_init(pc_command_t* command) {
     command->log_stop               = false;
     command->log_read               = false;
     command->log_reset              = false;
+    command->log_resend             = false;
+    command->log_resend_offset      = 0;
+    command->log_resend_mask        = 0;
     command->in_log_not_telemetry   = false;
     command->telemetry_mask         = 0;
     command->telemetry_mask_updated = false;
@@ -178,6 +181,13 @@ bool pc_command_get_message(pc_command_t* command, message_t* message_out) {
         command->log_read = false;
         return true;
     }
+    if (command->log_resend) {
+        message_out->ID = MESSAGE_LOG_RESEND_ID;
+        MESSAGE_LOG_RESEND_OFFSET_VALUE(message_out) = command->log_resend_offset;
+        MESSAGE_LOG_RESEND_MASK_VALUE(message_out) = command->log_resend_mask;
+        command->log_resend = false;
+        return true;
+    }
     if (command->log_reset) {
         message_out->ID = MESSAGE_LOG_CTL_ID;
         MESSAGE_LOG_CTL_VALUE(message_out) = MESSAGE_LOG_CTL_VALUE_RESET;
@@ -22,6 +22,9 @@ typedef struct pc_command {
     bool                log_stop;
     bool                log_read;
     bool                log_reset;
+    bool                log_resend;
+    uint32_t            log_resend_offset;
+    uint32_t            log_resend_mask;
     bool                in_log_not_telemetry;
     uint32_t            telemetry_mask;
     bool                telemetry_mask_updated;
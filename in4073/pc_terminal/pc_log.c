@@ -2,6 +2,7 @@
 #include "../serialcomm.h"
 #include "../fixedpoint.h"
 #include "../qc_mode.h"
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #ifdef WINDOWS
@@ -19,6 +20,9 @@
 
 static void pc_log_flush(pc_log_t* log);
 static void pc_log_clear(pc_log_t* log);
+static int pc_log_decode_record(pc_log_t* log, message_t* message);
+static void pc_log_receive_hist(pc_log_t* log, message_t* message);
+static void pc_log_receive_sched(pc_log_t* log, message_t* message);
 static void pc_log_print(pc_log_t* log, const char * fmt, pc_log_item_t item, ...);
 
 /******************************
@@ -46,7 +50,18 @@ bool pc_log_init(pc_log_t* log, FILE* file) {
     qc_state_init(&log->state);
     log->time = 0;
     log->mode = MODE_UNKNOWN;
+    for (int k = 0; k < QC_STATE_HIST_CNT; k++) {
+        log->hist_mean[k] = 0;
+        log->hist_max[k] = 0;
+    }
     log->initialised = false;
+    log->prev_valid = 0;
+    log->rec_len = 0;
+    log->dump = 0;
+    log->dump_got = 0;
+    log->dump_size = 0;
+    log->dump_rounds = 0;
+    log->trace = 0;
     pc_log_clear(log);
     return true;
 }
@@ -69,10 +84,24 @@ Author:
 
 void pc_log_receive(pc_log_t* log, message_t* message) {
     switch (message->ID) {
+        case MESSAGE_LOG_START_ID:
+            log->prev_valid = 0;
+            log->rec_len = 0;
+            break;
         case MESSAGE_LOG_END_ID:
             if (log->initialised) {
                 pc_log_flush(log);
             }
+            log->prev_valid = 0;
+            log->rec_len = 0;
+            break;
+        case MESSAGE_SUPERFRAME_END_ID:
+            // A superframe contains one full telemetry cycle
+            if (log->initialised) {
+                pc_log_flush(log);
+                pc_log_clear(log);
+                log->initialised = false;
+            }
             break;
         case MESSAGE_TIME_MODE_VOLTAGE_ID:
             if (log->initialised) {
@@ -208,12 +237,381 @@ void pc_log_receive(pc_log_t* log, message_t* message) {
                 pc_log_flush(log);
             }
             log->state.prof.pr[4].last_delta = MESSAGE_PROFILE_4_VALUE(message);
+            log->state.prof.pr[5].last_delta = MESSAGE_PROFILE_5_VALUE(message);
+            log->state.prof.pr[5].max_delta = MESSAGE_PROFILE_5_MAX_VALUE(message);
             log->set[PC_LOG_PR4_CURR] = true;
+            log->set[PC_LOG_PR5_CURR] = true;
+            log->set[PC_LOG_PR5_MAX] = true;
+            break;
+        case MESSAGE_PROFILE_HIST_ID:
+            pc_log_receive_hist(log, message);
+            break;
+        case MESSAGE_TRACE_ID:
+            if (log->trace)
+                pc_trace_receive(log->trace, message);
+            break;
+        case MESSAGE_SCHED_ID:
+            pc_log_receive_sched(log, message);
+            break;
+        case MESSAGE_TX_DROP_ID:
+            if (log->initialised && log->set[PC_LOG_tx_drop_telemetry]) {
+                pc_log_flush(log);
+            }
+            log->state.comm.tx_drop_telemetry   = MESSAGE_TX_DROP_TELEMETRY_VALUE(message);
+            log->state.comm.tx_drop_text        = MESSAGE_TX_DROP_TEXT_VALUE(message);
+            log->state.comm.tx_drop_control     = MESSAGE_TX_DROP_CONTROL_VALUE(message);
+            log->set[PC_LOG_tx_drop_telemetry]  = true;
+            log->set[PC_LOG_tx_drop_text]       = true;
+            log->set[PC_LOG_tx_drop_control]    = true;
             break;
         default:
             break;
     }
 }
+/******************************
+pc_log_receive_hist()
+*******************************
+Description:
+	Handles a part of a latency histogram. The bins are
+	collected in the log state, the statistics part completes
+	the histogram and sets its columns, the percentiles are
+	calculated from the bins when the line is printed.
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+	-	message_t* message:
+			The MESSAGE_PROFILE_HIST_ID message
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_log_receive_hist(pc_log_t* log, message_t* message) {
+    int k = MESSAGE_PROFILE_HIST_INDEX_VALUE(message);
+    int part = MESSAGE_PROFILE_HIST_PART_VALUE(message);
+    if (QC_STATE_HIST_CNT <= k || MESSAGE_PROFILE_HIST_PART_STATS < part)
+        return;
+    profile_hist_t* hist = &log->state.prof.hist[k];
+    if (part < MESSAGE_PROFILE_HIST_PART_STATS) {
+        for (int i = 0; i < MESSAGE_PROFILE_HIST_PART_BINS; i++) {
+            int bin = part * MESSAGE_PROFILE_HIST_PART_BINS + i;
+            if (bin < PROFILE_HIST_BINS)
+                hist->bin[bin] = MESSAGE_PROFILE_HIST_BIN_VALUE(message, i);
+        }
+        return;
+    }
+    if (log->initialised && log->set[PC_LOG_H0_MIN + k]) {
+        pc_log_flush(log);
+    }
+    hist->min_delta = MESSAGE_PROFILE_HIST_MIN_VALUE(message);
+    log->hist_mean[k] = MESSAGE_PROFILE_HIST_MEAN_VALUE(message);
+    log->hist_max[k] = MESSAGE_PROFILE_HIST_MAX_VALUE(message);
+    log->set[PC_LOG_H0_MIN + k]  = true;
+    log->set[PC_LOG_H0_MEAN + k] = true;
+    log->set[PC_LOG_H0_P50 + k]  = true;
+    log->set[PC_LOG_H0_P90 + k]  = true;
+    log->set[PC_LOG_H0_P99 + k]  = true;
+    log->set[PC_LOG_H0_MAX + k]  = true;
+}
+
+/******************************
+pc_log_receive_sched()
+*******************************
+Description:
+	Handles the deadline accounting of one task, see sched.h
+	on the Quadcopter
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+	-	message_t* message:
+			The MESSAGE_SCHED_ID message
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_log_receive_sched(pc_log_t* log, message_t* message) {
+    int k = MESSAGE_SCHED_TASK_VALUE(message);
+    if (QC_STATE_TASK_CNT <= k)
+        return;
+    if (log->initialised && log->set[PC_LOG_T0_MISS + k]) {
+        pc_log_flush(log);
+    }
+    log->state.sched.miss[k]        = MESSAGE_SCHED_MISS_VALUE(message);
+    log->state.sched.overrun[k]     = MESSAGE_SCHED_OVERRUN_VALUE(message);
+    log->state.sched.response[k]    = MESSAGE_SCHED_RESPONSE_VALUE(message);
+    log->set[PC_LOG_T0_MISS + k]        = true;
+    log->set[PC_LOG_T0_OVERRUN + k]     = true;
+    log->set[PC_LOG_T0_RESPONSE + k]    = true;
+}
+
+/******************************
+pc_log_decode()
+*******************************
+Description:
+	Decodes bytes of the log record stream and handles the
+	decoded messages like received ones. Records may be split
+	between calls.
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+	-	uint8_t* data:
+			The bytes of the stream
+	-	int size:
+			The number of bytes
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_log_decode(pc_log_t* log, uint8_t* data, int size) {
+    message_t message;
+    for (int i = 0; i < size; i++) {
+        log->rec[log->rec_len++] = data[i];
+        int result = pc_log_decode_record(log, &message);
+        if (result == 0)
+            continue;
+        log->rec_len = 0;
+        if (0 < result)
+            pc_log_receive(log, &message);
+    }
+}
+
+/******************************
+pc_log_dump_start()
+*******************************
+Description:
+	Prepares the reassembly of a log readback. The log arrives
+	in bulk frames that may be lost and are requested again,
+	so it is collected in memory and only decoded at the end.
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+	-	uint32_t size:
+			The size of the log in bytes
+
+Returns:
+	false if there is not enough memory
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+bool pc_log_dump_start(pc_log_t* log, uint32_t size) {
+    uint32_t chunks = (size + BULK_DATA_SIZE - 1) / BULK_DATA_SIZE;
+    free(log->dump);
+    free(log->dump_got);
+    log->dump = malloc(size ? size : 1);
+    log->dump_got = calloc(chunks ? chunks : 1, sizeof(bool));
+    log->dump_rounds = 0;
+    if (!log->dump || !log->dump_got) {
+        free(log->dump);
+        free(log->dump_got);
+        log->dump = 0;
+        log->dump_got = 0;
+        log->dump_size = 0;
+        return false;
+    }
+    // Parts that never arrive are decoded as padding
+    memset(log->dump, LOG_RECORD_PAD, size);
+    log->dump_size = size;
+    return true;
+}
+
+/******************************
+pc_log_dump_data()
+*******************************
+Description:
+	Stores the data of a bulk frame. Frames that do not start
+	at a chunk boundary or lie outside the log are ignored.
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+	-	uint32_t offset:
+			The offset of the data within the log
+	-	uint8_t* data:
+			The received bytes
+	-	int size:
+			The number of bytes
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_log_dump_data(pc_log_t* log, uint32_t offset, uint8_t* data, int size) {
+    if (!log->dump || offset % BULK_DATA_SIZE || log->dump_size <= offset)
+        return;
+    if (log->dump_size - offset < (uint32_t) size)
+        size = log->dump_size - offset;
+    memcpy(&log->dump[offset], data, size);
+    if (!log->dump_got[offset / BULK_DATA_SIZE])
+        log->dump_rounds = 0;
+    log->dump_got[offset / BULK_DATA_SIZE] = true;
+}
+
+/******************************
+pc_log_dump_missing()
+*******************************
+Description:
+	Finds the first parts of the log that have not arrived yet,
+	in the format of MESSAGE_LOG_RESEND_ID.
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+	-	uint32_t* offset:
+			(out) The offset of the first missing bulk frame
+
+Returns:
+	A mask of the missing bulk frames of the 32 starting at
+	offset, 0 if the log is complete
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+uint32_t pc_log_dump_missing(pc_log_t* log, uint32_t* offset) {
+    uint32_t i, first = 0, mask = 0;
+    uint32_t chunks = (log->dump_size + BULK_DATA_SIZE - 1) / BULK_DATA_SIZE;
+    if (!log->dump)
+        return 0;
+    for (i = 0; i < chunks && (!mask || i < first + 32); i++) {
+        if (!log->dump_got[i]) {
+            if (!mask)
+                first = i;
+            mask |= 1ul << (i - first);
+        }
+    }
+    *offset = first * BULK_DATA_SIZE;
+    return mask;
+}
+
+/******************************
+pc_log_dump_finish()
+*******************************
+Description:
+	Decodes the reassembled log and frees the buffers.
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_log_dump_finish(pc_log_t* log) {
+    message_t end;
+    if (!log->dump)
+        return;
+    log->prev_valid = 0;
+    log->rec_len = 0;
+    pc_log_decode(log, log->dump, log->dump_size);
+    end.ID = MESSAGE_LOG_END_ID;
+    end.value.v32[0] = log->dump_size;
+    end.value.v32[1] = 0;
+    pc_log_receive(log, &end);
+    free(log->dump);
+    free(log->dump_got);
+    log->dump = 0;
+    log->dump_got = 0;
+    log->dump_size = 0;
+}
+
+/******************************
+pc_log_decode_record()
+*******************************
+Description:
+	Decodes the record collected in log->rec.
+
+parameters:
+	-	pc_log_t* log:
+			Pointer to the log structure
+	-	message_t* message:
+			The decoded message, if there is one
+
+Returns:
+	0 if the record is not complete yet, 1 if a message was
+	decoded, -1 if the record was padding or invalid
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+int pc_log_decode_record(pc_log_t* log, message_t* message) {
+    uint8_t header = log->rec[0];
+    int len = log->rec_len;
+
+    if (header == LOG_RECORD_PAD)
+        return -1;
+
+    if (header == LOG_RECORD_KEYFRAME) {
+        if (len < 2)
+            return 0;
+        int size = serialcomm_value_size(log->rec[1]);
+        if (len < 2 + size)
+            return 0;
+        message->ID = log->rec[1];
+        message->value.v32[0] = 0;
+        message->value.v32[1] = 0;
+        for (int i = 0; i < size; i++)
+            message->value.v8[i] = log->rec[2 + i];
+    } else {
+        uint8_t id = LOG_RECORD_ID(header);
+        uint8_t mask = LOG_RECORD_MASK(header);
+        if (LOG_RECORD_DELTA_IDS <= id)
+            return -1; // Reserved
+        bool nibbles = (serialcomm_value_size(id) + 1) / 2 <= 3 && (header & LOG_RECORD_NIBBLES);
+        if (nibbles) {
+            mask = LOG_RECORD_NIBBLE_MASK(header);
+            if (len < 1 + (__builtin_popcount(mask) + 1) / 2)
+                return 0;
+        } else {
+            // Each changed field is a varint, ended by a byte below 0x80
+            int fields = 0;
+            for (int i = 1; i < len; i++) {
+                if (log->rec[i] < 0x80)
+                    fields++;
+            }
+            if (fields < __builtin_popcount(mask))
+                return (len < LOG_RECORD_MAX_SIZE) ? 0 : -1;
+        }
+        if (!(log->prev_valid & (1ul << id)))
+            return -1; // No keyframe for this ID yet
+        message->ID = id;
+        message->value = log->prev[id];
+        int pos = 1, n = 0;
+        for (int i = 0; i < 4; i++) {
+            if (!(mask & (1 << i)))
+                continue;
+            uint16_t zz = 0;
+            if (nibbles) {
+                zz = (n++ & 1) ? log->rec[pos++] >> 4 : log->rec[pos] & 0x0F;
+            } else {
+                for (int shift = 0; ; shift += 7) {
+                    uint8_t b = log->rec[pos++];
+                    zz |= (uint16_t) ((b & 0x7F) << shift);
+                    if (b < 0x80)
+                        break;
+                }
+            }
+            int16_t delta = (int16_t) ((zz >> 1) ^ -(zz & 1));
+            message->value.v16[i] += delta;
+        }
+    }
+
+    if (message->ID < LOG_RECORD_DELTA_IDS) {
+        log->prev[message->ID] = message->value;
+        log->prev_valid |= 1ul << message->ID;
+    }
+    return 1;
+}
+
 /******************************
 pc_log_close()
 *******************************
@@ -309,13 +707,36 @@ void pc_log_flush(pc_log_t* log) {
     /* 38 */    pc_log_print(log, "%d"  _SEP, PC_LOG_yaw_p, log->state.trim.yaw_p);
     /* 39 */    pc_log_print(log, "%d"  _SEP, PC_LOG_p1, log->state.trim.p1);
     /* 40 */    pc_log_print(log, "%d"  _SEP, PC_LOG_p2, log->state.trim.p2);
-    /* n=0..4 */for (int i = 0; i < QC_STATE_PROF_CNT; i++) {
+    /* n=0..4 */for (int i = 0; i <= PC_LOG_PR4_CURR - PC_LOG_PR0_CURR; i++) {
       /* 41+4*n, 42+4*n */  pc_log_print(log, "%u"_SEP"%u" _SEP, PC_LOG_PR0_CURR+i, log->state.prof.pr[i].last_delta, log->state.prof.pr[i].last_tag);
       /* 43+4*n, 44+4*n */  pc_log_print(log, "%u"_SEP"%u" _SEP, PC_LOG_PR0_MAX+i, log->state.prof.pr[i].max_delta, log->state.prof.pr[i].max_tag);
                 }
     /* 61 */    pc_log_print(log, "%f"  _SEP, PC_LOG_sphi,      FLOAT_FP(log->state.sensor.sphi, 16));
     /* 62 */    pc_log_print(log, "%f"  _SEP, PC_LOG_stheta,    FLOAT_FP(log->state.sensor.stheta, 16));
     /* 63 */    pc_log_print(log, "%f"  _SEP, PC_LOG_spsi,      FLOAT_FP(log->state.sensor.spsi, 16));
+    /* 64 */    pc_log_print(log, "%hu" _SEP, PC_LOG_tx_drop_telemetry, log->state.comm.tx_drop_telemetry);
+    /* 65 */    pc_log_print(log, "%hu" _SEP, PC_LOG_tx_drop_text,      log->state.comm.tx_drop_text);
+    /* 66 */    pc_log_print(log, "%hu" _SEP, PC_LOG_tx_drop_control,   log->state.comm.tx_drop_control);
+    /* k=0..2 */for (int k = 0; k < QC_STATE_HIST_CNT; k++) {
+                    // Percentiles are the upper bounds of their bins, capped at the maximum
+                    profile_hist_t* hist = &log->state.prof.hist[k];
+                    uint32_t p50 = profile_hist_percentile(hist, 500);
+                    uint32_t p90 = profile_hist_percentile(hist, 900);
+                    uint32_t p99 = profile_hist_percentile(hist, 990);
+      /* 67+6*k */  pc_log_print(log, "%u" _SEP, PC_LOG_H0_MIN+k,  hist->min_delta);
+      /* 68+6*k */  pc_log_print(log, "%u" _SEP, PC_LOG_H0_MEAN+k, log->hist_mean[k]);
+      /* 69+6*k */  pc_log_print(log, "%u" _SEP, PC_LOG_H0_P50+k,  p50 < log->hist_max[k] ? p50 : log->hist_max[k]);
+      /* 70+6*k */  pc_log_print(log, "%u" _SEP, PC_LOG_H0_P90+k,  p90 < log->hist_max[k] ? p90 : log->hist_max[k]);
+      /* 71+6*k */  pc_log_print(log, "%u" _SEP, PC_LOG_H0_P99+k,  p99 < log->hist_max[k] ? p99 : log->hist_max[k]);
+      /* 72+6*k */  pc_log_print(log, "%u" _SEP, PC_LOG_H0_MAX+k,  log->hist_max[k]);
+                }
+    /* 85, 86 */pc_log_print(log, "%u"_SEP"%u" _SEP, PC_LOG_PR5_CURR, log->state.prof.pr[5].last_delta, log->state.prof.pr[5].last_tag);
+    /* 87, 88 */pc_log_print(log, "%u"_SEP"%u" _SEP, PC_LOG_PR5_MAX, log->state.prof.pr[5].max_delta, log->state.prof.pr[5].max_tag);
+    /* k=0..4 */for (int k = 0; k < QC_STATE_TASK_CNT; k++) {
+      /* 89+3*k */  pc_log_print(log, "%hu" _SEP, PC_LOG_T0_MISS+k,     log->state.sched.miss[k]);
+      /* 90+3*k */  pc_log_print(log, "%hu" _SEP, PC_LOG_T0_OVERRUN+k,  log->state.sched.overrun[k]);
+      /* 91+3*k */  pc_log_print(log, "%hu" _SEP, PC_LOG_T0_RESPONSE+k, log->state.sched.response[k]);
+                }
 
     fprintf(log->file, _END);
     fflush(log->file);
@@ -5,6 +5,8 @@
 #include "../common.h"
 #include "../qc_mode.h"
 #include "../serialcomm.h"
+#include "../log.h"
+#include "pc_trace.h"
 
 typedef enum pc_log_item {
     PC_LOG_time,
@@ -60,6 +62,45 @@ typedef enum pc_log_item {
     PC_LOG_PR2_MAX,
     PC_LOG_PR3_MAX,
     PC_LOG_PR4_MAX,
+    PC_LOG_tx_drop_telemetry,
+    PC_LOG_tx_drop_text,
+    PC_LOG_tx_drop_control,
+    PC_LOG_H0_MIN,
+    PC_LOG_H1_MIN,
+    PC_LOG_H2_MIN,
+    PC_LOG_H0_MEAN,
+    PC_LOG_H1_MEAN,
+    PC_LOG_H2_MEAN,
+    PC_LOG_H0_P50,
+    PC_LOG_H1_P50,
+    PC_LOG_H2_P50,
+    PC_LOG_H0_P90,
+    PC_LOG_H1_P90,
+    PC_LOG_H2_P90,
+    PC_LOG_H0_P99,
+    PC_LOG_H1_P99,
+    PC_LOG_H2_P99,
+    PC_LOG_H0_MAX,
+    PC_LOG_H1_MAX,
+    PC_LOG_H2_MAX,
+    PC_LOG_PR5_CURR,
+    PC_LOG_PR5_MAX,
+    // Tasks of the Quadcopter main loop: control, receive, tx_flush, timer, text
+    PC_LOG_T0_MISS,
+    PC_LOG_T1_MISS,
+    PC_LOG_T2_MISS,
+    PC_LOG_T3_MISS,
+    PC_LOG_T4_MISS,
+    PC_LOG_T0_OVERRUN,
+    PC_LOG_T1_OVERRUN,
+    PC_LOG_T2_OVERRUN,
+    PC_LOG_T3_OVERRUN,
+    PC_LOG_T4_OVERRUN,
+    PC_LOG_T0_RESPONSE,
+    PC_LOG_T1_RESPONSE,
+    PC_LOG_T2_RESPONSE,
+    PC_LOG_T3_RESPONSE,
+    PC_LOG_T4_RESPONSE,
     _PC_LOG_LAST_ITEM_GUARD
 } pc_log_item_t;
 
@@ -72,12 +113,42 @@ typedef struct pc_log {
     qc_mode_t   mode;
     bool        initialised;
     bool        set[PC_LOG_ITEM_COUNT];
+    // Latency histogram statistics, the bins are in state.prof.hist
+    uint32_t    hist_mean[QC_STATE_HIST_CNT];
+    uint32_t    hist_max[QC_STATE_HIST_CNT];
+    // Log record decoder state
+    message_value_t prev[LOG_RECORD_DELTA_IDS];
+    uint32_t    prev_valid;
+    uint8_t     rec[LOG_RECORD_MAX_SIZE];
+    int         rec_len;
+    // Log readback reassembly: the received bytes and which
+    // BULK_DATA_SIZE chunks of them have arrived
+    uint8_t*    dump;
+    bool*       dump_got;
+    uint32_t    dump_size;
+    int         dump_rounds;
+    // Receiver of the trace dumps, if any
+    pc_trace_t* trace;
 } pc_log_t;
 
+// Number of times in a row missing parts of the log are requested
+// again without receiving any of them
+#define PC_LOG_RESEND_ROUNDS 8
+
 bool pc_log_init(pc_log_t* log, FILE* file);
 
 void pc_log_receive(pc_log_t* log, message_t*);
 
+void pc_log_decode(pc_log_t* log, uint8_t* data, int size);
+
+bool pc_log_dump_start(pc_log_t* log, uint32_t size);
+
+void pc_log_dump_data(pc_log_t* log, uint32_t offset, uint8_t* data, int size);
+
+uint32_t pc_log_dump_missing(pc_log_t* log, uint32_t* offset);
+
+void pc_log_dump_finish(pc_log_t* log);
+
 void pc_log_close(pc_log_t* log);
 
 #endif // PC_LOG_H
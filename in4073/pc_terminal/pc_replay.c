@@ -0,0 +1,304 @@
+#include "pc_capture.h"
+#include "pc_log.h"
+#include "../serialcomm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** PC REPLAY
+ *  =========
+ *
+ *  Feeds a capture of pc_terminal -r back through the decoders as
+ *  fast as they go: the bytes received through
+ *  serialcomm_receive_char() into pc_log_receive(), like
+ *  pc_rx_complete() does, the bytes sent optionally into a second
+ *  decoder. The telemetry and the logs read back are written as
+ *  pc_terminal writes them, so a session can be examined offline,
+ *  and the throughput of the decoders is measured.
+**/
+
+#ifdef WINDOWS
+    #define PC_REPLAY_NULL_DEV  "NUL"
+#else
+    #define PC_REPLAY_NULL_DEV  "/dev/null"
+#endif
+
+static void replay_rx_complete(message_t* message);
+static void replay_rx_bulk(uint32_t offset, uint8_t* data, int size);
+static void replay_tx_complete(message_t* message);
+static void replay_log_end(void);
+static int replay(const uint8_t* buf, size_t size, bool tx);
+
+pc_log_t    replay_log;
+pc_log_t    replay_telemetry;
+bool        replay_in_log;
+bool        replay_dump;
+uint32_t    replay_messages[2];
+
+/******************************
+print_help()
+*******************************
+Description:
+	Prints a message about the usage of this program
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+static void print_help(void) {
+    fprintf(stderr,
+        "Usage: pc_replay [-o telemetry] [-l log] [-n passes] [-t] [-d] capture\n"
+        "  -o: write the telemetry to this file, dropped by default\n"
+        "  -l: append the logs read back to this file, dropped by default\n"
+        "  -n: replay the capture this many times, for a steadier throughput\n"
+        "  -t: also decode the bytes sent to the Quadcopter\n"
+        "  -d: print the records and the messages decoded to stdout\n");
+}
+
+/*----------------------------------------------------------------
+ * main -- replay a capture
+ *----------------------------------------------------------------
+ */
+int main(int argc, char* argv[]) {
+    const char* telemetry = PC_REPLAY_NULL_DEV;
+    const char* log = PC_REPLAY_NULL_DEV;
+    int passes = 1;
+    bool tx = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:l:n:tdh")) != -1) {
+        switch (c) {
+        case 'o':
+            telemetry = optarg;
+            break;
+        case 'l':
+            log = optarg;
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 't':
+            tx = true;
+            break;
+        case 'd':
+            replay_dump = true;
+            break;
+        default:
+            print_help();
+            return c == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || passes < 1) {
+        print_help();
+        return 2;
+    }
+
+    size_t size;
+    uint64_t start;
+    uint8_t* buf = pc_capture_load(argv[optind], &size, &start);
+    if (!buf) {
+        fprintf(stderr, "Error: %s is not a capture.\n", argv[optind]);
+        return 1;
+    }
+    FILE* telemetry_file = fopen(telemetry, "w");
+    FILE* log_file = fopen(log, "a");
+    if (!telemetry_file || !log_file) {
+        fprintf(stderr, "Error: could not open the output files.\n");
+        return 1;
+    }
+    time_t start_s = start / 1000000;
+    fprintf(stderr, "Capture of %zu bytes, started %s", size, ctime(&start_s));
+
+    struct timespec t0, t1;
+    uint64_t bytes = 0;
+    int ret = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < passes && !ret; i++) {
+        pc_log_init(&replay_log, log_file);
+        pc_log_init(&replay_telemetry, telemetry_file);
+        replay_in_log = false;
+        replay_messages[0] = replay_messages[1] = 0;
+        ret = replay(buf, size, tx);
+        bytes += size - PC_CAPTURE_HEADER_SIZE;
+        // The readback was cut off
+        if (replay_in_log)
+            pc_log_dump_finish(&replay_log);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    fprintf(stderr, "%"PRIu32" messages received, %"PRIu32" sent per pass\n",
+        replay_messages[PC_CAPTURE_RX], replay_messages[PC_CAPTURE_TX]);
+    fprintf(stderr, "%d passes in %.3f s, %.1f MB/s, %.0f messages/s\n",
+        passes, seconds, bytes / seconds / 1e6,
+        passes * (double) (replay_messages[0] + replay_messages[1]) / seconds);
+    fclose(telemetry_file);
+    fclose(log_file);
+    free(buf);
+    return ret;
+}
+
+/******************************
+replay()
+*******************************
+Description:
+	Feeds the records of a capture to the decoders, each
+	direction from the start of the protocol
+
+parameters:
+	-	const uint8_t* buf, size_t size:
+			The capture
+	-	bool tx:
+			Whether to decode the bytes sent as well
+
+Returns:
+	0, or 1 if the capture is corrupt
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+int replay(const uint8_t* buf, size_t size, bool tx) {
+    serialcomm_t sc[2];
+    frame_t rx_frame[2];
+    superframe_t rx_superframe[2];
+    for (int i = 0; i < 2; i++) {
+        serialcomm_init(&sc[i]);
+        sc[i].rx_frame = &rx_frame[i];
+        sc[i].rx_superframe = &rx_superframe[i];
+    }
+    sc[PC_CAPTURE_RX].rx_complete_callback = &replay_rx_complete;
+    sc[PC_CAPTURE_RX].rx_bulk_callback = &replay_rx_bulk;
+    sc[PC_CAPTURE_TX].rx_complete_callback = &replay_tx_complete;
+
+    size_t pos = PC_CAPTURE_HEADER_SIZE;
+    pc_capture_record_t record = { .time_us = 0 };
+    int result;
+    while ((result = pc_capture_next(buf, size, &pos, &record)) == 1) {
+        if (replay_dump) {
+            printf("%12.6f %s %3d:", record.time_us / 1e6,
+                record.dir == PC_CAPTURE_RX ? "rx" : "tx", record.size);
+            for (int i = 0; i < record.size; i++)
+                printf(" %02x", record.data[i]);
+            printf("\n");
+        }
+        if (record.dir == PC_CAPTURE_TX && !tx)
+            continue;
+        serialcomm_t* s = &sc[record.dir];
+        for (int i = 0; i < record.size; i++)
+            serialcomm_receive_char(s, record.data[i]);
+    }
+    if (result < 0) {
+        fprintf(stderr, "Error: the capture is corrupt at byte %zu.\n", pos);
+        return 1;
+    }
+    return 0;
+}
+
+/******************************
+replay_rx_complete()
+*******************************
+Description:
+	Handles a message received from the Quadcopter like
+	pc_rx_complete() does: logs it as telemetry or as part of
+	a log readback
+
+parameters:
+	-	message_t* message:
+			pointer to the message
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void replay_rx_complete(message_t* message) {
+    replay_messages[PC_CAPTURE_RX]++;
+    if (replay_dump)
+        printf("             < %3d %08"PRIx32" %08"PRIx32"\n", message->ID,
+            message->value.v32[0], message->value.v32[1]);
+    if (replay_in_log)
+        pc_log_receive(&replay_log, message);
+    else
+        pc_log_receive(&replay_telemetry, message);
+
+    switch (message->ID) {
+        case MESSAGE_LOG_START_ID:
+            if (pc_log_dump_start(&replay_log, MESSAGE_LOG_START_SIZE_VALUE(message)))
+                replay_in_log = true;
+            break;
+        case MESSAGE_LOG_END_ID:
+            if (replay_in_log)
+                replay_log_end();
+            break;
+        default:
+            break;
+    }
+}
+
+/******************************
+replay_rx_bulk()
+*******************************
+Description:
+	Handles a bulk frame received from the Quadcopter
+
+parameters:
+	-	uint32_t offset:
+			the offset of the data within the log
+	-	uint8_t* data, int size:
+			the received bytes
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void replay_rx_bulk(uint32_t offset, uint8_t* data, int size) {
+    if (replay_in_log)
+        pc_log_dump_data(&replay_log, offset, data, size);
+}
+
+/******************************
+replay_tx_complete()
+*******************************
+Description:
+	Counts a message sent to the Quadcopter
+
+parameters:
+	-	message_t* message:
+			pointer to the message
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void replay_tx_complete(message_t* message) {
+    replay_messages[PC_CAPTURE_TX]++;
+    if (replay_dump)
+        printf("             > %3d %08"PRIx32" %08"PRIx32"\n", message->ID,
+            message->value.v32[0], message->value.v32[1]);
+}
+
+/******************************
+replay_log_end()
+*******************************
+Description:
+	Handles the end of a log readback like pc_log_end() does.
+	The parts pc_terminal requested again follow in the capture,
+	so the log is only decoded once they are complete, after
+	as many rounds as pc_terminal tried, or at the end of the
+	capture.
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void replay_log_end(void) {
+    uint32_t offset = 0;
+    if (pc_log_dump_missing(&replay_log, &offset)
+            && replay_log.dump_rounds < PC_LOG_RESEND_ROUNDS) {
+        replay_log.dump_rounds++;
+        return;
+    }
+    pc_log_dump_finish(&replay_log);
+    replay_in_log = false;
+}
@@ -1,6 +1,7 @@
 #include "pc_terminal.h"
 #include "console.h"
 #include "serial.h"
+#include "pc_capture.h"
 #include "../common.h"
 #include <stdlib.h>
 #include <string.h>
@@ -26,12 +27,25 @@
 **/
 
 void pc_rx_complete(message_t*);
+void pc_rx_bulk(uint32_t, uint8_t*, int);
+void pc_log_end(void);
 void pc_tx_byte(uint8_t);
+int pc_rx_byte(void);
 unsigned long long timespec_ms(struct timespec*);
 
 pc_command_t	command;
 pc_log_t		pc_log;
 pc_log_t		pc_telemetry;
+pc_trace_t		pc_trace;
+pc_capture_t	pc_capture;
+
+// The serial line or the pipes to the simulation
+int	(*serial_getchar_nb)(void);
+int	(*serial_putchar)(char);
+
+// Time of the last log readback frame, to notice a lost MESSAGE_LOG_END_ID
+#define LOG_TIMEOUT_MS	1000
+unsigned long long	log_last_rx;
 
 
 
@@ -56,6 +70,8 @@ void print_help(void) {
 	term_puts("\n\t\tIf ommitted ");
 	term_puts(JS_DEV);
 	term_puts(" is used\n");
+	term_puts("\n\tCAPTURE:\n\t\t-r <path to capture file> to record the serial bytes\n");
+	term_puts("\t\tin both directions, see pc_replay.\n");
 }
 
 /*----------------------------------------------------------------
@@ -68,12 +84,13 @@ int main(int argc, char *argv[])
 	char *js = NULL;
 	char *virtual_out = NULL;
 	char *virtual_in = NULL;
+	char *capture = NULL;
 
 	bool printhelp = false;
 
 	opterr = 0;
 	int c;
-	while ((c = getopt (argc, argv, "s::j::n:vh")) != -1) {
+	while ((c = getopt (argc, argv, "s::j::n:r:vh")) != -1) {
 		switch (c) {
 		case 's':
 			if (optarg)
@@ -96,6 +113,9 @@ int main(int argc, char *argv[])
 			else
 				{ fprintf(stderr, "Unknown option -n%s.\n", optarg); printhelp = true; }
 			break;
+		case 'r':
+			capture = optarg;
+			break;
 		case 'v':
 			virtual_in = VIRTUAL_IN_DEV;
 			virtual_out = VIRTUAL_OUT_DEV;
@@ -104,7 +124,7 @@ int main(int argc, char *argv[])
 			printhelp = true;
 			break;
 		case '?':
-			if (optopt == 's' || optopt == 'j' || optopt == 'n')
+			if (optopt == 's' || optopt == 'j' || optopt == 'n' || optopt == 'r')
 				fprintf (stderr, "Option -%c requires an argument.\n", optopt);
 			else if (isprint(optopt))
 				fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -120,7 +140,7 @@ int main(int argc, char *argv[])
 	if(printhelp) {
 		print_help();
 	} else {
-		run_terminal(serial, js, virtual_in, virtual_out);
+		run_terminal(serial, js, virtual_in, virtual_out, capture);
   	}
 	return 0;
 }
@@ -142,10 +162,13 @@ void print_run_help(void) {
 	fprintf(stderr, "Terminal program - Embedded Real-Time Systems\n");
 	fprintf(stderr, "--------------------------------------------------------\n\n");
 	fprintf(stderr, "Press ESC to PANIC or the number keys to enter modes.\n");
-	fprintf(stderr, "Motors - E: enable R: disable\n\n");
+	fprintf(stderr, "Motors - E: enable R: disable\n");
+	fprintf(stderr, "9: reset profiling (latency histograms)\n");
+	fprintf(stderr, "T: dump event trace (shift+T: into the log) to trace_N.json\n\n");
 	fprintf(stderr, "Logging (telemetry) - F (G) to select what to log (enter sum)\n");
-	for (int i = 0; i <= 11; i++) {
-		fprintf(stderr, "%#10x: %s\n", 1u<<i, message_id_to_pc_name(i));
+	for (int i = 0; i <= MESSAGE_SCHED_ID; i++) {
+		if (i != MESSAGE_TRACE_ID)
+			fprintf(stderr, "%#10x: %s\n", 1u<<i, message_id_to_pc_name(i));
 	}
 	fprintf(stderr, "C: start V: pause B: readback (safe mode only) N: reset\n\n");
 	fprintf(stderr, "Press X to REBOOT Quadcopter and EXIT terminal program.\n");
@@ -168,13 +191,15 @@ Parameters
 		-	Path to a input pipe in order to simulate the quadcopter, NULL when not used
 	char* virt_out
 		-	Path to a out pipe in order to simulate the quadcopter, NULL when not used
+	char* capture
+		-	Path to a file to record the serial bytes into, NULL when not used
 
 Author:
 	 Koos Eerden
 *******************************/
 
 
-void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
+void run_terminal(char* serial, char* js, char* virt_in, char* virt_out, char* capture) {
 
 	bool do_serial, do_js, do_virt;
 	bool error = false;
@@ -183,6 +208,7 @@ void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
 	serialcomm_t sc;
 	frame_t rx_frame;
 	frame_t tx_frame;
+	superframe_t rx_superframe;
 	int c;
 
 	pc_command_init(&command);
@@ -190,6 +216,9 @@ void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
 	FILE* pc_log_file = fopen("pc_log.txt", "a");
 	pc_log_init(&pc_log, pc_log_file);
 	pc_log_init(&pc_telemetry, stdout);
+	pc_trace_init(&pc_trace);
+	pc_log.trace = &pc_trace;
+	pc_telemetry.trace = &pc_trace;
 
 	do_virt = virt_in != NULL && virt_out != NULL;
 	do_serial = (serial != NULL) || do_virt;
@@ -204,21 +233,28 @@ void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
 				fprintf(stderr, "Error: could not open serial device\n");
 				exit(1);
 			}
+			serial_getchar_nb = &rs232_getchar_nb;
+			serial_putchar = &rs232_putchar;
 		} else {
 			if (virt_open(virt_in, virt_out)) {
 				fprintf(stderr, "Error opening virtual serial pipes.\n");
 				exit(1);
 			}
+			serial_getchar_nb = &virt_getchar_nb;
+			serial_putchar = &virt_putchar;
+		}
+		if (capture && !pc_capture_open(&pc_capture, capture, time_get_us())) {
+			fprintf(stderr, "Error: could not open capture file %s\n", capture);
+			exit(1);
 		}
 		// Serial communication protocol initialisation
 		 serialcomm_init(&sc);
 		 sc.tx_frame             = &tx_frame;
 		 sc.rx_frame             = &rx_frame;
+		 sc.rx_superframe        = &rx_superframe;
 		 sc.rx_complete_callback = &pc_rx_complete;
-		 if (!do_virt)
-		 	sc.tx_byte              = (void (*)(uint8_t)) &rs232_putchar;
-		 else
-		 	sc.tx_byte 				= (void (*)(uint8_t)) &virt_putchar;
+		 sc.rx_bulk_callback     = &pc_rx_bulk;
+		 sc.tx_byte              = &pc_tx_byte;
 		 serialcomm_send_start(&sc);
 		 serialcomm_send_restart_request(&sc);	
 	}
@@ -270,18 +306,10 @@ void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
 		
 		//handle input
 		if(do_serial){
-			if (!do_virt) {
-				if ((c = rs232_getchar_nb()) >= 0) {
-					serialcomm_receive_char(&sc, (uint8_t) c);
-				} else {
-					usleep(500);
-				}
+			if ((c = pc_rx_byte()) >= 0) {
+				serialcomm_receive_char(&sc, (uint8_t) c);
 			} else {
-				if ((c = virt_getchar_nb()) >= 0) {
-					serialcomm_receive_char(&sc, (uint8_t) c);
-				} else {
-					usleep(500);
-				}
+				usleep(500);
 			}
 
 			while (pc_command_get_message(&command, &tx_frame.message)) {
@@ -302,13 +330,8 @@ void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
 				}
 				last_msg = time_get_ms();
 				// Don't completely block communications...
-				if (!do_virt) {
-					if ((c = rs232_getchar_nb()) >= 0) 
-						serialcomm_receive_char(&sc, (uint8_t) c);
-				} else {
-					if ((c = virt_getchar_nb()) >= 0)
-						serialcomm_receive_char(&sc, (uint8_t) c);
-				}
+				if ((c = pc_rx_byte()) >= 0)
+					serialcomm_receive_char(&sc, (uint8_t) c);
 				read_keyboard(&command);
 				if (tx_frame.message.ID == MESSAGE_SET_TELEMSK_ID)
 					tmsk = tx_frame.message.value.v32[0];
@@ -316,6 +339,12 @@ void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
 					lmsk = tx_frame.message.value.v32[0];
 			}
 
+			if (command.in_log_not_telemetry &&
+					LOG_TIMEOUT_MS < time_get_ms() - log_last_rx) {
+				fprintf(stderr, "Log readback timed out.\n");
+				pc_log_end();
+			}
+
 			if (150 < time_get_ms() - last_msg) {
 				serialcomm_quick_send(&sc, MESSAGE_KEEP_ALIVE_ID, 0, 0);
 				last_msg = time_get_ms();
@@ -329,8 +358,12 @@ void run_terminal(char* serial, char* js, char* virt_in, char* virt_out) {
 		fprintf(stderr, "Error: %s\n", errormsg);
 	}
 
+	pc_trace_close(&pc_trace);
+
 	while (time_get_ms() - last_msg < 250) { }
 
+	pc_capture_close(&pc_capture);
+
 	if(do_serial && !do_virt)
 		rs232_close();
 	if (do_serial) {
@@ -385,18 +418,105 @@ void pc_rx_complete(message_t* message) {
     		fprintf(stderr, "%s", str_buf);
     		break;
     	case MESSAGE_LOG_END_ID:
-    		fprintf(stderr, "End of log.\n");
-    		command.in_log_not_telemetry = false;
+    		pc_log_end();
     		break;
     	case MESSAGE_LOG_START_ID:
     		fprintf(stderr, "Start of log.\n");
+    		if (!pc_log_dump_start(&pc_log, MESSAGE_LOG_START_SIZE_VALUE(message))) {
+    			fprintf(stderr, "Not enough memory for the log.\n");
+    			break;
+    		}
     		command.in_log_not_telemetry = true;
+    		log_last_rx = time_get_ms();
     		break;
         default:
         	break;
     }
 }
 
+/*----------------------------------------------------------------
+ * pc_rx_bulk -- Process a bulk frame received from the Quadcopter
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - offset: the offset of the data within the log
+ *      - data: the received bytes
+ *      - size: the number of bytes
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ */
+void pc_rx_bulk(uint32_t offset, uint8_t* data, int size) {
+	if (!command.in_log_not_telemetry)
+		return;
+	pc_log_dump_data(&pc_log, offset, data, size);
+	log_last_rx = time_get_ms();
+}
+
+/*----------------------------------------------------------------
+ * pc_rx_byte -- Read a byte from the Quadcopter, if any
+ *----------------------------------------------------------------
+ *  Returns: the byte, or a negative value if there is none
+ *  Author: Boldizsar Palotas
+ *
+ *  The byte is recorded into the capture file, if any.
+ */
+int pc_rx_byte(void) {
+	int c = serial_getchar_nb();
+	if (0 <= c && pc_capture.file)
+		pc_capture_byte(&pc_capture, PC_CAPTURE_RX, c, time_get_us());
+	return c;
+}
+
+/*----------------------------------------------------------------
+ * pc_tx_byte -- Send a byte to the Quadcopter
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - byte: the byte to send
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  The byte is recorded into the capture file, if any.
+ */
+void pc_tx_byte(uint8_t byte) {
+	if (pc_capture.file)
+		pc_capture_byte(&pc_capture, PC_CAPTURE_TX, byte, time_get_us());
+	serial_putchar(byte);
+}
+
+/*----------------------------------------------------------------
+ * pc_log_end -- Handle the end of a log readback
+ *----------------------------------------------------------------
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  Missing parts of the log are requested again until no more
+ *  of them arrive for PC_LOG_RESEND_ROUNDS requests in a row.
+ *  Once the log is complete it is decoded and the log on the
+ *  Quadcopter is reset. If parts are still missing they are
+ *  decoded as padding and the log on the Quadcopter is kept so
+ *  that it can be read again.
+ */
+void pc_log_end(void) {
+	uint32_t offset = 0;
+	uint32_t mask = pc_log_dump_missing(&pc_log, &offset);
+	if (mask && pc_log.dump_rounds < PC_LOG_RESEND_ROUNDS) {
+		fprintf(stderr, "Log: requesting frames 0x%08"PRIx32" at %"PRIu32" again.\n", mask, offset);
+		pc_log.dump_rounds++;
+		command.log_resend = true;
+		command.log_resend_offset = offset;
+		command.log_resend_mask = mask;
+		log_last_rx = time_get_ms();
+		return;
+	}
+	if (mask) {
+		fprintf(stderr, "Log incomplete, missing data from %"PRIu32" on.\n", offset);
+	} else {
+		command.log_reset = true;
+	}
+	pc_log_dump_finish(&pc_log);
+	fprintf(stderr, "End of log.\n");
+	command.in_log_not_telemetry = false;
+}
+
 
 
 inline int min(int a, int b) {
@@ -32,7 +32,7 @@ int min(int a, int b);
 int max(int a, int b);
 
 void print_help(void);
-void run_terminal(char* serial, char* js, char*, char*);
+void run_terminal(char* serial, char* js, char*, char*, char*);
 void read_keyboard(pc_command_t* command);
 void print_run_help(void);
 
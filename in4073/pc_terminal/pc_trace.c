@@ -0,0 +1,218 @@
+#include "pc_trace.h"
+#include <inttypes.h>
+
+// Names of the traced tasks and interrupts in trace_id_t order
+static const char * const pc_trace_names[TRACE_ID_COUNT] = {
+    "control",
+    "receive",
+    "tx_flush",
+    "timer",
+    "log_data",
+    "text",
+    "imu_read",
+    "idle",
+    "sensor_irq",
+    "timer_irq",
+};
+
+// Tasks are shown on the main loop thread, interrupts on their own
+#define PC_TRACE_TID_MAIN   1
+#define PC_TRACE_TID_IRQ    2
+
+static void pc_trace_start(pc_trace_t* trace, uint32_t expected, uint32_t recorded);
+static void pc_trace_event(pc_trace_t* trace, uint32_t event);
+static void pc_trace_write(pc_trace_t* trace, const char* name, char ph, int tid);
+
+/******************************
+pc_trace_init()
+*******************************
+Description:
+	Initialize the trace converter
+
+parameters:
+	-	pc_trace_t* trace:
+			Pointer to the trace structure that is initialised
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_trace_init(pc_trace_t* trace) {
+    trace->file = 0;
+    trace->dumps = 0;
+    trace->expected = 0;
+    trace->received = 0;
+    trace->recorded = 0;
+}
+
+/******************************
+pc_trace_receive()
+*******************************
+Description:
+	Handles a MESSAGE_TRACE_ID message, either the header of
+	a new dump or the next two events of the current one.
+	Events outside of a dump are ignored.
+
+parameters:
+	-	pc_trace_t* trace:
+			Pointer to the trace structure
+	-	message_t* message:
+			pointer to the message
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_trace_receive(pc_trace_t* trace, message_t* message) {
+    uint32_t event = MESSAGE_TRACE_EVENT_VALUE(message, 0);
+    if (TRACE_EVENT_CODE(event) == TRACE_HEADER) {
+        pc_trace_start(trace, TRACE_EVENT_TIME(event), MESSAGE_TRACE_EVENT_VALUE(message, 1));
+        return;
+    }
+    for (int i = 0; i < 2 && trace->file; i++)
+        pc_trace_event(trace, MESSAGE_TRACE_EVENT_VALUE(message, i));
+}
+
+/******************************
+pc_trace_close()
+*******************************
+Description:
+	Finishes the file of the current dump, if any. Reports
+	events that were overwritten on the Quadcopter or lost on
+	the way.
+
+parameters:
+	-	pc_trace_t* trace:
+			Pointer to the trace structure
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_trace_close(pc_trace_t* trace) {
+    if (!trace->file)
+        return;
+    fprintf(trace->file, "\n]}\n");
+    fclose(trace->file);
+    trace->file = 0;
+    fprintf(stderr, "Trace %d: %"PRIu32" of %"PRIu32" events, %"PRIu32" overwritten, written to trace_%d.json\n",
+        trace->dumps, trace->received, trace->expected,
+        trace->recorded - trace->expected, trace->dumps);
+}
+
+/******************************
+pc_trace_start()
+*******************************
+Description:
+	Starts the file of a new dump
+
+parameters:
+	-	pc_trace_t* trace:
+			Pointer to the trace structure
+	-	uint32_t expected:
+			Number of events in the dump
+	-	uint32_t recorded:
+			Number of events recorded since the last dump
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_trace_start(pc_trace_t* trace, uint32_t expected, uint32_t recorded) {
+    char name[32];
+    pc_trace_close(trace);
+    trace->dumps++;
+    snprintf(name, sizeof(name), "trace_%d.json", trace->dumps);
+    if (!(trace->file = fopen(name, "w"))) {
+        fprintf(stderr, "Cannot open %s.\n", name);
+        return;
+    }
+    trace->expected = expected;
+    trace->received = 0;
+    trace->recorded = recorded;
+    trace->time = 0;
+    for (int i = 0; i < TRACE_ID_COUNT; i++)
+        trace->open[i] = 0;
+    fprintf(trace->file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(trace->file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"main loop\"}},\n", PC_TRACE_TID_MAIN);
+    fprintf(trace->file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"interrupts\"}}", PC_TRACE_TID_IRQ);
+    if (!expected)
+        pc_trace_close(trace);
+}
+
+/******************************
+pc_trace_event()
+*******************************
+Description:
+	Converts a single event. The 24 bit time is unwrapped,
+	which is correct as long as consecutive events are less
+	than 16 s apart. Ends without a matching begin (the begin
+	was overwritten) are left out.
+
+parameters:
+	-	pc_trace_t* trace:
+			Pointer to the trace structure
+	-	uint32_t event:
+			The event as recorded
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_trace_event(pc_trace_t* trace, uint32_t event) {
+    uint32_t time = TRACE_EVENT_TIME(event);
+    uint8_t id = TRACE_ID(TRACE_EVENT_CODE(event));
+    if (trace->received == 0)
+        trace->time = time;
+    else
+        trace->time += (time - trace->last) & TRACE_TIME_MASK;
+    trace->last = time;
+    trace->received++;
+
+    const char* name = id < TRACE_ID_COUNT ? pc_trace_names[id] : "unknown";
+    switch (TRACE_KIND(TRACE_EVENT_CODE(event))) {
+        case TRACE_BEGIN:
+            if (id < TRACE_ID_COUNT)
+                trace->open[id]++;
+            pc_trace_write(trace, name, 'B', PC_TRACE_TID_MAIN);
+            break;
+        case TRACE_END:
+            if (id < TRACE_ID_COUNT && trace->open[id]) {
+                trace->open[id]--;
+                pc_trace_write(trace, name, 'E', PC_TRACE_TID_MAIN);
+            }
+            break;
+        case TRACE_INSTANT:
+            pc_trace_write(trace, name, 'i', PC_TRACE_TID_IRQ);
+            break;
+        default:
+            break;
+    }
+    if (trace->expected <= trace->received)
+        pc_trace_close(trace);
+}
+
+/******************************
+pc_trace_write()
+*******************************
+Description:
+	Writes a trace event object at the current time
+
+parameters:
+	-	pc_trace_t* trace:
+			Pointer to the trace structure
+	-	const char* name:
+			Name of the task or interrupt
+	-	char ph:
+			Phase: 'B'egin, 'E'nd or 'i'nstant
+	-	int tid:
+			Thread the event is shown on
+
+Author:
+	 Boldizsar Palotas
+*******************************/
+
+void pc_trace_write(pc_trace_t* trace, const char* name, char ph, int tid) {
+    fprintf(trace->file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%"PRIu64",\"pid\":1,\"tid\":%d}",
+        name, ph, ph == 'i' ? "\"s\":\"t\"," : "", trace->time, tid);
+}
@@ -0,0 +1,42 @@
+#ifndef PC_TRACE_H
+#define PC_TRACE_H
+
+#include <stdio.h>
+#include "../common.h"
+#include "../serialcomm.h"
+#include "../trace.h"
+
+/** pc_trace_t
+ *  Converts trace dumps of the Quadcopter (see trace.h) to the
+ *  Chrome trace event JSON format, one file per dump, which can
+ *  be opened in chrome://tracing or https://ui.perfetto.dev.
+ *  -------------------
+ *  Fields:
+ *  - file: The file of the dump being received, NULL if none.
+ *  - dumps: Number of dumps started, numbers the files.
+ *  - expected: Number of events announced by the dump header.
+ *  - received: Number of events received of the dump.
+ *  - recorded: Number of events recorded on the Quadcopter.
+ *  - time, last: The unwrapped time of the previous event and
+ *      its 24 bit time as recorded.
+ *  - open: Number of tasks begun and not ended yet per ID.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct pc_trace {
+    FILE*       file;
+    int         dumps;
+    uint32_t    expected;
+    uint32_t    received;
+    uint32_t    recorded;
+    uint64_t    time;
+    uint32_t    last;
+    int         open[TRACE_ID_COUNT];
+} pc_trace_t;
+
+void pc_trace_init(pc_trace_t* trace);
+
+void pc_trace_receive(pc_trace_t* trace, message_t* message);
+
+void pc_trace_close(pc_trace_t* trace);
+
+#endif // PC_TRACE_H
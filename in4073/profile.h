@@ -3,6 +3,33 @@
 
 #include <inttypes.h>
 
+// Number of bins of a latency histogram
+#define PROFILE_HIST_BINS   15
+
+/** Latency histogram
+ *  Optional extension of a profile: the distribution of its
+ *  deltas and their running min, mean and count.
+ *  ------------------
+ *  Fields:
+ *  - bounds: PROFILE_HIST_BINS - 1 ascending exclusive upper
+ *      bounds of the bins, the last bin has no upper bound.
+ *      If null, bin i holds deltas with i significant bits
+ *      (log2 bins: 0, 1, 2-3, 4-7, ...).
+ *  - bin: number of deltas in each bin. When a bin would
+ *      overflow, all bins are halved so the shape of the
+ *      distribution is kept.
+ *  - count, min_delta, sum: running statistics since the
+ *      last reset, not affected by the halving.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct profile_hist {
+    const uint32_t* bounds;
+    uint16_t bin[PROFILE_HIST_BINS];
+    uint32_t count;
+    uint32_t min_delta;
+    uint64_t sum;
+} profile_hist_t;
+
 typedef struct profile {
     uint32_t time;
     uint32_t tag;
@@ -10,13 +37,21 @@ typedef struct profile {
     uint32_t max_tag;
     uint32_t last_delta;
     uint32_t last_tag;
+    profile_hist_t* hist;
 } profile_t;
 
 static inline void profile_init(profile_t* p);
+static inline void profile_reset(profile_t* p);
 static inline void profile_start(profile_t* p, uint32_t time);
 static inline void profile_start_tag(profile_t* p, uint32_t time, uint32_t tag);
 static inline void profile_end(profile_t* p, uint32_t time);
 
+static inline void profile_hist_init(profile_hist_t* h, const uint32_t* bounds);
+static inline void profile_hist_add(profile_hist_t* h, uint32_t delta);
+static inline uint32_t profile_hist_bound(profile_hist_t* h, int bin);
+static inline uint32_t profile_hist_mean(profile_hist_t* h);
+static inline uint32_t profile_hist_percentile(profile_hist_t* h, uint32_t permille);
+
 static inline void profile_init(profile_t* p) {
     p->time = 0;
     p->tag = UINT32_MAX;
@@ -24,6 +59,17 @@ static inline void profile_init(profile_t* p) {
     p->max_tag = UINT32_MAX;
     p->last_delta = 0;
     p->last_tag = UINT32_MAX;
+    p->hist = 0;
+}
+
+// Clear the statistics but keep a running measurement
+static inline void profile_reset(profile_t* p) {
+    p->max_delta = 0;
+    p->max_tag = UINT32_MAX;
+    p->last_delta = 0;
+    p->last_tag = UINT32_MAX;
+    if (p->hist)
+        profile_hist_init(p->hist, p->hist->bounds);
 }
 
 static inline void profile_start(profile_t* p, uint32_t time) {
@@ -42,6 +88,66 @@ static inline void profile_end(profile_t* p, uint32_t time) {
         p->max_delta = p->last_delta;
         p->max_tag = p->tag;
     }
+    if (p->hist)
+        profile_hist_add(p->hist, p->last_delta);
+}
+
+static inline void profile_hist_init(profile_hist_t* h, const uint32_t* bounds) {
+    h->bounds = bounds;
+    for (int i = 0; i < PROFILE_HIST_BINS; i++)
+        h->bin[i] = 0;
+    h->count = 0;
+    h->min_delta = UINT32_MAX;
+    h->sum = 0;
+}
+
+static inline void profile_hist_add(profile_hist_t* h, uint32_t delta) {
+    int i = 0;
+    if (h->bounds) {
+        while (i < PROFILE_HIST_BINS - 1 && h->bounds[i] <= delta)
+            i++;
+    } else if (delta) {
+        i = 32 - __builtin_clz(delta);
+        if (PROFILE_HIST_BINS - 1 < i)
+            i = PROFILE_HIST_BINS - 1;
+    }
+    if (h->bin[i] == UINT16_MAX) {
+        for (int j = 0; j < PROFILE_HIST_BINS; j++)
+            h->bin[j] >>= 1;
+    }
+    h->bin[i]++;
+    h->count++;
+    h->sum += delta;
+    if (delta < h->min_delta)
+        h->min_delta = delta;
+}
+
+// Exclusive upper bound of a bin, UINT32_MAX for the last one
+static inline uint32_t profile_hist_bound(profile_hist_t* h, int bin) {
+    if (PROFILE_HIST_BINS - 1 <= bin)
+        return UINT32_MAX;
+    return h->bounds ? h->bounds[bin] : 1ul << bin;
+}
+
+static inline uint32_t profile_hist_mean(profile_hist_t* h) {
+    return h->count ? (uint32_t) (h->sum / h->count) : 0;
+}
+
+// Upper bound of the bin containing the given percentile
+// (in 1/1000), 0 if the histogram is empty
+static inline uint32_t profile_hist_percentile(profile_hist_t* h, uint32_t permille) {
+    uint32_t total = 0, sum = 0;
+    int i;
+    for (i = 0; i < PROFILE_HIST_BINS; i++)
+        total += h->bin[i];
+    if (!total)
+        return 0;
+    for (i = 0; i < PROFILE_HIST_BINS - 1; i++) {
+        sum += h->bin[i];
+        if ((uint64_t) total * permille <= (uint64_t) sum * 1000)
+            break;
+    }
+    return profile_hist_bound(h, i);
 }
 
 #endif // PROFILE_H
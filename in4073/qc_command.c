@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include "mode_constants.h"
 #include "log.h"
+#include "trace.h"
 #include "printf.h"
 
 static void qc_command_set_mode(qc_command_t* command, qc_mode_t mode);
@@ -42,6 +43,7 @@ void qc_command_init(qc_command_t* command,
     serialcomm->rx_frame                = &command->rx_frame;
     serialcomm->rx_complete_callback    = rx_complete_fn;
     serialcomm->tx_byte                 = tx_byte_fn;
+    serialcomm->tx_frame_fn             = system->hal->tx_frame_fn;
 }
 
 /** =======================================================
@@ -85,6 +87,7 @@ void qc_command_rx_message(qc_command_t* command, message_t* message) {
                 case MESSAGE_LOG_CTL_VALUE_STOP:
                     printf("> Stop logging\n");
                     command->system->do_logging = false;
+                    log_request_flush();
                     break;
                 case MESSAGE_LOG_CTL_VALUE_READ:
                     if (command->system->mode != MODE_0_SAFE) {
@@ -101,6 +104,14 @@ void qc_command_rx_message(qc_command_t* command, message_t* message) {
                     break;
             }
             break;
+        case MESSAGE_LOG_RESEND_ID:
+            if (command->system->mode != MODE_0_SAFE) {
+                printf("> Not in SAFE mode!\n");
+                break;
+            }
+            log_resend(MESSAGE_LOG_RESEND_OFFSET_VALUE(message),
+                MESSAGE_LOG_RESEND_MASK_VALUE(message));
+            break;
         case MESSAGE_SET_P12_ID:
             command->system->state->trim.p1 = MESSAGE_SET_P1_VALUE(message);
             command->system->state->trim.p2 = MESSAGE_SET_P2_VALUE(message);
@@ -134,6 +145,23 @@ void qc_command_rx_message(qc_command_t* command, message_t* message) {
                     if (MESSAGE_OPTMOD_VALUE(message) == 2) // Toggle option
                         command->system->state->option.wireless_control = !command->system->state->option.wireless_control;
                     break;
+                case 9: // Profiling reset
+                    if (MESSAGE_OPTMOD_VALUE(message) == 1 && MESSAGE_OPTVAL_VALUE(message)) {
+                        qc_state_reset_prof(command->system->state);
+                        qc_state_clear_sched(command->system->state);
+                        printf("Profiles reset.\n");
+                    }
+                    break;
+                case 10: // Trace dump over serial
+                case 11: // Trace dump into the log
+                    if (MESSAGE_OPTMOD_VALUE(message) == 1 && MESSAGE_OPTVAL_VALUE(message)) {
+                        if (trace_dump_start(MESSAGE_OPTNUM_VALUE(message) == 10 ?
+                                TRACE_DUMP_SERIAL : TRACE_DUMP_FLASH))
+                            printf("Trace dump started.\n");
+                        else
+                            printf("Trace dump already in progress.\n");
+                    }
+                    break;
             }
             break;
         case MESSAGE_REBOOT_ID:
@@ -4,6 +4,8 @@
 #include "mode_constants.h"
 
 static void qc_hal_tx_byte(uint8_t byte);
+static void qc_hal_tx_frame(uint8_t id, uint8_t* buf, int size);
+static void qc_hal_tx_flush(bool wait);
 static void qc_hal_set_outputs(qc_state_t* state);
 static void qc_hal_enable_motors(bool);
 static void qc_hal_get_inputs(qc_state_t* state);
@@ -11,6 +13,30 @@ static void qc_hal_get_inputs(qc_state_t* state);
 static bool motors_enabled = false;
 static bool enable_uart_output = true;
 
+// Transmit scheduler
+// ------------------
+// Frames that don't fit into tx_queue are deferred here, ordered by
+// priority (highest first) and FIFO within the same priority.
+
+typedef enum qc_hal_tx_prio {
+    TX_PRIO_TELEMETRY = 0,
+    TX_PRIO_TEXT,
+    TX_PRIO_CONTROL,
+    TX_PRIO_COUNT
+} qc_hal_tx_prio_t;
+
+#define TX_DEFER_SLOTS 4
+
+typedef struct qc_hal_tx_deferred {
+    uint8_t     prio;
+    uint8_t     size;
+    uint8_t     data[FRAME_MAX_ENCODED_SIZE];
+} qc_hal_tx_deferred_t;
+
+static qc_hal_tx_deferred_t tx_deferred[TX_DEFER_SLOTS];
+static int tx_deferred_cnt = 0;
+static uint16_t tx_drop_cnt[TX_PRIO_COUNT] = {0};
+
 /** =======================================================
  *  qc_hal_init -- Initialise the quadcopter HAL module.
  *  =======================================================
@@ -23,13 +49,16 @@ static bool enable_uart_output = true;
 **/
 void qc_hal_init(qc_hal_t* hal) {
     hal->tx_byte_fn     = &qc_hal_tx_byte;
+    hal->tx_frame_fn    = &qc_hal_tx_frame;
+    hal->tx_flush_fn    = &qc_hal_tx_flush;
     hal->get_inputs_fn  = &qc_hal_get_inputs;
     hal->set_outputs_fn = &qc_hal_set_outputs;
     hal->enable_motors_fn = &qc_hal_enable_motors;
     hal->flash_init_fn  = &spi_flash_init;
     hal->flash_read_fn  = &flash_read_bytes;
     hal->flash_write_fn = &flash_write_bytes;
-    hal->flash_erase_fn = &flash_chip_erase;
+    hal->flash_erase_sector_fn = &flash_sector_erase;
+    hal->flash_busy_fn  = &flash_busy;
     hal->imu_init_fn    = &imu_init;
     hal->reset_fn       = &NVIC_SystemReset;
     hal->get_time_us_fn = &get_time_us;
@@ -48,11 +77,140 @@ void qc_hal_init(qc_hal_t* hal) {
 void qc_hal_tx_byte(uint8_t byte) {
     if (!enable_uart_output)
         return;
-    volatile uint32_t to = 1000;
-    while (tx_queue.count == QUEUE_SIZE && --to) { }
     uart_put(byte);
 }
 
+/** =======================================================
+ *  qc_hal_tx_prio -- Transmit priority of a frame.
+ *  =======================================================
+ *  Parameters:
+ *  - id: The ID of the frame.
+ *  Returns: The priority, telemetry (superframes) is the
+ *      lowest, text is in between and everything else
+ *      (mode changes, control frames) is the highest.
+ *  Author: Boldizsar Palotas
+**/
+static qc_hal_tx_prio_t qc_hal_tx_prio(uint8_t id) {
+    switch (id) {
+        case FRAME_SUPER_ID:
+            return TX_PRIO_TELEMETRY;
+        case MESSAGE_TEXT_ID:
+            return TX_PRIO_TEXT;
+        default:
+            return TX_PRIO_CONTROL;
+    }
+}
+
+/** =======================================================
+ *  qc_hal_tx_put -- Put a frame into the UART queue.
+ *  =======================================================
+ *  Parameters:
+ *  - buf: The bytes of the frame.
+ *  - size: The number of bytes, must fit into tx_queue.
+ *  Author: Boldizsar Palotas
+**/
+static void qc_hal_tx_put(uint8_t* buf, int size) {
+    for (int i = 0; i < size; i++)
+        uart_put(buf[i]);
+}
+
+/** =======================================================
+ *  qc_hal_tx_frame -- Transmit a whole frame without blocking.
+ *  =======================================================
+ *  The frame is put into the UART transmit queue only as a
+ *  whole and only if no deferred frame with the same or
+ *  higher priority is waiting. Otherwise it is deferred. If
+ *  all deferred slots are taken, the lowest priority frame
+ *  (the newest one on ties) is dropped and counted.
+ *
+ *  Parameters:
+ *  - id: The ID of the frame, determines its priority.
+ *  - buf: The encoded bytes of the frame.
+ *  - size: The number of bytes.
+ *  Author: Boldizsar Palotas
+**/
+void qc_hal_tx_frame(uint8_t id, uint8_t* buf, int size) {
+    if (!enable_uart_output)
+        return;
+    qc_hal_tx_prio_t prio = qc_hal_tx_prio(id);
+
+    // Position after the deferred frames with the same or higher priority
+    int pos = 0;
+    while (pos < tx_deferred_cnt && prio <= tx_deferred[pos].prio)
+        pos++;
+
+    if (pos == 0 && size <= QUEUE_SIZE - queue_count(&tx_queue)) {
+        qc_hal_tx_put(buf, size);
+        return;
+    }
+
+    if (tx_deferred_cnt == TX_DEFER_SLOTS) {
+        if (pos == TX_DEFER_SLOTS) {
+            tx_drop_cnt[prio]++;
+            return;
+        }
+        tx_drop_cnt[tx_deferred[TX_DEFER_SLOTS - 1].prio]++;
+        tx_deferred_cnt--;
+    }
+    for (int i = tx_deferred_cnt; pos < i; i--)
+        tx_deferred[i] = tx_deferred[i - 1];
+    tx_deferred[pos].prio = prio;
+    tx_deferred[pos].size = size;
+    for (int i = 0; i < size; i++)
+        tx_deferred[pos].data[i] = buf[i];
+    tx_deferred_cnt++;
+}
+
+/** =======================================================
+ *  qc_hal_tx_ready -- Check if a deferred frame can be sent.
+ *  =======================================================
+ *  Returns: true if the highest priority deferred frame
+ *      fits into the UART transmit queue.
+ *  Author: Boldizsar Palotas
+**/
+bool qc_hal_tx_ready(void) {
+    return tx_deferred_cnt &&
+        tx_deferred[0].size <= QUEUE_SIZE - queue_count(&tx_queue);
+}
+
+/** =======================================================
+ *  qc_hal_tx_space -- Free space for new frames.
+ *  =======================================================
+ *  Returns: The number of bytes that can be transmitted
+ *      without deferring, zero while frames are deferred.
+ *  Author: Boldizsar Palotas
+**/
+uint32_t qc_hal_tx_space(void) {
+    if (tx_deferred_cnt)
+        return 0;
+    return QUEUE_SIZE - queue_count(&tx_queue);
+}
+
+/** =======================================================
+ *  qc_hal_tx_flush -- Send deferred frames.
+ *  =======================================================
+ *  Moves deferred frames into the UART transmit queue in
+ *  priority order as long as they fit.
+ *
+ *  Parameters:
+ *  - wait: If true, wait for the UART until all deferred
+ *      frames are queued. Never do this in the control path.
+ *  Author: Boldizsar Palotas
+**/
+void qc_hal_tx_flush(bool wait) {
+    while (tx_deferred_cnt) {
+        if (!qc_hal_tx_ready()) {
+            if (wait)
+                continue;
+            return;
+        }
+        qc_hal_tx_put(tx_deferred[0].data, tx_deferred[0].size);
+        tx_deferred_cnt--;
+        for (int i = 0; i < tx_deferred_cnt; i++)
+            tx_deferred[i] = tx_deferred[i + 1];
+    }
+}
+
 /** =======================================================
  *  qc_hal_get_inputs -- Update sensor readings in state.
  *  =======================================================
@@ -102,6 +260,9 @@ void qc_hal_get_inputs(qc_state_t* state) {
     state->sensor.sq            = GYRO_CONV_FROM_NATIVE(-sq) - state->offset.sq;
     state->sensor.sr            = GYRO_CONV_FROM_NATIVE(-sr) - state->offset.sr; 
 
+    state->comm.tx_drop_telemetry   = tx_drop_cnt[TX_PRIO_TELEMETRY];
+    state->comm.tx_drop_text        = tx_drop_cnt[TX_PRIO_TEXT];
+    state->comm.tx_drop_control     = tx_drop_cnt[TX_PRIO_CONTROL];
 }
 
 /** =======================================================
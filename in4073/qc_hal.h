@@ -10,19 +10,30 @@
  *  -------------------
  *  Fields:
  *  - tx_byte_fn: Function for transferring a single byte of data to PC
+ *  - tx_frame_fn: Function for transferring a whole frame to PC without
+ *      blocking, optional (NULL if frames are sent with tx_byte_fn)
+ *  - tx_flush_fn: Function for sending frames deferred by tx_frame_fn,
+ *      waits until all of them are queued if its argument is true
  *  - get_inputs_fn: Function for reading sensor data and other inputs before control
  *  - set_outputs_fn: Function for setting motor speed and other outputs after control
  *  - enable_motors_fn: Function for enabling or disabling power on the motors
+ *  - flash_erase_sector_fn: Function for starting the erase of the 4 KiB
+ *      flash sector at an address, returns before the erase is done
+ *  - flash_busy_fn: Function for checking if the flash is still busy
+ *      with an erase or write
 **/
 typedef struct qc_hal {
     void (*tx_byte_fn)(uint8_t);
+    void (*tx_frame_fn)(uint8_t, uint8_t*, int);
+    void (*tx_flush_fn)(bool);
     void (*get_inputs_fn)(qc_state_t*);
     void (*set_outputs_fn)(qc_state_t*);
     void (*enable_motors_fn)(bool);
     bool (*flash_init_fn)(void);
     bool (*flash_write_fn)(uint32_t, uint8_t*, uint32_t);
     bool (*flash_read_fn)(uint32_t, uint8_t*, uint32_t);
-    bool (*flash_erase_fn)(void);
+    bool (*flash_erase_sector_fn)(uint32_t);
+    bool (*flash_busy_fn)(void);
     void (*imu_init_fn)(bool, uint16_t);
     void (*reset_fn)(void);
     uint32_t (*get_time_us_fn)(void);
@@ -1,5 +1,7 @@
 #include "qc_state.h"
 
+const uint8_t qc_state_hist_prof[QC_STATE_HIST_CNT] = {0, 1, 3};
+
 /** =======================================================
  *  qc_state_init -- Initialise quadcopter state variable
  *  =======================================================
@@ -23,6 +25,8 @@ void qc_state_init(qc_state_t* state) {
     qc_state_clear_trim(state);
     qc_state_clear_option(state);
     qc_state_clear_prof(state);
+    qc_state_clear_comm(state);
+    qc_state_clear_sched(state);
 }
 
 /** =======================================================
@@ -218,7 +222,9 @@ void qc_state_clear_option(qc_state_t* state) {
 /** =======================================================
  *  qc_state_clear_prof -- Clear operating profiles
  *  =======================================================
- *  Clears all operating profiles in the state variable.
+ *  Clears all operating profiles in the state variable and
+ *  attaches the latency histograms (with log2 bins) to their
+ *  profiles.
  *  Parameters:
  *  - state: The state variable in which to clear the data.
  *  Author: Boldizsar Palotas
@@ -226,4 +232,55 @@ void qc_state_clear_option(qc_state_t* state) {
 void qc_state_clear_prof(qc_state_t* state) {
     for (int i = 0; i < QC_STATE_PROF_CNT; i++)
         profile_init(&state->prof.pr[i]);
+    for (int i = 0; i < QC_STATE_HIST_CNT; i++) {
+        profile_hist_init(&state->prof.hist[i], 0);
+        state->prof.pr[qc_state_hist_prof[i]].hist = &state->prof.hist[i];
+    }
+}
+
+/** =======================================================
+ *  qc_state_reset_prof -- Reset profiling statistics
+ *  =======================================================
+ *  Clears the maxima and the latency histograms of all
+ *  profiles. Unlike qc_state_clear_prof it can be called
+ *  while a profile is being measured.
+ *  Parameters:
+ *  - state: The state variable in which to clear the data.
+ *  Author: Boldizsar Palotas
+**/
+void qc_state_reset_prof(qc_state_t* state) {
+    for (int i = 0; i < QC_STATE_PROF_CNT; i++)
+        profile_reset(&state->prof.pr[i]);
+}
+
+/** =======================================================
+ *  qc_state_clear_comm -- Clear communication statistics
+ *  =======================================================
+ *  Clears all communication statistics in the state
+ *  variable.
+ *  Parameters:
+ *  - state: The state variable in which to clear the data.
+ *  Author: Boldizsar Palotas
+**/
+void qc_state_clear_comm(qc_state_t* state) {
+    state->comm.tx_drop_telemetry   = 0;
+    state->comm.tx_drop_text        = 0;
+    state->comm.tx_drop_control     = 0;
+}
+
+/** =======================================================
+ *  qc_state_clear_sched -- Clear task deadline accounting
+ *  =======================================================
+ *  Clears the deadline misses, overruns and response times
+ *  of all tasks in the state variable.
+ *  Parameters:
+ *  - state: The state variable in which to clear the data.
+ *  Author: Boldizsar Palotas
+**/
+void qc_state_clear_sched(qc_state_t* state) {
+    for (int i = 0; i < QC_STATE_TASK_CNT; i++) {
+        state->sched.miss[i]        = 0;
+        state->sched.overrun[i]     = 0;
+        state->sched.response[i]    = 0;
+    }
 }
@@ -27,18 +27,24 @@ typedef struct qc_state_orient {
     q32_t       yaw;
 } qc_state_orient_t;
 
+#define QC_STATE_MOTOR_CNT  4
+
 /** State: motor
  *  Motor speed signals
  *  ------------------
  *  Fields:
  *  - ae1..4 [relative unit]: Motor speed setpoint signal with values 0 to ??? TODO
+ *  - ae: The same signals as an array, for the motor mixer.
  *  Author: Boldizsar Palotas
 **/
-typedef struct qc_state_motor {
-    uint16_t    ae1;
-    uint16_t    ae2;
-    uint16_t    ae3;
-    uint16_t    ae4;
+typedef union qc_state_motor {
+    struct {
+        uint16_t    ae1;
+        uint16_t    ae2;
+        uint16_t    ae3;
+        uint16_t    ae4;
+    };
+    uint16_t    ae[QC_STATE_MOTOR_CNT];
 } qc_state_motor_t;
 
 /** State: sensor
@@ -221,18 +227,55 @@ typedef struct qc_state_option {
     bool        enable_motors;
 } qc_state_option_t;
 
-#define QC_STATE_PROF_CNT   5
+#define QC_STATE_PROF_CNT   6
+#define QC_STATE_HIST_CNT   3
 /** State: prof
  *  Placeholders for profiling different parts of the system.
  *  ------------------
  *  Fields:
  *  - prN: Profiling information slot N.
+ *  - hist: Latency histograms of the control loop (pr0), the
+ *      mode control function (pr1) and the sensor read (pr3),
+ *      see qc_state_hist_prof.
  *  Author: Boldizsar Palotas
 **/
 typedef struct qc_state_prof {
-    profile_t   pr[QC_STATE_PROF_CNT];
+    profile_t       pr[QC_STATE_PROF_CNT];
+    profile_hist_t  hist[QC_STATE_HIST_CNT];
 } qc_state_prof_t;
 
+/** State: comm
+ *  Serial communication statistics
+ *  ------------------
+ *  Fields:
+ *  - tx_drop_telemetry: number of dropped telemetry frames
+ *  - tx_drop_text: number of dropped text frames
+ *  - tx_drop_control: number of dropped control frames (mode etc.)
+ *  Author: Boldizsar Palotas
+**/
+typedef struct qc_state_comm {
+    uint16_t    tx_drop_telemetry;
+    uint16_t    tx_drop_text;
+    uint16_t    tx_drop_control;
+} qc_state_comm_t;
+
+#define QC_STATE_TASK_CNT   5
+/** State: sched
+ *  Deadline accounting of the main loop tasks, indexed like
+ *  the task table (see sched.h). Saturated to 16 bits.
+ *  ------------------
+ *  Fields:
+ *  - miss: number of releases completed after their deadline
+ *  - overrun: number of runs longer than their budget
+ *  - response: longest time from a release to its completion in us
+ *  Author: Boldizsar Palotas
+**/
+typedef struct qc_state_sched {
+    uint16_t    miss[QC_STATE_TASK_CNT];
+    uint16_t    overrun[QC_STATE_TASK_CNT];
+    uint16_t    response[QC_STATE_TASK_CNT];
+} qc_state_sched_t;
+
 /** State
  *  
  *  ------------------
@@ -250,6 +293,8 @@ typedef struct qc_state_prof {
  *  - trim: Controller trimming parameters
  *  - option: Other quadcopter options
  *  - prof: Profiling information
+ *  - comm: Serial communication statistics
+ *  - sched: Task deadline misses and overruns
  *  Author: Boldizsar Palotas
 **/
 typedef struct qc_state {
@@ -266,8 +311,13 @@ typedef struct qc_state {
     qc_state_trim_t     trim;
     qc_state_option_t   option;
     qc_state_prof_t     prof;
+    qc_state_comm_t     comm;
+    qc_state_sched_t    sched;
 } qc_state_t;
 
+// The profile slot measured by each histogram in qc_state_prof_t
+extern const uint8_t qc_state_hist_prof[QC_STATE_HIST_CNT];
+
 void qc_state_init(qc_state_t* state);
 
 void qc_state_clear_orient(qc_state_t* state);
@@ -296,4 +346,10 @@ void qc_state_clear_option(qc_state_t* state);
 
 void qc_state_clear_prof(qc_state_t* state);
 
+void qc_state_reset_prof(qc_state_t* state);
+
+void qc_state_clear_comm(qc_state_t* state);
+
+void qc_state_clear_sched(qc_state_t* state);
+
 #endif // QC_STATE_H
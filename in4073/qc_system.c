@@ -3,12 +3,19 @@
 #include "mode_constants.h"
 #include "printf.h"
 #include "log.h"
+#include "trace.h"
 #include <math.h>
+#include <stddef.h>
 
 #define SAFE_VOLTAGE 1050
 extern bool is_test_device;
 extern uint32_t iteration;
 
+static void qc_system_hist_part(qc_system_t* system, message_t* msg);
+static void qc_system_sched_task(qc_system_t* system, message_t* msg);
+static void qc_system_trace_dump(superframe_t* telemetry);
+static void qc_system_time_mode_voltage(qc_system_t* system, message_t* msg);
+
 /** =======================================================
  *  qc_system_init -- Initialise a model of the quadcopter
  *  =======================================================
@@ -51,6 +58,8 @@ void qc_system_init(qc_system_t* system,
     system->do_logging          = false;
     system->log_mask            = 0;
     system->telemetry_mask      = 0;
+    system->hist_part           = 0;
+    system->sched_task          = 0;
 
     // Init command (and serialcomm within)
     qc_command_init(system->command,
@@ -59,6 +68,7 @@ void qc_system_init(qc_system_t* system,
     // Init other members
     qc_state_init(system->state);
     qc_system_set_raw(system, false);
+    trace_init();
     if (!log_init(system->hal, system->serialcomm)) {
         qc_system_set_mode(system, MODE_1_PANIC);
         printf("> Log init error, starting in PANIC mode.\n");
@@ -146,19 +156,19 @@ void qc_kalman_filter(qc_state_t* state) {
 
     q32_t phi_state_est = state->sensor.sphi +
         FP_MUL1(T_CONST_RAW, state->sensor.sp, T_CONST_FRAC_BITS);
-    q32_t phi_meas_est = fp_asin_t1(FP_MUL1( - state->sensor.say, KALMAN_M, KALMAN_M_FRAC_BITS));
-    state->sensor.sphi = fp_angle_clip(
+    q32_t phi_meas_est = fp_asin(FP_MUL1( - state->sensor.say, KALMAN_M, KALMAN_M_FRAC_BITS));
+    state->sensor.sphi = fp_angle_wrap(
         FP_MUL1(phi_state_est, KALMAN_GYRO_WEIGHT, KALMAN_WEIGHT_FRAC_BITS) +
         FP_MUL1(phi_meas_est, KALMAN_ACC_WEIGHT, KALMAN_WEIGHT_FRAC_BITS));
 
     q32_t theta_state_est = state->sensor.stheta +
         FP_MUL1(T_CONST_RAW, state->sensor.sq, T_CONST_FRAC_BITS);
-    q32_t theta_meas_est = fp_asin_t1(FP_MUL1(state->sensor.sax, KALMAN_M, KALMAN_M_FRAC_BITS));
-    state->sensor.stheta = fp_angle_clip(
+    q32_t theta_meas_est = fp_asin(FP_MUL1(state->sensor.sax, KALMAN_M, KALMAN_M_FRAC_BITS));
+    state->sensor.stheta = fp_angle_wrap(
         FP_MUL1(theta_state_est, KALMAN_GYRO_WEIGHT, KALMAN_WEIGHT_FRAC_BITS) +
         FP_MUL1(theta_meas_est, KALMAN_ACC_WEIGHT, KALMAN_WEIGHT_FRAC_BITS));
 
-    state->sensor.spsi = fp_angle_clip(state->sensor.spsi +
+    state->sensor.spsi = fp_angle_wrap(state->sensor.spsi +
         FP_MUL1(T_CONST_RAW , state->sensor.sr, T_CONST_FRAC_BITS));
 
     // Task 2: Updating offset terms.
@@ -274,6 +284,10 @@ void qc_system_set_mode(qc_system_t* system, qc_mode_t mode) {
         return;
     }
 
+    // Don't keep log items only in RAM across mode changes. The log
+    // task programs them once the flash is done with any erase.
+    log_request_flush();
+
     qc_mode_t old_mode = system->mode;
     system->mode = mode;
     system->current_mode_table = &system->mode_tables[(int) mode];
@@ -284,101 +298,274 @@ void qc_system_set_mode(qc_system_t* system, qc_mode_t mode) {
         system->mode | (system->state->sensor.voltage << 16) );
 }
 
+/** =======================================================
+ *  qc_system_hist_part -- Fill a latency histogram message.
+ *  =======================================================
+ *  Fills in the next part of the latency histograms, so a
+ *  whole histogram takes MESSAGE_PROFILE_HIST_PART_STATS + 1
+ *  messages. Values are saturated to 16 bits.
+ *  Parameters:
+ *  - system: The system whose histograms to send.
+ *  - msg: The MESSAGE_PROFILE_HIST_ID message to fill in.
+ *  Author: Boldizsar Palotas
+**/
+void qc_system_hist_part(qc_system_t* system, message_t* msg) {
+    uint32_t index = system->hist_part / (MESSAGE_PROFILE_HIST_PART_STATS + 1);
+    uint32_t part = system->hist_part % (MESSAGE_PROFILE_HIST_PART_STATS + 1);
+    profile_hist_t* hist = &system->state->prof.hist[index];
+    profile_t* prof = &system->state->prof.pr[qc_state_hist_prof[index]];
+    MESSAGE_PROFILE_HIST_INDEX_VALUE(msg) = index;
+    MESSAGE_PROFILE_HIST_PART_VALUE(msg) = part;
+    if (part == MESSAGE_PROFILE_HIST_PART_STATS) {
+        uint32_t mean = profile_hist_mean(hist);
+        MESSAGE_PROFILE_HIST_MIN_VALUE(msg) = hist->count ?
+            (hist->min_delta < UINT16_MAX ? hist->min_delta : UINT16_MAX) : 0;
+        MESSAGE_PROFILE_HIST_MEAN_VALUE(msg) = mean < UINT16_MAX ? mean : UINT16_MAX;
+        MESSAGE_PROFILE_HIST_MAX_VALUE(msg) =
+            prof->max_delta < UINT16_MAX ? prof->max_delta : UINT16_MAX;
+    } else {
+        for (int i = 0; i < MESSAGE_PROFILE_HIST_PART_BINS; i++) {
+            int bin = part * MESSAGE_PROFILE_HIST_PART_BINS + i;
+            MESSAGE_PROFILE_HIST_BIN_VALUE(msg, i) =
+                bin < PROFILE_HIST_BINS ? hist->bin[bin] : 0;
+        }
+    }
+    system->hist_part++;
+    if (system->hist_part == QC_STATE_HIST_CNT * (MESSAGE_PROFILE_HIST_PART_STATS + 1))
+        system->hist_part = 0;
+}
+
+/** =======================================================
+ *  qc_system_sched_task -- Fill a task deadline message.
+ *  =======================================================
+ *  Fills in the deadline accounting of the next task, so all
+ *  of them are sent in QC_STATE_TASK_CNT messages.
+ *  Parameters:
+ *  - system: The system whose tasks to send.
+ *  - msg: The MESSAGE_SCHED_ID message to fill in.
+ *  Author: Boldizsar Palotas
+**/
+void qc_system_sched_task(qc_system_t* system, message_t* msg) {
+    uint32_t i = system->sched_task;
+    MESSAGE_SCHED_TASK_VALUE(msg) = i;
+    MESSAGE_SCHED_MISS_VALUE(msg) = system->state->sched.miss[i];
+    MESSAGE_SCHED_OVERRUN_VALUE(msg) = system->state->sched.overrun[i];
+    MESSAGE_SCHED_RESPONSE_VALUE(msg) = system->state->sched.response[i];
+    system->sched_task = (i + 1) % QC_STATE_TASK_CNT;
+}
+
+/** =======================================================
+ *  qc_system_trace_dump -- Send the next part of a trace dump.
+ *  =======================================================
+ *  Sends up to TRACE_DUMP_PER_TICK messages of the trace dump
+ *  in progress (see trace_dump_start), if any. Messages that
+ *  do not fit in the telemetry or the log are sent again in
+ *  the next tick.
+ *  Parameters:
+ *  - telemetry: The superframe of this tick.
+ *  Author: Boldizsar Palotas
+**/
+void qc_system_trace_dump(superframe_t* telemetry) {
+    message_t msg;
+    for (int i = 0; i < TRACE_DUMP_PER_TICK && trace_dump_next(&msg); i++) {
+        if (trace.dump == TRACE_DUMP_FLASH) {
+            if (!log_write(&msg))
+                break;
+        } else if (!serialcomm_superframe_add(telemetry, &msg)) {
+            break;
+        }
+        trace_dump_advance();
+    }
+}
+
+/** =======================================================
+ *  qc_system_time_mode_voltage -- Fill the time, mode and
+ *  voltage message.
+ *  =======================================================
+ *  Parameters:
+ *  - system: The system whose state to send.
+ *  - msg: The MESSAGE_TIME_MODE_VOLTAGE_ID message to fill in.
+ *  Author: Boldizsar Palotas
+**/
+void qc_system_time_mode_voltage(qc_system_t* system, message_t* msg) {
+    MESSAGE_TIME_VALUE(msg) = system->hal->get_time_us_fn();
+    MESSAGE_MODE_VALUE(msg) = system->mode;
+    MESSAGE_VOLTAGE_VALUE(msg) = system->state->sensor.voltage;
+}
+
+/** Telemetry message layout
+ *  One entry per loggable message ID. A message is either
+ *  filled in by fill_fn, or it is the listed state variables
+ *  packed one after the other into its value, up to the first
+ *  field with zero width.
+ *  ------------------
+ *  Fields (of qc_telemetry_field_t):
+ *  - offset: Offset of the variable in qc_state_t.
+ *  - size: Size of the variable, 2 or 4 bytes.
+ *  - shift: Right shift applied to the variable, for fixed
+ *      point variables the one of FP_CHUNK (see TM_CHUNK).
+ *  - width: Size of the field in the message, 2 or 4 bytes.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct qc_telemetry_field {
+    uint16_t    offset;
+    uint8_t     size;
+    uint8_t     shift;
+    uint8_t     width;
+} qc_telemetry_field_t;
+
+#define QC_TELEMETRY_FIELDS 4
+
+typedef struct qc_telemetry_msg {
+    void (*fill_fn)(qc_system_t*, message_t*);
+    qc_telemetry_field_t field[QC_TELEMETRY_FIELDS];
+} qc_telemetry_msg_t;
+
+#define TM_FIELD(var, shift, width) \
+    { offsetof(qc_state_t, var), sizeof(((qc_state_t*) 0)->var), (shift), (width) }
+// Shift of FP_CHUNK(var, fraca, fracb)
+#define TM_CHUNK(fraca, fracb) ((fracb) - (fraca))
+
+static void qc_system_telemetry_fill(qc_state_t* state, const qc_telemetry_msg_t* layout, message_t* msg);
+
+static const qc_telemetry_msg_t qc_telemetry[] = {
+    [MESSAGE_TIME_MODE_VOLTAGE_ID] = { qc_system_time_mode_voltage, {{0}} },
+    [MESSAGE_SPQR_ID] = { 0, {
+        TM_FIELD(sensor.sp, TM_CHUNK(8, 16), 2),
+        TM_FIELD(sensor.sq, TM_CHUNK(8, 16), 2),
+        TM_FIELD(sensor.sr, TM_CHUNK(8, 16), 2) } },
+    [MESSAGE_SAXYZ_ID] = { 0, {
+        TM_FIELD(sensor.sax, TM_CHUNK(8, 16), 2),
+        TM_FIELD(sensor.say, TM_CHUNK(8, 16), 2),
+        TM_FIELD(sensor.saz, TM_CHUNK(8, 16), 2) } },
+    [MESSAGE_S_ATT_ID] = { 0, {
+        TM_FIELD(sensor.sphi, TM_CHUNK(8, 16), 2),
+        TM_FIELD(sensor.stheta, TM_CHUNK(8, 16), 2),
+        TM_FIELD(sensor.spsi, TM_CHUNK(8, 16), 2) } },
+    [MESSAGE_AE1234_ID] = { 0, {
+        TM_FIELD(motor.ae1, 0, 2),
+        TM_FIELD(motor.ae2, 0, 2),
+        TM_FIELD(motor.ae3, 0, 2),
+        TM_FIELD(motor.ae4, 0, 2) } },
+    [MESSAGE_LMN_ID] = { 0, {
+        TM_FIELD(torque.L, TM_CHUNK(8, 16), 2),
+        TM_FIELD(torque.M, TM_CHUNK(8, 16), 2),
+        TM_FIELD(torque.N, TM_CHUNK(8, 16), 2) } },
+    [MESSAGE_PQR_ID] = { 0, {
+        TM_FIELD(spin.p, TM_CHUNK(8, 16), 2),
+        TM_FIELD(spin.q, TM_CHUNK(8, 16), 2),
+        TM_FIELD(spin.r, TM_CHUNK(8, 16), 2) } },
+    [MESSAGE_PHI_THETA_PSI_ID] = { 0, {
+        TM_FIELD(att.phi, TM_CHUNK(8, 16), 2),
+        TM_FIELD(att.theta, TM_CHUNK(8, 16), 2),
+        TM_FIELD(att.psi, TM_CHUNK(8, 16), 2) } },
+    [MESSAGE_SETPOINT_ID] = { 0, {
+        TM_FIELD(orient.lift, LIFT_SHIFT, 2),
+        TM_FIELD(orient.roll, ROLL_SHIFT, 2),
+        TM_FIELD(orient.pitch, PITCH_SHIFT, 2),
+        TM_FIELD(orient.yaw, YAW_SHIFT, 2) } },
+    [MESSAGE_Z_Z_PRES_ID] = { 0, {
+        TM_FIELD(pos.z, TM_CHUNK(8, 16), 2),
+        TM_FIELD(force.Z, TM_CHUNK(8, 16), 2),
+        TM_FIELD(sensor.pressure, 0, 4) } },
+    [MESSAGE_PROFILE_ID] = { 0, {
+        TM_FIELD(prof.pr[0].last_delta, 0, 2),
+        TM_FIELD(prof.pr[1].last_delta, 0, 2),
+        TM_FIELD(prof.pr[2].last_delta, 0, 2),
+        TM_FIELD(prof.pr[3].last_delta, 0, 2) } },
+    [MESSAGE_PROFILE_4_ID] = { 0, {
+        TM_FIELD(prof.pr[4].last_delta, 0, 2),
+        TM_FIELD(prof.pr[5].last_delta, 0, 2),
+        TM_FIELD(prof.pr[5].max_delta, 0, 2) } },
+    [MESSAGE_TX_DROP_ID] = { 0, {
+        TM_FIELD(comm.tx_drop_telemetry, 0, 2),
+        TM_FIELD(comm.tx_drop_text, 0, 2),
+        TM_FIELD(comm.tx_drop_control, 0, 2) } },
+    [MESSAGE_PROFILE_HIST_ID] = { qc_system_hist_part, {{0}} },
+    [MESSAGE_SCHED_ID] = { qc_system_sched_task, {{0}} },
+};
+
+#define QC_TELEMETRY_COUNT (sizeof(qc_telemetry) / sizeof(qc_telemetry[0]))
+
+/** =======================================================
+ *  qc_system_telemetry_fill -- Fill a message from its layout.
+ *  =======================================================
+ *  Parameters:
+ *  - state: The state to read the variables from.
+ *  - layout: The layout of the message (see qc_telemetry).
+ *  - msg: The message to fill in.
+ *  Author: Boldizsar Palotas
+**/
+void qc_system_telemetry_fill(qc_state_t* state, const qc_telemetry_msg_t* layout, message_t* msg) {
+    const uint8_t* src = (const uint8_t*) state;
+    uint8_t* dst = msg->value.v8;
+    msg->value.v32[0] = 0;
+    msg->value.v32[1] = 0;
+    for (int i = 0; i < QC_TELEMETRY_FIELDS && layout->field[i].width; i++) {
+        const qc_telemetry_field_t* field = &layout->field[i];
+        int32_t value = field->size == 4 ?
+            *(const int32_t*) (src + field->offset) :
+            *(const uint16_t*) (src + field->offset);
+        value >>= field->shift;
+        if (field->width == 4)
+            *(int32_t*) dst = value;
+        else
+            *(uint16_t*) dst = value;
+        dst += field->width;
+    }
+}
+
 /** =======================================================
  *  qc_system_log_data -- Do logging and telemetry collection.
  *  =======================================================
  *  Logs and/or sends the desired telemetry based on the bit
- *  mask set by the user.
+ *  mask set by the user. Telemetry messages are packed into
+ *  one superframe per call. Only the messages selected by
+ *  either mask are filled in, see qc_telemetry. Also runs
+ *  the log task, which programs a requested flush.
  *
  *  Parameters:
  *  - system: The system from which to log the data.
  *  Author: Boldizsar Palotas
 **/
 void qc_system_log_data(qc_system_t* system) {
-    int send_cnt = 0;
-    uint32_t bit_mask, index;
-    for (bit_mask = 0x01, index = 0; bit_mask; bit_mask = bit_mask << 1, index++) {
+    superframe_t telemetry;
+    uint32_t log_mask = system->do_logging ? system->log_mask : 0;
+    uint32_t mask = (system->telemetry_mask | log_mask) & ((1ul << QC_TELEMETRY_COUNT) - 1);
+    serialcomm_superframe_clear(&telemetry);
+    while (mask) {
+        // A libgcc call on the Cortex-M0, which has no CLZ, but only
+        // one per selected message
+        uint32_t index = __builtin_ctz(mask);
+        uint32_t bit_mask = 1ul << index;
+        const qc_telemetry_msg_t* layout = &qc_telemetry[index];
         message_t msg;
+        mask &= mask - 1;
+        if (layout->fill_fn)
+            layout->fill_fn(system, &msg);
+        else if (layout->field[0].width)
+            qc_system_telemetry_fill(system->state, layout, &msg);
+        else
+            continue;
         msg.ID = index;
-        switch (index) {
-            case MESSAGE_TIME_MODE_VOLTAGE_ID:
-                MESSAGE_TIME_VALUE(&msg) = system->hal->get_time_us_fn();
-                MESSAGE_MODE_VALUE(&msg) = system->mode;
-                MESSAGE_VOLTAGE_VALUE(&msg) = system->state->sensor.voltage;
-                break;
-            case MESSAGE_SETPOINT_ID:
-                MESSAGE_SETPOINT_LIFT_VALUE(&msg)   = system->state->orient.lift >> LIFT_SHIFT;
-                MESSAGE_SETPOINT_ROLL_VALUE(&msg)   = system->state->orient.roll >> ROLL_SHIFT;
-                MESSAGE_SETPOINT_PITCH_VALUE(&msg)  = system->state->orient.pitch >> PITCH_SHIFT;
-                MESSAGE_SETPOINT_YAW_VALUE(&msg)    = system->state->orient.yaw >> YAW_SHIFT;
-                break;
-            case MESSAGE_SPQR_ID:
-                MESSAGE_SP_VALUE(&msg) = FP_CHUNK(system->state->sensor.sp, 8, 16);
-                MESSAGE_SQ_VALUE(&msg) = FP_CHUNK(system->state->sensor.sq, 8, 16);
-                MESSAGE_SR_VALUE(&msg) = FP_CHUNK(system->state->sensor.sr, 8, 16);
-                break;
-            case MESSAGE_SAXYZ_ID:
-                MESSAGE_SAX_VALUE(&msg) = FP_CHUNK(system->state->sensor.sax, 8, 16);
-                MESSAGE_SAY_VALUE(&msg) = FP_CHUNK(system->state->sensor.say, 8, 16);
-                MESSAGE_SAZ_VALUE(&msg) = FP_CHUNK(system->state->sensor.saz, 8, 16);
-                break;
-            case MESSAGE_AE1234_ID:
-                MESSAGE_AE1_VALUE(&msg) = system->state->motor.ae1;
-                MESSAGE_AE2_VALUE(&msg) = system->state->motor.ae2;
-                MESSAGE_AE3_VALUE(&msg) = system->state->motor.ae3;
-                MESSAGE_AE4_VALUE(&msg) = system->state->motor.ae4;
-                break;
-            case MESSAGE_Z_Z_PRES_ID:
-                MESSAGE_ZPOS_VALUE(&msg) = FP_CHUNK(system->state->pos.z, 8, 16);
-                MESSAGE_ZFORCE_VALUE(&msg) = FP_CHUNK(system->state->force.Z, 8, 16);
-                MESSAGE_PRES_VALUE(&msg) = system->state->sensor.pressure;
-                break;
-            case MESSAGE_PHI_THETA_PSI_ID:
-                MESSAGE_PHI_VALUE(&msg)     = FP_CHUNK(system->state->att.phi, 8, 16);
-                MESSAGE_THETA_VALUE(&msg)   = FP_CHUNK(system->state->att.theta, 8, 16);
-                MESSAGE_PSI_VALUE(&msg)     = FP_CHUNK(system->state->att.psi, 8, 16);
-                break;
-            case MESSAGE_LMN_ID:
-                MESSAGE_L_VALUE(&msg) = FP_CHUNK(system->state->torque.L, 8, 16);
-                MESSAGE_M_VALUE(&msg) = FP_CHUNK(system->state->torque.M, 8, 16);
-                MESSAGE_N_VALUE(&msg) = FP_CHUNK(system->state->torque.N, 8, 16);
-                break;
-            case MESSAGE_PQR_ID:
-                MESSAGE_P_VALUE(&msg) = FP_CHUNK(system->state->spin.p, 8, 16);
-                MESSAGE_Q_VALUE(&msg) = FP_CHUNK(system->state->spin.q, 8, 16);
-                MESSAGE_R_VALUE(&msg) = FP_CHUNK(system->state->spin.r, 8, 16);
-                break;
-            case MESSAGE_S_ATT_ID:
-                MESSAGE_S_PHI_VALUE(&msg)   = FP_CHUNK(system->state->sensor.sphi, 8, 16);
-                MESSAGE_S_THETA_VALUE(&msg) = FP_CHUNK(system->state->sensor.stheta, 8, 16);
-                MESSAGE_S_PSI_VALUE(&msg)   = FP_CHUNK(system->state->sensor.spsi, 8, 16);
-                break;
-            case MESSAGE_PROFILE_ID:
-                MESSAGE_PROFILE_0_VALUE(&msg) = system->state->prof.pr[0].last_delta;
-                MESSAGE_PROFILE_1_VALUE(&msg) = system->state->prof.pr[1].last_delta;
-                MESSAGE_PROFILE_2_VALUE(&msg) = system->state->prof.pr[2].last_delta;
-                MESSAGE_PROFILE_3_VALUE(&msg) = system->state->prof.pr[3].last_delta;
-                break;
-            case MESSAGE_PROFILE_4_ID:
-                MESSAGE_PROFILE_4_VALUE(&msg) = system->state->prof.pr[4].last_delta;
-                break;
-            default:
-                continue;
-                break;
-        }
 
-        if (system->do_logging && system->log_mask & bit_mask) {
+        if (log_mask & bit_mask) {
             log_write(&msg);
         }
 
         if (system->telemetry_mask & bit_mask) {
-            send_cnt++;
-            if (10 < send_cnt) {
+            if (!serialcomm_superframe_add(&telemetry, &msg)) {
                 system->telemetry_mask = system->telemetry_mask & (bit_mask - 1);
                 printf("Too many messages, TELEMETRY MASK automatically reset to %#"PRIx32"!\n", system->telemetry_mask);
                 break;
             }
-            serialcomm_quick_send(system->serialcomm, msg.ID, msg.value.v32[0], msg.value.v32[1]);
         }
     }
+
+    qc_system_trace_dump(&telemetry);
+
+    // All telemetry of this tick goes out in a single superframe.
+    serialcomm_send_superframe(system->serialcomm, &telemetry);
+
+    log_task();
 }
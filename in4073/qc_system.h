@@ -68,6 +68,10 @@ struct serialcomm;
  *          processes all incoming messages (commands).
  *      - serialcomm: Pointer to the serial communication
  *          module for transmitting messages to the PC.
+ *      - hist_part: The next latency histogram part to send,
+ *          see MESSAGE_PROFILE_HIST_ID.
+ *      - sched_task: The next task whose deadline accounting
+ *          to send, see MESSAGE_SCHED_ID.
  *  Author: Boldizsar Palotas
 **/
 typedef struct qc_system {
@@ -81,6 +85,8 @@ typedef struct qc_system {
     uint32_t            do_logging;
     uint32_t            log_mask;
     uint32_t            telemetry_mask;
+    uint32_t            hist_part;
+    uint32_t            sched_task;
 } qc_system_t;
 
 void qc_system_init(qc_system_t* system,
@@ -0,0 +1,85 @@
+#include "sched.h"
+
+/** =======================================================
+ *  sched_init -- Initialize the task scheduler.
+ *  =======================================================
+ *  Parameters:
+ *  - sched: The scheduler to initialize.
+ *  - task, count: The task table, none of them released.
+ *  - stats: Where the misses and overruns are counted.
+ *  - get_time_us_fn: The clock to measure the tasks with.
+ *  Author: Boldizsar Palotas
+**/
+void sched_init(sched_t* sched, sched_task_t* task, int count,
+        qc_state_sched_t* stats, uint32_t (*get_time_us_fn)(void)) {
+    sched->task = task;
+    sched->count = count < QC_STATE_TASK_CNT ? count : QC_STATE_TASK_CNT;
+    sched->stats = stats;
+    sched->get_time_us_fn = get_time_us_fn;
+    uint32_t now = get_time_us_fn();
+    for (int i = 0; i < sched->count; i++) {
+        task[i].released = false;
+        task[i].release = now;
+    }
+}
+
+/** =======================================================
+ *  sched_next -- Pick the next task to run.
+ *  =======================================================
+ *  Polls the triggers of the tasks not released yet, so the
+ *  release time of a task is taken when its work is first
+ *  seen even if a higher priority task runs first. Periodic
+ *  tasks are released every period since sched_init, but
+ *  only as often as the main loop wakes up.
+ *  Parameters:
+ *  - sched: The scheduler.
+ *  Returns: The released task with the highest priority, NULL
+ *      if there is nothing to do.
+ *  Author: Boldizsar Palotas
+**/
+sched_task_t* sched_next(sched_t* sched) {
+    sched_task_t* next = 0;
+    uint32_t now = sched->get_time_us_fn();
+    for (int i = 0; i < sched->count; i++) {
+        sched_task_t* task = &sched->task[i];
+        if (!task->released && task->ready_fn) {
+            task->release = now;
+            task->released = task->ready_fn(&task->release);
+        } else if (!task->released && task->period <= now - task->release) {
+            task->release += task->period;
+            task->released = true;
+        }
+        if (task->released && (!next || next->priority < task->priority))
+            next = task;
+    }
+    return next;
+}
+
+/** =======================================================
+ *  sched_run -- Run a task and account for its timing.
+ *  =======================================================
+ *  Counts an overrun if the run took longer than the budget
+ *  and, once the task is done, a miss if it completed after
+ *  its deadline. Times are saturated to 16 bits.
+ *  Parameters:
+ *  - sched: The scheduler.
+ *  - task: The task returned by sched_next.
+ *  Author: Boldizsar Palotas
+**/
+void sched_run(sched_t* sched, sched_task_t* task) {
+    int i = task - sched->task;
+    uint32_t start = sched->get_time_us_fn();
+    bool done = task->run_fn();
+    uint32_t end = sched->get_time_us_fn();
+
+    if (task->budget < end - start && sched->stats->overrun[i] < UINT16_MAX)
+        sched->stats->overrun[i]++;
+    if (!done)
+        return;
+    task->released = false;
+    uint32_t response = end - task->release;
+    if (task->deadline < response && sched->stats->miss[i] < UINT16_MAX)
+        sched->stats->miss[i]++;
+    if (sched->stats->response[i] < response)
+        sched->stats->response[i] = response < UINT16_MAX ? response : UINT16_MAX;
+}
@@ -0,0 +1,83 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "qc_state.h"
+
+/** TASK SCHEDULER
+ *
+ *  The main loop runs the tasks of a static table, one at a
+ *  time and each to completion. A task is released when its
+ *  trigger (ready_fn) fires or, without a trigger, once every
+ *  period. The dispatcher (sched_next) then picks the released
+ *  task with the highest priority. Lower priority tasks only
+ *  delay a task by the length of a single run, so the budget
+ *  of every task bounds the latency of the ones above it.
+ *
+ *  The priorities are rate monotonic, or rather deadline
+ *  monotonic: the shorter the deadline, the higher the
+ *  priority, which is the same for tasks whose deadline is
+ *  their period. Every run is checked against the budget of
+ *  the task, the worst case execution time it is allowed, and
+ *  its completion against the deadline, counted from its
+ *  release. Overruns and misses are counted per task in
+ *  qc_state_sched_t and sent with the telemetry
+ *  (MESSAGE_SCHED_ID).
+ *  Author: Boldizsar Palotas
+**/
+
+/** sched_task_t
+ *  -------------------
+ *  Fields:
+ *  - ready_fn: The trigger, returns true if the task has work.
+ *      The release time is preset to now, the trigger may set
+ *      it earlier, e.g. to the time of an interrupt. NULL for
+ *      a periodic task.
+ *  - run_fn: The task, returns false if the work is not done
+ *      yet: then it stays released and runs again.
+ *  - period: Period of a periodic task, the minimum
+ *      interarrival time of a triggered one in us.
+ *  - deadline: Time from the release to the completion in us.
+ *  - budget: Worst case execution time of one run in us.
+ *  - priority: Higher priority tasks are run first.
+ *  - trace_id: ID of the task in the event trace (see trace.h).
+ *  - released: The task has been triggered and is not done yet.
+ *  - release: Time of the release.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sched_task {
+    bool        (*ready_fn)(uint32_t* release);
+    bool        (*run_fn)(void);
+    uint32_t    period;
+    uint32_t    deadline;
+    uint32_t    budget;
+    uint8_t     priority;
+    uint8_t     trace_id;
+    bool        released;
+    uint32_t    release;
+} sched_task_t;
+
+/** sched_t
+ *  -------------------
+ *  Fields:
+ *  - task, count: The task table, at most QC_STATE_TASK_CNT.
+ *  - stats: Deadline accounting, indexed like the table.
+ *  - get_time_us_fn: The clock of the releases and runs.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sched {
+    sched_task_t*       task;
+    int                 count;
+    qc_state_sched_t*   stats;
+    uint32_t            (*get_time_us_fn)(void);
+} sched_t;
+
+void sched_init(sched_t* sched, sched_task_t* task, int count,
+    qc_state_sched_t* stats, uint32_t (*get_time_us_fn)(void));
+
+sched_task_t* sched_next(sched_t* sched);
+
+void sched_run(sched_t* sched, sched_task_t* task);
+
+#endif // SCHED_H
@@ -2,7 +2,58 @@
 #include "common.h"
 
 static void serialcomm_rx_end(serialcomm_t* sc, uint8_t received_checksum);
+static void serialcomm_rx_super_char(serialcomm_t* sc, uint8_t c);
+static void serialcomm_rx_super_end(serialcomm_t* sc, uint8_t received_checksum);
+static void serialcomm_rx_error(serialcomm_t* sc);
+static void serialcomm_count_start(serialcomm_t* sc, uint8_t c);
 static uint8_t frame_checksum(frame_t* frame);
+static uint8_t superframe_checksum(uint8_t id, superframe_t* sf);
+static inline uint8_t checksum_update(uint8_t chkbuf, uint8_t c);
+static void serialcomm_tx_packet(serialcomm_t* sc, uint8_t id, uint8_t* buf, int size);
+static void serialcomm_tx_bytes(serialcomm_t* sc, uint8_t id, uint8_t* buf, int size);
+#if SERIALCOMM_FRAMING == SERIALCOMM_FRAMING_COBS
+static void serialcomm_cobs_receive_char(serialcomm_t* sc, uint8_t c);
+static void serialcomm_cobs_rx_end(serialcomm_t* sc);
+#endif
+
+#if SERIALCOMM_CHECKSUM == SERIALCOMM_CHECKSUM_CRC8
+    // CRC-8 lookup table for the polynomial x^8 + x^2 + x + 1 (0x07).
+    // Being const it is kept in flash on the quadcopter.
+    static const uint8_t crc8_table[256] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+    0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+    0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+    0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+    0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5,
+    0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85,
+    0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+    0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+    0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+    0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2,
+    0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32,
+    0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+    0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+    0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+    0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C,
+    0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC,
+    0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+    0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+    0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+    0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C,
+    0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B,
+    0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+    0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+    0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+    0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB,
+    0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB,
+    0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3
+    };
+#endif
 
 /*----------------------------------------------------------------
  *  serialcomm_init -- Initialize a serial communication channel.
@@ -16,10 +67,21 @@ void serialcomm_init(serialcomm_t* sc) {
     sc->status                  = SERIALCOMM_STATUS_Prestart;
     sc->rx_frame                = (frame_t*) 0;
     sc->tx_frame                = (frame_t*) 0;
+    sc->rx_superframe           = (superframe_t*) 0;
+    sc->rx_super                = false;
+    sc->rx_bulk                 = false;
+    sc->rx_super_len            = -1;
     sc->rx_cnt                  = 0;
     sc->start_cnt               = 0;
+#if SERIALCOMM_FRAMING == SERIALCOMM_FRAMING_COBS
+    sc->status                  = SERIALCOMM_STATUS_OK;
+    sc->rx_cobs_left            = 0;
+    sc->rx_cobs_code            = 0;
+#endif
     sc->rx_complete_callback    = (void (*)(message_t*)) 0;
+    sc->rx_bulk_callback        = (void (*)(uint32_t, uint8_t*, int)) 0;
     sc->tx_byte                 = (void (*)(uint8_t)) 0;
+    sc->tx_frame_fn             = (void (*)(uint8_t, uint8_t*, int)) 0;
 }
 
 /*----------------------------------------------------------------
@@ -43,10 +105,18 @@ void serialcomm_send_restart_request(serialcomm_t* sc) {
  *      - sc: pointer to the channel state variable.
  *  Returns: void
  *  Author: Boldizsar Palotas
+ *
+ *  With COBS framing a single delimiter is sent instead, which
+ *  terminates any partially received frame at the other end.
  */
 void serialcomm_send_start(serialcomm_t* sc) {
+#if SERIALCOMM_FRAMING == SERIALCOMM_FRAMING_COBS
+    uint8_t delimiter = FRAME_COBS_DELIMITER;
+    serialcomm_tx_bytes(sc, FRAME_START_ID, &delimiter, 1);
+#else
     serialcomm_quick_send(sc, FRAME_START_ID,
             FRAME_START_VALUE32, FRAME_START_VALUE32);
+#endif
 }
 
 /*----------------------------------------------------------------
@@ -64,7 +134,9 @@ void serialcomm_send_start(serialcomm_t* sc) {
  *  
  *  In SERIALCOMM_STATUS_OK the bytes are saved in the rx_buffer
  *  until the checksum is recieved, then the frame is processed
- *  as a whole.
+ *  as a whole. A frame starting with FRAME_SUPER_ID or
+ *  FRAME_BULK_ID is received as a superframe if an rx_superframe
+ *  buffer is available.
  *
  *  In SERIALCOMM_STATUS_Prestart we wait for at least FRAME_SIZE
  *  consecutive FRAME_START_VALUE bytes (a start frame).
@@ -74,9 +146,20 @@ void serialcomm_send_start(serialcomm_t* sc) {
  *  SERIALCOMM_STATUS_OK.
  *
  *  In SERIALCOMM_STATUS_Off the byte is disregarded.
+ *
+ *  With COBS framing the status is always SERIALCOMM_STATUS_OK
+ *  and the byte is handled by serialcomm_cobs_receive_char.
  */
  void serialcomm_receive_char(serialcomm_t* sc, uint8_t c) {
+#if SERIALCOMM_FRAMING == SERIALCOMM_FRAMING_COBS
+    serialcomm_cobs_receive_char(sc, c);
+    return;
+#endif
     if (sc->status == SERIALCOMM_STATUS_OK) {
+        if (sc->rx_super) {
+            serialcomm_rx_super_char(sc, c);
+            return;
+        }
         // Normal operation: fill buffer
         if (sc->rx_cnt == MESSAGE_SIZE) {   // End of frame
             serialcomm_rx_end(sc, c);
@@ -84,20 +167,18 @@ void serialcomm_send_start(serialcomm_t* sc) {
             return;
         }
         if (sc->rx_cnt == 0) {
-            sc->rx_frame->message.ID = c;
-            sc->rx_cnt++;
-        } else {
-            sc->rx_frame->message.value.v8[sc->rx_cnt++ - 1] = c;
-        }
-        if (c == FRAME_START_VALUE) {
-            sc->start_cnt++;
-            if (sc->start_cnt == FRAME_SIZE) {
-                sc->status = SERIALCOMM_STATUS_Start;
-                sc->start_cnt = 0;
+            if ((c == FRAME_SUPER_ID || c == FRAME_BULK_ID) && sc->rx_superframe) {
+                sc->rx_super = true;
+                sc->rx_bulk = c == FRAME_BULK_ID;
+                sc->rx_super_len = -1;
+            } else {
+                sc->rx_frame->message.ID = c;
+                sc->rx_cnt++;
             }
         } else {
-            sc->start_cnt = 0;
+            sc->rx_frame->message.value.v8[sc->rx_cnt++ - 1] = c;
         }
+        serialcomm_count_start(sc, c);
     } else if (sc->status == SERIALCOMM_STATUS_Prestart) {
         // Error: wait for at least a full START FRAME
         if (c == FRAME_START_VALUE) {
@@ -112,12 +193,159 @@ void serialcomm_send_start(serialcomm_t* sc) {
         // After error: wait for start of first frame that is not a START FRAME
         if (c != FRAME_START_VALUE) {
             sc->status = SERIALCOMM_STATUS_OK;
-            sc->rx_frame->message.ID = c;
-            sc->rx_cnt = 1;
+            sc->rx_cnt = 0;
+            serialcomm_receive_char(sc, c);
+        }
+    }
+}
+
+#if SERIALCOMM_FRAMING == SERIALCOMM_FRAMING_COBS
+/*----------------------------------------------------------------
+ *  serialcomm_cobs_receive_char -- Handles receiving a byte in
+ *  COBS framing mode.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - c: the received byte
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  The frame is decoded into rx_buf on the fly. Each COBS block
+ *  starts with a code byte n meaning n - 1 data bytes follow and
+ *  then a zero byte, except if n is 0xFF or the block is the last
+ *  one. A FRAME_COBS_DELIMITER ends the frame. Frames that are
+ *  too long are dropped (rx_cnt is -1 until the next delimiter).
+ */
+void serialcomm_cobs_receive_char(serialcomm_t* sc, uint8_t c) {
+    if (c == FRAME_COBS_DELIMITER) {
+        if (0 < sc->rx_cnt && sc->rx_cobs_left == 0) {
+            serialcomm_cobs_rx_end(sc);
+        }
+        sc->rx_cnt = 0;
+        sc->rx_cobs_left = 0;
+        sc->rx_cobs_code = 0;
+        return;
+    }
+    if (sc->rx_cnt < 0)
+        return;
+
+    if (sc->rx_cobs_left == 0) {
+        // Code byte: the previous block (if any) ended with an
+        // implicit zero unless it was a full 0xFF block
+        if (sc->rx_cobs_code && sc->rx_cobs_code != 0xFF) {
+            if (sc->rx_cnt == FRAME_MAX_SIZE) {
+                sc->rx_cnt = -1;
+                return;
+            }
+            sc->rx_buf[sc->rx_cnt++] = 0;
+        }
+        sc->rx_cobs_code = c;
+        sc->rx_cobs_left = c - 1;
+    } else {
+        if (sc->rx_cnt == FRAME_MAX_SIZE) {
+            sc->rx_cnt = -1;
+            return;
+        }
+        sc->rx_buf[sc->rx_cnt++] = c;
+        sc->rx_cobs_left--;
+    }
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_cobs_rx_end -- Handles a whole COBS decoded frame.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  The decoded bytes in rx_buf are either a regular frame or a
+ *  superframe (or bulk frame) and are passed to serialcomm_rx_end
+ *  or serialcomm_rx_super_end respectively. Frames of any other
+ *  length are dropped.
+ */
+void serialcomm_cobs_rx_end(serialcomm_t* sc) {
+    int i, size = sc->rx_cnt;
+    if ((sc->rx_buf[0] == FRAME_SUPER_ID || sc->rx_buf[0] == FRAME_BULK_ID)
+            && sc->rx_superframe) {
+        sc->rx_bulk = sc->rx_buf[0] == FRAME_BULK_ID;
+        if (size < 3 || sc->rx_buf[1] != size - 3)
+            return;
+        sc->rx_superframe->size = sc->rx_buf[1];
+        for (i = 0; i < sc->rx_superframe->size; i++) {
+            sc->rx_superframe->data[i] = sc->rx_buf[i + 2];
+        }
+        serialcomm_rx_super_end(sc, sc->rx_buf[size - 1]);
+    } else if (size == FRAME_SIZE) {
+        sc->rx_frame->message.ID = sc->rx_buf[0];
+        for (i = 0; i < MESSAGE_VALUE_SIZE; i++) {
+            sc->rx_frame->message.value.v8[i] = sc->rx_buf[i + 1];
         }
+        serialcomm_rx_end(sc, sc->rx_buf[FRAME_SIZE - 1]);
     }
 }
+#endif // SERIALCOMM_FRAMING_COBS
 
+/*----------------------------------------------------------------
+ *  serialcomm_count_start -- Detect start frames within the
+ *  stream of received bytes.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - c: the received byte
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ */
+void serialcomm_count_start(serialcomm_t* sc, uint8_t c) {
+    if (c == FRAME_START_VALUE) {
+        sc->start_cnt++;
+        if (sc->start_cnt == FRAME_SIZE) {
+            sc->status = SERIALCOMM_STATUS_Start;
+            sc->rx_super = false;
+            sc->start_cnt = 0;
+        }
+    } else {
+        sc->start_cnt = 0;
+    }
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_rx_super_char -- Handles receiving a byte of a
+ *  superframe.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - c: the received byte
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  The first byte after FRAME_SUPER_ID is the payload length,
+ *  then the payload follows and the last byte is the checksum.
+ *
+ *  Start frames are not looked for within superframes and bulk
+ *  frames: their payload is arbitrary data, where runs of
+ *  FRAME_START_VALUE bytes (-1 values, erased flash, log padding)
+ *  are common. The length is at most SUPERFRAME_DATA_SIZE, so a
+ *  corrupt frame still ends soon and fails its checksum.
+ */
+void serialcomm_rx_super_char(serialcomm_t* sc, uint8_t c) {
+    if (sc->rx_super_len < 0) {
+        if (SUPERFRAME_DATA_SIZE < c) {
+            sc->rx_super = false;
+            serialcomm_rx_error(sc);
+            return;
+        }
+        sc->rx_super_len = c;
+        sc->rx_cnt = 0;
+    } else if (sc->rx_cnt < sc->rx_super_len) {
+        sc->rx_superframe->data[sc->rx_cnt++] = c;
+    } else {
+        sc->rx_superframe->size = sc->rx_super_len;
+        sc->rx_super = false;
+        sc->rx_cnt = 0;
+        serialcomm_rx_super_end(sc, c);
+    }
+}
 /*----------------------------------------------------------------
  *  serialcomm_rx_end -- Handles the receiving of a whole frame.
  *----------------------------------------------------------------
@@ -154,15 +382,96 @@ void serialcomm_rx_end(serialcomm_t* sc, uint8_t received_checksum) {
             }
         }
     } else {
-        // Here we have a checksum error. Go into prestart mode and request a start frame.
-        sc->status = SERIALCOMM_STATUS_Prestart;
-        // Send a start frame anticipating that the connection might have been lost
-        // and the receiver could be in Prestart status.
-        serialcomm_send_start(sc);
-        serialcomm_send_restart_request(sc);
+        serialcomm_rx_error(sc);
     }
 }
 
+/*----------------------------------------------------------------
+ *  serialcomm_rx_super_end -- Handles the receiving of a whole
+ *  superframe.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - received_checksum: the checksum received as the last
+ *      byte of the superframe.
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  If the checksum is correct, the packed messages are unpacked
+ *  and passed one by one to rx_complete_callback, followed by a
+ *  MESSAGE_SUPERFRAME_END_ID message. The data of bulk frames is
+ *  passed to rx_bulk_callback instead. Otherwise the checksum
+ *  error is handled the same way as for regular frames.
+ */
+void serialcomm_rx_super_end(serialcomm_t* sc, uint8_t received_checksum) {
+    superframe_t* sf = sc->rx_superframe;
+    uint8_t id = sc->rx_bulk ? FRAME_BULK_ID : FRAME_SUPER_ID;
+    if (superframe_checksum(id, sf) != received_checksum) {
+        serialcomm_rx_error(sc);
+        return;
+    }
+    if (sc->rx_bulk) {
+        if (sc->rx_bulk_callback && BULK_OFFSET_SIZE <= sf->size) {
+            uint32_t offset = sf->data[0]
+                    | (uint32_t) sf->data[1] << 8
+                    | (uint32_t) sf->data[2] << 16
+                    | (uint32_t) sf->data[3] << 24;
+            sc->rx_bulk_callback(offset, &sf->data[BULK_OFFSET_SIZE],
+                    sf->size - BULK_OFFSET_SIZE);
+        }
+        return;
+    }
+    if (!sc->rx_complete_callback)
+        return;
+
+    message_t msg;
+    int i = 0, count = 0;
+    while (i < sf->size) {
+        uint8_t j, size = serialcomm_value_size(sf->data[i]);
+        if (sf->size < i + 1 + size)
+            break; // Malformed, ignore the rest
+        msg.ID = sf->data[i++];
+        msg.value.v32[0] = 0;
+        msg.value.v32[1] = 0;
+        for (j = 0; j < size; j++)
+            msg.value.v8[j] = sf->data[i++];
+        sc->rx_complete_callback(&msg);
+        count++;
+    }
+    msg.ID = MESSAGE_SUPERFRAME_END_ID;
+    msg.value.v32[0] = 0;
+    msg.value.v32[1] = 0;
+    MESSAGE_SUPERFRAME_END_COUNT_VALUE(&msg) = count;
+    sc->rx_complete_callback(&msg);
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_rx_error -- Handles a corrupted frame.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  A currupted channel is assumed and the status is reverted to
+ *  Prestart until a new start frame is received. This start frame
+ *  is also requested here.
+ *
+ *  With COBS framing the frame is simply dropped, the next
+ *  delimiter resynchronises the channel.
+ */
+void serialcomm_rx_error(serialcomm_t* sc) {
+#if SERIALCOMM_FRAMING != SERIALCOMM_FRAMING_COBS
+    // Here we have a checksum error. Go into prestart mode and request a start frame.
+    sc->status = SERIALCOMM_STATUS_Prestart;
+    sc->rx_cnt = 0;
+    // Send a start frame anticipating that the connection might have been lost
+    // and the receiver could be in Prestart status.
+    serialcomm_send_start(sc);
+    serialcomm_send_restart_request(sc);
+#endif
+}
+
 /*----------------------------------------------------------------
  *  serialcomm_quick_send -- Sends a frame.
  *----------------------------------------------------------------
@@ -185,6 +494,25 @@ void serialcomm_quick_send(serialcomm_t* sc, uint8_t id, uint32_t value_a, uint3
     sc->tx_frame = old_frame;
 }
 
+/*----------------------------------------------------------------
+ *  checksum_update -- Adds a byte to a running checksum.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - chkbuf: the checksum of the bytes so far
+ *      - c: the next byte
+ *  Returns: The checksum including c
+ *  Author: Boldizsar Palotas
+ *
+ *  The algorithm is selected by SERIALCOMM_CHECKSUM.
+ */
+uint8_t checksum_update(uint8_t chkbuf, uint8_t c) {
+#if SERIALCOMM_CHECKSUM == SERIALCOMM_CHECKSUM_CRC8
+    return crc8_table[chkbuf ^ c];
+#else
+    return chkbuf ^ c;
+#endif
+}
+
 /*----------------------------------------------------------------
  *  frame_checksum -- Calculates the checksum of a message.
  *----------------------------------------------------------------
@@ -194,19 +522,21 @@ void serialcomm_quick_send(serialcomm_t* sc, uint8_t id, uint32_t value_a, uint3
  *  Returns: The checksum of the frame
  *  Author: Boldizsar Palotas
  *
- *  The checksum is the XOR-ed result of the message ID and all
- *  value bytes.
+ *  The checksum is calculated over the message ID and all value
+ *  bytes with the algorithm selected by SERIALCOMM_CHECKSUM.
  *
- *  Note: if we change the checksum algorithm in a way that the checksum
- *  of a START frame becomes something else than 0xFF then we should
- *  handle receiving that byte separately in the serialcomm_receive_char
- *  function in the Prestart and Start branches.
+ *  The checksum of a START frame is always FRAME_START_VALUE so
+ *  that a START frame consists of FRAME_SIZE FRAME_START_VALUE
+ *  bytes regardless of the algorithm. The Prestart and Start
+ *  branches of serialcomm_receive_char depend on this.
  */
 uint8_t frame_checksum(frame_t* frame) {
-	 int i;
-    uint8_t chkbuf = frame->message.ID;
+    int i;
+    if (frame->message.ID == FRAME_START_ID)
+        return FRAME_START_VALUE;
+    uint8_t chkbuf = checksum_update(0, frame->message.ID);
     for (i = 0; i < MESSAGE_VALUE_SIZE; i++) {
-        chkbuf ^= frame->message.value.v8[i];
+        chkbuf = checksum_update(chkbuf, frame->message.value.v8[i]);
     }
     return chkbuf;
 }
@@ -220,16 +550,219 @@ uint8_t frame_checksum(frame_t* frame) {
  *  Author: Boldizsar Palotas
  */
 void serialcomm_send(serialcomm_t* sc) {
-	int tx_ptr;
-    if (sc->tx_byte == 0)
+    int i;
+    uint8_t buf[FRAME_SIZE];
+    if (sc->tx_byte == 0 && sc->tx_frame_fn == 0)
         return;
-    sc->tx_byte(sc->tx_frame->message.ID);
-    for (tx_ptr = 0; tx_ptr < MESSAGE_VALUE_SIZE; tx_ptr++) {
-        uint8_t c = sc->tx_frame->message.value.v8[tx_ptr];
-        sc->tx_byte(c);
+    buf[0] = sc->tx_frame->message.ID;
+    for (i = 0; i < MESSAGE_VALUE_SIZE; i++) {
+        buf[i + 1] = sc->tx_frame->message.value.v8[i];
     }
     sc->tx_frame->checksum = frame_checksum(sc->tx_frame);
-    sc->tx_byte(sc->tx_frame->checksum);
+    buf[FRAME_SIZE - 1] = sc->tx_frame->checksum;
+    serialcomm_tx_packet(sc, buf[0], buf, FRAME_SIZE);
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_tx_packet -- Transmits the bytes of a whole frame.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - id: the ID of the frame (FRAME_SUPER_ID for superframes)
+ *      - buf: the bytes of the frame including the checksum
+ *      - size: the number of bytes in buf
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  With START framing the bytes are sent as they are. With COBS
+ *  framing they are encoded and followed by a delimiter. As size
+ *  is at most FRAME_MAX_SIZE, no block is longer than 254 bytes.
+ */
+void serialcomm_tx_packet(serialcomm_t* sc, uint8_t id, uint8_t* buf, int size) {
+#if SERIALCOMM_FRAMING == SERIALCOMM_FRAMING_COBS
+    uint8_t out[FRAME_MAX_ENCODED_SIZE];
+    int i, n = 0, start = 0, end;
+    while (start <= size) {
+        for (end = start; end < size && buf[end] != 0; end++) { }
+        out[n++] = end - start + 1;
+        for (i = start; i < end; i++) {
+            out[n++] = buf[i];
+        }
+        start = end + 1;
+    }
+    out[n++] = FRAME_COBS_DELIMITER;
+    serialcomm_tx_bytes(sc, id, out, n);
+#else
+    serialcomm_tx_bytes(sc, id, buf, size);
+#endif
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_tx_bytes -- Hands the encoded bytes of a frame to
+ *  the underlying serial channel.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - id: the ID of the frame
+ *      - buf: the encoded bytes of the frame
+ *      - size: the number of bytes in buf
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ *
+ *  The whole frame is passed to tx_frame_fn if there is one so
+ *  that it can be scheduled as a unit, otherwise it is sent
+ *  byte by byte with tx_byte.
+ */
+void serialcomm_tx_bytes(serialcomm_t* sc, uint8_t id, uint8_t* buf, int size) {
+    int i;
+    if (sc->tx_frame_fn) {
+        sc->tx_frame_fn(id, buf, size);
+    } else if (sc->tx_byte) {
+        for (i = 0; i < size; i++) {
+            sc->tx_byte(buf[i]);
+        }
+    }
+}
+
+/*----------------------------------------------------------------
+ *  superframe_checksum -- Calculates the checksum of a superframe.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - id: FRAME_SUPER_ID or FRAME_BULK_ID
+ *      - sf: the superframe whose checksum we want to calculate
+ *  Returns: The checksum of the superframe
+ *  Author: Boldizsar Palotas
+ *
+ *  The checksum is calculated over the frame ID, the payload
+ *  size and all payload bytes with the algorithm selected by
+ *  SERIALCOMM_CHECKSUM.
+ */
+uint8_t superframe_checksum(uint8_t id, superframe_t* sf) {
+    int i;
+    uint8_t chkbuf = checksum_update(0, id);
+    chkbuf = checksum_update(chkbuf, sf->size);
+    for (i = 0; i < sf->size; i++) {
+        chkbuf = checksum_update(chkbuf, sf->data[i]);
+    }
+    return chkbuf;
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_value_size -- The number of used value bytes of a
+ *  Quadcopter -> PC message.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - id: the message id
+ *  Returns: The number of value bytes packed into superframes.
+ *  Author: Boldizsar Palotas
+ *
+ *  Messages only using the first three halfwords of their value
+ *  are packed with 6 bytes, unknown messages with all 8.
+ */
+uint8_t serialcomm_value_size(uint8_t id) {
+    switch (id) {
+        case MESSAGE_SPQR_ID:
+        case MESSAGE_SAXYZ_ID:
+        case MESSAGE_S_ATT_ID:
+        case MESSAGE_LMN_ID:
+        case MESSAGE_PQR_ID:
+        case MESSAGE_PHI_THETA_PSI_ID:
+        case MESSAGE_TX_DROP_ID:
+        case MESSAGE_PROFILE_4_ID:
+            return 6;
+        default:
+            return MESSAGE_VALUE_SIZE;
+    }
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_superframe_clear -- Empties a superframe.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sf: the superframe to clear
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ */
+void serialcomm_superframe_clear(superframe_t* sf) {
+    sf->size = 0;
+    sf->count = 0;
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_superframe_add -- Packs a message into a superframe.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sf: the superframe to pack the message into
+ *      - message: the message to add
+ *  Returns: false if the message does not fit, true otherwise.
+ *  Author: Boldizsar Palotas
+ */
+bool serialcomm_superframe_add(superframe_t* sf, message_t* message) {
+    uint8_t i, size = serialcomm_value_size(message->ID);
+    if (SUPERFRAME_DATA_SIZE < sf->size + 1 + size)
+        return false;
+    sf->data[sf->size++] = message->ID;
+    for (i = 0; i < size; i++)
+        sf->data[sf->size++] = message->value.v8[i];
+    sf->count++;
+    return true;
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_send_superframe -- Sends a superframe.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - sf: the superframe to send, nothing is sent if empty
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ */
+void serialcomm_send_superframe(serialcomm_t* sc, superframe_t* sf) {
+    int i;
+    uint8_t buf[FRAME_MAX_SIZE];
+    if ((sc->tx_byte == 0 && sc->tx_frame_fn == 0) || sf->size == 0)
+        return;
+    buf[0] = FRAME_SUPER_ID;
+    buf[1] = sf->size;
+    for (i = 0; i < sf->size; i++) {
+        buf[i + 2] = sf->data[i];
+    }
+    buf[sf->size + 2] = superframe_checksum(FRAME_SUPER_ID, sf);
+    serialcomm_tx_packet(sc, FRAME_SUPER_ID, buf, sf->size + 3);
+}
+
+/*----------------------------------------------------------------
+ *  serialcomm_send_bulk -- Sends a bulk frame.
+ *----------------------------------------------------------------
+ *  Parameters:
+ *      - sc: pointer to the channel state variable.
+ *      - offset: the stream offset of the first data byte
+ *      - data: the bytes to send
+ *      - size: the number of bytes, at most BULK_DATA_SIZE
+ *  Returns: void
+ *  Author: Boldizsar Palotas
+ */
+void serialcomm_send_bulk(serialcomm_t* sc, uint32_t offset, uint8_t* data, int size) {
+    int i;
+    superframe_t sf;
+    uint8_t buf[FRAME_MAX_SIZE];
+    if ((sc->tx_byte == 0 && sc->tx_frame_fn == 0) || BULK_DATA_SIZE < size)
+        return;
+    sf.size = BULK_OFFSET_SIZE + size;
+    sf.data[0] = offset;
+    sf.data[1] = offset >> 8;
+    sf.data[2] = offset >> 16;
+    sf.data[3] = offset >> 24;
+    for (i = 0; i < size; i++) {
+        sf.data[BULK_OFFSET_SIZE + i] = data[i];
+    }
+    buf[0] = FRAME_BULK_ID;
+    buf[1] = sf.size;
+    for (i = 0; i < sf.size; i++) {
+        buf[i + 2] = sf.data[i];
+    }
+    buf[sf.size + 2] = superframe_checksum(FRAME_BULK_ID, &sf);
+    serialcomm_tx_packet(sc, FRAME_BULK_ID, buf, sf.size + 3);
 }
 
 #ifdef PC_TERMINAL
@@ -246,6 +779,7 @@ void serialcomm_send(serialcomm_t* sc) {
         "SET_TELEMSK",
         "KEEP_ALIVE",
         "REBOOT",
+        "LOG_RESEND", // 10
         0
     };
 
@@ -276,7 +810,11 @@ void serialcomm_send(serialcomm_t* sc) {
         "SETPOINT",
         "Z FORCE POS PRESSURE",
         "PROFILE 0-3",
-        "PROFILE 4",
+        "PROFILE 4-5",
+        "TX DROPS",
+        "PROFILE HIST",
+        "TRACE",
+        "TASK DEADLINES", // 15
         0
     };
 
@@ -2,6 +2,7 @@
 #define SERIALCOMM_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 #define MESSAGE_VALUE_SIZE  8
 
@@ -78,11 +79,14 @@ typedef struct message {
 
 //#define MESSAGE_TEMP_PRESSURE_ID        10
 //#define MESSAGE_P12_ID                  11
-// 14
 // 15
 
 #define MESSAGE_PROFILE_ID              10
 #define MESSAGE_PROFILE_4_ID            11
+#define MESSAGE_TX_DROP_ID              12
+#define MESSAGE_PROFILE_HIST_ID         13
+#define MESSAGE_TRACE_ID                14
+#define MESSAGE_SCHED_ID                15
 
 // End loggable messages
 // Start control messages
@@ -90,6 +94,7 @@ typedef struct message {
 #define MESSAGE_LOG_END_ID              32
 #define MESSAGE_LOG_START_ID            33
 #define MESSAGE_TEXT_ID                 34
+#define MESSAGE_SUPERFRAME_END_ID       35
 
 // End control messages
 
@@ -257,11 +262,65 @@ typedef struct message {
 #define MESSAGE_PROFILE_2_VALUE(message) ((message)->value.v16[2])
 #define MESSAGE_PROFILE_3_VALUE(message) ((message)->value.v16[3])
 #define MESSAGE_PROFILE_4_VALUE(message) ((message)->value.v16[0])
+// Wakeup latency: last and maximum time from the sensor interrupt
+// until the control task starts
+#define MESSAGE_PROFILE_5_VALUE(message) ((message)->value.v16[1])
+#define MESSAGE_PROFILE_5_MAX_VALUE(message) ((message)->value.v16[2])
+
+// MESSAGE_TX_DROP_ID
+// Number of frames dropped by the transmit scheduler per priority
+
+#define MESSAGE_TX_DROP_TELEMETRY_VALUE(message) ((message)->value.v16[0])
+#define MESSAGE_TX_DROP_TEXT_VALUE(message)      ((message)->value.v16[1])
+#define MESSAGE_TX_DROP_CONTROL_VALUE(message)   ((message)->value.v16[2])
+
+// MESSAGE_PROFILE_HIST_ID
+// One part of a latency histogram (see profile_hist_t), the parts
+// of all histograms are sent in turn. Parts below
+// MESSAGE_PROFILE_HIST_PART_STATS carry three bins starting at bin
+// 3 * part, the last part carries the running min, mean and max.
+
+#define MESSAGE_PROFILE_HIST_INDEX_VALUE(message)  ((message)->value.v8[0])
+#define MESSAGE_PROFILE_HIST_PART_VALUE(message)   ((message)->value.v8[1])
+#define MESSAGE_PROFILE_HIST_BIN_VALUE(message, i) ((message)->value.v16[1 + (i)])
+#define MESSAGE_PROFILE_HIST_MIN_VALUE(message)    ((message)->value.v16[1])
+#define MESSAGE_PROFILE_HIST_MEAN_VALUE(message)   ((message)->value.v16[2])
+#define MESSAGE_PROFILE_HIST_MAX_VALUE(message)    ((message)->value.v16[3])
+#define MESSAGE_PROFILE_HIST_PART_BINS  3
+#define MESSAGE_PROFILE_HIST_PART_STATS 5
+
+// MESSAGE_TRACE_ID
+// Two events of a trace dump (see trace.h). The first message of
+// a dump is its header: the first word has the TRACE_HEADER code
+// and the number of events that follow instead of the time, the
+// second word is the number of events recorded.
+
+#define MESSAGE_TRACE_EVENT_VALUE(message, i) ((message)->value.v32[i])
+
+// MESSAGE_SCHED_ID
+// Deadline accounting of one main loop task (see sched.h), the
+// tasks are sent in turn.
+
+#define MESSAGE_SCHED_TASK_VALUE(message)       ((message)->value.v8[0])
+#define MESSAGE_SCHED_MISS_VALUE(message)       ((message)->value.v16[1])
+#define MESSAGE_SCHED_OVERRUN_VALUE(message)    ((message)->value.v16[2])
+#define MESSAGE_SCHED_RESPONSE_VALUE(message)   ((message)->value.v16[3])
 
 // MESSAGE_TEXT_ID
 
 #define MESSAGE_TEXT_VALUE(message)     ((message)->value.v8[0])
 
+// MESSAGE_SUPERFRAME_END_ID
+// Not sent on the wire: delivered by the receiver after the last
+// sub-message of a superframe was passed to rx_complete_callback.
+
+#define MESSAGE_SUPERFRAME_END_COUNT_VALUE(message) ((message)->value.v8[0])
+
+// MESSAGE_LOG_START_ID
+// Number of bytes of log data that follow in bulk frames
+
+#define MESSAGE_LOG_START_SIZE_VALUE(message) ((message)->value.v32[0])
+
 // Messages in PC -> Quadcopter direction
 
 // MESSAGE 0
@@ -338,6 +397,16 @@ typedef struct message {
 // MESSAGE 9
 #define MESSAGE_REBOOT_ID               9
 
+// MESSAGE 10
+// Request to send parts of the log again in bulk frames, followed
+// by a MESSAGE_LOG_END_ID. Bit i of the mask selects the
+// BULK_DATA_SIZE bytes at offset + i * BULK_DATA_SIZE. Only
+// handled in safe mode.
+#define MESSAGE_LOG_RESEND_ID           10
+
+#define MESSAGE_LOG_RESEND_OFFSET_VALUE(message) ((message)->value.v32[0])
+#define MESSAGE_LOG_RESEND_MASK_VALUE(message)   ((message)->value.v32[1])
+
 // Special frames
 
 #define FRAME_START_ID                  0xFF
@@ -348,6 +417,10 @@ typedef struct message {
 #define FRAME_SPECIAL_NOP_VALUE         0x00000000
 #define FRAME_SPECIAL_RESTART_VALUE     0xFEFEFEFE
 
+#define FRAME_SUPER_ID                  0xFD
+
+#define FRAME_BULK_ID                   0xFC
+
 #ifdef PC_TERMINAL
     const char * const message_id_to_qc_name(uint8_t);
     const char * const message_id_to_pc_name(uint8_t);
@@ -369,6 +442,96 @@ typedef struct frame {
 // The size of a frame in bytes
 #define FRAME_SIZE (MESSAGE_SIZE + 1)
 
+// Frame checksum algorithms. Both ends of the link have to be built
+// with the same SERIALCOMM_CHECKSUM setting.
+//  - XOR: XOR of all bytes, misses any pair of identical bit flips
+//  - CRC8: CRC-8 (polynomial 0x07) using a 256 byte lookup table
+#define SERIALCOMM_CHECKSUM_XOR     0
+#define SERIALCOMM_CHECKSUM_CRC8    1
+
+#ifndef SERIALCOMM_CHECKSUM
+    #define SERIALCOMM_CHECKSUM     SERIALCOMM_CHECKSUM_CRC8
+#endif
+
+// Framing modes. Both ends of the link have to be built with the same
+// SERIALCOMM_FRAMING setting.
+//  - START: raw frames, resynchronisation after an error needs a START
+//    frame and a restart request round trip
+//  - COBS: frames are Consistent Overhead Byte Stuffing encoded and
+//    terminated by a FRAME_COBS_DELIMITER byte, the receiver resyncs
+//    at the next delimiter without any handshake
+#define SERIALCOMM_FRAMING_START    0
+#define SERIALCOMM_FRAMING_COBS     1
+
+#ifndef SERIALCOMM_FRAMING
+    #define SERIALCOMM_FRAMING      SERIALCOMM_FRAMING_START
+#endif
+
+#define FRAME_COBS_DELIMITER        0x00
+
+// The maximum number of payload bytes in a superframe. A full
+// superframe (payload + 3 bytes of ID, length and checksum) must
+// fit within one TIMER_PERIOD (10 ms ~ 115 bytes at 115200 baud).
+#define SUPERFRAME_DATA_SIZE 100
+
+/*------------------------------------------------------------------
+ * superframe_t -- Variable-length frame packing multiple messages
+ *------------------------------------------------------------------
+ * Fields:
+ *  - size: the number of used bytes in data
+ *  - count: the number of messages packed into data
+ *  - data: the packed messages
+ *
+ * On the wire a superframe looks like this:
+ *
+ *  +----------------+------+-------------------------+----------+
+ *  | FRAME_SUPER_ID | size | ID_0 value_0 ID_1 ...   | checksum |
+ *  +----------------+------+-------------------------+----------+
+ *
+ * Each packed message is its ID followed by only the used bytes of
+ * its value (see serialcomm_value_size). Superframes are only sent
+ * in the Quadcopter -> PC direction.
+ * Author: Boldizsar Palotas
+ */
+typedef struct superframe {
+    uint8_t     size;
+    uint8_t     count;
+    uint8_t     data[SUPERFRAME_DATA_SIZE];
+} superframe_t;
+
+// The number of data bytes in a bulk frame. Divides the 256 byte
+// flash page so that one page read fills a whole number of frames.
+#define BULK_DATA_SIZE 64
+
+// The size of the stream offset at the start of a bulk frame
+#define BULK_OFFSET_SIZE 4
+
+/*------------------------------------------------------------------
+ * Bulk frames -- Frames carrying a block of a byte stream
+ *------------------------------------------------------------------
+ * Bulk frames share the wire format of superframes but carry raw
+ * data (the log during readback) instead of packed messages:
+ *
+ *  +---------------+------+--------+-------------+----------+
+ *  | FRAME_BULK_ID | size | offset | data        | checksum |
+ *  +---------------+------+--------+-------------+----------+
+ *
+ * The offset is the little endian 32 bit position of the first
+ * data byte within the stream. It doubles as a sequence number:
+ * the receiver can tell which blocks are missing and request them
+ * again. They are received into the rx_superframe buffer and
+ * passed to rx_bulk_callback. Bulk frames are only sent in the
+ * Quadcopter -> PC direction.
+ * Author: Boldizsar Palotas
+ */
+
+// The size of the largest frame in bytes (a full superframe). Must
+// be at most 254 so that COBS needs a single code byte per frame.
+#define FRAME_MAX_SIZE (SUPERFRAME_DATA_SIZE + 3)
+
+// The size of the largest frame after framing (COBS adds 2 bytes)
+#define FRAME_MAX_ENCODED_SIZE (FRAME_MAX_SIZE + 2)
+
 /*------------------------------------------------------------------
  * serialcomm_status_t -- The status of the serial communication
  * channel
@@ -391,9 +554,25 @@ typedef enum serialcomm_status {
  * Fields:
  *  - rx_frame:
  *  - tx_frame:
+ *  - rx_superframe: buffer for receiving superframes, superframes
+ *    are not accepted if this is null
+ *  - rx_super: true while a superframe is being received
+ *  - rx_bulk: true if the superframe being received is a bulk
+ *    frame
+ *  - rx_super_len: payload length of the superframe being received
+ *    or -1 if the length byte has not been received yet
+ *  - rx_buf: (COBS only) the decoded bytes of the frame being
+ *    received
+ *  - rx_cobs_left: (COBS only) number of bytes left in the current
+ *    COBS block
+ *  - rx_cobs_code: (COBS only) code byte of the current COBS block
  *  - rx_ptr:
  *  - rx_complete_callback:
+ *  - rx_bulk_callback: called with the offset and data of each
+ *    correct bulk frame, bulk frames are dropped if this is null
  *  - tx_byte:
+ *  - tx_frame_fn: optional, if set whole encoded frames are passed
+ *    to it (with the frame ID) instead of calling tx_byte per byte
  * Author:
  *  - Boldizsar Palotas
  */
@@ -401,10 +580,21 @@ typedef struct serialcomm {
     serialcomm_status_t status;
     frame_t* rx_frame;
     frame_t* tx_frame;
+    superframe_t* rx_superframe;
+    bool rx_super;
+    bool rx_bulk;
+    int rx_super_len;
     int rx_cnt;
     int start_cnt;
+#if SERIALCOMM_FRAMING == SERIALCOMM_FRAMING_COBS
+    uint8_t rx_buf[FRAME_MAX_SIZE];
+    uint8_t rx_cobs_left;
+    uint8_t rx_cobs_code;
+#endif
     void (*rx_complete_callback)(message_t*);
+    void (*rx_bulk_callback)(uint32_t, uint8_t*, int);
     void (*tx_byte)(uint8_t);
+    void (*tx_frame_fn)(uint8_t, uint8_t*, int);
 } serialcomm_t;
 
 void serialcomm_init(serialcomm_t* sc);
@@ -419,5 +609,15 @@ void serialcomm_send_start(serialcomm_t* sc);
 
 void serialcomm_send_restart_request(serialcomm_t* sc);
 
+uint8_t serialcomm_value_size(uint8_t id);
+
+void serialcomm_superframe_clear(superframe_t* sf);
+
+bool serialcomm_superframe_add(superframe_t* sf, message_t* message);
+
+void serialcomm_send_superframe(serialcomm_t* sc, superframe_t* sf);
+
+void serialcomm_send_bulk(serialcomm_t* sc, uint32_t offset, uint8_t* data, int size);
+
 
 #endif // SERIALCOMM_H
@@ -0,0 +1,307 @@
+#include "simulation.h"
+#include "../mode_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/** Gain tuning
+ *  ===========
+ *
+ *  Searches the trims of the gains of the full control mode (p1, p2
+ *  and yaw_p, see control_fn in mode_5_full.c) for the ones the
+ *  script flies best with, and prints them as the defaults of
+ *  mode_constants.h.
+ *
+ *  A candidate is flown with the same perturbed scenarios (see
+ *  montecarlo.c) as every other, and costs the mean of its flights:
+ *  the tracking errors, the motor saturation and the oscillation of
+ *  the motors, each over the amount that counts as much as the
+ *  others. The search is Nelder-Mead on the trims, which are
+ *  integers, so the candidates are rounded and the ones seen before
+ *  are not flown again. Nelder-Mead tries one point after the other;
+ *  here the reflection, the expansion and both contractions of an
+ *  iteration are flown at once, as are the points of a shrink, so
+ *  an iteration keeps 4 times the scenarios busy.
+**/
+
+// Amounts of the parts of the cost that count as 1
+// Roll and pitch error, RMS [rad]
+#define AT_TRACKING     0.05
+// Yaw rate error, RMS [rad/s]
+#define AT_YAW_TRACKING 0.2
+// Steps with a saturated motor
+#define AT_SATURATION   0.05
+// Change of the motor speeds between steps, RMS
+#define AT_OSCILLATION  10.0
+// Cost of a flight that failed or went unstable
+#define AT_COST_FAILED  1e6
+
+// The trims tuned and the first steps of the search
+#define AT_DIM          3
+#define AT_STEP_P1      6
+#define AT_STEP_P2      40
+#define AT_STEP_YAW_P   15
+
+// Candidates remembered
+#define AT_CACHE_SIZE   1024
+
+typedef struct at_point {
+    double      x[AT_DIM];
+    double      cost;
+} at_point_t;
+
+typedef struct at_cached {
+    int16_t     trim[AT_DIM];
+    double      cost;
+} at_cached_t;
+
+static const char*      at_script;
+static sim_scenario_t*  at_scenarios;
+static int              at_scenario_cnt;
+static int              at_jobs;
+static at_cached_t      at_cache[AT_CACHE_SIZE];
+static int              at_cached_cnt;
+static uint32_t         at_flights;
+
+static const double at_min[AT_DIM] = { P1_MIN, P2_MIN, YAWP_MIN };
+static const double at_max[AT_DIM] = { P1_MAX, P2_MAX, YAWP_MAX };
+
+static void at_round(const double* x, int16_t* trim);
+static at_cached_t* at_lookup(const int16_t* trim);
+static int at_evaluate(at_point_t* points, int count);
+static double at_cost(const sim_result_t* result);
+static void at_move(at_point_t* point, const double* from, const double* to, double factor);
+static int compare_point(const void* a, const void* b);
+static void at_print_default(const char* name, const char* frac_bits, int32_t value, int frac);
+
+// Tunes the trims and prints the defaults they give
+// ---
+// Parameters: script: the script to fly, scenarios: perturbed flights
+//     per candidate (0 for the unperturbed flight), jobs: flights at
+//     a time (0 for the number of CPUs), seed: seed of the
+//     perturbations, iterations: most iterations of the search
+// Returns: 0, or -1 on errors
+// BP
+int sim_autotune(const char* script, int scenarios, int jobs, uint64_t seed, int iterations) {
+    at_script = script;
+    at_jobs = jobs;
+    at_scenario_cnt = scenarios <= 0 ? 1 : scenarios;
+    at_scenarios = malloc(at_scenario_cnt * sizeof(sim_scenario_t));
+    if (!at_scenarios) {
+        fprintf(stderr, "Error setting up the flights.\n");
+        return -1;
+    }
+    for (int i = 0; i < at_scenario_cnt; i++) {
+        if (scenarios <= 0)
+            at_scenarios[i] = sim_scenario;
+        else
+            sim_scenario_draw(&at_scenarios[i], seed, i);
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+
+    // The current defaults and a step along each trim
+    at_point_t simplex[AT_DIM + 1];
+    const double step[AT_DIM] = { AT_STEP_P1, AT_STEP_P2, AT_STEP_YAW_P };
+    memset(simplex, 0, sizeof(simplex));
+    for (int i = 0; i < AT_DIM; i++)
+        simplex[i + 1].x[i] = step[i];
+    if (at_evaluate(simplex, AT_DIM + 1)) {
+        free(at_scenarios);
+        return -1;
+    }
+    double initial = simplex[0].cost;
+
+    int iteration;
+    for (iteration = 0; iteration < iterations; iteration++) {
+        qsort(simplex, AT_DIM + 1, sizeof(at_point_t), compare_point);
+        at_point_t* best = &simplex[0];
+        at_point_t* worst = &simplex[AT_DIM];
+
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+        double seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        int16_t trim[AT_DIM];
+        at_round(best->x, trim);
+        fprintf(stderr, "%3d cost %-10.4f p1 %4d p2 %4d yaw_p %4d  %6"PRIu32" flights, %.1f sims/s\n",
+            iteration, best->cost, trim[0], trim[1], trim[2], at_flights, at_flights / seconds);
+
+        // Done once the vertices round to the same trims
+        bool collapsed = true;
+        for (int i = 1; i <= AT_DIM; i++)
+            for (int j = 0; j < AT_DIM; j++)
+                if (.5 < fabs(simplex[i].x[j] - best->x[j]))
+                    collapsed = false;
+        if (collapsed)
+            break;
+
+        double centroid[AT_DIM] = {0};
+        for (int i = 0; i < AT_DIM; i++)
+            for (int j = 0; j < AT_DIM; j++)
+                centroid[j] += simplex[i].x[j] / AT_DIM;
+
+        // Reflection, expansion, outside and inside contraction
+        at_point_t trial[4];
+        at_move(&trial[0], centroid, worst->x, -1);
+        at_move(&trial[1], centroid, worst->x, -2);
+        at_move(&trial[2], centroid, worst->x, -.5);
+        at_move(&trial[3], centroid, worst->x, .5);
+        if (at_evaluate(trial, 4))
+            break;
+
+        at_point_t* accept = NULL;
+        if (trial[0].cost < best->cost)
+            accept = trial[1].cost < trial[0].cost ? &trial[1] : &trial[0];
+        else if (trial[0].cost < simplex[AT_DIM - 1].cost)
+            accept = &trial[0];
+        else if (trial[0].cost < worst->cost)
+            accept = trial[2].cost <= trial[0].cost ? &trial[2] : NULL;
+        else
+            accept = trial[3].cost < worst->cost ? &trial[3] : NULL;
+
+        if (accept) {
+            *worst = *accept;
+        } else {
+            // Shrink towards the best
+            for (int i = 1; i <= AT_DIM; i++)
+                at_move(&simplex[i], best->x, simplex[i].x, .5);
+            if (at_evaluate(&simplex[1], AT_DIM))
+                break;
+        }
+    }
+    qsort(simplex, AT_DIM + 1, sizeof(at_point_t), compare_point);
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    double seconds = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d iterations, %"PRIu32" flights of %d scenarios in %.3f s, %.1f sims/s\n",
+        iteration, at_flights, at_scenario_cnt, seconds, at_flights / seconds);
+
+    int16_t trim[AT_DIM];
+    at_round(simplex[0].x, trim);
+    printf("// Tuned on %s with %d scenarios, cost %.4f -> %.4f\n",
+        script, at_scenario_cnt, initial, simplex[0].cost);
+    at_print_default("P1_DEFAULT", "P1_FRAC_BITS", P1_DEFAULT + trim[0], P1_FRAC_BITS);
+    at_print_default("P2_DEFAULT", "P2_FRAC_BITS", P2_DEFAULT + trim[1], P2_FRAC_BITS);
+    at_print_default("YAWP_DEFAULT", "YAWP_FRAC_BITS", YAWP_DEFAULT + trim[2], YAWP_FRAC_BITS);
+    free(at_scenarios);
+    return 0;
+}
+
+// Trims of a point
+// BP
+void at_round(const double* x, int16_t* trim) {
+    for (int i = 0; i < AT_DIM; i++)
+        trim[i] = lround(x[i]);
+}
+
+// The cached candidate with these trims, NULL if not flown yet
+// BP
+at_cached_t* at_lookup(const int16_t* trim) {
+    for (int i = 0; i < at_cached_cnt; i++)
+        if (!memcmp(at_cache[i].trim, trim, sizeof(at_cache[i].trim)))
+            return &at_cache[i];
+    return NULL;
+}
+
+// Sets the cost of the points, flying all the scenarios of the ones
+// not flown yet at once
+// ---
+// Parameters: points: the candidates, count: number of candidates
+// Returns: 0, or -1 if the flights could not be started
+// BP
+int at_evaluate(at_point_t* points, int count) {
+    int16_t trim[count][AT_DIM];
+    int fly[count];
+    int flown = 0;
+    for (int i = 0; i < count; i++) {
+        at_round(points[i].x, trim[i]);
+        at_cached_t* cached = at_lookup(trim[i]);
+        fly[i] = -1;
+        for (int j = 0; j < i && !cached; j++)
+            if (0 <= fly[j] && !memcmp(trim[j], trim[i], sizeof(trim[i])))
+                fly[i] = fly[j];
+        if (cached)
+            points[i].cost = cached->cost;
+        else if (fly[i] < 0)
+            fly[i] = flown++;
+    }
+    if (!flown)
+        return 0;
+
+    int n = flown * at_scenario_cnt;
+    sim_scenario_t* scenarios = malloc(n * sizeof(sim_scenario_t));
+    sim_result_t* results = malloc(n * sizeof(sim_result_t));
+    double* cost = calloc(flown, sizeof(double));
+    int ret = -1;
+    if (scenarios && results && cost) {
+        for (int i = 0; i < count; i++) {
+            if (fly[i] < 0)
+                continue;
+            for (int j = 0; j < at_scenario_cnt; j++) {
+                sim_scenario_t* s = &scenarios[fly[i] * at_scenario_cnt + j];
+                *s = at_scenarios[j];
+                s->p1 = trim[i][0];
+                s->p2 = trim[i][1];
+                s->yaw_p = trim[i][2];
+            }
+        }
+        ret = sim_fly_all(at_script, scenarios, n, at_jobs, results);
+        at_flights += n;
+        for (int i = 0; i < n; i++)
+            cost[i / at_scenario_cnt] += at_cost(&results[i]) / at_scenario_cnt;
+        for (int i = 0; i < count; i++) {
+            if (fly[i] < 0)
+                continue;
+            points[i].cost = cost[fly[i]];
+            if (!at_lookup(trim[i]) && at_cached_cnt < AT_CACHE_SIZE) {
+                memcpy(at_cache[at_cached_cnt].trim, trim[i], sizeof(trim[i]));
+                at_cache[at_cached_cnt++].cost = cost[fly[i]];
+            }
+        }
+    } else {
+        fprintf(stderr, "Error setting up the flights.\n");
+    }
+    free(scenarios);
+    free(results);
+    free(cost);
+    return ret;
+}
+
+// Cost of a flight
+// BP
+double at_cost(const sim_result_t* result) {
+    if (result->failure != SIM_FAILURE_NONE)
+        return AT_COST_FAILED;
+    double cost = result->tracking / AT_TRACKING
+        + result->yaw_tracking / AT_YAW_TRACKING
+        + result->saturation / AT_SATURATION
+        + result->oscillation / AT_OSCILLATION;
+    return isfinite(cost) && cost < AT_COST_FAILED ? cost : AT_COST_FAILED;
+}
+
+// Sets point to from + factor * (to - from), within the range of
+// the trims
+// BP
+void at_move(at_point_t* point, const double* from, const double* to, double factor) {
+    for (int i = 0; i < AT_DIM; i++) {
+        double x = from[i] + factor * (to[i] - from[i]);
+        point->x[i] = x < at_min[i] ? at_min[i] : at_max[i] < x ? at_max[i] : x;
+    }
+}
+
+// BP
+int compare_point(const void* a, const void* b) {
+    double x = ((const at_point_t*) a)->cost, y = ((const at_point_t*) b)->cost;
+    return (y < x) - (x < y);
+}
+
+// Prints a default in the form of mode_constants.h
+// BP
+void at_print_default(const char* name, const char* frac_bits, int32_t value, int frac) {
+    char number[32];
+    snprintf(number, sizeof(number), "%g", (double) value / (1 << frac));
+    printf("#define %-15s ((int32_t) FP_FLOAT(%s%sf, %s))\n",
+        name, number, strchr(number, '.') ? "" : ".", frac_bits);
+}
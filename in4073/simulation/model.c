@@ -1,69 +1,108 @@
 #include "model.h"
 #include <math.h>
+#include <string.h>
 
-// BP
-void model_step(model_t* m) {
-    m->X = - sin(m->theta) * MODEL_G;
-    m->Y = sin(m->phi) * MODEL_G;
-    m->Z = - MODEL_B * (m->ae1sq + m->ae2sq + m->ae3sq + m->ae4sq) + MODEL_G;
+static void model_deriv(const model_t* m, const model_t* st, double* ds);
+static void model_outputs(model_t* m);
 
-    m->ax = m->X / MODEL_M_S;
-    m->ay = m->Y / MODEL_M_S;
-    m->az = m->Z / MODEL_M_S;
-
-    m->L = MODEL_B * (- m->ae2sq + m->ae4sq);
-    m->M = MODEL_B * (m->ae1sq - m->ae3sq);
-    m->N = MODEL_D * (-m->ae1sq + m->ae2sq - m->ae3sq + m->ae4sq);
+// Derivative of the state of st with the inputs of m
+// BP
+void model_deriv(const model_t* m, const model_t* st, double* ds) {
+    double sphi = sin(st->phi), cphi = cos(st->phi);
+    double sth = sin(st->theta), cth = cos(st->theta);
+    double spsi = sin(st->psi), cpsi = cos(st->psi);
 
-    m->u = (MODEL_T / MODEL_M) * m->X + m->u;
-    m->v = (MODEL_T / MODEL_M) * m->Y + m->v;
-    m->w = (MODEL_T / MODEL_M) * m->Z + m->w;
+    // Thrust along the body z axis, turned to the earth frame
+    double t = - m->Z / MODEL_M;
+    ds[0] = st->vx;
+    ds[1] = st->vy;
+    ds[2] = st->vz;
+    ds[3] = - t * (cpsi * sth * cphi + spsi * sphi) - MODEL_DRAG / MODEL_M * st->vx;
+    ds[4] = - t * (spsi * sth * cphi - cpsi * sphi) - MODEL_DRAG / MODEL_M * st->vy;
+    ds[5] = - t * cth * cphi + MODEL_G - MODEL_DRAG / MODEL_M * st->vz;
 
-    m->p = (MODEL_T / MODEL_I_L) * m->L + m->p;
-    m->q = (MODEL_T / MODEL_I_M) * m->M + m->q;
-    m->r = (MODEL_T / MODEL_I_N) * m->N + m->r;
+    // Euler angle rates from the body rates
+    double qr = st->q * sphi + st->r * cphi;
+    ds[6] = st->p + qr * sth / cth;
+    ds[7] = st->q * cphi - st->r * sphi;
+    ds[8] = qr / cth;
 
-    m->x = MODEL_T * m->u + m->x;
-    m->y = MODEL_T * m->v + m->y;
-    m->z = MODEL_T * m->w + m->z;
+    // Euler's equations
+    ds[9]  = (m->L + (MODEL_I_M - MODEL_I_N) * st->q * st->r - MODEL_DRAG_ROT * st->p) / MODEL_I_L;
+    ds[10] = (m->M + (MODEL_I_N - MODEL_I_L) * st->r * st->p - MODEL_DRAG_ROT * st->q) / MODEL_I_M;
+    ds[11] = (m->N + (MODEL_I_L - MODEL_I_M) * st->p * st->q - MODEL_DRAG_ROT * st->r) / MODEL_I_N;
+}
 
-    m->phi = MODEL_T * m->p + m->phi;
-    m->theta = MODEL_T * m->q + m->theta;
-    m->psi = MODEL_T * m->r + m->psi;
+// Computes the specific force in the body frame from the
+// acceleration of the current state
+// BP
+void model_outputs(model_t* m) {
+    double ds[MODEL_STATE_CNT];
+    model_deriv(m, m, ds);
+    if (m->grounded) {
+        ds[3] = 0;
+        ds[4] = 0;
+        ds[5] = 0;
+    }
+    // Earth frame minus gravity, turned to the body frame
+    double fx = ds[3], fy = ds[4], fz = ds[5] - MODEL_G;
+    double sphi = sin(m->phi), cphi = cos(m->phi);
+    double sth = sin(m->theta), cth = cos(m->theta);
+    double spsi = sin(m->psi), cpsi = cos(m->psi);
+    m->ax = cth * cpsi * fx + cth * spsi * fy - sth * fz;
+    m->ay = (sphi * sth * cpsi - cphi * spsi) * fx + (sphi * sth * spsi + cphi * cpsi) * fy
+        + sphi * cth * fz;
+    m->az = (cphi * sth * cpsi + sphi * spsi) * fx + (cphi * sth * spsi - sphi * cpsi) * fy
+        + cphi * cth * fz;
 }
 
+// Advances the model by MODEL_T with one RK4 step. On the ground
+// the model can turn but not sink or slide.
 // BP
-void model_init(model_t* m) {
+void model_step(model_t* m) {
     m->X = 0;
     m->Y = 0;
-    m->Z = 0;
+    m->Z = - MODEL_B * (m->ae1sq + m->ae2sq + m->ae3sq + m->ae4sq);
+#ifdef MIXER_FRAME_X
+    // The arms are at 45 degrees to the axes
+    m->L = MODEL_B * MODEL_ARM * M_SQRT1_2 * (- m->ae1sq - m->ae2sq + m->ae3sq + m->ae4sq);
+    m->M = MODEL_B * MODEL_ARM * M_SQRT1_2 * (m->ae1sq - m->ae2sq - m->ae3sq + m->ae4sq);
+#else
+    m->L = MODEL_B * MODEL_ARM * (- m->ae2sq + m->ae4sq);
+    m->M = MODEL_B * MODEL_ARM * (m->ae1sq - m->ae3sq);
+#endif
+    m->N = MODEL_D * (- m->ae1sq + m->ae2sq - m->ae3sq + m->ae4sq);
 
-    m->ax = 0;
-    m->ay = 0;
-    m->az = 0;
+    model_t k;
+    double* s = m->state;
+    double d1[MODEL_STATE_CNT], d2[MODEL_STATE_CNT], d3[MODEL_STATE_CNT], d4[MODEL_STATE_CNT];
+    model_deriv(m, m, d1);
+    for (int i = 0; i < MODEL_STATE_CNT; i++)
+        k.state[i] = s[i] + MODEL_T / 2 * d1[i];
+    model_deriv(m, &k, d2);
+    for (int i = 0; i < MODEL_STATE_CNT; i++)
+        k.state[i] = s[i] + MODEL_T / 2 * d2[i];
+    model_deriv(m, &k, d3);
+    for (int i = 0; i < MODEL_STATE_CNT; i++)
+        k.state[i] = s[i] + MODEL_T * d3[i];
+    model_deriv(m, &k, d4);
+    for (int i = 0; i < MODEL_STATE_CNT; i++)
+        s[i] += MODEL_T / 6 * (d1[i] + 2 * d2[i] + 2 * d3[i] + d4[i]);
 
-    m->L = 0;
-    m->M = 0;
-    m->N = 0;
-
-    m->u = 0;
-    m->v = 0;
-    m->w = 0;
-
-    m->p = 0;
-    m->q = 0;
-    m->r = 0;
-
-    m->x = 0;
-    m->y = 0;
-    m->z = 0;
-
-    m->phi = 0;
-    m->theta = 0;
-    m->psi = 0;
+    m->grounded = 0 <= m->z && 0 <= m->vz;
+    if (m->grounded) {
+        m->z = 0;
+        m->vx = 0;
+        m->vy = 0;
+        m->vz = 0;
+    }
+    model_outputs(m);
+}
 
-    m->ae1sq = 0;
-    m->ae2sq = 0;
-    m->ae3sq = 0;
-    m->ae4sq = 0;
+// Resting on the ground, level
+// BP
+void model_init(model_t* m) {
+    memset(m, 0, sizeof(*m));
+    m->grounded = true;
+    model_outputs(m);
 }
@@ -1,43 +1,79 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include <stdbool.h>
+
+/** Quadcopter model
+ *  ================
+ *
+ *  A rigid body with 6 degrees of freedom, integrated with RK4.
+ *  The position and velocity are in the earth frame (z down, the
+ *  ground is at z = 0), the attitude are ZYX Euler angles and the
+ *  rates are in the body frame. The motors push along the body -z
+ *  axis, + frame: 1 front, 2 right, 3 back, 4 left, 1 and 3 spin
+ *  the opposite way than 2 and 4 (see MIXER_MATRIX). Built with
+ *  MIXER_FRAME_X, the arms are turned by 45 degrees as the mixer
+ *  expects: 1 front right, 2 back right, 3 back left, 4 front left.
+**/
+
+#define MODEL_STATE_CNT 12
+
 typedef struct model {
-    double x;
-    double y;
-    double z;
-    double phi;
-    double theta;
-    double psi;
-    double u;
-    double v;
-    double w;
-    double p;
-    double q;
-    double r;
+    // The state, also as an array for the integration
+    union {
+        struct {
+            double x;
+            double y;
+            double z;
+            double vx;
+            double vy;
+            double vz;
+            double phi;
+            double theta;
+            double psi;
+            double p;
+            double q;
+            double r;
+        };
+        double state[MODEL_STATE_CNT];
+    };
+    // Forces [N] and torques [Nm] of the motors in the body frame
     double X;
     double Y;
     double Z;
     double L;
     double M;
     double N;
+    // Inputs: squared motor speeds
     double ae1sq;
     double ae2sq;
     double ae3sq;
     double ae4sq;
+    // Specific force in the body frame, what an accelerometer
+    // measures [m/s^2]
     double ax;
     double ay;
     double az;
+    bool   grounded;
 } model_t;
 
-#define MODEL_T     0.01
-#define MODEL_B     1.0
-#define MODEL_D     1.0
+// Step of the integration [s], the IMU samples at the same rate
+#define MODEL_T     0.001
+// Thrust per ae^2 [N], hovers at ae = 540 (see HC_AE_MIN/MAX)
+#define MODEL_B     (MODEL_M * MODEL_G / (4 * 540.0 * 540.0))
+// Reaction torque per ae^2 [Nm]
+#define MODEL_D     (MODEL_B * 0.02)
+// Arm of the motors [m]
+#define MODEL_ARM   0.2
+// Mass [kg] and moments of inertia [kg m^2]
 #define MODEL_M     1.0
-#define MODEL_M_S   1.0
-#define MODEL_I_L   1.0
-#define MODEL_I_M   1.0
-#define MODEL_I_N   1.0
-#define MODEL_G     10.0
+#define MODEL_I_L   0.01
+#define MODEL_I_M   0.01
+#define MODEL_I_N   0.02
+// Linear drag [N/(m/s)] and rotational drag [Nm/(rad/s)]
+#define MODEL_DRAG      0.3
+#define MODEL_DRAG_ROT  0.002
+#define MODEL_G     9.81
 
 void model_init(model_t*);
 void model_step(model_t*);
@@ -0,0 +1,409 @@
+#include "simulation.h"
+#include "../mode_constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+/** Monte Carlo flights
+ *  ===================
+ *
+ *  Flies the same script (see sim_script_read) many times with
+ *  randomly perturbed sensors, gains, initial attitudes and
+ *  motors (sim_scenario_t) and aggregates how the attitude
+ *  control coped with them: settling time, overshoot and motor
+ *  saturation.
+ *
+ *  The Quadcopter code keeps its state in globals and file scope
+ *  statics, as it does on the nRF51, so an instance of the
+ *  simulation is a process: each flight runs in a child forked
+ *  from the untouched image, at most jobs of them at a time, and
+ *  sends back its sim_result_t through a pipe. The flights share
+ *  nothing, so they scale with the cores. The perturbations only
+ *  depend on the seed and the number of the flight, the results
+ *  do not depend on the number of jobs.
+**/
+
+// Ranges of the perturbations
+// Sensor noise, drift and latency, at most [rad/s], [m/s^2], [Pa]
+// and [samples]
+#define MC_GYRO_NOISE   0.01
+#define MC_ACC_NOISE    0.1
+#define MC_BARO_NOISE   10
+#define MC_GYRO_DRIFT   0.001
+#define MC_ACC_DRIFT    0.01
+#define MC_LATENCY      4
+// Thrust of each motor, +/- relative
+#define MC_MOTOR_GAIN   0.05
+// Initial roll and pitch, +/- [rad]
+#define MC_ATTITUDE     0.2
+// Trimming of the gains, +/-
+#define MC_TRIM_P1      4
+#define MC_TRIM_P2      16
+#define MC_TRIM_YAW_P   8
+
+// The attitude has settled once its error stays within this [rad]
+#define MC_SETTLE_BAND  0.02
+
+// Names of the failures in the report
+static const char* mc_failure_names[SIM_FAILURE_CNT] = {
+    "none", "lost", "setup", "motors_off", "diverged", "expect"
+};
+
+// Random number generator of the process (splitmix64)
+static uint64_t rng_state;
+
+static uint64_t rng_next(void);
+static double rng_uniform(void);
+static int mc_jobs(void);
+static void mc_fly(const char* script, int run, sim_result_t* result);
+static void mc_collect(int fd, sim_result_t* results, int count);
+static void mc_report(const sim_scenario_t* scenarios, sim_result_t* results, int runs,
+    int jobs, double seconds);
+static void mc_report_row(const char* name, double* values, int count, int precision);
+static double percentile(double* values, int count, double p);
+static int compare_double(const void* a, const void* b);
+
+// Runs the flights and prints the statistics
+// ---
+// Parameters: script: the script to fly, runs: number of flights,
+//     jobs: flights at a time (0 for the number of CPUs), seed: seed
+//     of the perturbations
+// Returns: 0, or -1 on errors
+// BP
+int sim_monte_carlo(const char* script, int runs, int jobs, uint64_t seed) {
+    sim_scenario_t* scenarios = malloc(runs * sizeof(sim_scenario_t));
+    sim_result_t* results = malloc(runs * sizeof(sim_result_t));
+    if (!scenarios || !results) {
+        fprintf(stderr, "Error setting up the flights.\n");
+        free(scenarios);
+        free(results);
+        return -1;
+    }
+    for (int i = 0; i < runs; i++)
+        sim_scenario_draw(&scenarios[i], seed, i);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    int ret = sim_fly_all(script, scenarios, runs, jobs, results);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+    mc_report(scenarios, results, runs, jobs <= 0 ? mc_jobs() : jobs,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    free(scenarios);
+    free(results);
+    return ret;
+}
+
+// Reads the results the flights sent back so far
+// ---
+// Parameters: fd: the nonblocking end of the pipe, results: where
+//     to put them, count: number of flights
+// BP
+void mc_collect(int fd, sim_result_t* results, int count) {
+    sim_result_t result;
+    while (read(fd, &result, sizeof(result)) == sizeof(result))
+        if (0 <= result.run && result.run < count)
+            results[result.run] = result;
+}
+
+// Flies the script once with each scenario
+// ---
+// Parameters: script: the script to fly, scenarios: the perturbations
+//     of the flights, count: number of flights, jobs: flights at a time
+//     (0 for the number of CPUs), results: where to put the outcomes,
+//     failing with SIM_FAILURE_LOST if a flight sent back none
+// Returns: 0, or -1 if not all of the flights could be started
+// BP
+int sim_fly_all(const char* script, const sim_scenario_t* scenarios, int count,
+    int jobs, sim_result_t* results) {
+    if (jobs <= 0)
+        jobs = mc_jobs();
+
+    int fd[2];
+    if (pipe(fd)) {
+        fprintf(stderr, "Error %d setting up the flights. (%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    for (int i = 0; i < count; i++) {
+        memset(&results[i], 0, sizeof(results[i]));
+        results[i].run = i;
+        results[i].failure = SIM_FAILURE_LOST;
+    }
+
+    int started = 0, running = 0;
+    bool failed = false;
+    while (running || (started < count && !failed)) {
+        if (started < count && running < jobs && !failed) {
+            // Nothing buffered may be printed twice
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                sim_result_t result;
+                close(fd[0]);
+                print_model = false;
+                script_quiet = true;
+                sim_scenario = scenarios[started];
+                rng_state = sim_scenario.seed;
+                mc_fly(script, started, &result);
+                // Atomic, it is less than PIPE_BUF
+                write(fd[1], &result, sizeof(result));
+                _exit(0);
+            } else if (pid < 0) {
+                fprintf(stderr, "Error %d starting a flight. (%s)\n", errno, strerror(errno));
+                failed = true;
+            } else {
+                started++;
+                running++;
+            }
+            continue;
+        }
+        // Drain the pipe before reaping: with many jobs, children block
+        // in write() while it is full. A child that died without a
+        // result wakes nothing, hence the timeout
+        struct pollfd ready = { .fd = fd[0], .events = POLLIN };
+        poll(&ready, 1, 10);
+        mc_collect(fd[0], results, count);
+        while (0 < waitpid(-1, NULL, WNOHANG))
+            running--;
+    }
+    // A child writes its result before it exits
+    mc_collect(fd[0], results, count);
+    close(fd[0]);
+    close(fd[1]);
+    return failed ? -1 : 0;
+}
+
+// Number of CPUs, the default number of jobs
+// BP
+int mc_jobs(void) {
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    return jobs <= 0 ? 1 : jobs;
+}
+
+// Draws the perturbations of a flight
+// ---
+// Parameters: scenario: where to put them, seed: seed of the
+//     perturbations, run: number of the flight
+// Returns: nothing
+// BP
+void sim_scenario_draw(sim_scenario_t* scenario, uint64_t seed, int run) {
+    rng_state = seed ^ ((uint64_t) run << 32);
+    scenario->sensor.gyro_noise = MC_GYRO_NOISE * rng_uniform();
+    scenario->sensor.acc_noise = MC_ACC_NOISE * rng_uniform();
+    scenario->sensor.baro_noise = MC_BARO_NOISE * rng_uniform();
+    scenario->sensor.gyro_drift = MC_GYRO_DRIFT * rng_uniform();
+    scenario->sensor.acc_drift = MC_ACC_DRIFT * rng_uniform();
+    scenario->sensor.latency = rng_next() % (MC_LATENCY + 1);
+    for (int i = 0; i < 4; i++)
+        scenario->motor_gain[i] = 1 + MC_MOTOR_GAIN * (2 * rng_uniform() - 1);
+    scenario->phi = MC_ATTITUDE * (2 * rng_uniform() - 1);
+    scenario->theta = MC_ATTITUDE * (2 * rng_uniform() - 1);
+    scenario->p1 = lround(MC_TRIM_P1 * (2 * rng_uniform() - 1));
+    scenario->p2 = lround(MC_TRIM_P2 * (2 * rng_uniform() - 1));
+    scenario->yaw_p = lround(MC_TRIM_YAW_P * (2 * rng_uniform() - 1));
+    scenario->seed = rng_state;
+}
+
+// Flies the script with the perturbations of sim_scenario. The error
+// is the model's roll and pitch against the setpoint, and its yaw
+// rate against the setpoint. The flight fails if it could not start,
+// if the model flipped over or its attitude went NaN, if the motors
+// were never enabled or if an expect line of the script failed.
+// ---
+// Parameters: script: the script to fly, run: number of the flight,
+//     result: where to put the outcome
+// Returns: nothing
+// BP
+void mc_fly(const char* script, int run, sim_result_t* result) {
+    memset(result, 0, sizeof(*result));
+    result->run = run;
+
+    virtual_clock = true;
+    if (!sim_script_open(script) || init_all()) {
+        result->failure = SIM_FAILURE_SETUP;
+        return;
+    }
+
+    double e0[2] = { model.phi, model.theta };
+    double tracking = 0, yaw_tracking = 0, oscillation = 0;
+    uint16_t ae[QC_STATE_MOTOR_CNT] = {0};
+    uint32_t steps = 0, saturated = 0;
+    bool diverged = false;
+    while (sim_virtual_step()) {
+        // Also false for NaN
+        if (!(fabs(model.phi) <= M_PI / 2 && fabs(model.theta) <= M_PI / 2))
+            diverged = true;
+        double e[2] = {
+            model.phi - qc_state.orient.roll / 16384.0,
+            model.theta - qc_state.orient.pitch / 16384.0
+        };
+        result->settled = true;
+        for (int i = 0; i < 2; i++) {
+            if (MC_SETTLE_BAND < fabs(e[i]) || isnan(e[i])) {
+                result->settled = false;
+                result->settling_us = virtual_time_us;
+            }
+            if (e0[i] && result->overshoot < - copysign(e[i], e0[i]))
+                result->overshoot = - copysign(e[i], e0[i]);
+        }
+        if (enable_motors) {
+            steps++;
+            bool sat = false;
+            for (int i = 0; i < QC_STATE_MOTOR_CNT; i++) {
+                // Not from zero when the motors start
+                int32_t d = 1 < steps ? qc_state.motor.ae[i] - ae[i] : 0;
+                oscillation += d * d;
+                ae[i] = qc_state.motor.ae[i];
+                if (ae[i] == 0 || ae[i] == MAX_MOTOR_SPEED)
+                    sat = true;
+            }
+            saturated += sat;
+            double e_r = model.r - qc_state.orient.yaw / 1024.0;
+            tracking += e[0] * e[0] + e[1] * e[1];
+            yaw_tracking += e_r * e_r;
+        }
+    }
+    if (steps) {
+        result->saturation = (double) saturated / steps;
+        result->tracking = sqrt(tracking / steps);
+        result->yaw_tracking = sqrt(yaw_tracking / steps);
+        result->oscillation = sqrt(oscillation / (QC_STATE_MOTOR_CNT * steps));
+    }
+    if (diverged)
+        result->failure = SIM_FAILURE_DIVERGED;
+    else if (!steps)
+        result->failure = SIM_FAILURE_MOTORS_OFF;
+    else if (script_failures)
+        result->failure = SIM_FAILURE_EXPECT;
+}
+
+// Prints the flights, with -m, and their statistics. The statistics
+// are over the flights that did not fail, the settling time over the
+// ones that settled, "n/a" if there are none.
+// BP
+void mc_report(const sim_scenario_t* scenarios, sim_result_t* results, int runs,
+    int jobs, double seconds) {
+    double* settling = malloc(4 * runs * sizeof(double));
+    double* overshoot = settling + runs;
+    double* saturation = overshoot + runs;
+    double* tracking = saturation + runs;
+    int flown = 0, settled = 0;
+    int failures[SIM_FAILURE_CNT] = {0};
+    if (!settling)
+        return;
+
+    if (print_model)
+        printf("run,settled,settling_s,overshoot,saturation,gyro_noise,acc_noise,"
+            "baro_noise,gyro_drift,acc_drift,latency,"
+            "gain1,gain2,gain3,gain4,phi,theta,p1,p2,yaw_p,tracking,failure\n");
+    for (int i = 0; i < runs; i++) {
+        sim_result_t* r = &results[i];
+        if (print_model) {
+            const sim_scenario_t* s = &scenarios[i];
+            printf("%d,%d,%f,%f,%f,%f,%f,%f,%f,%f,%d,%f,%f,%f,%f,%f,%f,%d,%d,%d,%f,%s\n",
+                r->run, r->settled, r->settling_us / 1e6, r->overshoot, r->saturation,
+                s->sensor.gyro_noise, s->sensor.acc_noise, s->sensor.baro_noise,
+                s->sensor.gyro_drift, s->sensor.acc_drift, s->sensor.latency,
+                s->motor_gain[0], s->motor_gain[1],
+                s->motor_gain[2], s->motor_gain[3], s->phi, s->theta, s->p1, s->p2, s->yaw_p,
+                r->tracking, mc_failure_names[r->failure]);
+        }
+        failures[r->failure]++;
+        if (r->failure != SIM_FAILURE_NONE)
+            continue;
+        overshoot[flown] = r->overshoot;
+        saturation[flown] = 100 * r->saturation;
+        tracking[flown] = r->tracking;
+        flown++;
+        if (r->settled)
+            settling[settled++] = r->settling_us / 1e6;
+    }
+
+    fprintf(stderr, "%d flights in %.3f s with %d jobs, %.1f flights/s, %d failed\n",
+        runs, seconds, jobs, runs / seconds, runs - flown);
+    for (int i = SIM_FAILURE_NONE + 1; i < SIM_FAILURE_CNT; i++)
+        if (failures[i])
+            fprintf(stderr, "Failed:          %d %s\n", failures[i], mc_failure_names[i]);
+    fprintf(stderr, "Settled:         %d of %d\n", settled, flown);
+    fprintf(stderr, "                 mean      p50       p90       max\n");
+    mc_report_row("Settling [s]", settling, settled, 3);
+    mc_report_row("Overshoot [rad]", overshoot, flown, 4);
+    mc_report_row("Saturation [%]", saturation, flown, 2);
+    mc_report_row("Tracking [rad]", tracking, flown, 4);
+    free(settling);
+}
+
+// Prints the mean, median, 90th percentile and maximum of the values,
+// or n/a if there are none
+// BP
+void mc_report_row(const char* name, double* values, int count, int precision) {
+    fprintf(stderr, "%-16s ", name);
+    if (!count) {
+        fprintf(stderr, "n/a\n");
+        return;
+    }
+    fprintf(stderr, "%-9.*f %-9.*f %-9.*f %-9.*f\n",
+        precision, percentile(values, count, -1), precision, percentile(values, count, .5),
+        precision, percentile(values, count, .9), precision, percentile(values, count, 1));
+}
+
+// Percentile p of the values, sorting them, the mean for p < 0.
+// NAN if there are no values.
+// BP
+double percentile(double* values, int count, double p) {
+    if (!count)
+        return NAN;
+    if (p < 0) {
+        double sum = 0;
+        for (int i = 0; i < count; i++)
+            sum += values[i];
+        return sum / count;
+    }
+    qsort(values, count, sizeof(double), compare_double);
+    return values[(int) (p * (count - 1) + .5)];
+}
+
+// BP
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (y < x) - (x < y);
+}
+
+// Normally distributed random number with a standard deviation of 1
+// (Box-Muller, which gives them in pairs), the noise of the sensors
+// BP
+double sim_gauss(void) {
+    static bool have_spare = false;
+    static double spare;
+    if (have_spare) {
+        have_spare = false;
+        return spare;
+    }
+    double r = sqrt(-2 * log(1 - rng_uniform()));
+    double a = 2 * M_PI * rng_uniform();
+    spare = r * sin(a);
+    have_spare = true;
+    return r * cos(a);
+}
+
+// BP
+uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+// BP
+double rng_uniform(void) {
+    return (rng_next() >> 11) * (1.0 / (1ull << 53));
+}
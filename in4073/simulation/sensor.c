@@ -0,0 +1,110 @@
+#include "sensor.h"
+#include "simulation.h"
+#include "../mode_constants.h"
+#include <math.h>
+#include <string.h>
+
+// Native units of the raw readings
+// MPU-6050 accelerometer at +/- 2 g [LSB/g]
+#define SENSOR_ACC_LSB      16384.0
+// MPU-6050 gyro at +/- 2000 deg/s [rad/s per LSB], GYRO_CONV_CONST
+#define SENSOR_GYRO_LSB     (69.81317 / 65536)
+// Air pressure at the ground [Pa] and its change with the height,
+// z is down [Pa/m]
+#define SENSOR_PRESSURE_0   101325.0
+#define SENSOR_PRESSURE_DZ  12.0
+
+static int16_t sensor_clip(double value);
+static double sensor_noise(double sd);
+
+/** =======================================================
+ *  sensor_init -- Initialize the sensor emulation.
+ *  =======================================================
+ *  Parameters:
+ *  - sensor: The sensors to initialize, no samples and no bias.
+ *  - config: Their noise and latency.
+ *  Author: Boldizsar Palotas
+**/
+void sensor_init(sensor_t* sensor, const sensor_config_t* config) {
+    memset(sensor, 0, sizeof(*sensor));
+    sensor->config = *config;
+    if (sensor->config.latency < 0)
+        sensor->config.latency = 0;
+    if (SENSOR_BUFF_SIZE <= sensor->config.latency)
+        sensor->config.latency = SENSOR_BUFF_SIZE - 1;
+}
+
+/** =======================================================
+ *  sensor_sample -- Take a sample of the model.
+ *  =======================================================
+ *  The axes are those of the MPU on the board: the firmware
+ *  negates y and z of the accelerometer and q and r of the
+ *  gyro. The oldest sample is lost if the buffer is full.
+ *
+ *  Parameters:
+ *  - sensor: The sensors.
+ *  - model: The model after a step.
+ *  Author: Boldizsar Palotas
+**/
+void sensor_sample(sensor_t* sensor, const model_t* model) {
+    sensor_config_t* c = &sensor->config;
+    double drift_g = c->gyro_drift * sqrt(MODEL_T);
+    double drift_a = c->acc_drift * sqrt(MODEL_T);
+    for (int i = 0; i < 3; i++) {
+        sensor->gyro_bias[i] += sensor_noise(drift_g);
+        sensor->acc_bias[i] += sensor_noise(drift_a);
+    }
+
+    sensor_sample_t* s = &sensor->buff[(sensor->head + sensor->count) % SENSOR_BUFF_SIZE];
+    double a = SENSOR_ACC_LSB / MODEL_G;
+    s->sax = sensor_clip(  a * (model->ax + sensor->acc_bias[0] + sensor_noise(c->acc_noise)));
+    s->say = sensor_clip(- a * (model->ay + sensor->acc_bias[1] + sensor_noise(c->acc_noise)));
+    s->saz = sensor_clip(- a * (model->az + sensor->acc_bias[2] + sensor_noise(c->acc_noise)));
+    s->sp  = sensor_clip(  (model->p + sensor->gyro_bias[0] + sensor_noise(c->gyro_noise)) / SENSOR_GYRO_LSB);
+    s->sq  = sensor_clip(- (model->q + sensor->gyro_bias[1] + sensor_noise(c->gyro_noise)) / SENSOR_GYRO_LSB);
+    s->sr  = sensor_clip(- (model->r + sensor->gyro_bias[2] + sensor_noise(c->gyro_noise)) / SENSOR_GYRO_LSB);
+    s->pressure = lround(SENSOR_PRESSURE_0 + SENSOR_PRESSURE_DZ * model->z
+        + sensor_noise(c->baro_noise));
+
+    if (sensor->count < SENSOR_BUFF_SIZE)
+        sensor->count++;
+    else
+        sensor->head = (sensor->head + 1) % SENSOR_BUFF_SIZE;
+}
+
+/** =======================================================
+ *  sensor_read -- Read the oldest sample that is due.
+ *  =======================================================
+ *  A sample is due once config.latency newer samples have
+ *  been taken.
+ *
+ *  Parameters:
+ *  - sensor: The sensors.
+ *  - sample: Where to put the sample.
+ *  Returns: false if no sample is due.
+ *  Author: Boldizsar Palotas
+**/
+bool sensor_read(sensor_t* sensor, sensor_sample_t* sample) {
+    if (sensor->count <= sensor->config.latency)
+        return false;
+    *sample = sensor->buff[sensor->head];
+    sensor->head = (sensor->head + 1) % SENSOR_BUFF_SIZE;
+    sensor->count--;
+    return true;
+}
+
+// Rounds a reading to the range of the ADC
+// BP
+int16_t sensor_clip(double value) {
+    if (value < INT16_MIN)
+        return INT16_MIN;
+    if (INT16_MAX < value)
+        return INT16_MAX;
+    return (int16_t) lround(value);
+}
+
+// White noise of a standard deviation, none without it
+// BP
+double sensor_noise(double sd) {
+    return sd ? sd * sim_gauss() : 0;
+}
@@ -0,0 +1,78 @@
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "model.h"
+
+/** Sensor emulation
+ *  ================
+ *
+ *  Turns the model into the raw readings of the MPU-6050 and the
+ *  MS5611, in their native units and axes, so the simulation HAL
+ *  converts them like the firmware does (see process_raw_data in
+ *  in4073.c and qc_hal_get_inputs in qc_hal.c). The IMU samples at
+ *  the rate of the model (1/MODEL_T), the barometer with it.
+**/
+
+/** sensor_config_t
+ *  -------------------
+ *  Fields:
+ *  - gyro_noise, acc_noise, baro_noise: Standard deviation of the
+ *      white noise of a sample [rad/s], [m/s^2] and [Pa].
+ *  - gyro_drift, acc_drift: Random walk of the bias, standard
+ *      deviation after a second [rad/s] and [m/s^2].
+ *  - latency: Delay of the samples, in samples.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sensor_config {
+    double      gyro_noise;
+    double      acc_noise;
+    double      baro_noise;
+    double      gyro_drift;
+    double      acc_drift;
+    int         latency;
+} sensor_config_t;
+
+/** sensor_sample_t
+ *  Raw readings: sax..sr as read from the MPU FIFO (16384/g and
+ *  GYRO_CONV_CONST), pressure in Pa as read_baro() gives it.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sensor_sample {
+    int16_t     sax;
+    int16_t     say;
+    int16_t     saz;
+    int16_t     sp;
+    int16_t     sq;
+    int16_t     sr;
+    int32_t     pressure;
+} sensor_sample_t;
+
+// Most samples delayed and not read yet
+#define SENSOR_BUFF_SIZE    64
+
+/** sensor_t
+ *  -------------------
+ *  Fields:
+ *  - config: The noise and latency.
+ *  - gyro_bias, acc_bias: The current bias of the axes.
+ *  - buff, head, count: The samples not read yet.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sensor {
+    sensor_config_t config;
+    double          gyro_bias[3];
+    double          acc_bias[3];
+    sensor_sample_t buff[SENSOR_BUFF_SIZE];
+    int             head;
+    int             count;
+} sensor_t;
+
+void sensor_init(sensor_t* sensor, const sensor_config_t* config);
+
+void sensor_sample(sensor_t* sensor, const model_t* model);
+
+bool sensor_read(sensor_t* sensor, sensor_sample_t* sample);
+
+#endif // SENSOR_H
@@ -1,5 +1,4 @@
 #include "simulation.h"
-#include "model.h"
 #include <stdio.h>
 #include <time.h>
 #include <sys/types.h>
@@ -10,9 +9,14 @@
 #include <unistd.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <ctype.h>
+#include <getopt.h>
+#include "../mode_constants.h"
 
 model_t             model;
+sensor_t            sensor;
+uint64_t            model_steps;
 
 qc_system_t         qc_system;
 qc_mode_table_t     qc_mode_tables[MODE_COUNT];
@@ -29,6 +33,34 @@ uint32_t            iteration;
 int fifo_to_term;
 int fifo_to_sim;
 
+// Virtual clock mode: the time only advances by SIM_PERIOD_US per
+// control step and the serial input comes from a script
+bool                virtual_clock;
+uint32_t            virtual_time_us;
+FILE*               script_file;
+sim_script_line_t   script_line;
+bool                script_pending;
+serialcomm_t        script_serialcomm;
+uint32_t            script_keep_alive;
+// Bytes encoded from the script, not read by the Quadcopter yet
+#define SCRIPT_BUFF_SIZE 1024
+uint8_t             script_buff[SCRIPT_BUFF_SIZE];
+int                 script_head;
+int                 script_tail;
+// Number of expect lines the flight failed
+int                 script_failures;
+// Whether the failures and warnings of the script are only counted,
+// for the Monte Carlo flights, which report them per flight
+bool                script_quiet;
+// Mode of the Quadcopter after the previous step
+qc_mode_t           script_mode;
+// Where the bytes to the PC are written, -1 to drop them
+int                 output_fd = -1;
+bool                print_model;
+
+// Perturbations of the flight, none by default
+sim_scenario_t      sim_scenario = { .motor_gain = {1, 1, 1, 1} };
+
 // String buffer
 #define STRBUFF_SIZE 1024
 int strbuff_idx = 0;
@@ -51,7 +83,8 @@ static void sim_rx_complete(message_t*);
 static bool sim_flash_init(void);
 static bool sim_flash_read(uint32_t, uint8_t*, uint32_t);
 static bool sim_flash_write(uint32_t, uint8_t*, uint32_t);
-static bool sim_flash_erase(void);
+static bool sim_flash_erase_sector(uint32_t);
+static bool sim_flash_busy(void);
 
 static void sim_void(void);
 
@@ -59,36 +92,178 @@ static int init_fifos(void);
 
 static uint32_t time_get_us(void);
 
+static void sim_step(void);
+static void sim_print_model(void);
+static bool sim_script_read(void);
+static void sim_script_run(uint32_t now);
+static void sim_script_expect(const sim_script_line_t* l);
+static void sim_script_check_mode(void);
+static void sim_script_tx_byte(uint8_t);
+
 bool timer_tick = false;
 unsigned long long timer_last_tick;
 
 
 // Simulation entry point
+// Without arguments the simulation runs in real time and talks to
+// the PC terminal through the FIFOs. With -s it runs a script on a
+// virtual clock as fast as it can (see sim_script_read).
 // B Palotas
-int main(void) {
+int main(int argc, char* argv[]) {
     int i;
+    const char* script = NULL;
+    const char* output = NULL;
+    int runs = 0;
+    int jobs = 0;
+    uint64_t seed = 1;
+    int iterations = 0;
+
+    while ((i = getopt(argc, argv, "s:o:mn:j:r:t:h")) != -1) {
+        switch (i) {
+        case 's':
+            script = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'm':
+            print_model = true;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                "Usage: %s [-s script [-o output] [-m] [-n runs [-j jobs] [-r seed]] [-t iterations]]\n"
+                "  -s: run the script on a virtual clock instead of the FIFOs\n"
+                "  -o: write the bytes sent to the PC to this file\n"
+                "  -m: print the model state after every step to stdout,\n"
+                "      or every scenario with -n\n"
+                "  -n: fly the script this many times, randomly perturbed\n"
+                "  -j: number of flights at a time, the number of CPUs by default\n"
+                "  -r: seed of the perturbations\n"
+                "  -t: tune the gains in at most this many iterations, flying\n"
+                "      every candidate in the -n perturbed flights or unperturbed,\n"
+                "      and print the defaults for mode_constants.h\n",
+                argv[0]);
+            return i == 'h' ? 0 : 2;
+        }
+    }
+
+    if (script && 0 < iterations)
+        return sim_autotune(script, runs, jobs, seed, iterations);
+
+    if (script && 0 < runs)
+        return sim_monte_carlo(script, runs, jobs, seed);
+
+    if (script) {
+        virtual_clock = true;
+        if (!sim_script_open(script))
+            return -1;
+        if (output && (output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            fprintf(stderr, "Error %d opening %s. (%s)\n", errno, output, strerror(errno));
+            return -1;
+        }
+    }
+
     if ((i = init_all())) {
         fprintf(stderr, "Error initalizing.\n");
         return -1;
     }
 
+    if (virtual_clock) {
+        struct timespec start, end;
+        uint32_t steps = 0, saturated = 0;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        while (sim_virtual_step()) {
+            if (!enable_motors)
+                continue;
+            steps++;
+            for (i = 0; i < QC_STATE_MOTOR_CNT; i++)
+                if (qc_state.motor.ae[i] == MAX_MOTOR_SPEED) {
+                    saturated++;
+                    break;
+                }
+        }
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "Simulated %.2f s in %.3f s, %.0f model steps/s.\n",
+            virtual_time_us / 1e6, seconds, model_steps / seconds);
+        fprintf(stderr, "A motor at MAX_MOTOR_SPEED in %"PRIu32" of %"PRIu32" steps.\n",
+            saturated, steps);
+        if (script_failures)
+            fprintf(stderr, "%d expect lines failed.\n", script_failures);
+        if (output_fd != -1)
+            close(output_fd);
+        fclose(script_file);
+        return script_failures ? 1 : 0;
+    }
+
     fprintf(stderr, "Starting simulation.\n");
 
     while (1) {
         if (sim_check_timer_flag()) {
-            qc_system_step(&qc_system);
-            sim_display();
+            sim_step();
             sim_clear_timer_flag();
         }
 
-        sim_comm_send_text();
-
         int c;
         while (0 <= (c = sim_comm_getchar()))
             serialcomm_receive_char(&serialcomm, c);
     }
 }
 
+// One control period of a scripted flight on the virtual clock.
+// The Quadcopter runs as long as the script has lines left.
+// Returns: false if the script is over
+// BP
+bool sim_virtual_step(void) {
+    if (!script_pending)
+        return false;
+    sim_script_run(virtual_time_us);
+    int c;
+    while (0 <= (c = sim_comm_getchar()))
+        serialcomm_receive_char(&serialcomm, c);
+    virtual_time_us += SIM_PERIOD_US;
+    sim_step();
+    sim_script_check_mode();
+    return true;
+}
+
+// One control period: the Quadcopter, then the model it controls
+// BP
+void sim_step(void) {
+    trace_event(TRACE_INSTANT | TRACE_TIMER_IRQ, time_get_us());
+    trace_event(TRACE_BEGIN | TRACE_CONTROL, time_get_us());
+    sim_hal.get_inputs_fn(&qc_state);
+    qc_system_step(&qc_system);
+    trace_event(TRACE_END | TRACE_CONTROL, time_get_us());
+    trace_event(TRACE_BEGIN | TRACE_LOG_DATA, time_get_us());
+    qc_system_log_data(&qc_system);
+    trace_event(TRACE_END | TRACE_LOG_DATA, time_get_us());
+    for (int i = 0; i < SIM_MODEL_STEPS; i++) {
+        model_step(&model);
+        sensor_sample(&sensor, &model);
+    }
+    model_steps += SIM_MODEL_STEPS;
+    sim_display();
+
+    if (strbuff_idx) {
+        trace_event(TRACE_BEGIN | TRACE_TEXT, time_get_us());
+        sim_comm_send_text();
+        trace_event(TRACE_END | TRACE_TEXT, time_get_us());
+    }
+}
+
 // Simulation-specific init functions
 // B Palotas
 int init_all(void) {
@@ -96,13 +271,18 @@ int init_all(void) {
     qc_hal_init(&sim_hal);
     init_modes();
     model_init(&model);
+    model.phi = sim_scenario.phi;
+    model.theta = sim_scenario.theta;
+    sensor_init(&sensor, &sim_scenario.sensor);
     int i;
-    if ((i = init_fifos())) {
+    if (!virtual_clock && (i = init_fifos())) {
         if (i == -1) {
             fprintf(stderr, "Error creating FIFO to PC.\n");
             return -1;
         }
     }
+    if (!virtual_clock)
+        output_fd = fifo_to_term;
     timer_last_tick = time_get_us();
     qc_system_init(
         &qc_system,
@@ -114,6 +294,11 @@ int init_all(void) {
         &sim_rx_complete,
         &sim_hal
     );
+    // The sensors are emulated as in raw mode
+    qc_state.option.raw_control = true;
+    qc_state.trim.p1 = sim_scenario.p1;
+    qc_state.trim.p2 = sim_scenario.p2;
+    qc_state.trim.yaw_p = sim_scenario.yaw_p;
     return 0;
 }
 
@@ -131,7 +316,7 @@ void init_modes(void) {
 // BP
 bool sim_check_timer_flag(void) {
     unsigned long long t_us = time_get_us();
-    if (10000 <= t_us - timer_last_tick) {
+    if (SIM_PERIOD_US <= t_us - timer_last_tick) {
         timer_tick = true;
         timer_last_tick = t_us;
         return true;
@@ -148,7 +333,17 @@ void sim_clear_timer_flag(void) {
 // Debug output
 // BP
 void sim_display(void) {
-    // TODO display debug information
+    if (print_model)
+        sim_print_model();
+}
+
+// Prints the time, position, attitude and motor speeds of the model
+// as a line of CSV
+// BP
+void sim_print_model(void) {
+    printf("%"PRIu32",%f,%f,%f,%f,%f,%f,%d,%d,%d,%d\n", time_get_us(),
+        model.x, model.y, model.z, model.phi, model.theta, model.psi,
+        qc_state.motor.ae1, qc_state.motor.ae2, qc_state.motor.ae3, qc_state.motor.ae4);
 }
 
 // Communication
@@ -221,6 +416,13 @@ void sim_comm_send_text(void) {
 int sim_comm_getchar(void) {
     unsigned char c;
     int r;
+    if (virtual_clock) {
+        if (script_head == script_tail)
+            return -1;
+        c = script_buff[script_tail];
+        script_tail = (script_tail + 1) % SCRIPT_BUFF_SIZE;
+        return c;
+    }
     if ((r = read(fifo_to_sim, &c, 1)) == 1) {
         //fprintf(stderr, "> %c (%d)\n", isprint(c) ? c : ' ', c);
         return c; // Successful read
@@ -242,11 +444,14 @@ void qc_hal_init(qc_hal_t* hal) {
     hal->get_inputs_fn = sim_get_inputs_fn;
     hal->set_outputs_fn = sim_set_outputs_fn;
     hal->tx_byte_fn = sim_tx_byte_fn;
+    hal->tx_frame_fn = 0;
+    hal->tx_flush_fn = (void(*)(bool)) sim_void;
 
     hal->flash_init_fn = sim_flash_init;
     hal->flash_read_fn = sim_flash_read;
     hal->flash_write_fn = sim_flash_write;
-    hal->flash_erase_fn = sim_flash_erase;
+    hal->flash_erase_sector_fn = sim_flash_erase_sector;
+    hal->flash_busy_fn = sim_flash_busy;
 
     hal->imu_init_fn = (void(*)(bool, uint16_t)) sim_void;
 
@@ -256,30 +461,45 @@ void qc_hal_init(qc_hal_t* hal) {
 
 // BP
 void sim_tx_byte_fn(uint8_t byte) {
-    write(fifo_to_term, &byte, 1);
+    if (output_fd != -1)
+        write(output_fd, &byte, 1);
 }
 
 // BP
 void sim_get_inputs_fn(qc_state_t* state) {
+    sensor_sample_t sample;
+    int32_t pressure = -1;
     state->sensor.voltage = 1100;
-    state->sensor.pressure = 100;
     state->sensor.temperature = 100;
-    state->sensor.sax = (int32_t)(model.ax * 256 * 256);
-    state->sensor.say = (int32_t)(model.ay * 256 * 256);
-    state->sensor.saz = (int32_t)(model.az * 256 * 256);
-    state->sensor.sp = (int32_t)(model.p * 256 * 256);
-    state->sensor.sq = (int32_t)(model.q * 256 * 256);
-    state->sensor.sr = (int32_t)(model.r * 256 * 256);
-    qc_kalman_filter(state);
+    // The IMU samples since the last control step, converted and
+    // filtered one by one as in process_raw_data()
+    while (sensor_read(&sensor, &sample)) {
+        state->sensor.sax =  sample.sax * ACC_G_SCALE_INV - state->offset.sax;
+        state->sensor.say = -sample.say * ACC_G_SCALE_INV - state->offset.say;
+        state->sensor.saz = -sample.saz * ACC_G_SCALE_INV - state->offset.saz;
+        state->sensor.sp  = GYRO_CONV_FROM_NATIVE( sample.sp) - state->offset.sp;
+        state->sensor.sq  = GYRO_CONV_FROM_NATIVE(-sample.sq) - state->offset.sq;
+        state->sensor.sr  = GYRO_CONV_FROM_NATIVE(-sample.sr) - state->offset.sr;
+        acc_filter(state);
+        qc_kalman_filter(state);
+        pressure = sample.pressure;
+    }
+    // The newest pressure as in qc_hal_get_inputs()
+    if (0 <= pressure) {
+        state->sensor.pressure = pressure * BARO_SCALE_INV - state->offset.pressure;
+        state->sensor.prev_pressure_avg = state->sensor.pressure_avg;
+        state->sensor.pressure_avg -= state->sensor.pressure_avg >> PRESSURE_AVERAGE_SHIFT;
+        state->sensor.pressure_avg += state->sensor.pressure >> PRESSURE_AVERAGE_SHIFT;
+    }
 }
 
 // BP
 void sim_set_outputs_fn(qc_state_t* state) {
     if (enable_motors) {
-        model.ae1sq = state->motor.ae1 * state->motor.ae1;
-        model.ae2sq = state->motor.ae2 * state->motor.ae2;
-        model.ae3sq = state->motor.ae3 * state->motor.ae3;
-        model.ae4sq = state->motor.ae4 * state->motor.ae4;
+        model.ae1sq = sim_scenario.motor_gain[0] * state->motor.ae1 * state->motor.ae1;
+        model.ae2sq = sim_scenario.motor_gain[1] * state->motor.ae2 * state->motor.ae2;
+        model.ae3sq = sim_scenario.motor_gain[2] * state->motor.ae3 * state->motor.ae3;
+        model.ae4sq = sim_scenario.motor_gain[3] * state->motor.ae4 * state->motor.ae4;
     } else {
         model.ae1sq = 0;
         model.ae2sq = 0;
@@ -300,6 +520,8 @@ void sim_rx_complete(message_t* message) {
 
 // BP
 uint32_t time_get_us(void) {
+    if (virtual_clock)
+        return virtual_time_us;
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
     return (uint32_t)(ts.tv_sec * 1000000ull + ts.tv_nsec / 1000ull);
@@ -327,9 +549,160 @@ bool sim_flash_write(uint32_t addr, uint8_t* buf, uint32_t size) {
 }
 
 // BP
-bool sim_flash_erase(void) {
+bool sim_flash_erase_sector(uint32_t addr) {
+    addr &= ~0xFFFul;
+    for (uint32_t i = 0; i < 0x1000 && addr + i < LOGBUFF_SIZE; i++) {
+        logbuff[addr + i] = 0xFF;
+    }
+    return true;
+}
+
+// BP
+bool sim_flash_busy(void) {
+    return false;
+}
+
+// BP
+void sim_void(void) {}
+
+// Scripted serial input
+// ---------------------
+
+// Opens the script and reads its first line. The commands are sent
+// with their own serialcomm channel, like the PC terminal does.
+// BP
+bool sim_script_open(const char* path) {
+    if (!(script_file = fopen(path, "r"))) {
+        fprintf(stderr, "Error %d opening %s. (%s)\n", errno, path, strerror(errno));
+        return false;
+    }
+    serialcomm_init(&script_serialcomm);
+    script_serialcomm.tx_byte = sim_script_tx_byte;
+    serialcomm_send_start(&script_serialcomm);
+    serialcomm_send_restart_request(&script_serialcomm);
+    script_keep_alive = 0;
+    script_pending = sim_script_read();
     return true;
 }
 
+// Reads the next command of the script. A line is
+//   <time ms> <command> <arguments>
+// where the command is one of
+//   mode <mode>                    MESSAGE_SET_MODE_ID
+//   orient <lift> <roll> <pitch> <yaw>
+//                                  in the units of the PC terminal
+//   trim <p1> <p2> <yaw p>         MESSAGE_SET_P12_ID
+//   msg <id> <value a> <value b>   any message
+//   expect <roll> <pitch> <band>   nothing sent, fails the flight if
+//                                  the model's attitude is further
+//                                  than band from it [deg]
+//   end                            nothing, the last line
+// The times must not decrease. Empty lines and lines starting with
+// # are skipped. The simulation ends after the last line. scripts/
+// has examples, e.g. scripts/hover.txt takes off and hovers.
 // BP
-void sim_void(void) {}
\ No newline at end of file
+bool sim_script_read(void) {
+    char line[256];
+    while (fgets(line, sizeof(line), script_file)) {
+        sim_script_line_t* l = &script_line;
+        uint32_t ms;
+        int n = sscanf(line, "%"SCNu32" %15s %"SCNi32" %"SCNi32" %"SCNi32" %"SCNi32,
+            &ms, l->command, &l->arg[0], &l->arg[1], &l->arg[2], &l->arg[3]);
+        if (n <= 0 || line[0] == '#')
+            continue;
+        if (n == 1) {
+            fprintf(stderr, "Script line without a command: %s", line);
+            continue;
+        }
+        l->time_us = ms * 1000;
+        l->argc = n - 2;
+        return true;
+    }
+    return false;
+}
+
+// Sends the commands of the script due by now and a keep alive
+// message when the channel has been quiet, like the PC terminal
+// BP
+void sim_script_run(uint32_t now) {
+    while (script_pending && script_line.time_us <= now) {
+        sim_script_line_t* l = &script_line;
+        message_t message = { .ID = 0xFF, .value.v32 = {0, 0} };
+        if (!strcmp(l->command, "mode") && l->argc == 1) {
+            message.ID = MESSAGE_SET_MODE_ID;
+            MESSAGE_SET_MODE_VALUE(&message) = l->arg[0];
+        } else if (!strcmp(l->command, "orient") && l->argc == 4) {
+            // The same conversion as pc_command.c
+            message.ID = MESSAGE_SET_LIFT_ROLL_PITCH_YAW_ID;
+            MESSAGE_SET_LIFT_VALUE(&message)  = l->arg[0];
+            MESSAGE_SET_ROLL_VALUE(&message)  = RADIAN_FROM_DEGREE(l->arg[1]);
+            MESSAGE_SET_PITCH_VALUE(&message) = RADIAN_FROM_DEGREE(l->arg[2]);
+            MESSAGE_SET_YAW_VALUE(&message)   = FP_CHUNK(RADIAN_FROM_DEGREE(l->arg[3]), 10, 14);
+        } else if (!strcmp(l->command, "trim") && l->argc == 3) {
+            message.ID = MESSAGE_SET_P12_ID;
+            MESSAGE_SET_P1_VALUE(&message)   = l->arg[0];
+            MESSAGE_SET_P2_VALUE(&message)   = l->arg[1];
+            MESSAGE_SET_YAWP_VALUE(&message) = l->arg[2];
+        } else if (!strcmp(l->command, "msg") && l->argc == 3) {
+            message.ID = l->arg[0];
+            message.value.v32[0] = l->arg[1];
+            message.value.v32[1] = l->arg[2];
+        } else if (!strcmp(l->command, "expect") && l->argc == 3) {
+            sim_script_expect(l);
+        } else if (strcmp(l->command, "end")) {
+            fprintf(stderr, "Unknown script command at %"PRIu32" ms: %s\n",
+                l->time_us / 1000, l->command);
+        }
+        if (message.ID != 0xFF) {
+            serialcomm_quick_send(&script_serialcomm, message.ID,
+                message.value.v32[0], message.value.v32[1]);
+            script_keep_alive = now;
+        }
+        script_pending = sim_script_read();
+    }
+    if (150000 < now - script_keep_alive) {
+        serialcomm_quick_send(&script_serialcomm, MESSAGE_KEEP_ALIVE_ID, 0, 0);
+        script_keep_alive = now;
+    }
+}
+
+// Checks the attitude of the model against an expect line
+// BP
+void sim_script_expect(const sim_script_line_t* l) {
+    double roll = model.phi * 180 / M_PI;
+    double pitch = model.theta * 180 / M_PI;
+    if (fabs(roll - l->arg[0]) <= l->arg[2] && fabs(pitch - l->arg[1]) <= l->arg[2])
+        return;
+    script_failures++;
+    if (!script_quiet)
+        fprintf(stderr, "Expected roll %"PRId32" and pitch %"PRId32" +-%"PRId32" deg at %"PRIu32
+            " ms, the model is at %.2f and %.2f.\n", l->arg[0], l->arg[1], l->arg[2],
+            l->time_us / 1000, roll, pitch);
+}
+
+// Warns when the Quadcopter enters a mode that flies with the motors
+// disabled: the script most likely misses enabling them at zero lift
+// (msg 4 0x10001 1) and the model stays on the ground
+// BP
+void sim_script_check_mode(void) {
+    qc_mode_t mode = qc_system.mode;
+    if (mode == script_mode)
+        return;
+    script_mode = mode;
+    if ((mode == MODE_2_MANUAL || mode == MODE_4_YAW || mode == MODE_5_FULL_CONTROL)
+            && !qc_state.option.enable_motors && !script_quiet)
+        fprintf(stderr, "Warning: mode %d at %"PRIu32" ms with the motors disabled.\n",
+            mode, virtual_time_us / 1000);
+}
+
+// Queues a byte for the Quadcopter to receive
+// BP
+void sim_script_tx_byte(uint8_t byte) {
+    int head = (script_head + 1) % SCRIPT_BUFF_SIZE;
+    if (head == script_tail) {
+        fprintf(stderr, "Script buffer full, byte dropped.\n");
+        return;
+    }
+    script_buff[script_head] = byte;
+    script_head = head;
+}
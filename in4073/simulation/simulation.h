@@ -19,6 +19,12 @@
  *     +-----------+ +----------------+         +------------+
  *     | PC screen | | PC keyboard/js |
  *     +-----------+ +----------------+
+ *
+ *  With a script (sim -s), the pipes are replaced: the commands of
+ *  the script are encoded into the serial input, the output goes to
+ *  a file or is dropped. The clock is virtual then, it advances by a
+ *  control period per step, so the Quadcopter and the model run in
+ *  lockstep as fast as the host allows.
 **/
 
 // Standard includes
@@ -35,6 +41,98 @@
 #include "../mode_1_panic.h"
 #include "../mode_3_calibrate.h"
 #include "../mode_5_full.h"
+#include "../trace.h"
+
+// Simulation includes
+#include "model.h"
+#include "sensor.h"
+
+// Length of a control period and the steps of the model in it
+#define SIM_PERIOD_US 10000
+#define SIM_MODEL_STEPS ((int) (SIM_PERIOD_US / (MODEL_T * 1000000) + .5))
+
+/** sim_script_line_t
+ *  A command of the simulation script (see sim_script_read)
+ *  -------------------
+ *  Fields:
+ *  - time_us: When to send the command, on the virtual clock.
+ *  - command: Name of the command.
+ *  - arg, argc: Its arguments.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sim_script_line {
+    uint32_t    time_us;
+    char        command[16];
+    int32_t     arg[4];
+    int         argc;
+} sim_script_line_t;
+
+/** sim_scenario_t
+ *  Perturbations of a simulated flight (see montecarlo.c)
+ *  -------------------
+ *  Fields:
+ *  - sensor: Noise, drift and latency of the sensors.
+ *  - motor_gain: Factor of the thrust of each motor.
+ *  - phi, theta: Initial attitude of the model [rad].
+ *  - p1, p2, yaw_p: Trimming of the gains, as with the keyboard.
+ *  - seed: Seed of the sensor noise.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sim_scenario {
+    sensor_config_t sensor;
+    double      motor_gain[4];
+    double      phi;
+    double      theta;
+    int16_t     p1;
+    int16_t     p2;
+    int16_t     yaw_p;
+    uint64_t    seed;
+} sim_scenario_t;
+
+// Why a simulated flight does not count (sim_result_t)
+typedef enum sim_failure {
+    SIM_FAILURE_NONE = 0,
+    SIM_FAILURE_LOST,           // No result came back from the flight
+    SIM_FAILURE_SETUP,          // The script or the simulation did not start
+    SIM_FAILURE_MOTORS_OFF,     // The motors were never enabled
+    SIM_FAILURE_DIVERGED,       // The attitude went NaN or over 90 degrees
+    SIM_FAILURE_EXPECT,         // An expect line of the script failed
+    SIM_FAILURE_CNT
+} sim_failure_t;
+
+/** sim_result_t
+ *  Outcome of a simulated flight
+ *  -------------------
+ *  Fields:
+ *  - run: Number of the flight.
+ *  - failure: Why the flight does not count, SIM_FAILURE_NONE if
+ *      it does. The other fields are only meaningful if it does.
+ *  - settled: The attitude error was within the band at the end.
+ *  - settling_us: Time of the last step the attitude error was
+ *      out of the band [us].
+ *  - overshoot: Largest attitude error against the sign of the
+ *      initial one [rad].
+ *  - saturation: Fraction of the steps with a motor at zero or
+ *      at MAX_MOTOR_SPEED.
+ *  - tracking: RMS of the roll and pitch error [rad].
+ *  - yaw_tracking: RMS of the yaw rate error [rad/s].
+ *  - oscillation: RMS of the change of the motor speeds between
+ *      two steps.
+ *  The errors and the saturation are over the steps with the
+ *  motors enabled.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct sim_result {
+    int         run;
+    sim_failure_t failure;
+    bool        settled;
+    uint32_t    settling_us;
+    double      overshoot;
+    double      saturation;
+    double      tracking;
+    double      yaw_tracking;
+    double      oscillation;
+} sim_result_t;
 
 // Simulation-specific functions
 // -----------------------------
@@ -43,6 +141,16 @@
 int init_all(void);
 void init_modes(void);
 
+// Scripted flights on the virtual clock
+bool sim_script_open(const char* path);
+bool sim_virtual_step(void);
+int sim_fly_all(const char* script, const sim_scenario_t* scenarios, int count,
+    int jobs, sim_result_t* results);
+void sim_scenario_draw(sim_scenario_t* scenario, uint64_t seed, int run);
+int sim_monte_carlo(const char* script, int runs, int jobs, uint64_t seed);
+int sim_autotune(const char* script, int scenarios, int jobs, uint64_t seed, int iterations);
+double sim_gauss(void);
+
 // Timing
 bool sim_check_timer_flag(void);
 void sim_clear_timer_flag(void);
@@ -65,5 +173,14 @@ int simulation_printf(const char* fmt, ...);
 
 extern bool is_test_device;
 extern uint32_t led_patterns[];
+extern bool virtual_clock;
+extern uint32_t virtual_time_us;
+extern bool enable_motors;
+extern bool print_model;
+extern qc_state_t qc_state;
+extern model_t model;
+extern sim_scenario_t sim_scenario;
+extern int script_failures;
+extern bool script_quiet;
 
 #endif // SIMULATION_H
@@ -0,0 +1,111 @@
+#ifndef IN4073_H__
+#define IN4073_H__
+
+/** Host stand-in for in4073.h
+ *  ==========================
+ *
+ *  The drivers include in4073.h, which pulls in the nRF51 headers.
+ *  The host tests of the drivers put this directory first on the
+ *  include path instead: it declares only what they use, copied
+ *  from in4073.h, with the Cortex-M intrinsics mapped to the host.
+ *  The peripherals are structs that the test drives (see
+ *  test_twi.c): the interrupt handler runs when the test calls
+ *  mock_irq(), which a critical section defers to its end.
+**/
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sched.h>
+#include "nrf51_bitfields.h"
+
+// The barrier orders the data and the index of a queue between
+// the producer and the consumer thread
+#define __DMB() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// Queue
+// Single producer, single consumer: lock-free between one ISR and the
+// main loop. Must be power of 2
+#define QUEUE_SIZE 256
+typedef struct {
+	uint8_t Data[QUEUE_SIZE];
+	volatile uint32_t first; // Written by the consumer only
+	volatile uint32_t last;  // Written by the producer only
+} queue;
+void init_queue(queue *q);
+void enqueue(queue *q, char x);
+char dequeue(queue *q);
+uint32_t enqueue_n(queue *q, const uint8_t *data, uint32_t n);
+uint32_t dequeue_n(queue *q, uint8_t *data, uint32_t n);
+static inline uint32_t queue_count(queue *q) { return q->last - q->first; }
+
+// Critical sections nest, the interrupt handler runs at the end
+// of the outermost one. Masking the interrupts also keeps the ISR
+// and a critical section apart, between the threads of a test (see
+// test_queue.c) the outermost one takes mock_critical_lock instead.
+extern _Thread_local int mock_critical_level;
+extern bool mock_critical_lock;
+void mock_irq(void);
+static inline void CRITICALSECTION_FastEnter(void) {
+	if (!mock_critical_level++)
+		while (__atomic_test_and_set(&mock_critical_lock, __ATOMIC_ACQUIRE))
+			sched_yield();
+}
+static inline void CRITICALSECTION_FastExit(void) {
+	if (!--mock_critical_level) {
+		__atomic_clear(&mock_critical_lock, __ATOMIC_RELEASE);
+		mock_irq();
+	}
+}
+#define NVIC_ClearPendingIRQ(irq)
+#define NVIC_SetPriority(irq, prio)
+#define NVIC_EnableIRQ(irq)
+#define nrf_gpio_cfg(...)
+
+// The registers of the TWI peripheral that drivers/twi.c uses
+typedef struct {
+	volatile uint32_t TASKS_STARTRX, TASKS_STARTTX, TASKS_STOP, TASKS_SUSPEND, TASKS_RESUME;
+	volatile uint32_t EVENTS_STOPPED, EVENTS_RXDREADY, EVENTS_TXDSENT, EVENTS_ERROR;
+	volatile uint32_t SHORTS, INTENSET, ERRORSRC, ENABLE, PSELSCL, PSELSDA;
+	volatile uint32_t RXD, TXD, FREQUENCY, ADDRESS;
+} mock_twi_t;
+extern mock_twi_t mock_twi;
+#define NRF_TWI0 (&mock_twi)
+void SPI0_TWI0_IRQHandler(void);
+
+// Timers
+uint32_t get_time_us(void);
+
+// TWI
+// Transactions are queued and run by the TWI interrupt handler, which
+// also calls done_fn when one completes (see drivers/twi.c). A write
+// of length 0 only sends reg, e.g. a command byte.
+#define TWI_SCL	4
+#define TWI_SDA	2
+typedef enum twi_status {
+	TWI_DONE,
+	TWI_PENDING,
+	TWI_ERROR,
+	TWI_TIMEOUT
+} twi_status_t;
+typedef struct twi_xfer {
+	uint8_t addr;
+	uint8_t reg;
+	uint8_t length;
+	bool write;
+	uint8_t *data;
+	void (*done_fn)(struct twi_xfer *xfer);
+	volatile twi_status_t status;
+	// Used by the driver
+	uint8_t pos;
+	bool error;
+	struct twi_xfer *next;
+} twi_xfer_t;
+void twi_init(void);
+bool twi_submit(twi_xfer_t *xfer);
+bool twi_busy(void);
+bool twi_check_timeout(void);
+bool i2c_write(uint8_t slave_addr, uint8_t reg_addr, uint8_t length, uint8_t const *data);
+bool i2c_read(uint8_t slave_addr, uint8_t reg_addr, uint8_t length, uint8_t *data);
+
+#endif // IN4073_H__
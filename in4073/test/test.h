@@ -0,0 +1,44 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+
+/** Host tests
+ *  ==========
+ *
+ *  Each test is a program built from the Quadcopter sources with
+ *  the host compiler (see the Makefile). It checks its module with
+ *  TEST_CHECK, prints what it measured and returns the number of
+ *  failed checks, so `make -C test` stops at the first failing one.
+**/
+
+static int test_failures;
+
+// Counts and reports a failed condition
+#define TEST_CHECK(cond, ...) do {                                  \
+        if (!(cond)) {                                              \
+            test_failures++;                                        \
+            fprintf(stderr, "%s:%d: FAILED: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__);                           \
+            fprintf(stderr, "\n");                                  \
+        }                                                           \
+    } while (0)
+
+// Prints the result of a test, returns the value for main
+static inline int test_result(const char* name) {
+    fflush(stdout);
+    fprintf(stderr, "%s: %s\n", name, test_failures ? "FAILED" : "OK");
+    return test_failures;
+}
+
+// Monotonic time for the benchmarks [ns]
+static inline uint64_t test_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif // TEST_H
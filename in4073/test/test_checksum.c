@@ -0,0 +1,93 @@
+#include "test.h"
+#include "../serialcomm.h"
+#include <stdlib.h>
+
+/** Frame checksum (user-002)
+ *  Flips every single bit and every pair of bits of random frames
+ *  and counts the corrupted frames that are still delivered. The
+ *  CRC-8 has to catch all of them, the XOR checksum is built as
+ *  test_checksum_xor to compare. Also times serialcomm_send(),
+ *  which computes the checksum.
+**/
+
+#define FRAMES      200
+#define SENDS       10000000
+
+static uint8_t wire[2 * FRAME_SIZE];
+static int wire_len;
+static int received_cnt;
+
+static void tx(uint8_t c) {
+    wire[wire_len++] = c;
+}
+
+static void rx(message_t* message) {
+    (void) message;
+    received_cnt++;
+}
+
+// Feeds a frame with bits a and b flipped (-1 for none) to a fresh
+// receiver, returns whether it was delivered
+static bool deliver(const uint8_t* frame, int a, int b) {
+    serialcomm_t sc;
+    frame_t rx_frame;
+    superframe_t rx_superframe;
+    serialcomm_init(&sc);
+    sc.rx_frame = &rx_frame;
+    sc.rx_superframe = &rx_superframe;
+    sc.rx_complete_callback = &rx;
+    sc.status = SERIALCOMM_STATUS_OK;
+
+    uint8_t corrupt[FRAME_SIZE];
+    for (int i = 0; i < FRAME_SIZE; i++)
+        corrupt[i] = frame[i];
+    if (0 <= a)
+        corrupt[a / 8] ^= 1 << (a % 8);
+    if (0 <= b)
+        corrupt[b / 8] ^= 1 << (b % 8);
+    received_cnt = 0;
+    for (int i = 0; i < FRAME_SIZE; i++)
+        serialcomm_receive_char(&sc, corrupt[i]);
+    return received_cnt;
+}
+
+int main(void) {
+    serialcomm_t sc;
+    frame_t tx_frame;
+    serialcomm_init(&sc);
+    sc.tx_byte = &tx;
+    sc.tx_frame = &tx_frame;
+
+    const int bits = 8 * FRAME_SIZE;
+    long single = 0, pairs = 0, trials = 0;
+    srand(1);
+    for (int f = 0; f < FRAMES; f++) {
+        tx_frame.message.ID = rand() % MESSAGE_SUPERFRAME_END_ID;
+        for (int i = 0; i < MESSAGE_VALUE_SIZE; i++)
+            tx_frame.message.value.v8[i] = rand();
+        wire_len = 0;
+        serialcomm_send(&sc);
+        TEST_CHECK(wire_len == FRAME_SIZE && deliver(wire, -1, -1), "frame %d not delivered", f);
+        for (int a = 0; a < bits; a++) {
+            single += deliver(wire, a, -1);
+            for (int b = a + 1; b < bits; b++) {
+                pairs += deliver(wire, a, b);
+                trials++;
+            }
+        }
+    }
+    printf("Undetected: %ld of %d 1-bit errors, %ld of %ld 2-bit errors\n",
+        single, FRAMES * bits, pairs, trials);
+#if SERIALCOMM_CHECKSUM == SERIALCOMM_CHECKSUM_CRC8
+    TEST_CHECK(!single && !pairs, "CRC-8 missed errors");
+#endif
+
+    uint64_t t0 = test_now_ns();
+    for (long i = 0; i < SENDS; i++) {
+        wire_len = 0;
+        tx_frame.message.value.v32[0] = i;
+        serialcomm_send(&sc);
+    }
+    printf("serialcomm_send(): %.1f ns per frame\n", (double) (test_now_ns() - t0) / SENDS);
+    return test_result("test_checksum");
+}
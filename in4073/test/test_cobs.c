@@ -0,0 +1,171 @@
+#include "test.h"
+#include "../serialcomm.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** COBS framing (user-003)
+ *  Built with SERIALCOMM_FRAMING_COBS. Round trips frames,
+ *  superframes and bulk frames full of zero bytes, feeds random
+ *  garbage to the receiver and checks that it resyncs at the next
+ *  delimiter, counts the messages lost per bit error in a stream
+ *  of superframes and times the encoding.
+**/
+
+#define ROUND_TRIPS     10000
+#define GARBAGE_RUNS    10000
+#define CYCLES          20000
+#define BIT_ERRORS      200
+#define TELEMETRY_CNT   12
+#define SENDS           1000000
+
+static uint8_t wire[1 << 22];
+static int wire_len;
+static message_t received[SUPERFRAME_DATA_SIZE];
+static int received_cnt;
+static int superframes_cnt;
+static uint8_t bulk[BULK_DATA_SIZE];
+static uint32_t bulk_offset;
+static int bulk_size;
+
+static void tx(uint8_t c) {
+    wire[wire_len++] = c;
+}
+
+static void rx(message_t* message) {
+    if (message->ID == MESSAGE_SUPERFRAME_END_ID)
+        superframes_cnt++;
+    else if (received_cnt < SUPERFRAME_DATA_SIZE)
+        received[received_cnt++] = *message;
+}
+
+static void rx_bulk(uint32_t offset, uint8_t* data, int size) {
+    bulk_offset = offset;
+    bulk_size = size;
+    memcpy(bulk, data, size);
+}
+
+// A random byte, zero half of the time
+static uint8_t random_byte(void) {
+    return rand() % 2 ? rand() : 0;
+}
+
+static void feed(serialcomm_t* sc) {
+    for (int i = 0; i < wire_len; i++)
+        serialcomm_receive_char(sc, wire[i]);
+    wire_len = 0;
+}
+
+// Sends a frame, a superframe and a bulk frame and checks them
+static void round_trip(serialcomm_t* a, serialcomm_t* b) {
+    message_t message;
+    message.ID = rand() % MESSAGE_SUPERFRAME_END_ID;
+    for (int i = 0; i < MESSAGE_VALUE_SIZE; i++)
+        message.value.v8[i] = random_byte();
+    a->tx_frame->message = message;
+    serialcomm_send(a);
+    TEST_CHECK(wire_len <= FRAME_SIZE + 2, "frame of %d bytes", wire_len);
+    received_cnt = 0;
+    feed(b);
+    TEST_CHECK(received_cnt == 1 && received[0].ID == message.ID
+        && !memcmp(received[0].value.v8, message.value.v8, MESSAGE_VALUE_SIZE), "frame differs");
+
+    superframe_t sf;
+    message_t messages[TELEMETRY_CNT];
+    serialcomm_superframe_clear(&sf);
+    for (int k = 0; k < TELEMETRY_CNT; k++) {
+        messages[k].ID = k;
+        for (int i = 0; i < MESSAGE_VALUE_SIZE; i++)
+            messages[k].value.v8[i] = random_byte();
+        serialcomm_superframe_add(&sf, &messages[k]);
+    }
+    serialcomm_send_superframe(a, &sf);
+    received_cnt = 0;
+    int superframes = superframes_cnt;
+    feed(b);
+    TEST_CHECK(superframes_cnt == superframes + 1 && received_cnt == TELEMETRY_CNT,
+        "%d of %d messages received", received_cnt, TELEMETRY_CNT);
+    for (int k = 0; k < received_cnt; k++)
+        TEST_CHECK(received[k].ID == messages[k].ID && !memcmp(received[k].value.v8,
+            messages[k].value.v8, serialcomm_value_size(messages[k].ID)), "message %d differs", k);
+
+    uint8_t data[BULK_DATA_SIZE];
+    int size = 1 + rand() % BULK_DATA_SIZE;
+    uint32_t offset = rand();
+    for (int i = 0; i < size; i++)
+        data[i] = random_byte();
+    serialcomm_send_bulk(a, offset, data, size);
+    bulk_size = 0;
+    feed(b);
+    TEST_CHECK(bulk_size == size && bulk_offset == offset && !memcmp(bulk, data, size),
+        "bulk frame of %d bytes differs", size);
+}
+
+int main(void) {
+    serialcomm_t a, b;
+    frame_t tx_frame, rx_frame;
+    superframe_t rx_superframe;
+    serialcomm_init(&a);
+    a.tx_byte = &tx;
+    a.tx_frame = &tx_frame;
+    serialcomm_init(&b);
+    b.rx_frame = &rx_frame;
+    b.rx_superframe = &rx_superframe;
+    b.rx_complete_callback = &rx;
+    b.rx_bulk_callback = &rx_bulk;
+    srand(1);
+
+    for (int i = 0; i < ROUND_TRIPS; i++)
+        round_trip(&a, &b);
+
+    // Garbage of any length, then the receiver only needs the next
+    // delimiter to deliver frames again
+    for (int i = 0; i < GARBAGE_RUNS; i++) {
+        int len = rand() % (2 * FRAME_MAX_ENCODED_SIZE);
+        for (int k = 0; k < len; k++)
+            serialcomm_receive_char(&b, rand());
+        serialcomm_receive_char(&b, FRAME_COBS_DELIMITER);
+        round_trip(&a, &b);
+    }
+
+    // Bit errors in a stream of telemetry: each should cost about
+    // the superframe it hits
+    superframe_t sf;
+    int sent = 0;
+    for (int cycle = 0; cycle < CYCLES; cycle++) {
+        serialcomm_superframe_clear(&sf);
+        for (int k = 0; k < TELEMETRY_CNT; k++) {
+            message_t message;
+            message.ID = k;
+            for (int i = 0; i < MESSAGE_VALUE_SIZE; i++)
+                message.value.v8[i] = random_byte();
+            serialcomm_superframe_add(&sf, &message);
+            sent++;
+        }
+        serialcomm_send_superframe(&a, &sf);
+    }
+    for (int i = 0; i < BIT_ERRORS; i++)
+        wire[rand() % wire_len] ^= 1 << (rand() % 8);
+    received_cnt = 0;
+    int received_total = 0;
+    for (int i = 0; i < wire_len; i++) {
+        serialcomm_receive_char(&b, wire[i]);
+        received_total += received_cnt;
+        received_cnt = 0;
+    }
+    wire_len = 0;
+    double lost = (double) (sent - received_total) / BIT_ERRORS;
+    printf("%d bit errors in %d superframes: %.1f messages lost per error\n",
+        BIT_ERRORS, CYCLES, lost);
+    TEST_CHECK(lost <= 2 * TELEMETRY_CNT, "errors are not contained");
+
+    uint64_t t0 = test_now_ns();
+    int bytes = 0;
+    for (int i = 0; i < SENDS; i++) {
+        serialcomm_send_superframe(&a, &sf);
+        bytes += wire_len;
+        wire_len = 0;
+    }
+    printf("serialcomm_send_superframe(): %.1f ns per superframe, %.2f ns per byte\n",
+        (double) (test_now_ns() - t0) / SENDS, (double) (test_now_ns() - t0) / bytes);
+    return test_result("test_cobs");
+}
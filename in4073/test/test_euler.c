@@ -0,0 +1,152 @@
+#include "test.h"
+#include "../fixedpoint.h"
+#include <stdlib.h>
+#include <math.h>
+
+/** Quaternion to Euler angles (user-017)
+ *  Converts random unit quaternions and a roll/pitch/yaw grid
+ *  including +-90 degree pitch with fp_quat_euler, the norms off
+ *  by up to 0.2% as the DMP's are, and compares the angles with
+ *  libm in double precision. The float code it replaced is scored
+ *  the same way, then both are timed. Roll and yaw are not scored
+ *  within 0.26 degrees of gimbal lock, where they are undefined.
+**/
+
+#define RANDOM_CNT      1000000
+#define GRID_CNT        1000000
+#define TIMED_CNT       1024
+#define TIMED_PASSES    2000
+#define MAX_ERROR       1.1     // binary angle units
+#define MAX_MEAN_ERROR  0.35
+#define FLOAT_GARBAGE   100     // the float code is off by 2.2 at most otherwise
+
+#define QUAT_SENS       0x040000000 // 2^30
+
+// The float conversion update_euler_from_quaternions() used to do
+static void euler_float(const int32_t* quat, int16_t* e) {
+    float q[4];
+
+    q[0] = (float) quat[0] / QUAT_SENS;
+    q[1] = (float) quat[1] / QUAT_SENS;
+    q[2] = (float) quat[2] / QUAT_SENS;
+    q[3] = (float) quat[3] / QUAT_SENS;
+    e[0] = (int16_t) (atan2(2.0 * (q[2] * q[3] + q[0] * q[1]), q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]) * 10430.0);
+    e[1] = (int16_t) (-1.0 * asin(-2.0 * (q[1] * q[3] - q[0] * q[2])) * 10430.0);
+    e[2] = (int16_t) (atan2(2.0 * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]) * 10430.0);
+}
+
+static void euler_fixed(const int32_t* quat, int16_t* e) {
+    fp_quat_euler(quat, &e[0], &e[1], &e[2]);
+}
+
+// A unit quaternion, random or from the grid
+static void quaternion(long n, double* q) {
+    if (n < RANDOM_CNT) {
+        double norm;
+        do {
+            norm = 0;
+            for (int i = 0; i < 4; i++) {
+                q[i] = rand() / (double) RAND_MAX * 2 - 1;
+                norm += q[i] * q[i];
+            }
+            norm = sqrt(norm);
+        } while (norm < 1e-3 || 1 < norm);
+        for (int i = 0; i < 4; i++)
+            q[i] /= norm;
+    } else {
+        n -= RANDOM_CNT;
+        double r = ((n % 200) / 200.0 * 2 - 1) * M_PI;
+        double p = (((n / 200) % 100) / 99.0 * 2 - 1) * M_PI / 2;
+        double y = ((n / 20000) % 50 / 50.0 * 2 - 1) * M_PI;
+        double cr = cos(r / 2), sr = sin(r / 2);
+        double cp = cos(p / 2), sp = sin(p / 2);
+        double cy = cos(y / 2), sy = sin(y / 2);
+        q[0] = cr * cp * cy + sr * sp * sy;
+        q[1] = sr * cp * cy - cr * sp * sy;
+        q[2] = cr * sp * cy + sr * cp * sy;
+        q[3] = cr * cp * sy - sr * sp * cy;
+    }
+}
+
+// Difference of two angles in binary angle units, wrapped around
+static double angle_error(double a, double b) {
+    double d = fmod(fabs(a - b), 2 * FP_BRAD_PI);
+    return d < FP_BRAD_PI ? d : 2 * FP_BRAD_PI - d;
+}
+
+static double time_ns(void (*convert)(const int32_t*, int16_t*), int32_t quat[][4]) {
+    volatile int16_t sink;
+    int16_t e[3];
+    uint64_t t0 = test_now_ns();
+    for (int k = 0; k < TIMED_PASSES; k++)
+        for (int i = 0; i < TIMED_CNT; i++) {
+            convert(quat[i], e);
+            sink = e[0] + e[1] + e[2];
+        }
+    (void) sink;
+    return (double) (test_now_ns() - t0) / TIMED_PASSES / TIMED_CNT;
+}
+
+int main(void) {
+    const double scale = FP_BRAD_PI / M_PI;
+    const char* names[3] = { "roll", "pitch", "yaw" };
+    double max_fixed[3] = { 0 }, max_float[3] = { 0 }, sum[3] = { 0 };
+    long scored[3] = { 0 }, float_wrong = 0;
+
+    srand(1);
+    for (long n = 0; n < RANDOM_CNT + GRID_CNT; n++) {
+        double q[4], ref[3];
+        int32_t quat[4];
+        int16_t fixed[3], flt[3];
+        quaternion(n, q);
+        double norm = 1 + 0.002 * (rand() / (double) RAND_MAX * 2 - 1);
+        for (int i = 0; i < 4; i++)
+            quat[i] = lrint(q[i] * norm * QUAT_SENS);
+
+        ref[0] = atan2(2 * (q[2] * q[3] + q[0] * q[1]), q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]);
+        double s = 2 * (q[1] * q[3] - q[0] * q[2]);
+        s = s < -1 ? -1 : 1 < s ? 1 : s;
+        ref[1] = asin(s);
+        ref[2] = atan2(2 * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]);
+        bool gimbal_lock = 0.99999 < fabs(s);
+
+        euler_fixed(quat, fixed);
+        euler_float(quat, flt);
+        for (int k = 0; k < 3; k++) {
+            if (gimbal_lock && k != 1)
+                continue;
+            double d = angle_error(fixed[k], ref[k] * scale);
+            TEST_CHECK(d <= MAX_ERROR, "%s of (%"PRId32", %"PRId32", %"PRId32", %"PRId32") off by %.2f",
+                names[k], quat[0], quat[1], quat[2], quat[3], d);
+            max_fixed[k] = d < max_fixed[k] ? max_fixed[k] : d;
+            sum[k] += d;
+            scored[k]++;
+            // The float code returns a NaN cast to int16 past asin(1),
+            // and its asin() is steep near +-90 degrees
+            d = angle_error(flt[k], ref[k] * scale);
+            if (FLOAT_GARBAGE < d)
+                float_wrong++;
+            else
+                max_float[k] = d < max_float[k] ? max_float[k] : d;
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        printf("%-5s: fixed max %.2f mean %.3f, float max %.2f units (pi = %d)\n", names[k],
+            max_fixed[k], sum[k] / scored[k], max_float[k], FP_BRAD_PI);
+        TEST_CHECK(sum[k] / scored[k] <= MAX_MEAN_ERROR, "%s mean error %.3f", names[k], sum[k] / scored[k]);
+    }
+    printf("Float angles off by more than %d units: %ld\n", FLOAT_GARBAGE, float_wrong);
+
+    static int32_t quat[TIMED_CNT][4];
+    for (int i = 0; i < TIMED_CNT; i++) {
+        double q[4];
+        quaternion(i, q);
+        for (int j = 0; j < 4; j++)
+            quat[i][j] = lrint(q[j] * QUAT_SENS);
+    }
+    double fixed_ns = time_ns(&euler_fixed, quat);
+    double float_ns = time_ns(&euler_float, quat);
+    printf("Host time per conversion: fixed %.1f ns, float %.1f ns (hardware FPU, not the M0)\n",
+        fixed_ns, float_ns);
+    return test_result("test_euler");
+}
@@ -0,0 +1,237 @@
+#include "test.h"
+#include "../log.h"
+#include "../pc_terminal/pc_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Log (user-006, user-007, user-008)
+ *  The log on a flash mock whose busy time is controlled by the
+ *  test: log_write() must never program the flash, a flush request
+ *  and a reset must return at once and leave the programming to
+ *  log_task(), which waits for the flash without blocking and
+ *  programs no more than its budget per call.
+ *
+ *  Then the telemetry of a flight, the bytes the simulator sent
+ *  while flying log_flight.txt (see the Makefile), is logged and
+ *  replayed: decoded by pc_log.c it has to give the same output
+ *  as the plain messages, with log_task() called once per tick
+ *  keeping up with the items of the tick. Prints the size against the 9 bytes
+ *  per item of the fixed size records and the time to encode and
+ *  to decode a record.
+**/
+
+#define FLASH_SIZE  (1024 * 1024 / 8)
+#define FLIGHT_MAX  100000
+#define BUDGET      32      // LOG_PROGRAM_BUDGET of log.c
+
+static uint8_t flash[FLASH_SIZE];
+static int flash_busy_ticks;
+static uint32_t flash_written;
+static uint32_t task_max;
+
+static bool mock_flash_init(void) {
+    memset(flash, 0xFF, sizeof(flash));
+    return true;
+}
+
+static bool mock_flash_read(uint32_t addr, uint8_t* buf, uint32_t size) {
+    memcpy(buf, &flash[addr], size);
+    return true;
+}
+
+// A page program keeps the flash busy for the next tick
+static bool mock_flash_write(uint32_t addr, uint8_t* buf, uint32_t size) {
+    memcpy(&flash[addr], buf, size);
+    flash_written += size;
+    flash_busy_ticks = 1;
+    return true;
+}
+
+static bool mock_flash_erase_sector(uint32_t addr) {
+    memset(&flash[addr], 0xFF, 4096);
+    flash_busy_ticks = 3;
+    return true;
+}
+
+static bool mock_flash_busy(void) {
+    return flash_busy_ticks;
+}
+
+static bool mock_flash_idle(void) {
+    return false;
+}
+
+// A tick of the timer task, keeping count of the most bytes programmed
+static void tick(void) {
+    uint32_t written = flash_written;
+    log_task();
+    if (task_max < flash_written - written)
+        task_max = flash_written - written;
+}
+
+static message_t flight[FLIGHT_MAX];
+static int flight_cnt;
+
+static void flight_rx(message_t* message) {
+    if (message->ID <= MESSAGE_SCHED_ID && flight_cnt < FLIGHT_MAX)
+        flight[flight_cnt++] = *message;
+}
+
+// Reads the telemetry of a flight from the bytes sent to the PC
+static bool flight_load(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    serialcomm_t sc;
+    frame_t rx_frame;
+    superframe_t rx_superframe;
+    serialcomm_init(&sc);
+    sc.rx_frame = &rx_frame;
+    sc.rx_superframe = &rx_superframe;
+    sc.rx_complete_callback = &flight_rx;
+    int c;
+    while ((c = fgetc(file)) != EOF)
+        serialcomm_receive_char(&sc, c);
+    fclose(file);
+    return flight_cnt;
+}
+
+// Logs the messages of the flight with an ID in the mask, replays
+// the log and prints the figures
+static void flight_replay(qc_hal_t* hal, uint32_t id_mask) {
+    serialcomm_t sc;
+    serialcomm_init(&sc);
+    log_init(hal, &sc);
+
+    char *plain_text, *replay_text;
+    size_t plain_len, replay_len;
+    pc_log_t plain, replay;
+    pc_log_init(&plain, open_memstream(&plain_text, &plain_len));
+    pc_log_init(&replay, open_memstream(&replay_text, &replay_len));
+
+    // The IDs of a tick are sent in ascending order
+    int items = 0;
+    uint8_t last_id = 0;
+    uint64_t t0 = test_now_ns();
+    for (int i = 0; i < flight_cnt; i++) {
+        if (flight[i].ID <= last_id)
+            tick();
+        last_id = flight[i].ID;
+        if (!(id_mask & (1ul << flight[i].ID)))
+            continue;
+        TEST_CHECK(log_write(&flight[i]), "item %d not logged", i);
+        items++;
+    }
+    uint64_t t1 = test_now_ns();
+    log_flush();
+    uint32_t size = log_getsize();
+    for (int i = 0; i < flight_cnt; i++) {
+        if (id_mask & (1ul << flight[i].ID))
+            pc_log_receive(&plain, &flight[i]);
+    }
+    uint64_t t2 = test_now_ns();
+    pc_log_decode(&replay, flash, size);
+    uint64_t t3 = test_now_ns();
+
+    message_t end = { .ID = MESSAGE_LOG_END_ID };
+    pc_log_receive(&plain, &end);
+    pc_log_receive(&replay, &end);
+    pc_log_close(&plain);
+    pc_log_close(&replay);
+    TEST_CHECK(plain_len == replay_len && !memcmp(plain_text, replay_text, plain_len),
+        "the replay differs from the flight");
+    free(plain_text);
+    free(replay_text);
+
+    printf("IDs %#06"PRIx32": %d items in %"PRIu32" B, %.2f B/item, %.2fx smaller than 9 B/item,"
+        " encode %.0f ns/item, replay %.0f ns/item\n", id_mask, items, size,
+        (double) size / items, 9.0 * items / size,
+        (double) (t1 - t0) / items, (double) (t3 - t2) / items);
+}
+
+int main(int argc, char* argv[]) {
+    qc_hal_t hal;
+    memset(&hal, 0, sizeof(hal));
+    hal.flash_init_fn = &mock_flash_init;
+    hal.flash_read_fn = &mock_flash_read;
+    hal.flash_write_fn = &mock_flash_write;
+    hal.flash_erase_sector_fn = &mock_flash_erase_sector;
+    hal.flash_busy_fn = &mock_flash_busy;
+    serialcomm_t sc;
+    serialcomm_init(&sc);
+    TEST_CHECK(log_init(&hal, &sc), "init failed");
+
+    // 100 bytes or so staged in RAM, not a full page
+    message_t msg;
+    for (int i = 0; i < 10; i++) {
+        msg.ID = i;
+        memset(msg.value.v8, i, MESSAGE_VALUE_SIZE);
+        log_write(&msg);
+    }
+    uint32_t size = log_getsize();
+    tick();
+    TEST_CHECK(size < 256 && !flash_written, "%"PRIu32" of %"PRIu32" bytes programmed", flash_written, size);
+
+    // While an erase runs the request only takes note, then the page
+    // is programmed a budget per tick
+    flash_busy_ticks = 3;
+    log_request_flush();
+    for (int i = 0; i < 3; i++) {
+        tick();
+        TEST_CHECK(!flash_written, "programmed while busy");
+        flash_busy_ticks--;
+    }
+    for (uint32_t i = 0; i < (size + BUDGET - 1) / BUDGET; i++) {
+        tick();
+        if (flash_busy_ticks)
+            flash_busy_ticks--;
+    }
+    TEST_CHECK(flash_written == size, "%"PRIu32" of %"PRIu32" bytes programmed", flash_written, size);
+    flash_busy_ticks = 0;
+
+    // Done: no more programming until the next request
+    msg.ID = 0;
+    log_write(&msg);
+    tick();
+    TEST_CHECK(flash_written == size, "programmed without a request");
+    log_request_flush();
+    tick();
+    TEST_CHECK(flash_written == log_getsize(), "second request not programmed");
+
+    // Full pages need no request, but log_write() leaves them to
+    // log_task() too
+    size = log_getsize();
+    for (int i = 0; i < 100; i++) {
+        msg.ID = i % 10;
+        memset(msg.value.v8, i, MESSAGE_VALUE_SIZE);
+        log_write(&msg);
+    }
+    TEST_CHECK(flash_written == size, "log_write() programmed the flash");
+    while (flash_written < log_getsize() - log_getsize() % 256) {
+        tick();
+        if (flash_busy_ticks)
+            flash_busy_ticks--;
+    }
+    TEST_CHECK(task_max <= BUDGET, "%"PRIu32" bytes programmed in one tick", task_max);
+
+    // A reset from the receive task must not wait for the flash either,
+    // the mock would stay busy forever
+    flash_busy_ticks = 3;
+    size = flash_written;
+    log_reset();
+    TEST_CHECK(!log_getsize() && flash_written == size, "reset waited for the flash");
+    flash_busy_ticks = 0;
+
+    if (argc < 2)
+        return test_result("test_log");
+    TEST_CHECK(flight_load(argv[1]), "no flight in %s", argv[1]);
+    printf("Flight of %d telemetry items\n", flight_cnt);
+    hal.flash_busy_fn = &mock_flash_idle;
+    // All of it, the flight data without the profiling counters
+    // (10..12), and the time, sensors and attitude only
+    flight_replay(&hal, 0x1FFF);
+    flight_replay(&hal, 0x03FF);
+    flight_replay(&hal, 0x00CF);
+    TEST_CHECK(task_max <= BUDGET, "%"PRIu32" bytes programmed in one tick", task_max);
+    return test_result("test_log");
+}
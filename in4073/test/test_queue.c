@@ -0,0 +1,203 @@
+#include "test.h"
+#include "in4073.h"
+#include <pthread.h>
+#include <sched.h>
+
+/** SPSC queue (user-004)
+ *  Checks the limits of the queue, then a producer and a consumer
+ *  thread stream bytes through it with single and block calls,
+ *  like an ISR and the main loop do, and the consumer checks that
+ *  every byte arrives in order. Then the same byte by byte stream
+ *  runs through the queue and through the critical section queue
+ *  it replaced, built here with the stubbed critical sections, and
+ *  the throughput of both is printed.
+**/
+
+#define STREAM_BYTES    20000000u
+
+_Thread_local int mock_critical_level;
+bool mock_critical_lock;
+
+// No interrupt handler, the threads play the ISR and the main loop
+void mock_irq(void) {
+}
+
+static queue q;
+
+// The queue of drivers/queue.c before the SPSC ring, guarded by
+// critical sections
+typedef struct {
+    uint8_t Data[QUEUE_SIZE];
+    uint32_t first, last;
+    uint32_t count;
+} baseline_queue;
+
+static baseline_queue bq;
+
+static void baseline_init(baseline_queue* q) {
+    q->first = 0;
+    q->last = QUEUE_SIZE - 1;
+    q->count = 0;
+}
+
+static void baseline_enqueue(void* queue, char x) {
+    baseline_queue* q = queue;
+    if (q->count == QUEUE_SIZE)
+        return;
+
+    CRITICALSECTION_FastEnter();
+    q->last = (q->last + 1) & (QUEUE_SIZE - 1);
+    q->Data[ q->last ] = x;
+    q->count += 1;
+    CRITICALSECTION_FastExit();
+}
+
+static char baseline_dequeue(void* queue) {
+    baseline_queue* q = queue;
+    char x = q->Data[ q->first ];
+    CRITICALSECTION_FastEnter();
+    q->first = (q->first + 1) & (QUEUE_SIZE - 1);
+    q->count -= 1;
+    CRITICALSECTION_FastExit();
+    return x;
+}
+
+// A 32 bit load is atomic on the nRF51 as well
+static uint32_t baseline_count(void* queue) {
+    return __atomic_load_n(&((baseline_queue*) queue)->count, __ATOMIC_ACQUIRE);
+}
+
+static void spsc_enqueue(void* queue, char x) {
+    enqueue(queue, x);
+}
+
+static char spsc_dequeue(void* queue) {
+    return dequeue(queue);
+}
+
+static uint32_t spsc_count(void* queue) {
+    return queue_count(queue);
+}
+
+// A queue for the byte by byte stream. Both are called through
+// these pointers, so the calls cost the same
+typedef struct {
+    void* q;
+    void (*enqueue)(void*, char);
+    char (*dequeue)(void*);
+    uint32_t (*count)(void*);
+} stream_queue_t;
+
+// Mixes enqueue() and enqueue_n() of up to 10 bytes, byte i of
+// the stream being (uint8_t) i. Both threads yield when the queue
+// is full or empty, so the test also runs on a single core
+static void* producer(void* arg) {
+    (void) arg;
+    uint32_t i = 0;
+    uint8_t buf[10];
+    while (i < STREAM_BYTES) {
+        if (i % 3) {
+            uint32_t n = STREAM_BYTES - i < 10 ? STREAM_BYTES - i : 10;
+            for (uint32_t k = 0; k < n; k++)
+                buf[k] = i + k;
+            n = enqueue_n(&q, buf, n);
+            i += n;
+            if (!n)
+                sched_yield();
+        } else if (queue_count(&q) < QUEUE_SIZE) {
+            enqueue(&q, i);
+            i++;
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void* byte_producer(void* arg) {
+    stream_queue_t* s = arg;
+    uint32_t i = 0;
+    while (i < STREAM_BYTES) {
+        if (s->count(s->q) < QUEUE_SIZE) {
+            s->enqueue(s->q, i);
+            i++;
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Streams STREAM_BYTES one at a time from a producer thread
+// Returns: the throughput in MB/s
+static double byte_stream(stream_queue_t* s) {
+    pthread_t thread;
+    uint64_t t0 = test_now_ns();
+    pthread_create(&thread, NULL, &byte_producer, s);
+    uint32_t i = 0, errors = 0;
+    while (i < STREAM_BYTES) {
+        if (s->count(s->q)) {
+            errors += (uint8_t) s->dequeue(s->q) != (uint8_t) i;
+            i++;
+        } else {
+            sched_yield();
+        }
+    }
+    pthread_join(thread, NULL);
+    double seconds = (test_now_ns() - t0) / 1e9;
+    TEST_CHECK(!errors, "%"PRIu32" bytes corrupted", errors);
+    return STREAM_BYTES / seconds / 1e6;
+}
+
+int main(void) {
+    uint8_t buf[QUEUE_SIZE + 1];
+    init_queue(&q);
+    for (int i = 0; i <= QUEUE_SIZE; i++)
+        buf[i] = i;
+    TEST_CHECK(enqueue_n(&q, buf, QUEUE_SIZE + 1) == QUEUE_SIZE, "overfilled");
+    enqueue(&q, 0);
+    TEST_CHECK(queue_count(&q) == QUEUE_SIZE, "%"PRIu32" bytes in a full queue", queue_count(&q));
+    TEST_CHECK(dequeue_n(&q, buf, 10) == 10 && buf[9] == 9, "block not dequeued");
+    TEST_CHECK((uint8_t) dequeue(&q) == 10, "wrong byte dequeued");
+    TEST_CHECK(dequeue_n(&q, buf, QUEUE_SIZE) == QUEUE_SIZE - 11, "not emptied");
+    TEST_CHECK(!queue_count(&q) && !dequeue_n(&q, buf, 1), "not empty");
+
+    // The indices run freely, so they also have to wrap around
+    q.first = q.last = UINT32_MAX - 100;
+    pthread_t thread;
+    uint64_t t0 = test_now_ns();
+    pthread_create(&thread, NULL, &producer, NULL);
+    uint32_t i = 0, errors = 0;
+    while (i < STREAM_BYTES) {
+        if (i % 2) {
+            uint32_t n = dequeue_n(&q, buf, 16);
+            for (uint32_t k = 0; k < n; k++)
+                errors += buf[k] != (uint8_t) (i + k);
+            i += n;
+            if (!n)
+                sched_yield();
+        } else if (queue_count(&q)) {
+            errors += (uint8_t) dequeue(&q) != (uint8_t) i;
+            i++;
+        } else {
+            sched_yield();
+        }
+    }
+    pthread_join(thread, NULL);
+    double seconds = (test_now_ns() - t0) / 1e9;
+    TEST_CHECK(!errors, "%"PRIu32" bytes corrupted", errors);
+    printf("%u bytes between two threads, single and block calls: %.1f MB/s\n",
+        STREAM_BYTES, STREAM_BYTES / seconds / 1e6);
+
+    // The same byte by byte stream through both queues
+    stream_queue_t spsc = { &q, &spsc_enqueue, &spsc_dequeue, &spsc_count };
+    stream_queue_t baseline = { &bq, &baseline_enqueue, &baseline_dequeue, &baseline_count };
+    init_queue(&q);
+    baseline_init(&bq);
+    double spsc_mbps = byte_stream(&spsc);
+    double baseline_mbps = byte_stream(&baseline);
+    TEST_CHECK(!mock_critical_level, "critical section left open");
+    printf("%u bytes one at a time: SPSC %.1f MB/s, critical sections %.1f MB/s\n",
+        STREAM_BYTES, spsc_mbps, baseline_mbps);
+    return test_result("test_queue");
+}
@@ -0,0 +1,42 @@
+#include "test.h"
+#include "../fixedpoint.h"
+#include "../mode_constants.h"
+
+/** Square roots (user-019)
+ *  Checks that fp_sqrt20 gives the same result as fp_sqrt for
+ *  every n < 2^20, and that both are rounded to nearest, then
+ *  times them over the squared motor speeds mode_5_full takes
+ *  the root of.
+**/
+
+#define SQRT20_LIMIT    (1ul << 20)
+#define TIMED_CNT       50000000
+
+typedef uint32_t (*sqrt_t)(uint32_t n);
+
+static double time_ns(sqrt_t root) {
+    const uint32_t range = MAX_MOTOR_SPEED * MAX_MOTOR_SPEED + 1;
+    volatile uint32_t sink = 0;
+    uint64_t t0 = test_now_ns();
+    for (uint32_t i = 0; i < TIMED_CNT; i++)
+        sink += root(i * 2654435761u % range);
+    (void) sink;
+    return (double) (test_now_ns() - t0) / TIMED_CNT;
+}
+
+int main(void) {
+    long mismatches = 0;
+    for (uint32_t n = 0; n < SQRT20_LIMIT; n++) {
+        uint32_t r = fp_sqrt20(n);
+        if (r != fp_sqrt(n))
+            mismatches++;
+        // Nearest: r^2 - r < n <= r^2 + r
+        TEST_CHECK(n <= r * r + r && (!r || r * r - r < n), "fp_sqrt20(%"PRIu32") is %"PRIu32, n, r);
+    }
+    TEST_CHECK(!mismatches, "%ld mismatches", mismatches);
+    printf("0 to 2^20 - 1: %ld results differ from fp_sqrt\n", mismatches);
+
+    printf("Host time per call over 0 to %d^2: fp_sqrt %.1f ns, fp_sqrt20 %.1f ns\n",
+        MAX_MOTOR_SPEED, time_ns(&fp_sqrt), time_ns(&fp_sqrt20));
+    return test_result("test_sqrt");
+}
@@ -0,0 +1,101 @@
+#include "test.h"
+#include "../serialcomm.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Superframes (user-001)
+ *  Round trips of telemetry cycles packed into superframes, also
+ *  with runs of FRAME_START_VALUE bytes in the payload, and the
+ *  bytes on the wire per cycle against a frame per message.
+**/
+
+#define CYCLES          1000
+#define TELEMETRY_CNT   12
+
+static uint8_t wire[1 << 20];
+static int wire_len;
+static message_t received[TELEMETRY_CNT];
+static int received_cnt;
+static int cycles_cnt;
+
+static void tx(uint8_t c) {
+    wire[wire_len++] = c;
+}
+
+static void rx(message_t* message) {
+    if (message->ID == MESSAGE_SUPERFRAME_END_ID)
+        cycles_cnt++;
+    else if (received_cnt < TELEMETRY_CNT)
+        received[received_cnt++] = *message;
+}
+
+// Sends a cycle of telemetry and checks that the receiver gets
+// the same messages
+static void round_trip(serialcomm_t* a, serialcomm_t* b, message_t* messages, int cnt) {
+    superframe_t sf;
+    serialcomm_superframe_clear(&sf);
+    for (int i = 0; i < cnt; i++)
+        TEST_CHECK(serialcomm_superframe_add(&sf, &messages[i]), "message %d does not fit", i);
+    wire_len = 0;
+    received_cnt = 0;
+    int cycles = cycles_cnt;
+    serialcomm_send_superframe(a, &sf);
+    for (int i = 0; i < wire_len; i++)
+        serialcomm_receive_char(b, wire[i]);
+    TEST_CHECK(cycles_cnt == cycles + 1 && received_cnt == cnt,
+        "%d of %d messages received", received_cnt, cnt);
+    for (int i = 0; i < received_cnt; i++) {
+        int size = serialcomm_value_size(messages[i].ID);
+        TEST_CHECK(received[i].ID == messages[i].ID
+            && !memcmp(received[i].value.v8, messages[i].value.v8, size),
+            "message %d differs", i);
+    }
+}
+
+int main(void) {
+    serialcomm_t a, b;
+    frame_t tx_frame, rx_frame;
+    superframe_t rx_superframe;
+    serialcomm_init(&a);
+    a.tx_byte = &tx;
+    a.tx_frame = &tx_frame;
+    serialcomm_init(&b);
+    b.rx_frame = &rx_frame;
+    b.rx_superframe = &rx_superframe;
+    b.rx_complete_callback = &rx;
+
+    wire_len = 0;
+    serialcomm_send_start(&a);
+    for (int i = 0; i < wire_len; i++)
+        serialcomm_receive_char(&b, wire[i]);
+    TEST_CHECK(b.status == SERIALCOMM_STATUS_Start, "not started");
+
+    // Random payloads, then payloads of -1 everywhere: runs far
+    // longer than a start frame must not reset the receiver
+    message_t messages[TELEMETRY_CNT];
+    srand(1);
+    int wire_bytes = 0;
+    for (int cycle = 0; cycle < CYCLES; cycle++) {
+        for (int i = 0; i < TELEMETRY_CNT; i++) {
+            messages[i].ID = i;
+            for (int k = 0; k < MESSAGE_VALUE_SIZE; k++)
+                messages[i].value.v8[k] = cycle % 2 ? FRAME_START_VALUE : rand();
+        }
+        round_trip(&a, &b, messages, TELEMETRY_CNT);
+        wire_bytes += wire_len;
+    }
+    TEST_CHECK(b.status == SERIALCOMM_STATUS_OK, "receiver lost the stream");
+
+    // The payload is not checked before the end of a superframe, so
+    // even bytes that are not telemetry, -1 IDs included, arrive
+    for (int i = 0; i < 4; i++) {
+        messages[i].ID = FRAME_START_VALUE;
+        memset(messages[i].value.v8, FRAME_START_VALUE, MESSAGE_VALUE_SIZE);
+    }
+    round_trip(&a, &b, messages, 4);
+    TEST_CHECK(b.status == SERIALCOMM_STATUS_OK, "receiver reset by a run of -1 bytes");
+
+    printf("Telemetry of %d messages per cycle: %d bytes as superframes, %d bytes as frames\n",
+        TELEMETRY_CNT, wire_bytes / CYCLES, TELEMETRY_CNT * FRAME_SIZE);
+    return test_result("test_superframe");
+}
@@ -0,0 +1,138 @@
+#include "test.h"
+#include "../qc_system.h"
+#include "../mode_0_safe.h"
+#include "../mode_1_panic.h"
+#include "../mode_3_calibrate.h"
+#include "../mode_5_full.h"
+#include <stddef.h>
+#include <string.h>
+
+/** Telemetry (user-012)
+ *  Calls qc_system_log_data() with a stub HAL, decodes the
+ *  superframe it sends and checks that it holds exactly the
+ *  messages of the mask, in ID order, filled in from the state
+ *  by the layout table. Prints the time of a tick per mask. On
+ *  the Quadcopter __builtin_ctz() is a libgcc call, which this
+ *  host figure does not include: it costs about as much as
+ *  packing a field, once per set bit.
+**/
+
+#define TICKS   100000
+
+bool is_test_device = true;
+uint32_t iteration;
+
+static qc_system_t system;
+static qc_mode_table_t tables[MODE_COUNT];
+static qc_state_t state;
+static qc_command_t command;
+static serialcomm_t serialcomm;
+static qc_hal_t hal;
+
+static serialcomm_t receiver;
+static frame_t rx_frame;
+static superframe_t rx_superframe;
+static message_t received[32];
+static int received_cnt;
+static bool decode;
+
+int simulation_printf(const char* fmt, ...) {
+    (void) fmt;
+    return 0;
+}
+
+static void tx_byte(uint8_t c) {
+    if (decode)
+        serialcomm_receive_char(&receiver, c);
+}
+
+static void rx(message_t* message) {
+    if (message->ID != MESSAGE_SUPERFRAME_END_ID && received_cnt < 32)
+        received[received_cnt++] = *message;
+}
+
+static void stub(void) {}
+static void stub_bool(bool b) { (void) b; }
+static void stub_state(qc_state_t* s) { (void) s; }
+static void stub_imu(bool b, uint16_t f) { (void) b; (void) f; }
+static void stub_command(message_t* m) { (void) m; }
+static bool flash_ok(void) { return true; }
+static bool flash_busy(void) { return false; }
+static bool flash_rw(uint32_t a, uint8_t* b, uint32_t n) { (void) a; memset(b, 0xFF, n); return true; }
+static bool flash_erase(uint32_t a) { (void) a; return true; }
+static uint32_t get_time_us(void) { static uint32_t t; return t += 10000; }
+
+// Sends the telemetry of one tick and decodes it
+static void tick(uint32_t mask) {
+    system.telemetry_mask = mask;
+    received_cnt = 0;
+    decode = true;
+    qc_system_log_data(&system);
+    decode = false;
+}
+
+int main(void) {
+    hal.tx_byte_fn = &tx_byte;
+    hal.tx_flush_fn = &stub_bool;
+    hal.get_inputs_fn = &stub_state;
+    hal.set_outputs_fn = &stub_state;
+    hal.enable_motors_fn = &stub_bool;
+    hal.flash_init_fn = &flash_ok;
+    hal.flash_read_fn = &flash_rw;
+    hal.flash_write_fn = &flash_rw;
+    hal.flash_erase_sector_fn = &flash_erase;
+    hal.flash_busy_fn = &flash_busy;
+    hal.imu_init_fn = &stub_imu;
+    hal.reset_fn = &stub;
+    hal.get_time_us_fn = &get_time_us;
+    mode_0_safe_init(&tables[MODE_0_SAFE]);
+    mode_1_panic_init(&tables[MODE_1_PANIC]);
+    mode_2_manual_init(&tables[MODE_2_MANUAL]);
+    mode_3_calibrate_init(&tables[MODE_3_CALIBRATE]);
+    mode_4_yaw_init(&tables[MODE_4_YAW]);
+    mode_5_full_init(&tables[MODE_5_FULL_CONTROL]);
+    qc_system_init(&system, MODE_0_SAFE, tables, &state, &command, &serialcomm, &stub_command, &hal);
+    serialcomm_init(&receiver);
+    receiver.status = SERIALCOMM_STATUS_OK;
+    receiver.rx_frame = &rx_frame;
+    receiver.rx_superframe = &rx_superframe;
+    receiver.rx_complete_callback = &rx;
+
+    // Any state will do, as long as each field differs
+    uint8_t* p = (uint8_t*) &state;
+    for (size_t i = 0; i < offsetof(qc_state_t, prof); i++)
+        p[i] = i * 37 + 11;
+
+    const uint32_t masks[] = { 0x0000, 0x0001, 0x0011, 0x0FFF, 0x2EFF };
+    for (unsigned m = 0; m < sizeof(masks) / sizeof(masks[0]); m++) {
+        tick(masks[m]);
+        int k = 0;
+        for (int id = 0; id < 32; id++) {
+            if (!(masks[m] & (1ul << id)))
+                continue;
+            TEST_CHECK(k < received_cnt && received[k].ID == id, "mask %#"PRIx32": no message %d", masks[m], id);
+            k++;
+        }
+        TEST_CHECK(k == received_cnt, "mask %#"PRIx32": %d messages instead of %d", masks[m], received_cnt, k);
+        if (masks[m] & (1ul << MESSAGE_AE1234_ID)) {
+            message_t* ae = &received[__builtin_popcount(masks[m] & ((1ul << MESSAGE_AE1234_ID) - 1))];
+            TEST_CHECK(MESSAGE_AE1_VALUE(ae) == state.motor.ae1 && MESSAGE_AE2_VALUE(ae) == state.motor.ae2
+                && MESSAGE_AE3_VALUE(ae) == state.motor.ae3 && MESSAGE_AE4_VALUE(ae) == state.motor.ae4,
+                "motors not packed");
+        }
+
+        uint64_t t0 = test_now_ns();
+        for (int i = 0; i < TICKS; i++) {
+            system.telemetry_mask = masks[m];
+            qc_system_log_data(&system);
+        }
+        printf("Mask 0x%04"PRIx32": %.0f ns per tick\n", masks[m], (double) (test_now_ns() - t0) / TICKS);
+    }
+
+    // IDs 0..12 do not fit in a superframe: the mask is cut back to
+    // the messages that did
+    tick(0x1FFF);
+    TEST_CHECK(received_cnt == 12 && system.telemetry_mask == 0x0FFF,
+        "mask %#"PRIx32" after %d messages", system.telemetry_mask, received_cnt);
+    return test_result("test_telemetry");
+}
@@ -0,0 +1,110 @@
+#include "test.h"
+#include "../fixedpoint.h"
+#include <stdlib.h>
+#include <math.h>
+
+/** Trigonometry (user-018)
+ *  Compares fp_sin, fp_cos and fp_angle_wrap for every input
+ *  within +-40 radians, fp_asin for every input in [-1, 1] and
+ *  past it, and fp_atan2 on a grid and on random vectors of
+ *  random magnitude with libm, against the error bounds of their
+ *  comments. Then times them, for the flat cost they claim.
+**/
+
+#define ANGLE_RANGE     (40 * 65536)
+#define ATAN2_GRID      4000
+#define ATAN2_RANDOM    10000000
+#define TIMED_CNT       20000000
+
+// Error bounds of the doc comments in LSB (2^-16)
+#define SIN_MAX_ERROR   1.5
+#define WRAP_MAX_ERROR  0.5
+#define ASIN_MAX_ERROR  2.0
+#define ATAN2_MAX_ERROR 3.5
+
+#define Q16             65536.0
+
+static double atan2_error;
+
+static void check_atan2(int32_t y, int32_t x) {
+    double e = fabs(remainder(fp_atan2(y, x) / Q16 - atan2(y, x), 2 * M_PI)) * Q16;
+    TEST_CHECK(e <= ATAN2_MAX_ERROR, "atan2(%"PRId32", %"PRId32") off by %.2f", y, x, e);
+    atan2_error = e < atan2_error ? atan2_error : e;
+}
+
+static int32_t random32(void) {
+    return (int32_t) (((uint32_t) rand() << 1) ^ rand());
+}
+
+int main(void) {
+    double sin_error = 0, cos_error = 0, wrap_error = 0, asin_error = 0;
+    int32_t wrap_min = 0, wrap_max = 0;
+
+    for (int32_t a = -ANGLE_RANGE; a <= ANGLE_RANGE; a++) {
+        double r = a / Q16;
+        double e = fabs(fp_sin(a) / Q16 - sin(r)) * Q16;
+        TEST_CHECK(e <= SIN_MAX_ERROR, "sin(%"PRId32") off by %.2f", a, e);
+        sin_error = e < sin_error ? sin_error : e;
+        e = fabs(fp_cos(a) / Q16 - cos(r)) * Q16;
+        TEST_CHECK(e <= SIN_MAX_ERROR, "cos(%"PRId32") off by %.2f", a, e);
+        cos_error = e < cos_error ? cos_error : e;
+        int32_t w = fp_angle_wrap(a);
+        wrap_min = w < wrap_min ? w : wrap_min;
+        wrap_max = wrap_max < w ? w : wrap_max;
+        e = fabs(remainder(r - w / Q16, 2 * M_PI)) * Q16;
+        TEST_CHECK(e <= WRAP_MAX_ERROR, "wrap(%"PRId32") off by %.2f", a, e);
+        wrap_error = e < wrap_error ? wrap_error : e;
+    }
+    TEST_CHECK(-M_PI * Q16 - 1 <= wrap_min && wrap_max <= M_PI * Q16 + 1,
+        "wrapped to [%"PRId32", %"PRId32"]", wrap_min, wrap_max);
+
+    for (int32_t x = -65536 - 1000; x <= 65536 + 1000; x++) {
+        double s = x / Q16;
+        s = s < -1 ? -1 : 1 < s ? 1 : s;
+        double e = fabs(fp_asin(x) / Q16 - asin(s)) * Q16;
+        TEST_CHECK(e <= ASIN_MAX_ERROR, "asin(%"PRId32") off by %.2f", x, e);
+        asin_error = e < asin_error ? asin_error : e;
+    }
+
+    for (int i = 0; i < ATAN2_GRID; i++)
+        for (int j = 0; j < ATAN2_GRID; j++) {
+            int32_t x = (int32_t) ((i - ATAN2_GRID / 2) * 1070000.3);
+            int32_t y = (int32_t) ((j - ATAN2_GRID / 2) * 1070000.7);
+            if (i % 2)
+                check_atan2(y / 100000, x / 100000);
+            else
+                check_atan2(y, x);
+        }
+    srand(7);
+    for (long k = 0; k < ATAN2_RANDOM; k++) {
+        int32_t x = random32() >> (rand() % 31);
+        int32_t y = random32() >> (rand() % 31);
+        check_atan2(y, x);
+    }
+    TEST_CHECK(fp_atan2(0, 0) == 0, "atan2(0, 0) is %"PRId32, fp_atan2(0, 0));
+
+    printf("Max error in LSB: sin %.2f, cos %.2f, wrap %.2f, asin %.2f, atan2 %.2f\n",
+        sin_error, cos_error, wrap_error, asin_error, atan2_error);
+
+    // Host time per call, for inputs across the whole range
+    volatile int32_t sink = 0;
+    uint64_t t0;
+#define TIME(name, expr) do {                                               \
+        t0 = test_now_ns();                                                 \
+        for (int i = 0; i < TIMED_CNT; i++) {                               \
+            int32_t a = (int32_t) ((uint32_t) i * 2654435761u) >> 15;       \
+            sink += (expr);                                                 \
+        }                                                                   \
+        printf("%-24s %5.1f ns\n", name, (double) (test_now_ns() - t0) / TIMED_CNT); \
+    } while (0)
+    TIME("fp_angle_wrap (+-2pi)", fp_angle_wrap((a % 411774) * 2));
+    TIME("fp_angle_wrap (+-20pi)", fp_angle_wrap((a % 411774) * 20));
+    TIME("fp_sin", fp_sin(a));
+    TIME("fp_asin (0 to 1)", fp_asin(a & 0xFFFF));
+    TIME("fp_asin (-1 to 1)", fp_asin((a & 0x1FFFF) - 65536));
+    TIME("fp_atan2 (small)", fp_atan2(a >> 12, (a >> 12) * 7 + 3));
+    TIME("fp_atan2 (large)", fp_atan2(a << 12, (a << 12) * 7 + 3));
+    TIME("libm sin (double, FPU)", (int32_t) (sin(a / Q16) * Q16));
+    (void) sink;
+    return test_result("test_trig");
+}
@@ -0,0 +1,201 @@
+#include "test.h"
+#include "in4073.h"
+#include <string.h>
+
+/** TWI driver (user-015)
+ *  drivers/twi.c against a mock of the nRF51 TWI peripheral with
+ *  a single slave at MOCK_ADDR, a register file with an auto
+ *  incremented pointer. The mock clock advances 25 us, about a
+ *  byte at 400 kHz, per get_time_us() call, and the peripheral
+ *  makes one step per tick. Covers blocking transfers, the
+ *  queue order, transactions chained from callbacks, a NACK
+ *  completing with TWI_ERROR and a hung bus completing with
+ *  TWI_TIMEOUT, also for a background chain that nothing waits
+ *  for, like the DMP FIFO reads.
+**/
+
+#define MOCK_ADDR   0x68
+#define MOCK_NO_TXD 0xFFFFFFFFu
+
+mock_twi_t mock_twi;
+_Thread_local int mock_critical_level;
+bool mock_critical_lock;
+
+static uint32_t now_us;
+static uint8_t regs[256];
+static uint8_t reg_ptr;
+static bool addressed, receiving, suspended, stopping;
+static bool hung;
+static bool hang_after_a;
+
+// One step of the peripheral: carries out a task or a write of
+// TXD and raises its event
+static void mock_step(void) {
+    mock_twi_t* t = &mock_twi;
+    if (hung) {
+        t->TASKS_STARTTX = t->TASKS_STARTRX = t->TASKS_RESUME = t->TASKS_STOP = 0;
+        return;
+    }
+    if (t->TASKS_STOP) {
+        t->TASKS_STOP = 0;
+        receiving = suspended = false;
+        t->EVENTS_STOPPED = 1;
+        return;
+    }
+    if (t->TASKS_STARTTX) {
+        t->TASKS_STARTTX = 0;
+        addressed = true;
+        if (t->ADDRESS != MOCK_ADDR) {
+            t->ERRORSRC = 2; // NACK of the address
+            t->EVENTS_ERROR = 1;
+            t->TXD = MOCK_NO_TXD;
+            return;
+        }
+    }
+    if (t->TXD != MOCK_NO_TXD && !receiving) {
+        if (addressed)
+            reg_ptr = t->TXD;
+        else
+            regs[reg_ptr++] = t->TXD;
+        addressed = false;
+        t->TXD = MOCK_NO_TXD;
+        t->EVENTS_TXDSENT = 1;
+        return;
+    }
+    if (t->TASKS_STARTRX || (t->TASKS_RESUME && suspended)) {
+        t->TASKS_STARTRX = t->TASKS_RESUME = 0;
+        receiving = true;
+        suspended = false;
+        t->RXD = regs[reg_ptr++];
+        t->EVENTS_RXDREADY = 1;
+        if (t->SHORTS & TWI_SHORTS_BB_STOP_Msk)
+            stopping = true;
+        else if (t->SHORTS & TWI_SHORTS_BB_SUSPEND_Msk)
+            suspended = true;
+        return;
+    }
+    t->TASKS_RESUME = 0;
+    if (stopping && !t->EVENTS_RXDREADY) {
+        stopping = receiving = false;
+        t->EVENTS_STOPPED = 1;
+    }
+}
+
+// Runs the interrupt handler while there are events, unless in a
+// critical section
+void mock_irq(void) {
+    static bool in_irq;
+    mock_twi_t* t = &mock_twi;
+    if (mock_critical_level || in_irq)
+        return;
+    in_irq = true;
+    while (t->EVENTS_STOPPED || t->EVENTS_RXDREADY || t->EVENTS_TXDSENT || t->EVENTS_ERROR)
+        SPI0_TWI0_IRQHandler();
+    in_irq = false;
+}
+
+uint32_t get_time_us(void) {
+    now_us += 25;
+    mock_step();
+    mock_irq();
+    return now_us;
+}
+
+// Lets the bus run, like the main loop does while it waits
+static void run(int ticks) {
+    while (ticks--)
+        get_time_us();
+}
+
+static char order[8];
+static int order_cnt;
+static twi_xfer_t xfer_a, xfer_b, xfer_c;
+static uint8_t data_a[4], data_c[2];
+static bool chain_busy;
+
+static void done_b(twi_xfer_t* xfer) {
+    order[order_cnt++] = 'b';
+    chain_busy = false;
+}
+
+// Chains a command write, like the DMP FIFO reads chain theirs
+static void done_a(twi_xfer_t* xfer) {
+    order[order_cnt++] = 'a';
+    xfer_b = (twi_xfer_t) { .addr = MOCK_ADDR, .reg = 0x20, .write = true, .done_fn = &done_b };
+    TEST_CHECK(twi_submit(&xfer_b), "chained transaction rejected");
+    if (hang_after_a)
+        hung = true;
+}
+
+static void done_c(twi_xfer_t* xfer) {
+    order[order_cnt++] = 'c';
+}
+
+int main(void) {
+    mock_twi.TXD = MOCK_NO_TXD;
+    twi_init();
+
+    // Blocking transfers
+    uint8_t w[5] = { 1, 2, 3, 4, 5 }, r[5] = { 0 };
+    TEST_CHECK(!i2c_write(MOCK_ADDR, 0x10, 5, w), "write failed");
+    TEST_CHECK(!i2c_read(MOCK_ADDR, 0x10, 5, r) && !memcmp(w, r, 5), "read back differs");
+    TEST_CHECK(!i2c_read(MOCK_ADDR, 0x12, 1, r) && r[0] == 3, "single byte read failed");
+    TEST_CHECK(!twi_busy(), "busy after the transfers");
+
+    // A NACK completes with an error, the next transfer works
+    twi_xfer_t nack = { .addr = 0x42, .reg = 0, .length = 2, .data = r };
+    TEST_CHECK(twi_submit(&nack), "rejected");
+    run(20);
+    TEST_CHECK(nack.status == TWI_ERROR, "NACK status %d", nack.status);
+    TEST_CHECK(!i2c_read(MOCK_ADDR, 0x13, 2, r) && r[0] == 4 && r[1] == 5, "read after a NACK failed");
+
+    // Queue order: a, then c queued behind it, then b which a's
+    // callback chains behind c. A queued transaction is not
+    // accepted again.
+    chain_busy = true;
+    xfer_a = (twi_xfer_t) { .addr = MOCK_ADDR, .reg = 0x10, .length = 4, .data = data_a, .done_fn = &done_a };
+    xfer_c = (twi_xfer_t) { .addr = MOCK_ADDR, .reg = 0x11, .length = 2, .data = data_c, .done_fn = &done_c };
+    TEST_CHECK(twi_submit(&xfer_a) && twi_submit(&xfer_c), "rejected");
+    TEST_CHECK(!twi_submit(&xfer_a) && xfer_a.status == TWI_PENDING && twi_busy(), "queued twice");
+    run(200);
+    TEST_CHECK(order_cnt == 3 && !memcmp(order, "acb", 3), "order %.*s", order_cnt, order);
+    TEST_CHECK(xfer_a.status == TWI_DONE && xfer_b.status == TWI_DONE && xfer_c.status == TWI_DONE,
+        "not done");
+    TEST_CHECK(data_a[0] == 1 && data_a[3] == 4 && data_c[0] == 2 && data_c[1] == 3, "wrong data");
+    TEST_CHECK(!chain_busy && !twi_busy(), "still busy");
+
+    // Invalid: a read of nothing. A command only write is fine.
+    TEST_CHECK(i2c_read(MOCK_ADDR, 0, 0, r) && !i2c_write(MOCK_ADDR, 0x30, 0, NULL), "length 0");
+
+    // A hung bus under a blocking read: both the queued background
+    // transaction and the read time out
+    hung = true;
+    TEST_CHECK(twi_submit(&xfer_c), "rejected");
+    uint32_t t0 = now_us;
+    TEST_CHECK(i2c_read(MOCK_ADDR, 0x10, 1, r), "read on a hung bus succeeded");
+    TEST_CHECK(xfer_c.status == TWI_TIMEOUT, "status %d", xfer_c.status);
+    printf("Blocking read on a hung bus: given up after %"PRIu32" us\n", now_us - t0);
+
+    // A hung background chain that nothing waits for: only the
+    // main loop's twi_check_timeout() completes it, then the
+    // chain's callback clears its busy flag
+    hung = false;
+    hang_after_a = true;
+    chain_busy = true;
+    TEST_CHECK(twi_submit(&xfer_a), "rejected");
+    int passes = 0;
+    while (chain_busy && passes < 1000) {
+        run(4);
+        twi_check_timeout();
+        passes++;
+    }
+    TEST_CHECK(xfer_a.status == TWI_DONE && xfer_b.status == TWI_TIMEOUT, "status %d, %d",
+        xfer_a.status, xfer_b.status);
+    TEST_CHECK(!chain_busy && !twi_busy(), "chain still busy");
+    printf("Background chain on a hung bus: timed out after %d main loop passes\n", passes);
+
+    hung = hang_after_a = false;
+    TEST_CHECK(!i2c_read(MOCK_ADDR, 0x10, 1, r) && r[0] == 1, "no recovery after a timeout");
+    TEST_CHECK(!mock_critical_level, "critical section left open");
+    return test_result("test_twi");
+}
@@ -0,0 +1,95 @@
+#include "trace.h"
+
+trace_t trace;
+
+/** =======================================================
+ *  trace_init -- Initialize the event trace.
+ *  =======================================================
+ *  Clears the trace and starts recording.
+ *  Author: Boldizsar Palotas
+**/
+void trace_init(void) {
+    trace.dump = TRACE_DUMP_NONE;
+    trace_clear();
+}
+
+/** =======================================================
+ *  trace_clear -- Drop all recorded events.
+ *  =======================================================
+ *  Author: Boldizsar Palotas
+**/
+void trace_clear(void) {
+    trace.head = 0;
+    trace.enabled = true;
+}
+
+/** =======================================================
+ *  trace_dump_start -- Start sending the recorded events.
+ *  =======================================================
+ *  Stops the recording, the events are sent by the telemetry
+ *  (see qc_system_log_data) with trace_dump_next.
+ *
+ *  Parameters:
+ *  - target: Where to send the events.
+ *  Returns: false if a dump is already in progress.
+ *  Author: Boldizsar Palotas
+**/
+bool trace_dump_start(trace_dump_target_t target) {
+    if (trace.dump != TRACE_DUMP_NONE || target == TRACE_DUMP_NONE)
+        return false;
+    trace.enabled = false;
+    trace.dump_end = trace.head;
+    trace.dump_pos = trace.head < TRACE_SIZE ? 0 : trace.head - TRACE_SIZE;
+    trace.dump_header = true;
+    trace.dump = target;
+    return true;
+}
+
+/** =======================================================
+ *  trace_dump_next -- Fill in the next message of a dump.
+ *  =======================================================
+ *  The first message is the header, the rest carry two events
+ *  each. The message is not consumed until trace_dump_advance
+ *  is called, so it can be sent again if it did not fit.
+ *
+ *  Parameters:
+ *  - msg: The MESSAGE_TRACE_ID message to fill in.
+ *  Returns: false if no dump is in progress.
+ *  Author: Boldizsar Palotas
+**/
+bool trace_dump_next(message_t* msg) {
+    if (trace.dump == TRACE_DUMP_NONE)
+        return false;
+    uint32_t pos = trace.dump_pos;
+    msg->ID = MESSAGE_TRACE_ID;
+    if (trace.dump_header) {
+        MESSAGE_TRACE_EVENT_VALUE(msg, 0) = ((trace.dump_end - pos) << 8) | TRACE_HEADER;
+        MESSAGE_TRACE_EVENT_VALUE(msg, 1) = trace.dump_end;
+    } else {
+        MESSAGE_TRACE_EVENT_VALUE(msg, 0) = trace.event[pos & (TRACE_SIZE - 1)];
+        MESSAGE_TRACE_EVENT_VALUE(msg, 1) = pos + 1 < trace.dump_end ?
+            trace.event[(pos + 1) & (TRACE_SIZE - 1)] : 0;
+    }
+    return true;
+}
+
+/** =======================================================
+ *  trace_dump_advance -- Consume the message of a dump.
+ *  =======================================================
+ *  Moves on to the next message after the one filled in by
+ *  trace_dump_next was sent. Clears the trace and resumes the
+ *  recording after the last one.
+ *  Author: Boldizsar Palotas
+**/
+void trace_dump_advance(void) {
+    if (trace.dump == TRACE_DUMP_NONE)
+        return;
+    if (trace.dump_header)
+        trace.dump_header = false;
+    else
+        trace.dump_pos += 2;
+    if (trace.dump_end <= trace.dump_pos) {
+        trace.dump = TRACE_DUMP_NONE;
+        trace_clear();
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "serialcomm.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+/** EVENT TRACE
+ *
+ *  The trace is a ring of the most recent TRACE_SIZE events in
+ *  RAM. Each event is a single word: the low 24 bits of the
+ *  time in us shifted up by 8 and the event code in the low
+ *  byte. The code is the kind of the event ORed with its ID:
+ *
+ *  - TRACE_BEGIN / TRACE_END: start and end of a task
+ *  - TRACE_INSTANT: an interrupt or other point event
+ *  - TRACE_HEADER: never recorded, marks the start of a dump
+ *
+ *  A dump (see trace_dump_start) stops the recording and sends
+ *  a header followed by the events from oldest to newest, two
+ *  per MESSAGE_TRACE_ID message, a few messages per telemetry
+ *  tick. The trace is cleared and recording resumes after the
+ *  last message. The header carries the number of events that
+ *  follow and the number of events recorded since the previous
+ *  dump, the difference of the two were overwritten.
+ *
+ *  Recording is not atomic: events recorded from interrupts
+ *  must not preempt another recording (see TRACE in in4073.h).
+ *  Author: Boldizsar Palotas
+**/
+
+// Number of events kept, must be a power of 2
+#ifndef TRACE_SIZE
+    #define TRACE_SIZE      256
+#endif
+
+#define TRACE_BEGIN         0x00
+#define TRACE_END           0x40
+#define TRACE_INSTANT       0x80
+#define TRACE_HEADER        0xC0
+
+#define TRACE_KIND(code)    ((code) & 0xC0)
+#define TRACE_ID(code)      ((code) & 0x3F)
+#define TRACE_EVENT_CODE(event) ((uint8_t) (event))
+#define TRACE_EVENT_TIME(event) ((event) >> 8)
+#define TRACE_TIME_MASK     0xFFFFFFul
+
+// The traced tasks and interrupts
+typedef enum trace_id {
+    TRACE_CONTROL,      // process_and_control
+    TRACE_RECEIVE,      // receive_commands
+    TRACE_TX_FLUSH,     // deferred frames to the UART
+    TRACE_TIMER_TASK,   // inputs, LEDs, logging and telemetry
+    TRACE_LOG_DATA,     // qc_system_log_data
+    TRACE_TEXT,         // transmit_text
+    TRACE_IMU_READ,     // background burst read of the raw IMU samples
+    TRACE_IDLE,         // nothing to do
+    TRACE_SENSOR_IRQ,   // IMU data ready
+    TRACE_TIMER_IRQ,    // control timer tick
+    TRACE_ID_COUNT
+} trace_id_t;
+
+// Where a dump goes
+typedef enum trace_dump_target {
+    TRACE_DUMP_NONE,
+    TRACE_DUMP_SERIAL,  // in the telemetry superframes
+    TRACE_DUMP_FLASH    // into the log
+} trace_dump_target_t;
+
+// Number of MESSAGE_TRACE_ID messages sent per telemetry tick
+#define TRACE_DUMP_PER_TICK 4
+
+/** trace_t
+ *  -------------------
+ *  Fields:
+ *  - event: The ring of events, event i is at i % TRACE_SIZE.
+ *  - head: Number of events recorded since the last clear.
+ *  - enabled: Events are only recorded if set.
+ *  - dump: Where the dump in progress goes, if any.
+ *  - dump_pos, dump_end: The next and the end event of the dump.
+ *  - dump_header: The header of the dump is not sent yet.
+ *  Author: Boldizsar Palotas
+**/
+typedef struct trace {
+    uint32_t    event[TRACE_SIZE];
+    uint32_t    head;
+    bool        enabled;
+    trace_dump_target_t dump;
+    uint32_t    dump_pos;
+    uint32_t    dump_end;
+    bool        dump_header;
+} trace_t;
+
+extern trace_t trace;
+
+static inline void trace_event(uint8_t code, uint32_t time);
+
+void trace_init(void);
+void trace_clear(void);
+bool trace_dump_start(trace_dump_target_t target);
+bool trace_dump_next(message_t* msg);
+void trace_dump_advance(void);
+
+static inline void trace_event(uint8_t code, uint32_t time) {
+    if (trace.enabled)
+        trace.event[trace.head++ & (TRACE_SIZE - 1)] = (time << 8) | code;
+}
+
+#endif // TRACE_H